@@ -0,0 +1,311 @@
+/*
+ * addrmap.c - Open-addressing hash table keyed by IPv6 addresses
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <inttypes.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "teredo.h"
+#include "addrmap.h"
+
+#define ADDRMAP_MIN_SLOTS 16
+/* Clusters of the old table are migrated until this many entries moved */
+#define ADDRMAP_MIGRATE_STEP 8
+
+
+static inline bool addr_equal (const union teredo_addr *a,
+                               const union teredo_addr *b)
+{
+	uint64_t a0, a1, b0, b1;
+
+	memcpy (&a0, a->ip6.s6_addr, 8);
+	memcpy (&a1, a->ip6.s6_addr + 8, 8);
+	memcpy (&b0, b->ip6.s6_addr, 8);
+	memcpy (&b1, b->ip6.s6_addr + 8, 8);
+	return !((a0 ^ b0) | (a1 ^ b1));
+}
+
+
+static teredo_addrmap_slot *
+table_find (const teredo_addrmap_table *t, const union teredo_addr *key,
+            uint32_t hash)
+{
+	if (t->slots == NULL)
+		return NULL;
+
+	for (size_t i = hash & t->mask;; i = (i + 1) & t->mask)
+	{
+		teredo_addrmap_slot *slot = t->slots + i;
+
+		if (slot->value == NULL)
+			return NULL;
+		if ((slot->hash == hash) && addr_equal (&slot->key, key))
+			return slot;
+	}
+}
+
+
+/* The table must have at least one free slot. */
+static void table_put (teredo_addrmap_table *t, const union teredo_addr *key,
+                       uint32_t hash, void *value)
+{
+	size_t i = hash & t->mask;
+
+	while (t->slots[i].value != NULL)
+		i = (i + 1) & t->mask;
+
+	t->slots[i].key = *key;
+	t->slots[i].hash = hash;
+	t->slots[i].value = value;
+	t->count++;
+}
+
+
+/**
+ * Empties a slot, shifting back the following entries of the same cluster
+ * where needed, so that no tombstone is ever left behind.
+ */
+static void table_erase (teredo_addrmap_table *t, teredo_addrmap_slot *slot)
+{
+	size_t i = slot - t->slots;
+
+	for (size_t j = (i + 1) & t->mask;
+	     t->slots[j].value != NULL;
+	     j = (j + 1) & t->mask)
+	{
+		size_t home = t->slots[j].hash & t->mask;
+
+		/* Move the entry iff its home slot is not within (i, j] */
+		if (((j - home) & t->mask) >= ((j - i) & t->mask))
+		{
+			t->slots[i] = t->slots[j];
+			i = j;
+		}
+	}
+
+	t->slots[i].value = NULL;
+	t->count--;
+}
+
+
+static void addrmap_migrate_end (teredo_addrmap *map)
+{
+	assert (map->old.count == 0);
+	free (map->old.slots);
+	map->old.slots = NULL;
+	map->old.mask = 0;
+	map->migrate_left = 0;
+}
+
+
+/**
+ * Moves whole clusters from the old table to the current one. Clusters are
+ * never split so that lookups in the old table remain correct; the
+ * migration boundary is always an empty slot.
+ */
+static void addrmap_migrate (teredo_addrmap *map, unsigned budget)
+{
+	teredo_addrmap_table *old = &map->old;
+	size_t i = map->migrate_pos;
+
+	while ((budget > 0) && (old->count > 0) && (map->migrate_left > 0))
+	{
+		i = (i + 1) & old->mask;
+		map->migrate_left--;
+
+		while (old->slots[i].value != NULL)
+		{
+			teredo_addrmap_slot *slot = old->slots + i;
+
+			table_put (&map->cur, &slot->key, slot->hash, slot->value);
+			slot->value = NULL;
+			old->count--;
+			if (budget > 0)
+				budget--;
+
+			i = (i + 1) & old->mask;
+			map->migrate_left--;
+		}
+	}
+
+	map->migrate_pos = i;
+	if (old->count == 0)
+		addrmap_migrate_end (map);
+}
+
+
+/**
+ * Allocates a bigger table and starts migrating the current one into it.
+ */
+static int addrmap_grow (teredo_addrmap *map)
+{
+	size_t slots = (map->cur.slots != NULL) ? 2 * (map->cur.mask + 1)
+	                                        : ADDRMAP_MIN_SLOTS;
+
+	if (map->fixed)
+		return -1;
+
+	/* Only one migration at a time */
+	if (map->old.slots != NULL)
+		addrmap_migrate (map, ~0u);
+	assert (map->old.slots == NULL);
+
+	teredo_addrmap_slot *tab = calloc (slots, sizeof (*tab));
+	if (tab == NULL)
+		return -1;
+
+	map->old = map->cur;
+	map->cur.slots = tab;
+	map->cur.mask = slots - 1;
+	map->cur.count = 0;
+
+	if (map->old.count == 0)
+	{
+		addrmap_migrate_end (map);
+		return 0;
+	}
+
+	/* Start right after an empty slot (there is always one) */
+	size_t i = 0;
+	while (map->old.slots[i].value != NULL)
+		i++;
+	map->migrate_pos = i;
+	map->migrate_left = map->old.mask + 1;
+	return 0;
+}
+
+
+void teredo_addrmap_init (teredo_addrmap *map)
+{
+	memset (map, 0, sizeof (*map));
+}
+
+
+void teredo_addrmap_init_fixed (teredo_addrmap *map,
+                                teredo_addrmap_slot *tab, size_t slots)
+{
+	assert ((slots >= 2) && !(slots & (slots - 1)));
+
+	teredo_addrmap_init (map);
+	map->cur.slots = tab;
+	map->cur.mask = slots - 1;
+	map->fixed = true;
+}
+
+
+void teredo_addrmap_destroy (teredo_addrmap *map)
+{
+	if (!map->fixed)
+		free (map->cur.slots);
+	free (map->old.slots);
+	teredo_addrmap_init (map);
+}
+
+
+void teredo_addrmap_clear (teredo_addrmap *map)
+{
+	if (map->fixed)
+	{
+		memset (map->cur.slots, 0,
+		        (map->cur.mask + 1) * sizeof (*map->cur.slots));
+		map->cur.count = 0;
+	}
+	else
+	{
+		teredo_addrmap_destroy (map);
+		teredo_addrmap_init (map);
+	}
+}
+
+
+void *teredo_addrmap_get_hashed (const teredo_addrmap *map,
+                                 const union teredo_addr *key, uint32_t hash)
+{
+	const teredo_addrmap_slot *slot = table_find (&map->cur, key, hash);
+
+	if (slot == NULL)
+		slot = table_find (&map->old, key, hash);
+	return (slot != NULL) ? slot->value : NULL;
+}
+
+
+void *teredo_addrmap_get (const teredo_addrmap *map,
+                          const union teredo_addr *key)
+{
+	return teredo_addrmap_get_hashed (map, key, teredo_addr_hash (key));
+}
+
+
+int teredo_addrmap_insert (teredo_addrmap *map, const union teredo_addr *key,
+                           void *value)
+{
+	uint32_t hash = teredo_addr_hash (key);
+
+	assert (value != NULL);
+	assert (teredo_addrmap_get (map, key) == NULL);
+
+	if (map->old.slots != NULL)
+		addrmap_migrate (map, ADDRMAP_MIGRATE_STEP);
+
+	/* Keeps the load factor at or below 3/4 */
+	size_t slots = (map->cur.slots != NULL) ? (map->cur.mask + 1) : 0;
+	if (4 * (map->cur.count + map->old.count + 1) > 3 * slots)
+	{
+		if (addrmap_grow (map) && (map->cur.count + 1 >= slots))
+			return -1; /* out of memory and current table is full */
+	}
+
+	table_put (&map->cur, key, hash, value);
+	return 0;
+}
+
+
+void *teredo_addrmap_remove (teredo_addrmap *map,
+                             const union teredo_addr *key)
+{
+	uint32_t hash = teredo_addr_hash (key);
+	teredo_addrmap_table *t = &map->cur;
+	teredo_addrmap_slot *slot = table_find (t, key, hash);
+
+	if (slot == NULL)
+	{
+		t = &map->old;
+		slot = table_find (t, key, hash);
+		if (slot == NULL)
+			return NULL;
+	}
+
+	void *value = slot->value;
+	table_erase (t, slot);
+
+	if ((t == &map->old) && (t->count == 0))
+		addrmap_migrate_end (map);
+	return value;
+}
@@ -0,0 +1,166 @@
+/**
+ * @file addrmap.h
+ * @brief Open-addressing hash table keyed by IPv6 addresses
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_ADDRMAP_H
+# define LIBTEREDO_ADDRMAP_H
+
+/*
+ * Linear probing with inline keys, backward-shift deletion (no tombstones)
+ * and incremental resizing: when the table grows, the previous table is
+ * kept and migrated a few clusters at a time by subsequent insertions.
+ *
+ * The table is not thread-safe; the caller is expected to serialize access.
+ * NULL values cannot be stored (NULL denotes an empty slot).
+ */
+
+typedef struct teredo_addrmap_slot
+{
+	union teredo_addr key;
+	uint32_t hash;
+	void *value;
+} teredo_addrmap_slot;
+
+typedef struct teredo_addrmap_table
+{
+	teredo_addrmap_slot *slots;
+	size_t mask; /* number of slots minus one */
+	size_t count;
+} teredo_addrmap_table;
+
+typedef struct teredo_addrmap
+{
+	teredo_addrmap_table cur; /* receives all insertions */
+	teredo_addrmap_table old; /* being migrated (slots == NULL if none) */
+	size_t migrate_pos; /* empty slot of the old table before next cluster */
+	size_t migrate_left; /* slots of the old table left to scan */
+	bool fixed; /* table memory owned by the caller (never grows) */
+} teredo_addrmap;
+
+
+/**
+ * Hashes a 16-bytes IPv6 (Teredo) address.
+ */
+static inline uint32_t teredo_addr_hash (const union teredo_addr *addr)
+{
+	uint64_t h = ((uint64_t)addr->t6_addr32[0] << 32) | addr->t6_addr32[1];
+
+	h *= UINT64_C(0x9e3779b97f4a7c15);
+	h ^= ((uint64_t)addr->t6_addr32[2] << 32) | addr->t6_addr32[3];
+	h *= UINT64_C(0xc2b2ae3d27d4eb4f);
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Initializes an empty table. Memory is only allocated upon insertion.
+ */
+void teredo_addrmap_init (teredo_addrmap *map);
+
+/**
+ * Initializes an empty table of a fixed size, in zero-filled memory
+ * provided by the caller (e.g. from an arena). The table never grows:
+ * insertions fail once all slots but one are used.
+ *
+ * @param slots number of slots (must be a power of two)
+ */
+void teredo_addrmap_init_fixed (teredo_addrmap *map,
+                                teredo_addrmap_slot *tab, size_t slots);
+
+/**
+ * Releases all memory used by a table (but not the values). The memory of
+ * fixed-size tables is left to its owner.
+ */
+void teredo_addrmap_destroy (teredo_addrmap *map);
+
+/**
+ * Removes all values from a table. Fixed-size tables keep their memory.
+ */
+void teredo_addrmap_clear (teredo_addrmap *map);
+
+/**
+ * Looks up a value.
+ *
+ * @return the value associated with @a key, or NULL if not found.
+ */
+void *teredo_addrmap_get (const teredo_addrmap *map,
+                          const union teredo_addr *key);
+
+/**
+ * Looks up a value, like teredo_addrmap_get(), with a precomputed hash.
+ *
+ * @param hash teredo_addr_hash() of @a key
+ */
+void *teredo_addrmap_get_hashed (const teredo_addrmap *map,
+                                 const union teredo_addr *key,
+                                 uint32_t hash);
+
+/**
+ * Adds a value. @a key must not be present in the table already.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+int teredo_addrmap_insert (teredo_addrmap *map, const union teredo_addr *key,
+                           void *value);
+
+/**
+ * Removes a value.
+ *
+ * @return the removed value, or NULL if @a key was not found.
+ */
+void *teredo_addrmap_remove (teredo_addrmap *map,
+                             const union teredo_addr *key);
+
+/**
+ * Prefetches the slot where a key would be found, so that a subsequent
+ * lookup of several keys does not wait for each cache miss in turn.
+ *
+ * @param hash teredo_addr_hash() of the key
+ */
+static inline void teredo_addrmap_prefetch (const teredo_addrmap *map,
+                                            uint32_t hash)
+{
+#ifdef __GNUC__
+	if (map->cur.slots != NULL)
+		__builtin_prefetch (map->cur.slots + (hash & map->cur.mask));
+	if (map->old.slots != NULL)
+		__builtin_prefetch (map->old.slots + (hash & map->old.mask));
+#else
+	(void)map;
+	(void)hash;
+#endif
+}
+
+/**
+ * @return the number of values in the table.
+ */
+static inline size_t teredo_addrmap_count (const teredo_addrmap *map)
+{
+	return map->cur.count + map->old.count;
+}
+
+# ifdef __cplusplus
+}
+# endif
+#endif /* ifndef LIBTEREDO_ADDRMAP_H */
@@ -0,0 +1,152 @@
+/*
+ * arena.c - Preallocated memory arena
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "arena.h"
+
+#define TEREDO_ARENA_HUGE_PAGE (2 << 20) // bytes
+#define TEREDO_ARENA_ALIGN 64
+
+
+/**
+ * Maps anonymous memory, faulting it in if possible.
+ */
+static void *arena_map (size_t size, int flags)
+{
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+	return mmap (NULL, size, PROT_READ | PROT_WRITE,
+	             MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+}
+
+
+int teredo_arena_init (teredo_arena *a, size_t size)
+{
+	size = (size + TEREDO_ARENA_HUGE_PAGE - 1)
+	       & ~(size_t)(TEREDO_ARENA_HUGE_PAGE - 1);
+	if (size == 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	a->huge = false;
+#ifdef MAP_HUGETLB
+	/* Explicit huge pages must have been reserved by the administrator */
+	a->base = arena_map (size, MAP_HUGETLB);
+	if (a->base != MAP_FAILED)
+		a->huge = true;
+	else
+#endif
+	{
+		a->base = arena_map (size, 0);
+		if (a->base == MAP_FAILED)
+			return -1;
+#ifdef MADV_HUGEPAGE
+		/* Transparent huge pages (this may come too late for the pages
+		 * that MAP_POPULATE already faulted in, but not for khugepaged) */
+		madvise (a->base, size, MADV_HUGEPAGE);
+#endif
+#ifndef MAP_POPULATE
+		for (size_t i = 0; i < size; i += 4096)
+			a->base[i] = 0;
+#endif
+	}
+
+	pthread_mutex_init (&a->lock, NULL);
+	a->size = size;
+	a->used = 0;
+	a->free = NULL;
+	return 0;
+}
+
+
+void teredo_arena_destroy (teredo_arena *a)
+{
+	pthread_mutex_destroy (&a->lock);
+	munmap (a->base, a->size);
+}
+
+
+void *teredo_arena_alloc_table (teredo_arena *a, size_t size)
+{
+	size = (size + TEREDO_ARENA_ALIGN - 1)
+	       & ~(size_t)(TEREDO_ARENA_ALIGN - 1);
+
+	if (size > a->size - a->used)
+		return NULL;
+
+	void *table = a->base + a->used;
+	a->used += size;
+	return table; /* anonymous memory is zero-filled */
+}
+
+
+void *teredo_arena_alloc_chunk (teredo_arena *a)
+{
+	void *chunk;
+
+	pthread_mutex_lock (&a->lock);
+	chunk = a->free;
+	if (chunk != NULL)
+		a->free = *(void **)chunk;
+	else
+	if (a->size - a->used >= TEREDO_ARENA_CHUNK)
+	{
+		chunk = a->base + a->used;
+		a->used += TEREDO_ARENA_CHUNK;
+	}
+	pthread_mutex_unlock (&a->lock);
+	return chunk;
+}
+
+
+void teredo_arena_free_chunk (teredo_arena *a, void *chunk)
+{
+	assert (((uint8_t *)chunk >= a->base)
+	     && ((uint8_t *)chunk < a->base + a->used));
+
+	pthread_mutex_lock (&a->lock);
+	*(void **)chunk = a->free;
+	a->free = chunk;
+	pthread_mutex_unlock (&a->lock);
+}
+
+
+size_t teredo_arena_chunks_left (const teredo_arena *a)
+{
+	return (a->size - a->used) / TEREDO_ARENA_CHUNK;
+}
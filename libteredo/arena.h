@@ -0,0 +1,97 @@
+/**
+ * @file arena.h
+ * @brief Preallocated memory arena
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_ARENA_H
+# define LIBTEREDO_ARENA_H
+
+# include <pthread.h>
+
+/*
+ * An arena is a single memory mapping, allocated and faulted in at once,
+ * preferably from huge pages so that the objects within cost few TLB
+ * entries. Tables live at the start of the arena: they are allocated
+ * once at setup time and never freed. The rest of the arena is split
+ * into fixed-size chunks, which slabs (see slab.h) obtain and give back.
+ * The whole arena is only returned to the system when destroyed.
+ */
+# define TEREDO_ARENA_CHUNK 65536 // bytes
+
+typedef struct teredo_arena
+{
+	pthread_mutex_t lock;
+	uint8_t *base;
+	size_t size;
+	size_t used; /* bytes allocated (tables and chunks), from the start */
+	void *free; /* free chunks list */
+	bool huge; /* backed by explicit huge pages */
+} teredo_arena;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Maps and faults in an arena. Explicit huge pages are used if available,
+ * otherwise transparent huge pages are requested.
+ *
+ * @param size arena size (rounded up to the huge page size)
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+int teredo_arena_init (teredo_arena *a, size_t size);
+
+/**
+ * Unmaps an arena, and hence all objects allocated from it.
+ */
+void teredo_arena_destroy (teredo_arena *a);
+
+/**
+ * Allocates a zero-filled table, aligned on a cache line. Not thread-safe.
+ * Tables are never freed.
+ *
+ * @return NULL if the arena is full.
+ */
+void *teredo_arena_alloc_table (teredo_arena *a, size_t size);
+
+/**
+ * Allocates a chunk of TEREDO_ARENA_CHUNK bytes, aligned on a cache line.
+ * Thread-safe.
+ *
+ * @return NULL if the arena is full.
+ */
+void *teredo_arena_alloc_chunk (teredo_arena *a);
+
+/**
+ * Gives a chunk back to its arena. Thread-safe.
+ */
+void teredo_arena_free_chunk (teredo_arena *a, void *chunk);
+
+/**
+ * @return the number of chunks that can still be carved out of the arena
+ * (not counting the chunks that were given back).
+ */
+size_t teredo_arena_chunks_left (const teredo_arena *a);
+
+# ifdef __cplusplus
+}
+# endif
+#endif /* ifndef LIBTEREDO_ARENA_H */
@@ -0,0 +1,66 @@
+/*
+ * bloom.c - Lock-free negative lookup filter
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "bloom.h"
+
+int teredo_bloom_init (teredo_bloom *f, unsigned capacity)
+{
+	uint64_t words = ((uint64_t)capacity * TEREDO_BLOOM_BITS_PER_ENTRY) / 64;
+	uint32_t n = 1;
+
+	while ((n < words) && (n < UINT32_C(0x80000000)))
+		n <<= 1;
+
+	/* Pages are only touched once used */
+	f->words = calloc (n, sizeof (*f->words));
+	if (f->words == NULL)
+		return -1;
+
+	f->mask = n - 1;
+	f->count = 0;
+	return 0;
+}
+
+
+void teredo_bloom_destroy (teredo_bloom *f)
+{
+	free (f->words);
+}
+
+
+void teredo_bloom_clear (teredo_bloom *f)
+{
+	if (f->count == 0)
+		return; /* avoids touching pages */
+
+	for (uint32_t i = 0; i <= f->mask; i++)
+		atomic_store_explicit (f->words + i, 0, memory_order_relaxed);
+	f->count = 0;
+}
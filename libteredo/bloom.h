@@ -0,0 +1,113 @@
+/**
+ * @file bloom.h
+ * @brief Lock-free negative lookup filter
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_BLOOM_H
+# define LIBTEREDO_BLOOM_H
+
+# include <stdatomic.h>
+
+/*
+ * Register-blocked Bloom filter of 32-bit hashes: each hash sets
+ * TEREDO_BLOOM_K bits of a single 64-bit word, so that a test costs one
+ * (relaxed atomic) load. Bits are set by a single writer (the caller
+ * serializes additions and clearing), but tests need no lock at all.
+ * A test racing with an addition may miss it, as if it had happened first.
+ *
+ * False positives are possible, false negatives are not. There is no
+ * removal: the filter can only be cleared as a whole.
+ */
+# define TEREDO_BLOOM_K 4
+# define TEREDO_BLOOM_BITS_PER_ENTRY 8
+
+typedef struct teredo_bloom
+{
+	atomic_uint_least64_t *words;
+	uint32_t mask; /* number of words - 1 */
+	unsigned count; /* additions since last cleared */
+} teredo_bloom;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Initializes an empty filter.
+ *
+ * @param capacity number of entries the filter is sized for; more entries
+ * can be added, at the expense of more false positives.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+int teredo_bloom_init (teredo_bloom *f, unsigned capacity);
+
+/**
+ * Releases the memory used by a filter.
+ */
+void teredo_bloom_destroy (teredo_bloom *f);
+
+/**
+ * Empties a filter.
+ */
+void teredo_bloom_clear (teredo_bloom *f);
+
+# ifdef __cplusplus
+}
+# endif
+
+static inline uint64_t teredo_bloom_bits (uint32_t hash)
+{
+	/* Bits positions come from a remix of the hash, bits 58 to 63,
+	 * 52 to 57, and so on. The word index uses the low-order bits. */
+	uint64_t h = hash * UINT64_C(0x9e3779b97f4a7c15), bits = 0;
+
+	for (unsigned i = 0; i < TEREDO_BLOOM_K; i++)
+		bits |= UINT64_C(1) << ((h >> (58 - 6 * i)) & 63);
+	return bits;
+}
+
+/**
+ * Adds a hash to a filter. Not thread-safe with other additions.
+ */
+static inline void teredo_bloom_add (teredo_bloom *f, uint32_t hash)
+{
+	atomic_uint_least64_t *w = f->words + (hash & f->mask);
+
+	atomic_store_explicit (w, atomic_load_explicit (w, memory_order_relaxed)
+	                          | teredo_bloom_bits (hash),
+	                       memory_order_relaxed);
+	f->count++;
+}
+
+/**
+ * Tests whether a hash may have been added to a filter. Thread-safe.
+ *
+ * @return false if the hash was definitely not added, true otherwise.
+ */
+static inline bool teredo_bloom_test (const teredo_bloom *f, uint32_t hash)
+{
+	uint64_t bits = teredo_bloom_bits (hash);
+
+	return (atomic_load_explicit (f->words + (hash & f->mask),
+	                              memory_order_relaxed) & bits) == bits;
+}
+
+#endif /* ifndef LIBTEREDO_BLOOM_H */
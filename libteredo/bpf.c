@@ -0,0 +1,656 @@
+/*
+ * bpf.c - In-kernel eBPF datapath
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "tunnel.h"
+#include "bpf.h"
+
+#ifdef HAVE_BPF_DATAPATH
+# include <time.h>
+# include <stddef.h>
+# include <sys/socket.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <net/if.h>
+# include <net/if_arp.h>
+# include <ifaddrs.h>
+# include <pthread.h>
+# include <linux/bpf.h>
+# include <linux/pkt_cls.h>
+# include <linux/if_ether.h>
+# include "clock.h"
+# include "peerlist.h" // TEREDO_TIMEOUT
+# include "debug.h"
+
+# if !HAVE_DECL_BPF_TCX_INGRESS
+/* Kernel headers older than Linux 6.6 */
+#  define BPF_TCX_INGRESS 46
+#  define BPF_TCX_EGRESS  47
+# endif
+
+/* Map value: mapping and expiry of a trusted peer */
+struct teredo_bpf_peer
+{
+	uint32_t ipv4;
+	uint16_t port;
+	uint16_t pad;
+	uint64_t expires; // CLOCK_MONOTONIC nanoseconds
+};
+
+struct teredo_datapath
+{
+	int map;
+	int progs[2];
+	int links[2];
+};
+
+# define TEREDO_BPF_MAX_PEERS 65536
+
+/*** Minimal eBPF assembler ***/
+# define INSN(c, d, s, o, i) \
+	((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), \
+	                    .off = (o), .imm = (i) })
+# define MOV64_IMM(d, i) INSN (BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+# define MOV64_REG(d, s) INSN (BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+# define ALU64_IMM(op, d, i) INSN (BPF_ALU64 | (op) | BPF_K, d, 0, 0, i)
+# define ALU64_REG(op, d, s) INSN (BPF_ALU64 | (op) | BPF_X, d, s, 0, 0)
+# define ALU32_IMM(op, d, i) INSN (BPF_ALU | (op) | BPF_K, d, 0, 0, i)
+# define NTOH(d, bits) INSN (BPF_ALU | BPF_END | BPF_TO_BE, d, 0, 0, bits)
+# define LDX(sz, d, s, o) INSN (BPF_LDX | (sz) | BPF_MEM, d, s, o, 0)
+# define STX(sz, d, s, o) INSN (BPF_STX | (sz) | BPF_MEM, d, s, o, 0)
+# define ST(sz, d, o, i) INSN (BPF_ST | (sz) | BPF_MEM, d, 0, o, i)
+# define JMP_IMM(op, d, i) INSN (BPF_JMP | (op) | BPF_K, d, 0, 0, i)
+# define JMP_REG(op, d, s) INSN (BPF_JMP | (op) | BPF_X, d, s, 0, 0)
+# define JMP32_IMM(op, d, i) INSN (BPF_JMP32 | (op) | BPF_K, d, 0, 0, i)
+# define JMP32_REG(op, d, s) INSN (BPF_JMP32 | (op) | BPF_X, d, s, 0, 0)
+# define CALL(f) INSN (BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_##f)
+# define EXIT() INSN (BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+# define LD_IMM64(d, v) \
+	INSN (BPF_LD | BPF_DW | BPF_IMM, d, 0, 0, (uint32_t)(v)), \
+	INSN (0, 0, 0, 0, (uint32_t)((uint64_t)(v) >> 32))
+# define LD_MAP_FD(d, fd) \
+	INSN (BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), \
+	INSN (0, 0, 0, 0, 0)
+
+# define SKB_FIELD(f) offsetof (struct __sk_buff, f)
+
+enum { L_PASS, L_DROP, L_NEXT, L_MAX };
+
+typedef struct bpf_asm
+{
+	struct bpf_insn insn[160];
+	int8_t target[160]; // jump label (-1: none)
+	unsigned labels[L_MAX];
+	unsigned len;
+} bpf_asm;
+
+static void asm_emit (bpf_asm *a, int label, struct bpf_insn insn)
+{
+	assert (a->len < sizeof (a->insn) / sizeof (a->insn[0]));
+	a->target[a->len] = label;
+	a->insn[a->len++] = insn;
+}
+
+# define EMIT(...) \
+	do { \
+		const struct bpf_insn tab_[] = { __VA_ARGS__ }; \
+		for (size_t i_ = 0; i_ < sizeof (tab_) / sizeof (tab_[0]); i_++) \
+			asm_emit (a, -1, tab_[i_]); \
+	} while (0)
+# define GOTO(label, insn) asm_emit (a, label, insn)
+# define LABEL(label) (a->labels[label] = a->len)
+
+static void asm_link (bpf_asm *a)
+{
+	for (unsigned i = 0; i < a->len; i++)
+		if (a->target[i] >= 0)
+			a->insn[i].off = a->labels[a->target[i]] - (i + 1);
+}
+
+
+/**
+ * Assembles the ingress program: decapsulation of packets from trusted
+ * peers. The packet is copied to the stack at fp-88 as follows:
+ * IPv4 header (fp-88), UDP header (fp-68), IPv6 header (fp-60).
+ */
+static void
+bpf_asm_ingress (bpf_asm *a, int map, unsigned l2, unsigned tun_ifindex,
+                 uint32_t ipv4, uint16_t port)
+{
+	EMIT (MOV64_REG (BPF_REG_6, BPF_REG_1),
+	      LDX (BPF_W, BPF_REG_0, BPF_REG_6, SKB_FIELD (protocol)));
+	GOTO (L_PASS, JMP32_IMM (BPF_JNE, BPF_REG_0, htons (ETH_P_IP)));
+	EMIT (LDX (BPF_W, BPF_REG_0, BPF_REG_6, SKB_FIELD (len)));
+	GOTO (L_PASS, JMP32_IMM (BPF_JLT, BPF_REG_0, l2 + 68));
+	EMIT (MOV64_REG (BPF_REG_1, BPF_REG_6),
+	      MOV64_IMM (BPF_REG_2, l2),
+	      MOV64_REG (BPF_REG_3, BPF_REG_10),
+	      ALU64_IMM (BPF_ADD, BPF_REG_3, -88),
+	      MOV64_IMM (BPF_REG_4, 68),
+	      CALL (skb_load_bytes));
+	GOTO (L_PASS, JMP_IMM (BPF_JNE, BPF_REG_0, 0));
+
+	/* IPv4 header without options nor fragmentation, toward our socket */
+	EMIT (LDX (BPF_B, BPF_REG_0, BPF_REG_10, -88));
+	GOTO (L_PASS, JMP32_IMM (BPF_JNE, BPF_REG_0, 0x45));
+	EMIT (LDX (BPF_H, BPF_REG_0, BPF_REG_10, -82),
+	      ALU32_IMM (BPF_AND, BPF_REG_0, htons (0x3fff)));
+	GOTO (L_PASS, JMP32_IMM (BPF_JNE, BPF_REG_0, 0));
+	EMIT (LDX (BPF_B, BPF_REG_0, BPF_REG_10, -79));
+	GOTO (L_PASS, JMP32_IMM (BPF_JNE, BPF_REG_0, IPPROTO_UDP));
+	if (ipv4 != INADDR_ANY)
+	{
+		EMIT (LDX (BPF_W, BPF_REG_0, BPF_REG_10, -72));
+		GOTO (L_PASS, JMP32_IMM (BPF_JNE, BPF_REG_0, (int32_t)ipv4));
+	}
+	EMIT (LDX (BPF_H, BPF_REG_0, BPF_REG_10, -66));
+	GOTO (L_PASS, JMP32_IMM (BPF_JNE, BPF_REG_0, port));
+
+	/* Consistent lengths: no trailer, UDP length, IPv6 payload length */
+	EMIT (LDX (BPF_H, BPF_REG_7, BPF_REG_10, -86),
+	      NTOH (BPF_REG_7, 16),
+	      LDX (BPF_W, BPF_REG_0, BPF_REG_6, SKB_FIELD (len)),
+	      ALU64_IMM (BPF_SUB, BPF_REG_0, l2));
+	GOTO (L_PASS, JMP32_REG (BPF_JNE, BPF_REG_0, BPF_REG_7));
+	EMIT (LDX (BPF_H, BPF_REG_0, BPF_REG_10, -64),
+	      NTOH (BPF_REG_0, 16),
+	      ALU64_IMM (BPF_SUB, BPF_REG_7, 20));
+	GOTO (L_PASS, JMP32_REG (BPF_JNE, BPF_REG_0, BPF_REG_7));
+	EMIT (LDX (BPF_H, BPF_REG_0, BPF_REG_10, -56),
+	      NTOH (BPF_REG_0, 16),
+	      ALU64_IMM (BPF_SUB, BPF_REG_7, 48));
+	GOTO (L_PASS, JMP32_REG (BPF_JNE, BPF_REG_0, BPF_REG_7));
+
+	/* IPv6 packet, but neither a bubble, nor link-local, nor multicast */
+	EMIT (LDX (BPF_B, BPF_REG_0, BPF_REG_10, -60),
+	      ALU32_IMM (BPF_RSH, BPF_REG_0, 4));
+	GOTO (L_PASS, JMP32_IMM (BPF_JNE, BPF_REG_0, 6));
+	EMIT (LDX (BPF_B, BPF_REG_0, BPF_REG_10, -54));
+	GOTO (L_PASS, JMP32_IMM (BPF_JEQ, BPF_REG_0, IPPROTO_NONE));
+	EMIT (LDX (BPF_B, BPF_REG_0, BPF_REG_10, -52));
+	GOTO (L_NEXT, JMP32_IMM (BPF_JNE, BPF_REG_0, 0xfe));
+	EMIT (LDX (BPF_B, BPF_REG_0, BPF_REG_10, -51),
+	      ALU32_IMM (BPF_AND, BPF_REG_0, 0xc0));
+	GOTO (L_PASS, JMP32_IMM (BPF_JEQ, BPF_REG_0, 0x80));
+	LABEL (L_NEXT);
+	EMIT (LDX (BPF_B, BPF_REG_0, BPF_REG_10, -36));
+	GOTO (L_PASS, JMP32_IMM (BPF_JEQ, BPF_REG_0, 0xff));
+
+	/* Trusted peer with a matching mapping */
+	EMIT (LD_MAP_FD (BPF_REG_1, map),
+	      MOV64_REG (BPF_REG_2, BPF_REG_10),
+	      ALU64_IMM (BPF_ADD, BPF_REG_2, -52),
+	      CALL (map_lookup_elem));
+	GOTO (L_PASS, JMP_IMM (BPF_JEQ, BPF_REG_0, 0));
+	EMIT (MOV64_REG (BPF_REG_7, BPF_REG_0),
+	      LDX (BPF_W, BPF_REG_1, BPF_REG_7,
+	           offsetof (struct teredo_bpf_peer, ipv4)),
+	      LDX (BPF_W, BPF_REG_2, BPF_REG_10, -76));
+	GOTO (L_PASS, JMP32_REG (BPF_JNE, BPF_REG_1, BPF_REG_2));
+	EMIT (LDX (BPF_H, BPF_REG_1, BPF_REG_7,
+	           offsetof (struct teredo_bpf_peer, port)),
+	      LDX (BPF_H, BPF_REG_2, BPF_REG_10, -68));
+	GOTO (L_PASS, JMP32_REG (BPF_JNE, BPF_REG_1, BPF_REG_2));
+
+	EMIT (CALL (ktime_get_ns),
+	      LD_IMM64 (BPF_REG_1, TEREDO_TIMEOUT * UINT64_C(1000000000)),
+	      ALU64_REG (BPF_ADD, BPF_REG_0, BPF_REG_1),
+	      STX (BPF_DW, BPF_REG_7, BPF_REG_0,
+	           offsetof (struct teredo_bpf_peer, expires)));
+
+	/* Decapsulation */
+	EMIT (MOV64_REG (BPF_REG_1, BPF_REG_6),
+	      MOV64_IMM (BPF_REG_2, htons (ETH_P_IPV6)),
+	      MOV64_IMM (BPF_REG_3, 0),
+	      CALL (skb_change_proto));
+	GOTO (L_PASS, JMP_IMM (BPF_JNE, BPF_REG_0, 0));
+	EMIT (MOV64_REG (BPF_REG_1, BPF_REG_6),
+	      MOV64_IMM (BPF_REG_2, -48),
+	      MOV64_IMM (BPF_REG_3, BPF_ADJ_ROOM_MAC),
+	      MOV64_IMM (BPF_REG_4, 0),
+	      CALL (skb_adjust_room));
+	GOTO (L_DROP, JMP_IMM (BPF_JNE, BPF_REG_0, 0));
+	EMIT (MOV64_REG (BPF_REG_1, BPF_REG_6),
+	      MOV64_IMM (BPF_REG_2, BPF_CSUM_LEVEL_RESET),
+	      CALL (csum_level),
+	      MOV64_IMM (BPF_REG_1, tun_ifindex),
+	      MOV64_IMM (BPF_REG_2, BPF_F_INGRESS),
+	      CALL (redirect),
+	      EXIT ());
+
+	LABEL (L_PASS);
+	EMIT (MOV64_IMM (BPF_REG_0, TC_ACT_UNSPEC), EXIT ());
+	LABEL (L_DROP);
+	EMIT (MOV64_IMM (BPF_REG_0, TC_ACT_SHOT), EXIT ());
+	asm_link (a);
+}
+
+
+/**
+ * Assembles the egress program: encapsulation of packets toward trusted
+ * peers. The IPv6 header is copied to the stack at fp-40, and the IPv4 and
+ * UDP headers are built at fp-72.
+ */
+static void
+bpf_asm_egress (bpf_asm *a, int map, unsigned net_ifindex,
+                uint32_t ipv4, uint16_t port)
+{
+	EMIT (MOV64_REG (BPF_REG_6, BPF_REG_1),
+	      LDX (BPF_W, BPF_REG_0, BPF_REG_6, SKB_FIELD (protocol)));
+	GOTO (L_PASS, JMP32_IMM (BPF_JNE, BPF_REG_0, htons (ETH_P_IPV6)));
+	EMIT (LDX (BPF_W, BPF_REG_8, BPF_REG_6, SKB_FIELD (len)));
+	GOTO (L_PASS, JMP32_IMM (BPF_JLT, BPF_REG_8, 40));
+	GOTO (L_PASS, JMP32_IMM (BPF_JGT, BPF_REG_8, 65535 - 28));
+	EMIT (MOV64_REG (BPF_REG_1, BPF_REG_6),
+	      MOV64_IMM (BPF_REG_2, 0),
+	      MOV64_REG (BPF_REG_3, BPF_REG_10),
+	      ALU64_IMM (BPF_ADD, BPF_REG_3, -40),
+	      MOV64_IMM (BPF_REG_4, 40),
+	      CALL (skb_load_bytes));
+	GOTO (L_PASS, JMP_IMM (BPF_JNE, BPF_REG_0, 0));
+
+	/* Trusted peer that has not expired */
+	EMIT (LD_MAP_FD (BPF_REG_1, map),
+	      MOV64_REG (BPF_REG_2, BPF_REG_10),
+	      ALU64_IMM (BPF_ADD, BPF_REG_2, -16),
+	      CALL (map_lookup_elem));
+	GOTO (L_PASS, JMP_IMM (BPF_JEQ, BPF_REG_0, 0));
+	EMIT (MOV64_REG (BPF_REG_7, BPF_REG_0),
+	      CALL (ktime_get_ns),
+	      LDX (BPF_DW, BPF_REG_1, BPF_REG_7,
+	           offsetof (struct teredo_bpf_peer, expires)));
+	GOTO (L_PASS, JMP_REG (BPF_JGT, BPF_REG_0, BPF_REG_1));
+
+	/* IPv4 header (without Don't Fragment flag) */
+	EMIT (ST (BPF_B, BPF_REG_10, -72, 0x45),
+	      ST (BPF_B, BPF_REG_10, -71, 0),
+	      MOV64_REG (BPF_REG_0, BPF_REG_8),
+	      ALU64_IMM (BPF_ADD, BPF_REG_0, 28),
+	      NTOH (BPF_REG_0, 16),
+	      STX (BPF_H, BPF_REG_10, BPF_REG_0, -70),
+	      ST (BPF_W, BPF_REG_10, -68, 0),
+	      ST (BPF_B, BPF_REG_10, -64, 64),
+	      ST (BPF_B, BPF_REG_10, -63, IPPROTO_UDP),
+	      ST (BPF_H, BPF_REG_10, -62, 0),
+	      ST (BPF_W, BPF_REG_10, -60, (int32_t)ipv4),
+	      LDX (BPF_W, BPF_REG_0, BPF_REG_7,
+	           offsetof (struct teredo_bpf_peer, ipv4)),
+	      STX (BPF_W, BPF_REG_10, BPF_REG_0, -56));
+	/* UDP header (without checksum, like teredo_send()) */
+	EMIT (ST (BPF_H, BPF_REG_10, -52, port),
+	      LDX (BPF_H, BPF_REG_0, BPF_REG_7,
+	           offsetof (struct teredo_bpf_peer, port)),
+	      STX (BPF_H, BPF_REG_10, BPF_REG_0, -50),
+	      MOV64_REG (BPF_REG_0, BPF_REG_8),
+	      ALU64_IMM (BPF_ADD, BPF_REG_0, 8),
+	      NTOH (BPF_REG_0, 16),
+	      STX (BPF_H, BPF_REG_10, BPF_REG_0, -48),
+	      ST (BPF_H, BPF_REG_10, -46, 0));
+	/* IPv4 header checksum */
+	EMIT (MOV64_IMM (BPF_REG_1, 0),
+	      MOV64_IMM (BPF_REG_2, 0),
+	      MOV64_REG (BPF_REG_3, BPF_REG_10),
+	      ALU64_IMM (BPF_ADD, BPF_REG_3, -72),
+	      MOV64_IMM (BPF_REG_4, 20),
+	      MOV64_IMM (BPF_REG_5, 0),
+	      CALL (csum_diff),
+	      MOV64_REG (BPF_REG_1, BPF_REG_0),
+	      ALU64_IMM (BPF_RSH, BPF_REG_1, 16),
+	      ALU64_IMM (BPF_AND, BPF_REG_0, 0xffff),
+	      ALU64_REG (BPF_ADD, BPF_REG_0, BPF_REG_1),
+	      MOV64_REG (BPF_REG_1, BPF_REG_0),
+	      ALU64_IMM (BPF_RSH, BPF_REG_1, 16),
+	      ALU64_IMM (BPF_AND, BPF_REG_0, 0xffff),
+	      ALU64_REG (BPF_ADD, BPF_REG_0, BPF_REG_1),
+	      ALU64_IMM (BPF_XOR, BPF_REG_0, 0xffff),
+	      STX (BPF_H, BPF_REG_10, BPF_REG_0, -62));
+
+	/* Encapsulation */
+	EMIT (MOV64_REG (BPF_REG_1, BPF_REG_6),
+	      MOV64_IMM (BPF_REG_2, 48),
+	      MOV64_IMM (BPF_REG_3, BPF_ADJ_ROOM_MAC),
+	      MOV64_IMM (BPF_REG_4, 0),
+	      CALL (skb_adjust_room));
+	GOTO (L_PASS, JMP_IMM (BPF_JNE, BPF_REG_0, 0));
+	EMIT (MOV64_REG (BPF_REG_1, BPF_REG_6),
+	      MOV64_IMM (BPF_REG_2, htons (ETH_P_IP)),
+	      MOV64_IMM (BPF_REG_3, 0),
+	      CALL (skb_change_proto));
+	GOTO (L_DROP, JMP_IMM (BPF_JNE, BPF_REG_0, 0));
+	EMIT (MOV64_REG (BPF_REG_1, BPF_REG_6),
+	      MOV64_IMM (BPF_REG_2, 0),
+	      MOV64_REG (BPF_REG_3, BPF_REG_10),
+	      ALU64_IMM (BPF_ADD, BPF_REG_3, -72),
+	      MOV64_IMM (BPF_REG_4, 28),
+	      MOV64_IMM (BPF_REG_5, 0),
+	      CALL (skb_store_bytes));
+	GOTO (L_DROP, JMP_IMM (BPF_JNE, BPF_REG_0, 0));
+	/* Neighbour redirection expects (and strips) a link layer header */
+	EMIT (MOV64_REG (BPF_REG_1, BPF_REG_6),
+	      MOV64_IMM (BPF_REG_2, ETH_HLEN),
+	      MOV64_IMM (BPF_REG_3, 0),
+	      CALL (skb_change_head));
+	GOTO (L_DROP, JMP_IMM (BPF_JNE, BPF_REG_0, 0));
+	EMIT (MOV64_IMM (BPF_REG_1, net_ifindex),
+	      MOV64_IMM (BPF_REG_2, 0),
+	      MOV64_IMM (BPF_REG_3, 0),
+	      MOV64_IMM (BPF_REG_4, 0),
+	      CALL (redirect_neigh),
+	      EXIT ());
+
+	LABEL (L_PASS);
+	EMIT (MOV64_IMM (BPF_REG_0, TC_ACT_UNSPEC), EXIT ());
+	LABEL (L_DROP);
+	EMIT (MOV64_IMM (BPF_REG_0, TC_ACT_SHOT), EXIT ());
+	asm_link (a);
+}
+
+
+static int sys_bpf (int cmd, union bpf_attr *attr)
+{
+	return syscall (__NR_bpf, cmd, attr, sizeof (*attr));
+}
+
+
+static int bpf_prog_load (const bpf_asm *a)
+{
+	union bpf_attr attr;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.prog_type = BPF_PROG_TYPE_SCHED_CLS;
+	attr.insns = (uintptr_t)a->insn;
+	attr.insn_cnt = a->len;
+	attr.license = (uintptr_t)"GPL";
+
+	int fd = sys_bpf (BPF_PROG_LOAD, &attr);
+#ifndef NDEBUG
+	if (fd == -1 && errno == EACCES)
+	{
+		/* Rejected by the verifier */
+		static char log[65536];
+
+		attr.log_buf = (uintptr_t)log;
+		attr.log_size = sizeof (log);
+		attr.log_level = 1;
+		if (sys_bpf (BPF_PROG_LOAD, &attr) == -1)
+			debug ("eBPF verifier: %s", log);
+		errno = EACCES;
+	}
+#endif
+	return fd;
+}
+
+
+static int bpf_link_create (int prog, unsigned ifindex, unsigned type)
+{
+	union bpf_attr attr;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.link_create.prog_fd = prog;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = type;
+
+	int fd = sys_bpf (BPF_LINK_CREATE, &attr);
+	if (fd == -1 && errno == EINVAL)
+		errno = EOPNOTSUPP; /* kernel without tcx (before Linux 6.6) */
+	return fd;
+}
+
+
+/**
+ * @return the offset of the network header on an interface, or -1 if the
+ * link layer is not supported.
+ */
+static int if_l2_offset (unsigned ifindex)
+{
+	struct ifreq req;
+
+	memset (&req, 0, sizeof (req));
+	if (if_indextoname (ifindex, req.ifr_name) == NULL)
+		return -1;
+
+	int fd = socket (AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+
+	int val = ioctl (fd, SIOCGIFHWADDR, &req);
+	close (fd);
+	if (val)
+		return -1;
+
+	switch (req.ifr_hwaddr.sa_family)
+	{
+		case ARPHRD_ETHER:
+		case ARPHRD_LOOPBACK:
+			return ETH_HLEN;
+		case ARPHRD_NONE:
+			return 0;
+	}
+	errno = EPROTONOSUPPORT;
+	return -1;
+}
+
+
+/**
+ * @return the first IPv4 address of an interface, or INADDR_ANY.
+ */
+static uint32_t if_ipv4 (unsigned ifindex)
+{
+	char name[IF_NAMESIZE];
+	if (if_indextoname (ifindex, name) == NULL)
+		return INADDR_ANY;
+
+	struct ifaddrs *ifa;
+	if (getifaddrs (&ifa))
+		return INADDR_ANY;
+
+	uint32_t ipv4 = INADDR_ANY;
+	for (const struct ifaddrs *p = ifa; p != NULL; p = p->ifa_next)
+		if ((p->ifa_addr != NULL) && (p->ifa_addr->sa_family == AF_INET)
+		 && !strcmp (p->ifa_name, name))
+		{
+			ipv4 = ((const struct sockaddr_in *)p->ifa_addr)->sin_addr.s_addr;
+			break;
+		}
+
+	freeifaddrs (ifa);
+	return ipv4;
+}
+
+
+teredo_datapath *teredo_datapath_create (unsigned tun_ifindex,
+                                         unsigned net_ifindex,
+                                         uint32_t ipv4, uint16_t port)
+{
+	if (port == 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	int l2 = if_l2_offset (net_ifindex);
+	if (l2 == -1)
+		return NULL;
+
+	uint32_t src = (ipv4 != INADDR_ANY) ? ipv4 : if_ipv4 (net_ifindex);
+	if (src == INADDR_ANY)
+	{
+		errno = EADDRNOTAVAIL;
+		return NULL;
+	}
+
+	teredo_datapath *dp = malloc (sizeof (*dp));
+	if (dp == NULL)
+		return NULL;
+	dp->progs[0] = dp->progs[1] = dp->links[0] = dp->links[1] = -1;
+
+	union bpf_attr attr;
+	memset (&attr, 0, sizeof (attr));
+	attr.map_type = BPF_MAP_TYPE_LRU_HASH;
+	attr.key_size = sizeof (struct in6_addr);
+	attr.value_size = sizeof (struct teredo_bpf_peer);
+	attr.max_entries = TEREDO_BPF_MAX_PEERS;
+
+	dp->map = sys_bpf (BPF_MAP_CREATE, &attr);
+	if (dp->map == -1)
+		goto error;
+
+	bpf_asm *a = malloc (sizeof (*a));
+	if (a == NULL)
+		goto error;
+
+	memset (a, 0, sizeof (*a));
+	bpf_asm_ingress (a, dp->map, l2, tun_ifindex, ipv4, port);
+	dp->progs[0] = bpf_prog_load (a);
+
+	memset (a, 0, sizeof (*a));
+	bpf_asm_egress (a, dp->map, net_ifindex, src, port);
+	dp->progs[1] = bpf_prog_load (a);
+	free (a);
+
+	if ((dp->progs[0] == -1) || (dp->progs[1] == -1))
+		goto error;
+
+	/* tcx links are detached when their file descriptor is closed */
+	dp->links[0] = bpf_link_create (dp->progs[0], net_ifindex,
+	                                BPF_TCX_INGRESS);
+	if (dp->links[0] == -1)
+		goto error;
+	dp->links[1] = bpf_link_create (dp->progs[1], tun_ifindex,
+	                                BPF_TCX_EGRESS);
+	if (dp->links[1] == -1)
+		goto error;
+
+	return dp;
+
+error:
+	{
+		int saved_errno = errno;
+		teredo_datapath_destroy (dp);
+		errno = saved_errno;
+	}
+	return NULL;
+}
+
+
+void teredo_datapath_destroy (teredo_datapath *dp)
+{
+	assert (dp != NULL);
+
+	for (unsigned i = 0; i < 2; i++)
+	{
+		if (dp->links[i] != -1)
+			close (dp->links[i]);
+		if (dp->progs[i] != -1)
+			close (dp->progs[i]);
+	}
+	if (dp->map != -1)
+		close (dp->map);
+	free (dp);
+}
+
+
+void teredo_datapath_update (teredo_datapath *dp, const struct in6_addr *addr,
+                             uint32_t ipv4, uint16_t port, unsigned ttl)
+{
+	struct teredo_bpf_peer value = { .ipv4 = ipv4, .port = port };
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	value.expires = (ts.tv_sec + (uint64_t)ttl) * 1000000000 + ts.tv_nsec;
+
+	union bpf_attr attr;
+	memset (&attr, 0, sizeof (attr));
+	attr.map_fd = dp->map;
+	attr.key = (uintptr_t)addr;
+	attr.value = (uintptr_t)&value;
+	attr.flags = BPF_ANY;
+	sys_bpf (BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+
+void teredo_datapath_flush (teredo_datapath *dp)
+{
+	struct in6_addr key;
+	union bpf_attr attr;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.map_fd = dp->map;
+	attr.key = 0; /* first key */
+	attr.next_key = (uintptr_t)&key;
+
+	/* Deleting the first key restarts the iteration every time */
+	while (sys_bpf (BPF_MAP_GET_NEXT_KEY, &attr) == 0)
+	{
+		union bpf_attr del;
+
+		memset (&del, 0, sizeof (del));
+		del.map_fd = dp->map;
+		del.key = (uintptr_t)&key;
+		if (sys_bpf (BPF_MAP_DELETE_ELEM, &del))
+			break;
+	}
+}
+
+#else /* HAVE_BPF_DATAPATH */
+
+teredo_datapath *teredo_datapath_create (unsigned tun_ifindex,
+                                         unsigned net_ifindex,
+                                         uint32_t ipv4, uint16_t port)
+{
+	(void)tun_ifindex; (void)net_ifindex; (void)ipv4; (void)port;
+	errno = ENOSYS;
+	return NULL;
+}
+
+
+void teredo_datapath_destroy (teredo_datapath *dp)
+{
+	(void)dp; /* never created */
+}
+
+
+void teredo_datapath_update (teredo_datapath *dp, const struct in6_addr *addr,
+                             uint32_t ipv4, uint16_t port, unsigned ttl)
+{
+	(void)dp; (void)addr; (void)ipv4; (void)port; (void)ttl;
+}
+
+
+void teredo_datapath_flush (teredo_datapath *dp)
+{
+	(void)dp; /* never created */
+}
+#endif /* !HAVE_BPF_DATAPATH */
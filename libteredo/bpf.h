@@ -0,0 +1,67 @@
+/**
+ * @file bpf.h
+ * @brief In-kernel eBPF datapath
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_BPF_H
+# define LIBTEREDO_BPF_H
+
+/*
+ * Two traffic control programs share a hash map of trusted peers, keyed by
+ * IPv6 address. On the network interface, the ingress program decapsulates
+ * Teredo packets whose outer source matches the mapping of a trusted peer,
+ * and redirects them to the tunnel interface. On the tunnel interface, the
+ * egress program encapsulates packets toward trusted peers, and sends them
+ * out of the network interface. Anything else (bubbles, pings, unknown or
+ * expired peers, malformed packets) goes through userspace as usual.
+ *
+ * The kernel refreshes the entries expiry whenever it decapsulates a
+ * packet, so that the peers that only exchange traffic in the kernel
+ * remain valid.
+ */
+
+struct in6_addr;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Adds a trusted peer to the in-kernel datapath map, or updates its
+ * mapping.
+ *
+ * @param addr IPv6 address of the peer
+ * @param ipv4 mapped IPv4 address of the peer (network byte order)
+ * @param port mapped UDP port of the peer (network byte order)
+ * @param ttl seconds until the entry expires unless refreshed
+ */
+void teredo_datapath_update (teredo_datapath *dp, const struct in6_addr *addr,
+                             uint32_t ipv4, uint16_t port, unsigned ttl);
+
+/**
+ * Removes all peers from the in-kernel datapath map.
+ */
+void teredo_datapath_flush (teredo_datapath *dp);
+
+# ifdef __cplusplus
+}
+# endif
+
+#endif /* ifndef LIBTEREDO_BPF_H */
@@ -0,0 +1,340 @@
+/*
+ * checksum.c - Internet checksum computation
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h> // memcpy(), strcmp()
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "checksum.h"
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+# define CKSUM_X86 1
+# include <immintrin.h>
+#endif
+#if defined (__ARM_NEON) || defined (__ARM_NEON__)
+# define CKSUM_NEON 1
+# include <arm_neon.h>
+#endif
+
+/*
+ * All kernels add up the native byte order 16-bits words of a buffer
+ * (with a trailing odd byte padded with zero) into a 64-bits accumulator.
+ * This is congruent to the one's complement sum, which does not depend on
+ * the byte order (see RFC1071), modulo 0xffff.
+ */
+typedef uint64_t (*cksum_sum_fn) (const uint8_t *, size_t);
+
+static uint64_t cksum_sum_scalar (const uint8_t *p, size_t len)
+{
+	uint64_t sum = 0;
+
+	/* A 32-bits word is congruent to the sum of its two 16-bits halves */
+	for (; len >= 8; len -= 8, p += 8)
+	{
+		uint32_t a, b;
+
+		memcpy (&a, p, 4);
+		memcpy (&b, p + 4, 4);
+		sum += a;
+		sum += b;
+	}
+
+	if (len >= 4)
+	{
+		uint32_t a;
+
+		memcpy (&a, p, 4);
+		sum += a;
+		p += 4;
+		len -= 4;
+	}
+
+	if (len >= 2)
+	{
+		uint16_t w;
+
+		memcpy (&w, p, 2);
+		sum += w;
+		p += 2;
+		len -= 2;
+	}
+
+	if (len > 0)
+	{
+		uint16_t w = 0;
+
+		memcpy (&w, p, 1);
+		sum += w;
+	}
+	return sum;
+}
+
+/*
+ * Vector kernels accumulate into 32-bits lanes, each getting two 16-bits
+ * words per vector. They are spilled to 64-bits before they may overflow.
+ */
+#define CKSUM_VECTORS_MAX 16384
+
+#ifdef CKSUM_X86
+__attribute__ ((target ("sse2")))
+static uint64_t cksum_sum_sse2 (const uint8_t *p, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	uint64_t sum = 0;
+
+	while (len >= 16)
+	{
+		size_t n = len / 16;
+		if (n > CKSUM_VECTORS_MAX)
+			n = CKSUM_VECTORS_MAX;
+		len -= n * 16;
+
+		__m128i acc = zero;
+		for (; n > 0; n--, p += 16)
+		{
+			__m128i v = _mm_loadu_si128 ((const __m128i *)p);
+
+			acc = _mm_add_epi32 (acc, _mm_unpacklo_epi16 (v, zero));
+			acc = _mm_add_epi32 (acc, _mm_unpackhi_epi16 (v, zero));
+		}
+
+		uint32_t lanes[4];
+		_mm_storeu_si128 ((__m128i *)lanes, acc);
+		for (unsigned i = 0; i < 4; i++)
+			sum += lanes[i];
+	}
+
+	return sum + cksum_sum_scalar (p, len);
+}
+
+
+__attribute__ ((target ("avx2")))
+static uint64_t cksum_sum_avx2 (const uint8_t *p, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256 ();
+	uint64_t sum = 0;
+
+	while (len >= 32)
+	{
+		size_t n = len / 32;
+		if (n > CKSUM_VECTORS_MAX)
+			n = CKSUM_VECTORS_MAX;
+		len -= n * 32;
+
+		__m256i acc = zero;
+		for (; n > 0; n--, p += 32)
+		{
+			__m256i v = _mm256_loadu_si256 ((const __m256i *)p);
+
+			acc = _mm256_add_epi32 (acc, _mm256_unpacklo_epi16 (v, zero));
+			acc = _mm256_add_epi32 (acc, _mm256_unpackhi_epi16 (v, zero));
+		}
+
+		uint32_t lanes[8];
+		_mm256_storeu_si256 ((__m256i *)lanes, acc);
+		for (unsigned i = 0; i < 8; i++)
+			sum += lanes[i];
+	}
+
+	return sum + cksum_sum_scalar (p, len);
+}
+#endif
+
+#ifdef CKSUM_NEON
+static uint64_t cksum_sum_neon (const uint8_t *p, size_t len)
+{
+	uint64_t sum = 0;
+
+	while (len >= 16)
+	{
+		size_t n = len / 16;
+		if (n > CKSUM_VECTORS_MAX)
+			n = CKSUM_VECTORS_MAX;
+		len -= n * 16;
+
+		uint32x4_t acc = vdupq_n_u32 (0);
+		for (; n > 0; n--, p += 16)
+			acc = vpadalq_u16 (acc, vreinterpretq_u16_u8 (vld1q_u8 (p)));
+
+		uint64x2_t s = vpaddlq_u32 (acc);
+		sum += vgetq_lane_u64 (s, 0) + vgetq_lane_u64 (s, 1);
+	}
+
+	return sum + cksum_sum_scalar (p, len);
+}
+#endif
+
+
+static const struct
+{
+	const char *name;
+	cksum_sum_fn sum;
+} cksum_kernels[] =
+{
+#ifdef CKSUM_X86
+	{ "avx2", cksum_sum_avx2 },
+	{ "sse2", cksum_sum_sse2 },
+#endif
+#ifdef CKSUM_NEON
+	{ "neon", cksum_sum_neon },
+#endif
+	{ "scalar", cksum_sum_scalar },
+};
+
+static bool cksum_kernel_supported (const char *name)
+{
+#ifdef CKSUM_X86
+	__builtin_cpu_init ();
+	if (strcmp (name, "avx2") == 0)
+		return __builtin_cpu_supports ("avx2");
+	if (strcmp (name, "sse2") == 0)
+		return __builtin_cpu_supports ("sse2");
+#endif
+	(void)name;
+	return true;
+}
+
+static _Atomic (cksum_sum_fn) cksum_sum = NULL;
+
+
+int teredo_cksum_select (const char *name)
+{
+	for (size_t i = 0; i < sizeof (cksum_kernels) / sizeof (cksum_kernels[0]);
+	     i++)
+	{
+		if (((name == NULL) || (strcmp (name, cksum_kernels[i].name) == 0))
+		 && cksum_kernel_supported (cksum_kernels[i].name))
+		{
+			atomic_store_explicit (&cksum_sum, cksum_kernels[i].sum,
+			                       memory_order_relaxed);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+static inline uint16_t cksum_fold (uint64_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+
+static inline uint16_t cksum_swap (uint16_t word)
+{
+	return (word << 8) | (word >> 8);
+}
+
+
+/**
+ * Computes the 16-bits one's complement sum over a scatter-gather array
+ * (not complemented).
+ */
+static uint16_t cksum_sum_iov (const struct iovec *iov, size_t n)
+{
+	cksum_sum_fn sum_fn = atomic_load_explicit (&cksum_sum,
+	                                            memory_order_relaxed);
+	if (sum_fn == NULL)
+	{
+		teredo_cksum_select (NULL);
+		sum_fn = atomic_load_explicit (&cksum_sum, memory_order_relaxed);
+	}
+
+	uint64_t sum = 0;
+	bool odd = false;
+
+	for (; n > 0; iov++, n--)
+	{
+		uint16_t part = cksum_fold (sum_fn (iov->iov_base, iov->iov_len));
+
+		/* Bytes following an odd offset belong to the other half-words */
+		sum += odd ? cksum_swap (part) : part;
+		odd ^= iov->iov_len & 1;
+	}
+	return cksum_fold (sum);
+}
+
+
+/**
+ * Computes an Internet checksum over a scatter-gather array.
+ * Buffers need not be aligned neither of even length.
+ * Jumbograms are supported (though you probably don't care).
+ */
+static uint16_t in_cksum (const struct iovec *iov, size_t n)
+{
+	return cksum_sum_iov (iov, n) ^ 0xffff;
+}
+
+
+uint16_t
+teredo_cksum (const void *src, const void *dst, uint8_t protocol,
+              const struct iovec *data, size_t n)
+{
+	struct iovec iov[3 + n];
+	size_t plen = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		iov[3 + i].iov_base = data[i].iov_base;
+		plen += (iov[3 + i].iov_len = data[i].iov_len);
+	}
+
+	uint32_t pseudo[4] = { htonl (plen), htonl (protocol) };
+	iov[0].iov_base = (void *)src;
+	iov[0].iov_len = 16;
+	iov[1].iov_base = (void *)dst;
+	iov[1].iov_len = 16;
+	iov[2].iov_base = pseudo;
+	iov[2].iov_len = 8;
+
+	return in_cksum (iov, 3 + n);
+}
+
+
+uint16_t teredo_cksum_adjust (uint16_t cksum, const void *oldp,
+                              const void *newp, size_t len)
+{
+	struct iovec iov[2] =
+	{
+		{ (void *)oldp, len },
+		{ (void *)newp, len },
+	};
+
+	/* RFC1624 eqn. 3: HC' = ~(~HC + ~m + m') */
+	uint64_t sum = (uint16_t)~cksum;
+	sum += cksum_sum_iov (iov, 1) ^ 0xffff;
+	sum += cksum_sum_iov (iov + 1, 1);
+	return cksum_fold (sum) ^ 0xffff;
+}
@@ -37,5 +37,15 @@ icmp6_checksum (const struct ip6_hdr *ip6, const struct icmp6_hdr *icmp6)
 	return teredo_cksum (&ip6->ip6_src, &ip6->ip6_dst, IPPROTO_ICMPV6, &iov, 1);
 }
 
+/**
+ * Selects the checksum computation kernel (e.g. "scalar", "sse2", "avx2" or
+ * "neon"). By default, the best one supported by the CPU is used.
+ * This is meant for testing.
+ *
+ * @param name kernel name, or NULL for the default.
+ * @return 0 on success, -1 if the kernel is not supported.
+ */
+int teredo_cksum_select (const char *name);
+
 #endif
 
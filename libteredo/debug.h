@@ -24,8 +24,10 @@
 
 # ifdef __GNUC__
 #  define LIBTEREDO_NORETURN __attribute__ ((noreturn))
+#  define LIBTEREDO_ALWAYS_INLINE inline __attribute__ ((always_inline))
 # else
 #  define LIBTEREDO_NORETURN
+#  define LIBTEREDO_ALWAYS_INLINE inline
 # endif
 
 # ifndef NDEBUG
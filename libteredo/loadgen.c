@@ -0,0 +1,702 @@
+/*
+ * loadgen.c - Teredo clients load generator
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef HAVE_GETOPT_H
+# include <getopt.h>
+#endif
+
+#include <libteredo/teredo.h>
+#include <libteredo/teredo-udp.h>
+#include "packets.h"
+
+/*
+ * Each simulated client has its own UDP socket, that is its own mapping.
+ * It qualifies against the Teredo server, then pings the target through
+ * the server. The reply comes through the target's Teredo relay, which
+ * punches a hole with bubbles; the client answers them. Once the first
+ * Echo Reply comes directly from the relay, the client streams Echo Requests
+ * to the target through the relay.
+ */
+
+/** Delay between retransmissions (RS and pings through the server) */
+#define LOADGEN_RETRY_DELAY 2000000000u
+/** Retransmissions before a client gives up */
+#define LOADGEN_RETRIES 3
+/** Maximum number of latency samples kept per thread and measure */
+#define LOADGEN_SAMPLES_MAX (1 << 20)
+
+enum loadgen_state
+{
+	LOADGEN_QUALIFYING,
+	LOADGEN_CONNECTING,
+	LOADGEN_STREAMING,
+	LOADGEN_FAILED,
+};
+
+typedef struct loadgen_client
+{
+	int fd;
+	enum loadgen_state state;
+	unsigned id;
+	unsigned tries;
+	uint64_t since; /* start of the current state (ns) */
+	uint64_t retry; /* next retransmission (ns) */
+	union teredo_addr addr;
+	uint32_t relay_ipv4;
+	uint16_t relay_port;
+	uint16_t seq;
+	uint8_t nonce[8];
+} loadgen_client;
+
+typedef struct loadgen_samples
+{
+	uint64_t *v;
+	size_t count;
+} loadgen_samples;
+
+enum
+{
+	LOADGEN_QUALIFICATION,
+	LOADGEN_CONNECTION,
+	LOADGEN_RTT,
+	LOADGEN_MEASURES
+};
+
+static const char *const loadgen_measures[LOADGEN_MEASURES] =
+{
+	"qualification", "connection", "round-trip",
+};
+
+typedef struct loadgen_thread
+{
+	pthread_t thread;
+	loadgen_client *clients;
+	unsigned count;
+	loadgen_samples samples[LOADGEN_MEASURES];
+} loadgen_thread;
+
+static struct
+{
+	uint32_t bind_ipv4;
+	uint32_t server_ipv4;
+	struct in6_addr target;
+	unsigned clients;
+	unsigned threads;
+	unsigned rate; /* packets per second (all clients) */
+	size_t size; /* IPv6 packet size */
+	unsigned duration; /* seconds */
+	bool cone;
+} cfg =
+{
+	.clients = 1000,
+	.threads = 1,
+	.rate = 1000,
+	.size = 1280,
+	.duration = 10,
+};
+
+static uint64_t loadgen_end;
+
+static atomic_uint_fast64_t n_qualified, n_connected, n_failed;
+static atomic_uint_fast64_t n_tx, n_rx, n_rx_bytes, n_bubbles;
+
+
+static uint64_t loadgen_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+
+static void loadgen_sample (loadgen_thread *t, unsigned measure, uint64_t ns)
+{
+	loadgen_samples *s = t->samples + measure;
+
+	if (s->v == NULL)
+		s->v = malloc (LOADGEN_SAMPLES_MAX * sizeof (*s->v));
+	if ((s->v != NULL) && (s->count < LOADGEN_SAMPLES_MAX))
+		s->v[s->count++] = ns;
+}
+
+
+static void loadgen_fail (loadgen_client *c)
+{
+	c->state = LOADGEN_FAILED;
+	atomic_fetch_add (&n_failed, 1);
+}
+
+
+/** IPv6 size of Echo Requests through the server (see server.c) */
+#define LOADGEN_SERVER_PING_SIZE 64
+
+/**
+ * Sends an ICMPv6 Echo Request to the target, carrying a timestamp.
+ * @param size IPv6 packet size
+ */
+static int loadgen_ping (loadgen_client *c, uint32_t ipv4, uint16_t port,
+                         size_t size)
+{
+	union
+	{
+		struct
+		{
+			struct ip6_hdr ip6;
+			struct icmp6_hdr icmp6;
+			uint64_t stamp;
+		} hdr;
+		uint8_t buf[65536];
+	} pkt;
+	size_t plen = size - sizeof (pkt.hdr.ip6);
+
+	pkt.hdr.ip6.ip6_flow = htonl (0x60000000);
+	pkt.hdr.ip6.ip6_plen = htons (plen);
+	pkt.hdr.ip6.ip6_nxt = IPPROTO_ICMPV6;
+	pkt.hdr.ip6.ip6_hlim = 64;
+	pkt.hdr.ip6.ip6_src = c->addr.ip6;
+	pkt.hdr.ip6.ip6_dst = cfg.target;
+
+	pkt.hdr.icmp6.icmp6_type = ICMP6_ECHO_REQUEST;
+	pkt.hdr.icmp6.icmp6_code = 0;
+	pkt.hdr.icmp6.icmp6_cksum = 0;
+	pkt.hdr.icmp6.icmp6_id = htons (c->id);
+	pkt.hdr.icmp6.icmp6_seq = htons (c->seq++);
+	pkt.hdr.stamp = loadgen_now ();
+	memset (pkt.buf + sizeof (pkt.hdr), 0, size - sizeof (pkt.hdr));
+
+	struct iovec iov = { &pkt.hdr.icmp6, plen };
+	pkt.hdr.icmp6.icmp6_cksum = teredo_cksum (&pkt.hdr.ip6.ip6_src,
+	                                          &pkt.hdr.ip6.ip6_dst,
+	                                          IPPROTO_ICMPV6, &iov, 1);
+
+	if (teredo_send (c->fd, pkt.buf, size, ipv4, port) != (int)size)
+		return -1;
+	atomic_fetch_add_explicit (&n_tx, 1, memory_order_relaxed);
+	return 0;
+}
+
+
+static int loadgen_start (loadgen_client *c, uint64_t now)
+{
+	c->state = LOADGEN_QUALIFYING;
+	c->since = now;
+	c->retry = now + LOADGEN_RETRY_DELAY;
+	c->tries = 0;
+	c->seq = 0;
+	c->relay_ipv4 = 0;
+	c->relay_port = 0;
+
+	return teredo_send_rs (c->fd, cfg.server_ipv4, c->nonce, cfg.cone);
+}
+
+
+/**
+ * Retransmits the pending RS or ping through the server.
+ */
+static void loadgen_retry (loadgen_client *c, uint64_t now)
+{
+	if ((c->state != LOADGEN_QUALIFYING) && (c->state != LOADGEN_CONNECTING))
+		return;
+	if (now < c->retry)
+		return;
+
+	if (++c->tries > LOADGEN_RETRIES)
+	{
+		loadgen_fail (c);
+		return;
+	}
+
+	c->retry = now + LOADGEN_RETRY_DELAY;
+	if (c->state == LOADGEN_QUALIFYING)
+		teredo_send_rs (c->fd, cfg.server_ipv4, c->nonce, cfg.cone);
+	else
+		loadgen_ping (c, cfg.server_ipv4, htons (IPPORT_TEREDO),
+		              LOADGEN_SERVER_PING_SIZE);
+}
+
+
+static void loadgen_receive (loadgen_thread *t, loadgen_client *c,
+                             const teredo_packet *p, uint64_t now)
+{
+	const struct ip6_hdr *ip6 = p->ip6;
+
+	if ((p->ip6_len < sizeof (*ip6)) || ((ip6->ip6_vfc >> 4) != 6)
+	 || (sizeof (*ip6) + ntohs (ip6->ip6_plen) > p->ip6_len))
+		return;
+
+	bool from_server = (p->source_ipv4 == cfg.server_ipv4)
+	                && (p->source_port == htons (IPPORT_TEREDO));
+
+	if (c->state == LOADGEN_QUALIFYING)
+	{
+		uint16_t mtu;
+
+		if (!from_server || !p->auth_present
+		 || memcmp (p->auth_nonce, c->nonce, sizeof (c->nonce))
+		 || teredo_parse_ra (p, &c->addr, cfg.cone, &mtu))
+			return;
+
+		loadgen_sample (t, LOADGEN_QUALIFICATION, now - c->since);
+		atomic_fetch_add (&n_qualified, 1);
+
+		/* Pings the target through the server */
+		c->state = LOADGEN_CONNECTING;
+		c->since = now;
+		c->retry = now + LOADGEN_RETRY_DELAY;
+		c->tries = 0;
+		loadgen_ping (c, cfg.server_ipv4, htons (IPPORT_TEREDO),
+		              LOADGEN_SERVER_PING_SIZE);
+		return;
+	}
+
+	if (c->state == LOADGEN_FAILED)
+		return;
+
+	if (IsBubble (ip6))
+	{
+		/* Indirect bubbles carry the relay mapping as origin indication */
+		uint32_t ipv4 = from_server ? p->orig_ipv4 : p->source_ipv4;
+		uint16_t port = from_server ? p->orig_port : p->source_port;
+
+		if (ipv4 != 0)
+		{
+			teredo_reply_bubble (c->fd, ipv4, port, ip6);
+			atomic_fetch_add_explicit (&n_bubbles, 1, memory_order_relaxed);
+		}
+		return;
+	}
+
+	const struct icmp6_hdr *icmp6 = (const struct icmp6_hdr *)(ip6 + 1);
+	uint64_t stamp;
+
+	if ((ip6->ip6_nxt != IPPROTO_ICMPV6)
+	 || (ntohs (ip6->ip6_plen) < sizeof (*icmp6) + sizeof (stamp))
+	 || (icmp6->icmp6_type != ICMP6_ECHO_REPLY)
+	 || (icmp6->icmp6_id != htons (c->id)))
+		return;
+
+	memcpy (&stamp, icmp6 + 1, sizeof (stamp));
+	if (stamp > now)
+		return; /* bogus */
+
+	atomic_fetch_add_explicit (&n_rx, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit (&n_rx_bytes, sizeof (*ip6)
+	                           + ntohs (ip6->ip6_plen), memory_order_relaxed);
+	loadgen_sample (t, LOADGEN_RTT, now - stamp);
+
+	if ((c->state == LOADGEN_CONNECTING) && !from_server)
+	{
+		/* The relay has accepted our bubble */
+		loadgen_sample (t, LOADGEN_CONNECTION, now - c->since);
+		atomic_fetch_add (&n_connected, 1);
+		c->relay_ipv4 = p->source_ipv4;
+		c->relay_port = p->source_port;
+		c->state = LOADGEN_STREAMING;
+	}
+}
+
+
+static void *loadgen_thread_run (void *data)
+{
+	loadgen_thread *t = data;
+	struct pollfd *ufd = malloc (t->count * sizeof (*ufd));
+	teredo_packet *p = malloc (sizeof (*p));
+
+	if ((ufd == NULL) || (p == NULL))
+	{
+		free (p);
+		free (ufd);
+		return NULL;
+	}
+
+	uint64_t now = loadgen_now ();
+	for (unsigned i = 0; i < t->count; i++)
+	{
+		ufd[i].fd = t->clients[i].fd;
+		ufd[i].events = POLLIN;
+		if (loadgen_start (t->clients + i, now))
+			loadgen_fail (t->clients + i);
+	}
+
+	/* Round-robin transmission across streaming clients */
+	uint64_t interval = UINT64_C(1000000000) * cfg.threads / cfg.rate;
+	uint64_t next_tx = now, next_retry = now;
+	unsigned rr = 0;
+
+	while (now < loadgen_end)
+	{
+		for (unsigned n = 0; (next_tx <= now) && (n < t->count); n++)
+		{
+			loadgen_client *c = t->clients + rr;
+
+			rr = (rr + 1) % t->count;
+			if (c->state != LOADGEN_STREAMING)
+				continue;
+
+			loadgen_ping (c, c->relay_ipv4, c->relay_port, cfg.size);
+			next_tx += interval;
+			n = 0;
+		}
+
+		/* Does not try to catch up if lagging behind for too long */
+		if (next_tx + UINT64_C(1000000000) < now)
+			next_tx = now;
+
+		if (next_retry <= now)
+		{
+			for (unsigned i = 0; i < t->count; i++)
+				loadgen_retry (t->clients + i, now);
+			next_retry = now + 100000000;
+		}
+
+		uint64_t deadline = (next_tx < next_retry) ? next_tx : next_retry;
+		int timeout = (deadline > now) ? (deadline - now + 999999) / 1000000
+		                               : 0;
+
+		if (poll (ufd, t->count, timeout) > 0)
+			for (unsigned i = 0; i < t->count; i++)
+				if (ufd[i].revents)
+					while (teredo_recv (ufd[i].fd, p) == 0)
+						loadgen_receive (t, t->clients + i, p,
+						                 loadgen_now ());
+		now = loadgen_now ();
+	}
+
+	free (p);
+	free (ufd);
+	return NULL;
+}
+
+
+static int cmp_u64 (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+static void loadgen_report (loadgen_thread *th)
+{
+	for (unsigned m = 0; m < LOADGEN_MEASURES; m++)
+	{
+		loadgen_samples all = { NULL, 0 };
+
+		for (unsigned i = 0; i < cfg.threads; i++)
+			all.count += th[i].samples[m].count;
+		if (all.count == 0)
+			continue;
+
+		all.v = malloc (all.count * sizeof (*all.v));
+		if (all.v == NULL)
+			continue;
+
+		size_t n = 0;
+		for (unsigned i = 0; i < cfg.threads; i++)
+		{
+			const loadgen_samples *s = th[i].samples + m;
+
+			memcpy (all.v + n, s->v, s->count * sizeof (*s->v));
+			n += s->count;
+		}
+		qsort (all.v, all.count, sizeof (*all.v), cmp_u64);
+
+#define PC(pc) (all.v[(size_t)((pc) * (all.count - 1) / 100.)] / 1000.)
+		printf ("%-14s %8zu samples  p50 %9.3f  p90 %9.3f  p99 %9.3f  "
+		        "p99.9 %9.3f  max %9.3f ms\n", loadgen_measures[m],
+		        all.count, PC (50.) / 1000., PC (90.) / 1000.,
+		        PC (99.) / 1000., PC (99.9) / 1000., PC (100.) / 1000.);
+#undef PC
+		free (all.v);
+	}
+}
+
+
+/**
+ * Prints progress once per second until the end of the test.
+ */
+static void loadgen_monitor (void)
+{
+	uint64_t last_tx = 0, last_rx = 0, last_bytes = 0;
+	uint64_t start = loadgen_now (), now = start;
+
+	while (now < loadgen_end)
+	{
+		struct timespec ts = { 1, 0 };
+		while (clock_nanosleep (CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR);
+
+		now = loadgen_now ();
+
+		uint64_t tx = atomic_load (&n_tx), rx = atomic_load (&n_rx);
+		uint64_t bytes = atomic_load (&n_rx_bytes);
+
+		printf ("%3"PRIu64"s: %"PRIu64" qualified, %"PRIu64" connected, "
+		        "%"PRIu64" failed, tx %"PRIu64" pkt/s, rx %"PRIu64" pkt/s "
+		        "(%.3f Mbit/s)\n", (now - start) / 1000000000,
+		        atomic_load (&n_qualified), atomic_load (&n_connected),
+		        atomic_load (&n_failed), tx - last_tx, rx - last_rx,
+		        (bytes - last_bytes) * 8 / 1e6);
+		fflush (stdout);
+		last_tx = tx;
+		last_rx = rx;
+		last_bytes = bytes;
+	}
+
+	double secs = (now - start) / 1e9;
+	uint64_t tx = atomic_load (&n_tx), rx = atomic_load (&n_rx);
+
+	printf ("\n%u clients: %"PRIu64" qualified, %"PRIu64" connected, "
+	        "%"PRIu64" failed, %"PRIu64" bubbles answered\n"
+	        "%"PRIu64" packets sent (%.0f pkt/s), %"PRIu64" received "
+	        "(%.0f pkt/s, %.3f Mbit/s), %.2f%% lost\n", cfg.clients,
+	        atomic_load (&n_qualified), atomic_load (&n_connected),
+	        atomic_load (&n_failed), atomic_load (&n_bubbles),
+	        tx, tx / secs, rx, rx / secs,
+	        atomic_load (&n_rx_bytes) * 8 / 1e6 / secs,
+	        tx ? 100. * (tx - (rx < tx ? rx : tx)) / tx : 0.);
+}
+
+
+static int usage (const char *path)
+{
+	printf ("Usage: %s [OPTIONS] <server IPv4> <target IPv6>\n"
+	        "Simulates Teredo clients streaming pings through relays.\n\n"
+	        "  -b, --bind     local IPv4 address to bind to\n"
+	        "  -c, --clients  number of clients (default: 1000)\n"
+	        "  -C, --cone     qualifies as cone clients\n"
+	        "  -d, --duration test duration in seconds (default: 10)\n"
+	        "  -h, --help     display this help and exit\n"
+	        "  -j, --threads  number of threads (default: 1)\n"
+	        "  -r, --rate     packets per second, all clients (default: 1000)\n"
+	        "  -s, --size     IPv6 packet size in bytes (default: 1280)\n"
+	        "  -V, --version  display program version and exit\n", path);
+	return 0;
+}
+
+
+static int version (void)
+{
+	puts (PACKAGE_NAME" v"PACKAGE_VERSION);
+	return 0;
+}
+
+
+static int parse_uint (const char *str, unsigned min, unsigned max,
+                       unsigned *res)
+{
+	char *end;
+	unsigned long v = strtoul (str, &end, 0);
+
+	if ((*str == '\0') || (*end != '\0') || (v < min) || (v > max))
+	{
+		fprintf (stderr, "Invalid value: %s\n", str);
+		return -1;
+	}
+	*res = v;
+	return 0;
+}
+
+
+int main (int argc, char *argv[])
+{
+	static const struct option opts[] =
+	{
+		{ "bind",       required_argument, NULL, 'b' },
+		{ "clients",    required_argument, NULL, 'c' },
+		{ "cone",       no_argument,       NULL, 'C' },
+		{ "duration",   required_argument, NULL, 'd' },
+		{ "help",       no_argument,       NULL, 'h' },
+		{ "threads",    required_argument, NULL, 'j' },
+		{ "rate",       required_argument, NULL, 'r' },
+		{ "size",       required_argument, NULL, 's' },
+		{ "version",    no_argument,       NULL, 'V' },
+		{ NULL,         no_argument,       NULL, '\0'}
+	};
+
+	int c;
+	unsigned size;
+
+	while ((c = getopt_long (argc, argv, "b:c:Cd:hj:r:s:V", opts,
+	                         NULL)) != -1)
+		switch (c)
+		{
+			case 'b':
+				if (inet_pton (AF_INET, optarg, &cfg.bind_ipv4) != 1)
+				{
+					fprintf (stderr, "Invalid IPv4 address: %s\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'c':
+				if (parse_uint (optarg, 1, 1000000, &cfg.clients))
+					return 1;
+				break;
+
+			case 'C':
+				cfg.cone = true;
+				break;
+
+			case 'd':
+				if (parse_uint (optarg, 1, 86400, &cfg.duration))
+					return 1;
+				break;
+
+			case 'h':
+				return usage (argv[0]);
+
+			case 'j':
+				if (parse_uint (optarg, 1, 1024, &cfg.threads))
+					return 1;
+				break;
+
+			case 'r':
+				if (parse_uint (optarg, 1, 100000000, &cfg.rate))
+					return 1;
+				break;
+
+			case 's':
+				if (parse_uint (optarg, sizeof (struct ip6_hdr) + 16,
+				                MAX_TEREDO_PACKET_SIZE, &size))
+					return 1;
+				cfg.size = size;
+				break;
+
+			case 'V':
+				return version ();
+
+			default:
+				return 1;
+		}
+
+	if ((argc - optind) != 2)
+	{
+		usage (argv[0]);
+		return 1;
+	}
+	if ((inet_pton (AF_INET, argv[optind], &cfg.server_ipv4) != 1)
+	 || (inet_pton (AF_INET6, argv[optind + 1], &cfg.target) != 1))
+	{
+		fputs ("Invalid server IPv4 or target IPv6 address\n", stderr);
+		return 1;
+	}
+	if (cfg.threads > cfg.clients)
+		cfg.threads = cfg.clients;
+
+	/* One socket per client */
+	struct rlimit lim;
+	if (getrlimit (RLIMIT_NOFILE, &lim) == 0)
+	{
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit (RLIMIT_NOFILE, &lim);
+	}
+
+	loadgen_client *clients = calloc (cfg.clients, sizeof (*clients));
+	loadgen_thread *th = calloc (cfg.threads, sizeof (*th));
+	unsigned opened = 0, started = 0;
+	int retval = 1;
+
+	if ((clients == NULL) || (th == NULL))
+	{
+		perror ("Error");
+		goto out;
+	}
+
+	srand (time (NULL));
+	for (; opened < cfg.clients; opened++)
+	{
+		clients[opened].id = opened;
+		for (unsigned i = 0; i < sizeof (clients[opened].nonce); i++)
+			clients[opened].nonce[i] = rand ();
+		clients[opened].fd = teredo_socket (cfg.bind_ipv4, 0);
+		if (clients[opened].fd == -1)
+		{
+			perror ("Client socket");
+			goto out;
+		}
+	}
+
+	loadgen_end = loadgen_now () + cfg.duration * UINT64_C(1000000000);
+
+	for (unsigned i = 0, first = 0; i < cfg.threads; i++)
+	{
+		unsigned count = (cfg.clients - first) / (cfg.threads - i);
+
+		th[i].clients = clients + first;
+		th[i].count = count;
+		first += count;
+
+		errno = pthread_create (&th[i].thread, NULL, loadgen_thread_run,
+		                        th + i);
+		if (errno)
+		{
+			perror ("Thread");
+			loadgen_end = 0;
+			break;
+		}
+		started++;
+	}
+
+	if (started == cfg.threads)
+	{
+		loadgen_monitor ();
+		retval = 0;
+	}
+
+	for (unsigned i = 0; i < started; i++)
+		pthread_join (th[i].thread, NULL);
+	if (retval == 0)
+		loadgen_report (th);
+
+out:
+	while (opened > 0)
+		teredo_close (clients[--opened].fd);
+	if (th != NULL)
+		for (unsigned i = 0; i < cfg.threads; i++)
+			for (unsigned m = 0; m < LOADGEN_MEASURES; m++)
+				free (th[i].samples[m].v);
+	free (th);
+	free (clients);
+	return retval;
+}
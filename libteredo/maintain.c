@@ -55,6 +55,7 @@
 #include "security.h"
 #include "maintain.h"
 #include "v4global.h" // is_ipv4_global_unicast()
+#include "stats.h"
 #include "debug.h"
 
 static inline void gettime (struct timespec *now)
@@ -82,6 +83,7 @@ struct teredo_maintenance
 	pthread_cond_t processed;
 
 	const teredo_packet *incoming;
+	bool resolving; /* inner mutex released for name resolution */
 
 	int fd;
 	struct
@@ -90,21 +92,36 @@ struct teredo_maintenance
 		teredo_state_cb cb;
 		void *opaque;
 	} state;
-	char *server;
+	char *server, *server2;
+	uint32_t server_ip_cached; /* last valid server address */
 
 	unsigned qualification_delay;
 	unsigned qualification_retries;
 	unsigned refresh_delay;
+	unsigned refresh_max;
 	unsigned restart_delay;
+
+	int cache_fd; /* qualification cache file, or -1 */
+	uint64_t cache_saved; /* time() of the last cache write */
+
+	/* NAT binding lifetime discovery */
+	unsigned refresh; /* current refresh interval */
+	unsigned refresh_good; /* longest interval the binding survived */
+	unsigned refresh_bad; /* shortest interval the binding did not survive */
 };
 
 
 /**
- * Resolves an IPv4 address (thread-safe).
+ * Resolves the IPv4 addresses of a host (thread-safe).
+ *
+ * @param ipv4 [OUT] resolved addresses (without duplicates)
+ * @param max room in the ipv4 array (at least one)
+ * @param count [OUT] number of resolved addresses (at least one on success)
  *
  * @return 0 on success, or an error value as defined for getaddrinfo().
  */
-static int getipv4byname (const char *restrict name, uint32_t *restrict ipv4)
+static int getipv4byname (const char *restrict name, uint32_t *restrict ipv4,
+                          unsigned max, unsigned *restrict count)
 {
 	struct addrinfo hints =
 	{
@@ -116,9 +133,21 @@ static int getipv4byname (const char *restrict name, uint32_t *restrict ipv4)
 	if (val)
 		return val;
 
-	*ipv4 = ((const struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
+	unsigned n = 0;
+	for (const struct addrinfo *p = res; (p != NULL) && (n < max);
+	     p = p->ai_next)
+	{
+		uint32_t ip = ((const struct sockaddr_in *)(p->ai_addr))->sin_addr.s_addr;
+		unsigned i = 0;
+
+		while ((i < n) && (ipv4[i] != ip))
+			i++;
+		if (i == n)
+			ipv4[n++] = ip;
+	}
 	freeaddrinfo (res);
 
+	*count = n;
 	return 0;
 }
 
@@ -221,6 +250,352 @@ cleanup_unlock (void *o)
 }
 
 
+static void
+cleanup_relock (void *o)
+{
+	teredo_maintenance *m = (teredo_maintenance *)o;
+
+	(void)pthread_mutex_lock (&m->inner);
+	m->resolving = false;
+}
+
+
+#define TEREDO_MAX_SERVERS 4
+
+/**
+ * Resolves the server IPv4 addresses without holding the inner mutex, so
+ * that packets reception is not held up by a slow resolver. Incoming
+ * packets are dropped in the mean time (no solicitation is pending anyway).
+ * If resolution fails, the last valid address, if any, is used instead.
+ *
+ * @param ipv4 [OUT] global unicast server addresses (TEREDO_MAX_SERVERS)
+ * @param count [OUT] number of server addresses (possibly zero)
+ * @param ipv4_2 [OUT] secondary server address from the secondary server
+ * name, or zero if none
+ *
+ * @return 0 on success, or an error value as defined for getaddrinfo().
+ */
+static int
+maintenance_resolve (teredo_maintenance *restrict m, uint32_t *restrict ipv4,
+                     unsigned *restrict count, uint32_t *restrict ipv4_2)
+{
+	unsigned n = 0, n2 = 0;
+	int val;
+
+	m->resolving = true;
+	pthread_mutex_unlock (&m->inner);
+
+	pthread_cleanup_push (cleanup_relock, m);
+	val = getipv4byname (m->server, ipv4, TEREDO_MAX_SERVERS, &n);
+	if ((m->server2 == NULL)
+	 || getipv4byname (m->server2, ipv4_2, 1, &n2))
+		*ipv4_2 = 0;
+	pthread_cleanup_pop (1);
+
+	if (val == 0)
+	{
+		unsigned i = 0;
+
+		for (unsigned j = 0; j < n; j++)
+			if (is_ipv4_global_unicast (ipv4[j]))
+				ipv4[i++] = ipv4[j];
+		n = i;
+		if (n > 0)
+			m->server_ip_cached = ipv4[0];
+	}
+	else if (m->server_ip_cached != 0)
+	{
+		syslog (LOG_WARNING,
+		        _("Cannot resolve Teredo server address \"%s\": %s"),
+		        m->server, gai_strerror (val));
+		ipv4[0] = m->server_ip_cached;
+		n = 1;
+		val = 0;
+	}
+	*count = n;
+	return val;
+}
+
+
+/* Router solicitation destination */
+struct maintenance_target
+{
+	uint32_t ip; /* destination */
+	uint32_t server_ip; /* primary server address (expected in the RA) */
+	uint8_t nonce[8];
+};
+
+/* Delay between solicitations to qualification candidates */
+static const long RaceStaggerNs = 250000000;
+
+
+static bool
+timespec_before (const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec < b->tv_sec)
+	    || ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec));
+}
+
+
+/**
+ * Sends Router Solicitations to every target, with staggered starts, and
+ * waits for the first valid Router Advertisement from any of them, or
+ * until the deadline.
+ *
+ * @param start time of the first solicitation
+ * @param winner [OUT] index of the target that replied
+ *
+ * @return 0 if a valid RA was received, ETIMEDOUT otherwise.
+ */
+static int
+maintenance_race (teredo_maintenance *restrict m,
+                  struct maintenance_target *restrict targets, unsigned n,
+                  const struct timespec *start,
+                  const struct timespec *deadline,
+                  teredo_state *restrict newst, unsigned *restrict winner)
+{
+	struct timespec next = *start;
+	unsigned sent = 0;
+
+	for (;;)
+	{
+		struct timespec now;
+		gettime (&now);
+
+		while ((sent < n) && !timespec_before (&now, &next))
+		{
+			struct maintenance_target *t = targets + sent++;
+
+			teredo_get_nonce (deadline->tv_sec, t->ip,
+			                  htons (IPPORT_TEREDO), t->nonce);
+			teredo_send_rs (m->fd, t->ip, t->nonce, false);
+			teredo_stat_inc (TEREDO_STAT_MAINT_RS);
+
+			next.tv_nsec += RaceStaggerNs;
+			if (next.tv_nsec >= 1000000000)
+			{
+				next.tv_sec++;
+				next.tv_nsec -= 1000000000;
+			}
+		}
+
+		bool more = (sent < n) && timespec_before (&next, deadline);
+		if (wait_reply (m, more ? &next : deadline))
+		{
+			if (more)
+				continue; /* time for the next solicitation */
+			return ETIMEDOUT;
+		}
+
+		/* check received packet */
+		int val = EPERM;
+		for (unsigned i = 0; (i < sent) && (val != 0); i++)
+		{
+			val = maintenance_recv (m->incoming, targets[i].server_ip,
+			                        targets[i].nonce, false, newst);
+			if (val == 0)
+				*winner = i;
+		}
+		m->incoming = NULL;
+		pthread_cond_signal (&m->processed);
+
+		if (val == 0)
+			return 0;
+	}
+}
+
+
+/* Binding lifetime discovery stops when known within that many seconds */
+static const unsigned RefreshPrecision = 10;
+
+/**
+ * Updates the NAT binding refresh interval after a successful refresh.
+ * Intervals are doubled until the mapping changes, then the binding
+ * lifetime is searched by bisection. The longest interval that was
+ * survived is kept eventually, until the binding is lost with it.
+ *
+ * @param lost whether the mapping changed since the previous refresh
+ *
+ * @return true if the refresh interval changed.
+ */
+static bool
+maintenance_adapt (teredo_maintenance *m, bool lost)
+{
+	unsigned old = m->refresh;
+
+	if (m->refresh_max <= m->refresh_delay)
+		return false; /* fixed interval */
+
+	if (lost)
+	{
+		if (m->refresh <= m->refresh_delay)
+		{
+			/* Not caused by the discovery: start over */
+			m->refresh_good = m->refresh_delay;
+			m->refresh_bad = 0;
+			return false;
+		}
+		if (m->refresh <= m->refresh_good)
+		{
+			/* The known good interval does not work anymore: start over */
+			m->refresh = m->refresh_good = m->refresh_delay;
+			m->refresh_bad = 0;
+		}
+		else
+		{
+			m->refresh_bad = m->refresh;
+			m->refresh = m->refresh_good;
+		}
+	}
+	else
+	{
+		if (m->refresh > m->refresh_good)
+			m->refresh_good = m->refresh;
+
+		unsigned next;
+		if (m->refresh_bad == 0)
+			next = 2 * m->refresh_good;
+		else
+		if (m->refresh_bad - m->refresh_good > RefreshPrecision)
+			next = (m->refresh_good + m->refresh_bad) / 2;
+		else
+			next = m->refresh_good; /* converged */
+
+		m->refresh = (next < m->refresh_max) ? next : m->refresh_max;
+	}
+
+	if (m->refresh == old)
+		return false;
+
+	if (m->refresh == m->refresh_good)
+		syslog (LOG_INFO, _("NAT binding refresh interval: %u seconds"),
+		        m->refresh);
+	return true;
+}
+
+
+/*
+ * Qualification cache file format (native byte order, not portable):
+ * the last successful qualification, for a restarted client to come up
+ * immediately with the same address while it is revalidated.
+ */
+struct maintenance_cache
+{
+	char magic[8]; /* "TEREDOQC" */
+	uint32_t version;
+	uint32_t local_ip; /* local UDP socket address... */
+	uint16_t local_port; /* ...and port (network byte order) */
+	uint16_t mtu;
+	uint16_t refresh;
+	uint16_t reserved;
+	uint64_t saved; /* time() */
+	uint32_t server_ip;
+	uint32_t ipv4;
+	struct in6_addr addr;
+};
+
+static const char cache_magic[8] = "TEREDOQC";
+
+/* Cached qualifications older than that are ignored */
+static const unsigned CacheLifetime = 3600; // seconds
+
+/* Unchanged qualifications are saved again after that long */
+static const unsigned CacheRewrite = 300; // seconds
+
+
+static int maintenance_local_addr (int fd, uint32_t *ip, uint16_t *port)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof (addr);
+
+	if (getsockname (fd, (struct sockaddr *)&addr, &len)
+	 || (addr.sin_family != AF_INET))
+		return -1;
+	*ip = addr.sin_addr.s_addr;
+	*port = addr.sin_port;
+	return 0;
+}
+
+
+/**
+ * Saves a successful qualification to the cache file, if any.
+ *
+ * @param force whether to write the cache even if it was written
+ * recently (i.e. whether the qualification changed)
+ */
+static void
+maintenance_cache_save (teredo_maintenance *m, const teredo_state *state,
+                        uint32_t server_ip, bool force)
+{
+	struct maintenance_cache c;
+	uint64_t now = time (NULL);
+
+	if ((m->cache_fd == -1)
+	 || (!force && (now >= m->cache_saved)
+	  && (now - m->cache_saved < CacheRewrite)))
+		return;
+
+	memset (&c, 0, sizeof (c));
+	memcpy (c.magic, cache_magic, sizeof (c.magic));
+	c.version = 1;
+	if (maintenance_local_addr (m->fd, &c.local_ip, &c.local_port))
+		return;
+	c.mtu = state->mtu;
+	c.refresh = state->refresh;
+	c.saved = now;
+	c.server_ip = server_ip;
+	c.ipv4 = state->ipv4;
+	c.addr = state->addr.ip6;
+
+	if ((pwrite (m->cache_fd, &c, sizeof (c), 0) != sizeof (c))
+	 || ftruncate (m->cache_fd, sizeof (c)))
+		syslog (LOG_WARNING, _("Error (%s): %m"), "qualification cache");
+	else
+		m->cache_saved = now;
+}
+
+
+/**
+ * Loads the cached qualification, if any, if it is recent enough and was
+ * obtained through the same local address and port.
+ *
+ * @return 0 on success, -1 if there is no usable cached qualification.
+ */
+static int
+maintenance_cache_load (teredo_maintenance *m, teredo_state *state,
+                        uint32_t *server_ip)
+{
+	struct maintenance_cache c;
+	uint32_t ip;
+	uint16_t port;
+
+	if ((m->cache_fd == -1)
+	 || (pread (m->cache_fd, &c, sizeof (c), 0) != sizeof (c))
+	 || memcmp (c.magic, cache_magic, sizeof (c.magic)) || (c.version != 1)
+	 || maintenance_local_addr (m->fd, &ip, &port))
+		return -1;
+
+	uint64_t now = time (NULL);
+	if ((c.saved > now) || (now - c.saved > CacheLifetime)
+	 || (c.local_ip != ip) || (c.local_port != port) || (c.mtu < 1280)
+	 || !is_ipv4_global_unicast (c.server_ip)
+	 || (IN6_TEREDO_SERVER (&c.addr) != c.server_ip))
+		return -1;
+
+	state->addr.ip6 = c.addr;
+	state->ipv4 = c.ipv4;
+	state->mtu = c.mtu;
+	state->refresh = m->refresh;
+	state->up = true;
+	*server_ip = c.server_ip;
+
+	/* Keeps the discovered NAT binding lifetime */
+	if ((c.refresh > m->refresh_delay) && (c.refresh <= m->refresh_max))
+		state->refresh = m->refresh = m->refresh_good = c.refresh;
+	return 0;
+}
+
+
 /*
  * Implementation notes:
  * - Optional Teredo interval determination procedure was never implemented.
@@ -243,13 +618,26 @@ void maintenance_thread (teredo_maintenance *m)
 {
 	struct timespec deadline = { 0, 0 };
 	teredo_state *c_state = &m->state.state;
-	uint32_t server_ip = 0;
+	uint32_t server_ip = 0, server_ip2 = 0;
+	uint32_t servers[TEREDO_MAX_SERVERS];
+	unsigned nservers = 0;
 	unsigned count = 0;
 	enum
 	{
 		TERR_NONE,
 		TERR_BLACKHOLE
 	} last_error = TERR_NONE;
+	uint64_t down_since = teredo_hist_now ();
+
+	if (maintenance_cache_load (m, c_state, &server_ip) == 0)
+	{
+		/* Comes up immediately, then revalidates with the server */
+		syslog (LOG_NOTICE, _("Using cached Teredo address"));
+		m->state.cb (c_state, m->state.opaque);
+		teredo_hist_record (TEREDO_HIST_TUNNEL_UP,
+		                    teredo_hist_now () - down_since);
+		gettime (&deadline);
+	}
 
 	pthread_mutex_lock (&m->inner);
 
@@ -262,10 +650,10 @@ void maintenance_thread (teredo_maintenance *m)
 		/* Resolve server IPv4 addresses */
 		while (server_ip == 0)
 		{
-			/* FIXME: mutex kept while resolving - very bad */
-			int val = getipv4byname (m->server, &server_ip);
+			int val = maintenance_resolve (m, servers, &nservers,
+			                               &server_ip2);
 			gettime (&deadline);
-	
+
 			if (val)
 			{
 				/* DNS resolution failed */
@@ -273,8 +661,7 @@ void maintenance_thread (teredo_maintenance *m)
 				        _("Cannot resolve Teredo server address \"%s\": %s"),
 				        m->server, gai_strerror (val));
 			}
-			else
-			if (!is_ipv4_global_unicast (server_ip))
+			else if (nservers == 0)
 			{
 				syslog (LOG_ERR,
 				        _("Teredo server has a non global IPv4 address."));
@@ -284,6 +671,7 @@ void maintenance_thread (teredo_maintenance *m)
 				/* DNS resolution succeeded */
 				/* Tells Teredo client about the new server's IP */
 				assert (!c_state->up);
+				server_ip = servers[0];
 				c_state->addr.teredo.server_ip = server_ip;
 				m->state.cb (c_state, m->state.opaque);
 				break; /* Done! */
@@ -300,30 +688,39 @@ void maintenance_thread (teredo_maintenance *m)
 			deadline.tv_sec += m->qualification_delay;
 		while (!checkTimeDrift (&deadline));
 
-		uint8_t nonce[8];
-		teredo_get_nonce (deadline.tv_sec, server_ip, htons (IPPORT_TEREDO),
-		                  nonce);
-		teredo_send_rs (m->fd, server_ip, nonce, false);
+		struct timespec start;
+		gettime (&start);
+		uint64_t solicited = teredo_hist_now ();
+
+		/*
+		 * While qualifying, races all server addresses, primary then
+		 * secondary, and keeps the first one to reply. Once qualified, only
+		 * that server is solicited.
+		 */
+		struct maintenance_target targets[2 * TEREDO_MAX_SERVERS];
+		unsigned ntargets = 0, winner = 0;
+
+		if (c_state->up)
+			targets[ntargets++].ip = server_ip;
+		else
+		{
+			for (unsigned i = 0; i < nservers; i++)
+				targets[ntargets++].ip = servers[i];
+			for (unsigned i = 0; i < nservers; i++)
+				targets[ntargets++].ip = ((i == 0) && server_ip2)
+					? server_ip2 : htonl (ntohl (servers[i]) + 1);
+		}
+		for (unsigned i = 0; i < ntargets; i++)
+			targets[i].server_ip = c_state->up
+				? server_ip : servers[i % nservers];
 
-		int val = 0;
 		teredo_state newst;
 		newst.mtu = 1280;
 		newst.up = true;
 
 		/* RECEIVE ROUTER ADVERTISEMENT */
-		do
-		{
-			val = wait_reply (m, &deadline);
-			if (val)
-				continue; // time out
-
-			/* check received packet */
-			val = maintenance_recv (m->incoming, server_ip,
-			                        nonce, false, &newst);
-			m->incoming = NULL;
-			pthread_cond_signal (&m->processed);
-		}
-		while ((val != 0) && (val != ETIMEDOUT));
+		int val = maintenance_race (m, targets, ntargets, &start, &deadline,
+		                            &newst, &winner);
 
 		unsigned delay = 0;
 
@@ -331,6 +728,7 @@ void maintenance_thread (teredo_maintenance *m)
 		if (val /* == ETIMEDOUT */)
 		{
 			/* no response */
+			teredo_stat_inc (TEREDO_STAT_MAINT_FAILURES);
 			count++;
 
 			if (count >= m->qualification_retries)
@@ -349,6 +747,7 @@ void maintenance_thread (teredo_maintenance *m)
 					syslog (LOG_NOTICE, _("Lost Teredo connectivity"));
 					c_state->up = false;
 					m->state.cb (c_state, m->state.opaque);
+					down_since = teredo_hist_now ();
 					server_ip = 0;
 				}
 
@@ -359,7 +758,21 @@ void maintenance_thread (teredo_maintenance *m)
 		else
 		/* RA received and parsed succesfully */
 		{
+			uint64_t now = teredo_hist_now ();
+
+			teredo_stat_inc (TEREDO_STAT_MAINT_RA);
+			teredo_hist_record (TEREDO_HIST_QUALIFICATION, now - solicited);
 			count = 0;
+			server_ip = targets[winner].server_ip;
+
+			/* Mapping changed since the last refresh: binding timed out? */
+			bool lost = c_state->up
+				&& ((c_state->addr.teredo.client_port
+				     != newst.addr.teredo.client_port)
+				 || (c_state->addr.teredo.client_ip
+				     != newst.addr.teredo.client_ip));
+			bool adapted = maintenance_adapt (m, lost);
+			newst.refresh = m->refresh;
 
 			/* 12-bits Teredo flags randomization */
 			newst.addr.teredo.flags = c_state->addr.teredo.flags;
@@ -374,15 +787,27 @@ void maintenance_thread (teredo_maintenance *m)
 			 || !IN6_ARE_ADDR_EQUAL (&c_state->addr.ip6, &newst.addr.ip6)
 			 || (c_state->mtu != newst.mtu))
 			{
+				if (!c_state->up)
+					teredo_hist_record (TEREDO_HIST_TUNNEL_UP,
+					                    now - down_since);
 				memcpy(c_state, &newst, sizeof (*c_state));
 
 				syslog (LOG_NOTICE, _("New Teredo address/MTU"));
 				m->state.cb (c_state, m->state.opaque);
+				maintenance_cache_save (m, c_state, server_ip, true);
+			}
+			else if (adapted)
+			{
+				c_state->refresh = newst.refresh;
+				m->state.cb (c_state, m->state.opaque);
+				maintenance_cache_save (m, c_state, server_ip, true);
 			}
+			else /* keeps the cache fresh on a stable link */
+				maintenance_cache_save (m, c_state, server_ip, false);
 
 			/* Success: schedule next NAT binding maintenance */
 			last_error = TERR_NONE;
-			delay = m->refresh_delay;
+			delay = m->refresh;
 		}
 
 		/* WAIT UNTIL NEXT SOLICITATION */
@@ -402,6 +827,7 @@ void maintenance_thread (teredo_maintenance *m)
 
 static LIBTEREDO_NORETURN void *do_maintenance (void *opaque)
 {
+	teredo_thread_setup (TEREDO_THREAD_HOUSEKEEPING, "teredo-maint");
 	maintenance_thread ((teredo_maintenance *)opaque);
 }
 
@@ -416,7 +842,8 @@ teredo_maintenance *
 teredo_maintenance_start (int fd, teredo_state_cb cb, void *opaque,
                           const char *s1, const char *s2,
                           unsigned q_sec, unsigned q_retries,
-                          unsigned refresh_sec, unsigned restart_sec)
+                          unsigned refresh_sec, unsigned refresh_max,
+                          unsigned restart_sec, int cache_fd)
 {
 	teredo_maintenance *m = (teredo_maintenance *)malloc (sizeof (*m));
 
@@ -430,15 +857,21 @@ teredo_maintenance_start (int fd, teredo_state_cb cb, void *opaque,
 
 	assert (s1 != NULL);
 	m->server = strdup (s1);
-	(void)s2;
+	m->server2 = (s2 != NULL) ? strdup (s2) : NULL;
 
 	m->qualification_delay = q_sec ?: QualificationDelay;
 	m->qualification_retries = q_retries ?: QualificationRetries;
 	m->refresh_delay = refresh_sec ?: RefreshDelay;
+	m->refresh_max = refresh_max;
+	m->cache_fd = cache_fd;
 	m->restart_delay = restart_sec ?: RestartDelay;
+	m->refresh = m->refresh_good = m->refresh_delay;
+	m->refresh_bad = 0;
 
-	if (m->server == NULL)
+	if ((m->server == NULL) || ((s2 != NULL) && (m->server2 == NULL)))
 	{
+		free (m->server2);
+		free (m->server);
 		free (m);
 		return NULL;
 	}
@@ -470,6 +903,7 @@ teredo_maintenance_start (int fd, teredo_state_cb cb, void *opaque,
 	pthread_mutex_destroy (&m->outer);
 	pthread_mutex_destroy (&m->inner);
 
+	free (m->server2);
 	free (m->server);
 	free (m);
 	return NULL;
@@ -486,6 +920,7 @@ void teredo_maintenance_stop (teredo_maintenance *m)
 	pthread_mutex_destroy (&m->inner);
 	pthread_mutex_destroy (&m->outer);
 
+	free (m->server2);
 	free (m->server);
 	free (m);
 }
@@ -510,6 +945,14 @@ int teredo_maintenance_process (teredo_maintenance *restrict m,
 	pthread_mutex_lock (&m->outer);
 	pthread_mutex_lock (&m->inner);
 
+	if (m->resolving)
+	{
+		/* Not waiting for any advertisement: do not wait for the resolver */
+		pthread_mutex_unlock (&m->inner);
+		pthread_mutex_unlock (&m->outer);
+		return -1;
+	}
+
 	m->incoming = packet;
 	pthread_cond_signal (&m->received);
 
@@ -40,6 +40,9 @@ typedef struct teredo_state
 
 	/** whether the Teredo tunnel is up and running */
 	bool up; 
+
+	/** NAT binding refresh interval in use (seconds) */
+	uint16_t refresh;
 } teredo_state;
 
 # ifdef __cplusplus
@@ -70,7 +73,12 @@ typedef void (*teredo_state_cb) (const struct teredo_state *s, void *opaque);
  * @param q_sec qualification time out (seconds), 0 = default
  * @param q_retries qualification retries, 0 = default
  * @param refresh_sec qualification refresh interval (seconds), 0 = default
+ * @param refresh_max longest refresh interval to probe the NAT binding
+ * lifetime with (seconds), or not more than @a refresh_sec to always use
+ * @a refresh_sec
  * @param restart_sec qualification failure interval (seconds), 0 = default
+ * @param cache_fd file to load the last qualification from at startup and
+ * save successful qualifications to, or -1 for none
  *
  * @return NULL on error.
  */
@@ -78,7 +86,8 @@ teredo_maintenance *
 teredo_maintenance_start (int fd, teredo_state_cb cb, void *opaque,
                           const char *s1, const char *s2,
                           unsigned q_sec, unsigned q_retries,
-                          unsigned refresh_sec, unsigned restart_sec);
+                          unsigned refresh_sec, unsigned refresh_max,
+                          unsigned restart_sec, int cache_fd);
 
 /**
  * Stops and destroys a maintenance thread created by
@@ -37,6 +37,8 @@
   <ghost@aladdin.com>.  Other authors are noted in the change history
   that follows (in reverse chronological order):
 
+  2026-10-14 rdc Added md5_finish_multi(), hashing several messages at
+	once.
   2002-04-13 lpd Removed support for non-ANSI compilers; removed
 	references to Ghostscript; clarified derivation from RFC 1321;
 	now handles byte order either statically or dynamically.
@@ -84,6 +86,15 @@ void md5_append(md5_state_t *pms, const md5_byte_t *data, int nbytes);
 /* Finish the message and return the digest. */
 void md5_finish(md5_state_t *pms, md5_byte_t digest[16]);
 
+/*
+ * Append each of count messages of the same length to a copy of the same
+ * state, e.g. the state after an HMAC key block, and return their digests.
+ * The messages are hashed several at a time in SIMD lanes, so this costs
+ * much less than as many md5_append() and md5_finish() calls.
+ */
+void md5_finish_multi(const md5_state_t *pms, const md5_byte_t *const data[],
+		      int nbytes, md5_byte_t (*digests)[16], unsigned count);
+
 #ifdef __cplusplus
 }  /* end extern "C" */
 #endif
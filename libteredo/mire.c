@@ -26,6 +26,7 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h> // memcpy()
 
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -91,10 +92,12 @@ process_icmpv6 (int fd, struct ip6_hdr *ip6, size_t plen,
 	ip6->ip6_dst = ip6->ip6_src;
 	ip6->ip6_src = buf;;
 
+	/* Swapping addresses does not change the checksum, the type does */
+	uint8_t type[2];
+	memcpy (type, hdr, 2);
 	hdr->icmp6_type = ICMP6_ECHO_REPLY;
 	hdr->icmp6_code = 0;
-	hdr->icmp6_cksum = 0;
-	hdr->icmp6_cksum = icmp6_checksum (ip6, hdr);
+	hdr->icmp6_cksum = teredo_cksum_adjust (hdr->icmp6_cksum, type, hdr, 2);
 
 	teredo_send (fd, ip6, sizeof (*ip6) + plen, ipv4, port);
 }
@@ -48,6 +48,7 @@
 
 #include "packets.h"
 #include "checksum.h"
+#include "probe.h"
 
 
 int
@@ -68,6 +69,7 @@ teredo_send_bubble (int fd, uint32_t ip, uint16_t port,
 			{ (void *)dst, 16 }
 		};
 
+		TEREDO_PROBE (bubble_send, ip, port, dst);
 		return teredo_sendv (fd, iov, 3, ip, port) == 40 ? 0 : -1;
 	}
 
@@ -111,6 +113,31 @@ int CheckBubble (const teredo_packet *packet)
 }
 
 
+void PrepareBubbleChecks (const teredo_packet *const *packets, unsigned n)
+{
+	uint32_t ipv4[TEREDO_BATCH_SIZE];
+	uint16_t port[TEREDO_BATCH_SIZE];
+	uint8_t nonces[TEREDO_BATCH_SIZE][LIBTEREDO_NONCE_LEN];
+
+	while (n > 0)
+	{
+		unsigned count = (n < TEREDO_BATCH_SIZE) ? n : TEREDO_BATCH_SIZE;
+
+		for (unsigned i = 0; i < count; i++)
+		{
+			const struct in6_addr *it = &packets[i]->ip6->ip6_src;
+
+			ipv4[i] = IN6_TEREDO_IPV4 (it);
+			port[i] = IN6_TEREDO_PORT (it);
+		}
+		/* Same nonces as CheckBubble(), left in the cache */
+		teredo_get_nonces (0, ipv4, port, nonces, count);
+		packets += count;
+		n -= count;
+	}
+}
+
+
 #ifdef MIREDO_TEREDO_CLIENT
 static const struct in6_addr in6addr_allrouters =
 { { { 0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x2 } } };
@@ -299,6 +326,7 @@ SendPing (int fd, const union teredo_addr *src, const struct in6_addr *dst)
 	                     &ping.ip6.ip6_dst, (uint8_t *)&ping.icmp6.icmp6_id);
 
 	ping.icmp6.icmp6_cksum = icmp6_checksum (&ping.ip6, &ping.icmp6);
+	TEREDO_PROBE (ping_send, dst);
 
 	return teredo_send (fd, &ping, sizeof (ping.ip6) + sizeof (ping.icmp6)
 	                    + PING_PAYLOAD, IN6_TEREDO_SERVER (src),
@@ -424,10 +452,7 @@ BuildICMPv6Error (struct icmp6_hdr *restrict out, uint8_t type, uint8_t code,
 	if (inlen > 1280 - (sizeof (struct ip6_hdr) + sizeof (struct icmp6_hdr)))
 		inlen = 1280 - (sizeof (struct ip6_hdr) + sizeof (struct icmp6_hdr));
 
-	/* TODO: use iovecs */
-	memcpy (out + 1, in, inlen);
-
-	return sizeof (*out) + inlen;
+	return inlen;
 }
 
 
@@ -443,6 +468,8 @@ BuildIPv6Error (struct ip6_hdr *out, const struct in6_addr *src,
 	len = BuildICMPv6Error (h, type, code, in, len);
 	if (len == 0)
 		return 0;
+	memcpy (h + 1, in, len);
+	len += sizeof (*h);
 
 	out->ip6_flow = htonl (0x60000000);
 	out->ip6_plen = htons (len);
@@ -40,6 +40,12 @@ extern "C" {
 int CheckPing (const teredo_packet *packet);
 int CheckBubble (const teredo_packet *packet);
 
+/**
+ * Computes the nonces that CheckBubble() will need for a batch of bubbles
+ * at once, so that checking each of them afterwards costs no hashing.
+ */
+void PrepareBubbleChecks (const teredo_packet *const *packets, unsigned n);
+
 
 /**
  * Returns true if the packet whose header is passed as a parameter looks
@@ -128,19 +134,21 @@ int SendPing (int fd, const union teredo_addr *src,
               const struct in6_addr *dst);
 
 /**
- * Builds an ICMPv6 error message with specified type and code from an IPv6
- * packet. The output buffer must be at least 1240 bytes long and have
- * adequate IPv6 packet alignment. The ICMPv6 checksum is not set as they are
- * not enough information for its computation.
+ * Builds the header of an ICMPv6 error message with specified type and code
+ * from an IPv6 packet. The error payload is the leading part of the original
+ * packet, which is not copied: it should be referenced in place, e.g. as the
+ * second element of an I/O vector. The ICMPv6 checksum is not set as they
+ * are not enough information for its computation.
  *
- * @param out output buffer
+ * @param out output ICMPv6 header
  * @param type ICMPv6 error type
  * @param code ICMPv6 error code
  * @param in original IPv6 packet
  * @param inlen original IPv6 packet length (including IPv6 header)
  *
- * @return the actual size of the generated error message, or zero if no
- * ICMPv6 packet should be generated. Never fails.
+ * @return the number of bytes from the original packet to quote after the
+ * ICMPv6 header, or zero if no ICMPv6 packet should be generated.
+ * Never fails.
  */
 int BuildICMPv6Error (struct icmp6_hdr *restrict out,
                       uint8_t type, uint8_t code,
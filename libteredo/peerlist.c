@@ -24,15 +24,24 @@
 #endif
 
 #include <stdbool.h>
+#include <stdio.h> /* fdopen() */
 #include <string.h>
 #include <time.h>
 #include <stdlib.h> /* malloc() / free() */
+#include <limits.h> /* UINT_MAX */
+#include <stddef.h> /* offsetof() */
+#include <stdatomic.h>
 #include <assert.h>
 
 #include <inttypes.h>
 
 #include <sys/types.h>
+#include <sys/uio.h> /* struct iovec */
+#include <sys/mman.h> /* mmap() */
+#include <sys/stat.h> /* fstat() */
+#include <unistd.h> /* pwrite(), ftruncate() */
 #include <netinet/in.h>
+#include <arpa/inet.h> /* inet_ntop() */
 #include <pthread.h>
 #include <errno.h>
 
@@ -41,8 +50,6 @@
 #endif
 #ifdef HAVE_JUDY_H
 # include <Judy.h>
-#else
-# include <search.h>
 #endif
 
 #include "teredo.h"
@@ -50,438 +57,1713 @@
 #include "debug.h"
 #include "clock.h"
 #include "peerlist.h"
+#include "addrmap.h"
+#include "arena.h"
+#include "bloom.h"
+#include "slab.h"
+#include "stats.h"
+#include "tunnel.h"
+#include "pktbuf.h"
+#include "probe.h"
 
 /*
  * Packets queueing
+ *
+ * Each peer has at most one bounded FIFO buffer holding its queued packets
+ * back to back, in arrival order. Buffers are allocated from a slab when
+ * the first packet gets queued, and released once the queue is flushed.
+ * The slab has its own lock, as queues are flushed after the peer list is
+ * released. Incoming packets that are in a reference-counted receive
+ * buffer are retained rather than copied to the queue buffer.
  */
 struct teredo_queue
 {
-	teredo_queue *next;
-	size_t length;
-	uint32_t ipv4;
-	uint16_t port;
-	bool incoming;
-	uint8_t data[];
+	unsigned count;
+	size_t used; /* bytes of the packets buffer */
+	size_t bytes; /* bytes charged to the budget, see teredo_peer_queue() */
+	uint8_t *data; /* packets buffer, after the entries */
+	struct teredo_queue_entry
+	{
+		const uint8_t *ptr;
+		size_t length;
+		teredo_pktbuf *buf; /* retained buffer, or NULL if copied */
+		uint32_t ipv4;
+		uint16_t port;
+		bool incoming;
+	} entries[];
+};
+
+typedef struct teredo_queue_pool
+{
+	pthread_mutex_t lock;
+	teredo_slab queues;
+	size_t max_bytes; /* per queue */
+	unsigned max_packets; /* per queue */
+} teredo_queue_pool;
+
+
+/*** Peer list handling ***/
+
+/*
+ * Each peer is split into two records, allocated from separate slabs.
+ * The hot record holds what the packet forwarding fast path needs, in 32
+ * bytes (two records per cache line). The cold record holds the peer
+ * address, the list links and the packets queue. It is only touched when
+ * a peer is created, moves to the recent generation, is on probation, has
+ * packets queued, or expires. The index keeps its own copy of the address.
+ */
+typedef struct teredo_listcold teredo_listcold;
+
+typedef struct teredo_listitem
+{
+	teredo_peer peer;
+	teredo_listcold *cold;
+	uint8_t shard; /* shard index */
+	uint8_t gen; /* generation number when last used */
+	bool probation;
+} teredo_listitem;
+
+struct teredo_listcold
+{
+	union teredo_addr key;
+	teredo_listitem *next;
+	teredo_listitem **pprev;
+	/* Probation list links (untrusted peers only) */
+	teredo_listitem *prob_next, *prob_prev;
+	teredo_queue *queue;
+	uint32_t prob_time; /* last use while on probation */
+	uint32_t setup_start; /* first queued packet (microseconds, wrapping) */
+	bool setup_pending; /* packets were queued since the peer was created */
+};
+
+static_assert (sizeof (teredo_listitem) <= 32, "Hot peer record too big");
+
+/*
+ * The list is split into independently locked shards, so that lookups of
+ * peers hashing to different shards never contend on the same mutex.
+ * Each shard has its own recent/old generations and index; only the
+ * remaining capacity is shared (atomically) by all shards. The order of
+ * peers within a generation does not matter. A peer is in the recent
+ * generation if its generation number is that of the shard.
+ *
+ * New peers are on probation until teredo_list_trust() is called (i.e.
+ * until a bubble or ping round trip proves them). Each shard keeps its
+ * peers on probation in LRU order. When the list is full, the least
+ * recently used of them is evicted to admit a new peer, provided it has
+ * had TEREDO_PROBATION seconds to prove itself. Hence a flood of spoofed
+ * sources cannot lock new peers out until the garbage collector runs, and
+ * never evicts trusted peers.
+ *
+ * When generations rotate, the old one becomes the expired one, which the
+ * garbage collector then removes from the index at most TEREDO_EXPIRE_BATCH
+ * peers at a time, so that the shard lock is only ever held briefly.
+ * Expired peers are still found (and revived) until they are removed.
+ *
+ * Each generation also has a Bloom filter of the hashes of its peer
+ * addresses, which lookups that cannot create a peer test without taking
+ * the shard lock, so that packets from unknown sources are rejected
+ * cheaply. A peer is added to the filter of the recent generation
+ * whenever it enters that generation. As the expired generation is empty
+ * by the time generations rotate, its filter is then cleared and reused
+ * for the new recent generation.
+ *
+ * The records and the index tables of all shards can come from a single
+ * preallocated arena (see teredo_list_set_budget()). Each shard then has a
+ * fixed-size index table, while the chunks of the records are shared.
+ */
+#define TEREDO_PROBATION 3 // seconds
+#define TEREDO_EXPIRE_BATCH 64
+#define TEREDO_LIST_SHARD_BITS 4
+#define TEREDO_LIST_SHARDS (1 << TEREDO_LIST_SHARD_BITS)
+#define TEREDO_LISTSLAB_ITEMS 256
+#define TEREDO_FILTER_MIN 64 /* minimum filter capacity per shard */
+#define TEREDO_FILTER_MAX 32768 /* maximum filter capacity per shard */
+
+typedef struct teredo_listshard
+{
+	pthread_mutex_t lock;
+	teredo_listitem *recent, *old, *expired;
+	teredo_listitem *prob_head, *prob_tail; /* most recent first */
+	uint8_t gen; /* generation number of recent peers */
+	uint8_t filter; /* filter index of the recent generation */
+	teredo_bloom filters[3]; /* recent, old and expired generations */
+	teredo_slab items; /* hot records */
+	teredo_slab colds; /* cold records */
+#ifdef HAVE_LIBJUDY
+	Pvoid_t PJHSArray;
+#else
+	teredo_addrmap map;
+#endif
+} teredo_listshard;
+
+struct teredo_peerlist
+{
+	teredo_listshard shards[TEREDO_LIST_SHARDS];
+	teredo_queue_pool pool;
+	atomic_int left; /* negative if the maximum was lowered below use */
+	unsigned max; /* maximum number of peers */
+	unsigned expiration;
+	unsigned reserved; /* preallocated peers */
+	teredo_arena *arena; /* memory budget (or NULL) */
+	unsigned arena_max; /* peers that fit in the arena */
+	pthread_t gc;
+	bool has_gc; /* false if teredo_list_gc() is called by the owner */
 };
 
-static const unsigned teredo_MaxQueueBytes = 1280;
 
+static void teredo_queue_pool_setup (teredo_queue_pool *pool, size_t bytes)
+{
+	pool->max_bytes = bytes;
+	/* Each packet has at least an IPv6 header */
+	pool->max_packets = bytes / 40;
+	teredo_slab_init (&pool->queues, sizeof (teredo_queue)
+	                  + pool->max_packets * sizeof (struct teredo_queue_entry)
+	                  + bytes, 16);
+}
 
-static inline void teredo_peer_init (teredo_peer *peer)
+
+static void teredo_queue_pool_init (teredo_queue_pool *pool)
 {
-	peer->queue = NULL;
-	peer->queue_left = teredo_MaxQueueBytes;
+	pthread_mutex_init (&pool->lock, NULL);
+	teredo_queue_pool_setup (pool, MAXQUEUE);
 }
 
 
-static inline void teredo_peer_destroy (teredo_peer *peer)
+static void teredo_queue_pool_destroy (teredo_queue_pool *pool)
 {
-	teredo_queue *p = peer->queue;
+	teredo_slab_destroy (&pool->queues);
+	pthread_mutex_destroy (&pool->lock);
+}
+
+
+/**
+ * Releases a packets queue.
+ */
+static void teredo_queue_free (teredo_queue_pool *pool, teredo_queue *q)
+{
+	for (unsigned i = 0; i < q->count; i++)
+		if (q->entries[i].buf != NULL)
+			teredo_pktbuf_release (q->entries[i].buf);
+
+	pthread_mutex_lock (&pool->lock);
+	teredo_slab_free (&pool->queues, q);
+	pthread_mutex_unlock (&pool->lock);
+}
+
+
+static inline teredo_listitem *listitem_of (const teredo_peer *peer)
+{
+	return (teredo_listitem *)((char *)peer
+	                           - offsetof (teredo_listitem, peer));
+}
 
-	while (p != NULL)
-	{
-		teredo_queue *buf;
 
-		buf = p->next;
-		free (p);
-		p = buf;
+/**
+ * Releases the packets queue of a peer, if any.
+ */
+static inline void teredo_peer_flush (teredo_queue_pool *pool,
+                                      teredo_listitem *p)
+{
+	teredo_listcold *c = p->cold;
+
+	if (c->queue != NULL)
+	{
+		teredo_queue_free (pool, c->queue);
+		c->queue = NULL;
 	}
 }
 
 
-static void teredo_peer_queue (teredo_peer *restrict peer,
+static void teredo_peer_queue (teredo_peerlist *restrict list,
+                               teredo_peer *restrict peer,
                                const void *restrict data, size_t len,
                                uint32_t ip, uint16_t port, bool incoming)
 {
-	teredo_queue *p;
-
-	if (len > peer->queue_left)
-		return;
-	peer->queue_left -= len;
+	teredo_queue_pool *pool = &list->pool;
+	teredo_listcold *c = listitem_of (peer)->cold;
+	teredo_queue *q = c->queue;
 
-	p = (teredo_queue *)malloc (sizeof (*p) + len);
-	p->length = len;
-	memcpy (p->data, data, len);
-	p->ipv4 = ip;
-	p->port = port;
-	p->incoming = incoming;
+	if (q == NULL)
+	{
+		if ((len > pool->max_bytes) || (pool->max_packets == 0))
+			goto full;
+
+		pthread_mutex_lock (&pool->lock);
+		q = teredo_slab_alloc (&pool->queues);
+		pthread_mutex_unlock (&pool->lock);
+		if (q == NULL)
+			goto full;
+
+		q->count = 0;
+		q->used = 0;
+		q->bytes = 0;
+		q->data = (uint8_t *)(q->entries + pool->max_packets);
+		c->queue = q;
+	}
+	else if ((q->count >= pool->max_packets)
+	      || (len > pool->max_bytes - q->bytes))
+		goto full;
+
+	struct teredo_queue_entry *e = q->entries + q->count++;
+	/* A retained receive buffer is charged in full, as it is pinned */
+	size_t charge = sizeof (teredo_pktbuf);
+
+	e->length = len;
+	e->buf = (incoming && (charge <= pool->max_bytes - q->bytes))
+		? teredo_pktbuf_hold (data, len) : NULL;
+	e->ipv4 = ip;
+	e->port = port;
+	e->incoming = incoming;
+	if (e->buf != NULL)
+		e->ptr = data;
+	else
+	{
+		e->ptr = q->data + q->used;
+		memcpy (q->data + q->used, data, len);
+		q->used += len;
+		charge = len;
+	}
+	q->bytes += charge;
+	if (!c->setup_pending)
+	{
+		c->setup_start = teredo_hist_now ();
+		c->setup_pending = true;
+	}
+	TEREDO_PROBE (peer_queue, &c->key.ip6, len, incoming);
+	return;
 
-	p->next = peer->queue;
-	peer->queue = p;
+full:
+	teredo_stat_inc (TEREDO_STAT_QUEUE_FULL);
+	TEREDO_PROBE (peer_drop, &c->key.ip6, len, incoming);
 }
 
 
-void teredo_enqueue_in (teredo_peer *restrict peer, const void *restrict data,
+void teredo_enqueue_in (teredo_peerlist *restrict list,
+                        teredo_peer *restrict peer, const void *restrict data,
                         size_t len, uint32_t ip, uint16_t port)
 {
-	teredo_peer_queue (peer, data, len, ip, port, true);
+	teredo_peer_queue (list, peer, data, len, ip, port, true);
 }
 
 
-void teredo_enqueue_out (teredo_peer *restrict peer,
+void teredo_enqueue_out (teredo_peerlist *restrict list,
+                         teredo_peer *restrict peer,
                          const void *restrict data, size_t len)
 {
-	teredo_peer_queue (peer, data, len, 0, 0, false);
+	teredo_peer_queue (list, peer, data, len, 0, 0, false);
 }
 
 
 teredo_queue *teredo_peer_queue_yield (teredo_peer *peer)
 {
-	teredo_queue *q = peer->queue;
-	peer->queue = NULL;
-	peer->queue_left = teredo_MaxQueueBytes;
+	teredo_listcold *c = listitem_of (peer)->cold;
+	teredo_queue *q = c->queue;
+
+	c->queue = NULL;
 	return q;
 }
 
 
-void teredo_queue_emit (teredo_queue *q, int fd, uint32_t ipv4, uint16_t port,
+bool teredo_peer_queued (const teredo_peer *peer)
+{
+	return listitem_of (peer)->cold->queue != NULL;
+}
+
+
+void teredo_queue_emit (teredo_peerlist *list, teredo_queue *q, int fd,
+                        uint32_t ipv4, uint16_t port,
                         teredo_dequeue_cb cb, void *opaque)
 {
-	while (q != NULL)
+	if (q == NULL)
+		return;
+
+	struct iovec out[q->count];
+	unsigned n = 0;
+
+	for (unsigned i = 0; i < q->count; i++)
 	{
-		teredo_queue *buf;
+		const struct teredo_queue_entry *e = q->entries + i;
 
-		buf = q->next;
-		if (q->incoming)
+		if (e->incoming)
 		{
-			if ((ipv4 == q->ipv4) && (port == q->port))
-				cb (opaque, q->data, q->length);
+			if ((ipv4 == e->ipv4) && (port == e->port))
+			{   /* The callback may retain the buffer in turn */
+				teredo_pktbuf *prev = teredo_pktbuf_swap_current (e->buf);
+				cb (opaque, e->ptr, e->length);
+				teredo_pktbuf_swap_current (prev);
+			}
 		}
 		else
-			teredo_send (fd, q->data, q->length, ipv4, port);
-		free (q);
-		q = buf;
+		{
+			out[n].iov_base = (void *)e->ptr;
+			out[n].iov_len = e->length;
+			n++;
+		}
 	}
+
+	/* Outgoing packets all go to the same peer: send them at once */
+	if (n > 0)
+		teredo_sendmv (fd, out, n, ipv4, port);
+
+	teredo_queue_free (&list->pool, q);
 }
 
 
-/*** Peer list handling ***/
-typedef struct teredo_listitem
+/**
+ * Releases a packets queue without sending it, passing each queued outgoing
+ * packet to a callback first (e.g. to report the peer as unreachable).
+ */
+void teredo_queue_discard (teredo_peerlist *list, teredo_queue *q,
+                           teredo_dequeue_cb cb, void *opaque)
 {
-	union teredo_addr key; /* must be first (for listitem_cmp()) */
-	struct teredo_listitem **pprev, *next;
-	teredo_peer peer;
-} teredo_listitem;
+	if (q == NULL)
+		return;
 
-struct teredo_peerlist
-{
-	teredo_listitem *recent, *old;
-	unsigned left;
-	unsigned expiration;
-	pthread_t gc;
-	pthread_mutex_t lock;
-#ifdef HAVE_LIBJUDY
-	Pvoid_t PJHSArray;
-#else
-        void *root;
-#endif
-};
+	for (unsigned i = 0; i < q->count; i++)
+	{
+		const struct teredo_queue_entry *e = q->entries + i;
 
+		if (!e->incoming)
+			cb (opaque, e->ptr, e->length);
+	}
 
-static inline teredo_listitem *listitem_create (void)
-{
-	teredo_listitem *entry = malloc (sizeof (*entry));
-	if (entry != NULL)
-		teredo_peer_init (&entry->peer);
-	return entry;
+	teredo_queue_free (&list->pool, q);
 }
 
 
-static inline void listitem_destroy (teredo_listitem *entry)
+/**
+ * Selects the shard a Teredo address belongs to. The most significant bits
+ * of the hash are used, as the least significant ones index the hash table.
+ */
+static inline unsigned listshard_index (uint32_t hash)
+{
+	return hash >> (32 - TEREDO_LIST_SHARD_BITS);
+}
+
+/**
+ * Checks whether an address hash may be in a shard, without locking it.
+ * @return false if the shard definitely has no peer with that hash.
+ */
+static inline bool listshard_filter (const teredo_listshard *s, uint32_t hash)
 {
-	teredo_peer_destroy (&entry->peer);
-	free (entry);
+	return teredo_bloom_test (s->filters + 0, hash)
+	    || teredo_bloom_test (s->filters + 1, hash)
+	    || teredo_bloom_test (s->filters + 2, hash);
 }
 
 
-static void listitem_recdestroy (teredo_listitem *entry)
+/**
+ * Initializes the (empty) records slabs of a shard.
+ */
+static void listshard_slabs_init (teredo_peerlist *l, teredo_listshard *s)
 {
-	while (entry != NULL)
+	if (l->arena != NULL)
+	{
+		teredo_slab_init_arena (&s->items, sizeof (teredo_listitem),
+		                        l->arena);
+		teredo_slab_init_arena (&s->colds, sizeof (teredo_listcold),
+		                        l->arena);
+	}
+	else
 	{
-		teredo_listitem *buf = entry->next;
-		listitem_destroy (entry);
-		entry = buf;
+		teredo_slab_init (&s->items, sizeof (teredo_listitem),
+		                  TEREDO_LISTSLAB_ITEMS);
+		teredo_slab_init (&s->colds, sizeof (teredo_listcold),
+		                  TEREDO_LISTSLAB_ITEMS);
 	}
 }
 
-#ifndef HAVE_LIBJUDY
-static void listitem_free (void *p)
+
+/* The shard must be locked. */
+static void probation_unlink (teredo_listshard *s, teredo_listitem *p)
 {
-	(void) p;
+	teredo_listcold *c = p->cold;
+
+	assert (p->probation);
+
+	if (c->prob_prev != NULL)
+		c->prob_prev->cold->prob_next = c->prob_next;
+	else
+		s->prob_head = c->prob_next;
+	if (c->prob_next != NULL)
+		c->prob_next->cold->prob_prev = c->prob_prev;
+	else
+		s->prob_tail = c->prob_prev;
+	p->probation = false;
 }
 
-static int listitem_cmp (const void *pa, const void *pb)
+
+/* The shard must be locked. */
+static void probation_push (teredo_listshard *s, teredo_listitem *p,
+                            teredo_clock_t now)
 {
-	const struct in6_addr *const *a = pa, *const *b = pb;
+	teredo_listcold *c = p->cold;
 
-	return memcmp (a, b, sizeof (**a));
+	c->prob_prev = NULL;
+	c->prob_next = s->prob_head;
+	if (c->prob_next != NULL)
+		c->prob_next->cold->prob_prev = p;
+	else
+		s->prob_tail = p;
+	s->prob_head = p;
+	c->prob_time = now;
+	p->probation = true;
 }
-#endif
 
-#include <sched.h>
 
 /**
- * Peer list garbage collector entry point.
- *
- * @return never ever.
+ * Removes a peer from its generation. The shard must be locked.
  */
-static LIBTEREDO_NORETURN void *garbage_collector (void *data)
+static inline void generation_unlink (teredo_listitem *p)
 {
-	struct teredo_peerlist *l = (struct teredo_peerlist *)data;
-
-	for (;;)
-	{
-		struct timespec delay = { .tv_sec = l->expiration };
-		while (clock_nanosleep (CLOCK_REALTIME, 0, &delay, &delay));
-
-		int state;
-		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &state);
-		/* cancel-unsafe section starts */
-		pthread_mutex_lock (&l->lock);
-
-		// remove expired peers from hash table
-		for (teredo_listitem *p = l->old; p != NULL; p = p->next)
-		{
-#ifdef HAVE_LIBJUDY
-			int Rc_int;
+	teredo_listcold *c = p->cold;
 
-			JHSD (Rc_int, l->PJHSArray, (uint8_t *)&p->key, 16);
-			assert (Rc_int);
-#else
-                        teredo_listitem **pp;
+	assert (*(c->pprev) == p);
+	assert ((c->next == NULL) || (c->next->cold->pprev == &c->next));
 
-                        pp = tdelete (&p->key.ip6, &l->root, listitem_cmp);
-                        assert (pp != NULL);
-#endif
-			l->left++;
-		}
+	if (c->next != NULL)
+		c->next->cold->pprev = c->pprev;
+	*(c->pprev) = c->next;
+}
 
-		// unlinks old peers
-		teredo_listitem *old = l->old;
 
-		// moves recent peers to old peers area
-		l->old = l->recent;
-		l->recent = NULL;
-		if (l->old != NULL)
-			l->old->pprev = &l->old;
+/**
+ * Inserts a peer in the recent generation. The shard must be locked.
+ * @param hash teredo_addr_hash() of the peer address
+ */
+static inline void generation_push (teredo_listshard *s, teredo_listitem *p,
+                                    uint32_t hash)
+{
+	teredo_listcold *c = p->cold;
 
-		pthread_mutex_unlock (&l->lock);
+	teredo_bloom_add (s->filters + s->filter, hash);
 
-		// Perform possibly expensive memory release without the lock
-		sched_yield ();
-		listitem_recdestroy (old);
+	c->next = s->recent;
+	if (c->next != NULL)
+		c->next->cold->pprev = &c->next;
 
-		/* cancel-unsafe section ends */
-		pthread_setcancelstate (state, NULL);
-		sched_yield ();
-	}
+	s->recent = p;
+	c->pprev = &s->recent;
+	p->gen = s->gen;
 }
 
 
-teredo_peerlist *teredo_list_create (unsigned max, unsigned expiration)
+/* The shard must be locked. */
+static teredo_listitem *listitem_create (teredo_peerlist *l,
+                                         teredo_listshard *s)
 {
-	/*printf ("Peer size: %u/%u bytes\n",sizeof (teredo_peer),
-	        sizeof (teredo_listitem));*/
-	assert (expiration > 0);
-
-	teredo_peerlist *l = (teredo_peerlist *)malloc (sizeof (*l));
-	if (l == NULL)
+	teredo_listitem *p = teredo_slab_alloc (&s->items);
+	if (p == NULL)
 		return NULL;
 
-	memset (l, 0, sizeof (l));
-	pthread_mutex_init (&l->lock, NULL);
-	l->recent = l->old = NULL;
-	l->left = max;
-	l->expiration = expiration;
-#ifdef HAVE_LIBJUDY
-	l->PJHSArray = (Pvoid_t)NULL;
-#else
-	l->root = NULL;
-#endif
-
-	if (pthread_create (&l->gc, NULL, garbage_collector, l))
+	teredo_listcold *c = teredo_slab_alloc (&s->colds);
+	if (c == NULL)
 	{
-		pthread_mutex_destroy (&l->lock);
-		free (l);
+		teredo_slab_free (&s->items, p);
 		return NULL;
 	}
 
-	return l;
+	p->cold = c;
+	p->shard = s - l->shards;
+	p->probation = false;
+	c->queue = NULL;
+	return p;
 }
 
 
-void teredo_list_reset (teredo_peerlist *l, unsigned max)
+/* The shard must be locked. */
+static void listitem_destroy (teredo_peerlist *l, teredo_listshard *s,
+                              teredo_listitem *p)
 {
-	pthread_mutex_lock (&l->lock);
+	teredo_peer_flush (&l->pool, p);
+	teredo_slab_free (&s->colds, p->cold);
+	teredo_slab_free (&s->items, p);
+}
 
+
+/**
+ * Removes a peer from the shard index, from its generation and from the
+ * probation list, and flushes its packet queues. The records themselves
+ * are not freed. The shard must be locked.
+ */
+static void listshard_unlink (teredo_peerlist *l, teredo_listshard *s,
+                              teredo_listitem *p)
+{
 #ifdef HAVE_LIBJUDY
-	// detach old array
-	Pvoid_t array = l->PJHSArray;
-	l->PJHSArray = (Pvoid_t)NULL;
+	int Rc_int;
+
+	JHSD (Rc_int, s->PJHSArray, (uint8_t *)&p->cold->key, 16);
+	assert (Rc_int);
 #else
-	void *root = l->root;
-	l->root = NULL;
+	teredo_listitem *q = teredo_addrmap_remove (&s->map, &p->cold->key);
+	assert (q == p);
+	(void)q;
 #endif
+	generation_unlink (p);
+	if (p->probation)
+		probation_unlink (s, p);
+	teredo_peer_flush (&l->pool, p);
+}
 
-	teredo_listitem *recent = l->recent, *old = l->old;
-	// unlinks peers and resets lists
-	l->recent = l->old = NULL;
-	l->left = max;
 
-	pthread_mutex_unlock (&l->lock);
+/**
+ * Evicts an expired peer, or otherwise the least recently used peer on
+ * probation if it was given enough time to prove itself, from a shard.
+ * The shard must be locked.
+ * @return the evicted entry for reuse, or NULL if none.
+ */
+static teredo_listitem *listshard_evict (teredo_peerlist *l,
+                                         teredo_listshard *s)
+{
+	teredo_listitem *p = s->expired;
 
-	/* the mutex is not needed for actual memory release */
-	listitem_recdestroy (old);
-	listitem_recdestroy (recent);
+	if (p == NULL)
+	{
+		p = s->prob_tail;
+		if ((p == NULL)
+		 || (((uint32_t)teredo_clock () - p->cold->prob_time)
+		      < TEREDO_PROBATION))
+			return NULL;
+		teredo_stat_inc (TEREDO_STAT_PEERS_EVICTED);
+	}
+	else
+		teredo_stat_inc (TEREDO_STAT_PEERS_REMOVED);
 
-#ifdef HAVE_LIBJUDY
-	// destroy the old array that was detached before unlocking
-	intptr_t Rc_word;
-	JHSFA (Rc_word, array);
-#else
-	tdestroy (root, listitem_free);
-#endif
+	listshard_unlink (l, s, p);
+	return p;
 }
 
 
-void teredo_list_destroy (teredo_peerlist *l)
+/**
+ * Flushes the packet queues of a list of detached peers.
+ */
+static void listitem_recdestroy (teredo_peerlist *l, teredo_listitem *p)
 {
-	teredo_list_reset (l, 0);
+	unsigned count = 0;
 
-	pthread_cancel (l->gc);
-	pthread_join (l->gc, NULL);
-	pthread_mutex_destroy (&l->lock);
+	for (; p != NULL; p = p->cold->next)
+	{
+		teredo_peer_flush (&l->pool, p);
+		count++;
+	}
+	teredo_stat_add (TEREDO_STAT_PEERS_REMOVED, count);
+}
 
-	free (l);
+/**
+ * Tries to reserve room for one more peer in the list.
+ * @return false if the list is full.
+ */
+/**
+ * Sets the maximum number of peers, without checking the current number.
+ */
+static void list_set_max (teredo_peerlist *l, unsigned max)
+{
+	if (max > INT_MAX)
+		max = INT_MAX;
+	l->max = max;
+	atomic_store_explicit (&l->left, max, memory_order_relaxed);
 }
 
 
-teredo_peer *teredo_list_lookup (teredo_peerlist *restrict list,
-                                 const struct in6_addr *restrict addr,
-                                 bool *restrict create)
+static bool list_reserve (teredo_peerlist *l)
 {
-	teredo_listitem *p;
+	int left = atomic_load_explicit (&l->left, memory_order_relaxed);
+
+	do
+		if (left <= 0)
+			return false;
+	while (!atomic_compare_exchange_weak_explicit (&l->left, &left, left - 1,
+	                                               memory_order_relaxed,
+	                                               memory_order_relaxed));
+	return true;
+}
 
-	pthread_mutex_lock (&list->lock);
 
-#ifdef HAVE_LIBJUDY
-	teredo_listitem **pp = NULL;
+/**
+ * Makes the old generation of a shard the expired one, and the recent
+ * generation the old one. The expired generation must be empty.
+ * The shard must be locked.
+ */
+static void listshard_rotate (teredo_listshard *s)
+{
+	assert (s->expired == NULL);
 
-	/* Judy dynamic array-based fast lookup */
-	{
-		void *PValue;
+	s->expired = s->old;
+	if (s->expired != NULL)
+		s->expired->cold->pprev = &s->expired;
 
-		if (create != NULL)
-		{
-			JHSI (PValue, list->PJHSArray, (uint8_t *)addr, 16);
-			if (PValue == PJERR)
-				goto error; /* out of memory */
-			pp = (teredo_listitem **)PValue;
-			p = *pp;
-		}
-		else
-		{
-			JHSG (PValue, list->PJHSArray, (uint8_t *)addr, 16);
-			pp = (teredo_listitem **)PValue;
-			p = (pp != NULL) ? *pp : NULL;
-		}
+	s->old = s->recent;
+	s->recent = NULL;
+	if (s->old != NULL)
+		s->old->cold->pprev = &s->old;
+	s->gen++;
 
-	}
-#else
-	void **pp;
+	/* The filter of the (empty) expired generation becomes the recent one */
+	s->filter = (s->filter + 1) % 3;
+	teredo_bloom_clear (s->filters + s->filter);
+}
 
-	if (create != NULL)
-	{
-		pp = tsearch (addr, &list->root, listitem_cmp);
-		if (pp == NULL)
-			goto error; /* out of memory */
-		p = (*pp != addr) ? *pp : NULL;
-	}
-	else
-	{
-		pp = tfind (addr, &list->root, listitem_cmp);
-		p = (pp != NULL) ? *pp : NULL;
-	}
-#endif
 
-	if (p != NULL)
-	{
-		/* peer was already in list */
-		assert (*(p->pprev) == p);
-		assert ((p->next == NULL) || (p->next->pprev == &p->next));
+/**
+ * Removes up to TEREDO_EXPIRE_BATCH expired peers from a shard, and gives
+ * them back to the shard slabs. The shard must be locked.
+ * @return true if expired peers remain.
+ */
+static bool listshard_expire (teredo_peerlist *l, teredo_listshard *s)
+{
+	unsigned count = 0;
 
-		if (create != NULL)
-			*create = false;
+	while ((s->expired != NULL) && (count < TEREDO_EXPIRE_BATCH))
+	{
+		teredo_listitem *p = s->expired;
 
-		/* move peer to the top of the head of the "recent" list */
-		if (list->recent != p)
-		{
-			// unlinks
-			if (p->next != NULL)
-				p->next->pprev = p->pprev;
-			*(p->pprev) = p->next;
+		listshard_unlink (l, s, p);
+		listitem_destroy (l, s, p);
+		count++;
+	}
+	atomic_fetch_add_explicit (&l->left, count, memory_order_relaxed);
+	teredo_stat_add (TEREDO_STAT_PEERS_REMOVED, count);
+	return s->expired != NULL;
+}
 
-			// inserts at head
-			p->next = list->recent;
-			if (p->next != NULL)
-				p->next->pprev = &p->next;
 
-			list->recent = p;
-			p->pprev = &list->recent;
+/**
+ * Removes all expired peers from a shard, one batch at a time.
+ */
+static void listshard_purge (teredo_peerlist *l, teredo_listshard *s)
+{
+	bool more;
 
-			assert (*(p->pprev) == p);
-			assert ((p->next == NULL) || (p->next->pprev == &p->next));
-		}
+	do
+	{
+		int state;
 
-		return &p->peer;
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &state);
+		/* cancel-unsafe section starts */
+		pthread_mutex_lock (&s->lock);
+		more = listshard_expire (l, s);
+		pthread_mutex_unlock (&s->lock);
+		/* cancel-unsafe section ends */
+		pthread_setcancelstate (state, NULL);
+	}
+	while (more);
+}
+
+#include <sched.h>
+
+void teredo_list_gc (teredo_peerlist *l)
+{
+	struct timespec start, end;
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	TEREDO_PROBE (gc_start);
+
+	for (unsigned i = 0; i < TEREDO_LIST_SHARDS; i++)
+	{
+		teredo_listshard *s = l->shards + i;
+		int state;
+
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &state);
+		pthread_mutex_lock (&s->lock);
+		listshard_rotate (s);
+		pthread_mutex_unlock (&s->lock);
+		pthread_setcancelstate (state, NULL);
+
+		listshard_purge (l, s);
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &end);
+
+	uint64_t usec = (end.tv_sec - start.tv_sec) * 1000000
+	                + (end.tv_nsec - start.tv_nsec) / 1000;
+	teredo_stat_inc (TEREDO_STAT_GC_RUNS);
+	teredo_stat_add (TEREDO_STAT_GC_USEC, usec);
+	TEREDO_PROBE (gc_done, usec);
+}
+
+
+/**
+ * Peer list garbage collector entry point.
+ *
+ * @return never ever.
+ */
+static LIBTEREDO_NORETURN void *garbage_collector (void *data)
+{
+	struct teredo_peerlist *l = (struct teredo_peerlist *)data;
+
+	teredo_thread_setup (TEREDO_THREAD_HOUSEKEEPING, "teredo-gc");
+
+	for (;;)
+	{
+		struct timespec delay = { .tv_sec = l->expiration };
+		while (clock_nanosleep (CLOCK_REALTIME, 0, &delay, &delay));
+
+		teredo_list_gc (l);
+		sched_yield ();
+	}
+}
+
+
+static teredo_peerlist *list_create (unsigned max, unsigned expiration,
+                                     bool has_gc)
+{
+	/*printf ("Peer size: %u/%u bytes\n",sizeof (teredo_peer),
+	        sizeof (teredo_listitem));*/
+	assert (expiration > 0);
+
+	teredo_peerlist *l = (teredo_peerlist *)malloc (sizeof (*l));
+	if (l == NULL)
+		return NULL;
+
+	memset (l, 0, sizeof (*l));
+
+	/* Filters cannot be resized, as they are tested without locking */
+	unsigned capacity = max / TEREDO_LIST_SHARDS;
+	if (capacity < TEREDO_FILTER_MIN)
+		capacity = TEREDO_FILTER_MIN;
+	if (capacity > TEREDO_FILTER_MAX)
+		capacity = TEREDO_FILTER_MAX;
+
+	for (unsigned i = 0; i < TEREDO_LIST_SHARDS; i++)
+	{
+		teredo_listshard *s = l->shards + i;
+
+		for (unsigned j = 0; j < 3; j++)
+			if (teredo_bloom_init (s->filters + j, capacity))
+			{
+				while (j-- > 0)
+					teredo_bloom_destroy (s->filters + j);
+				while (i-- > 0)
+					for (j = 0; j < 3; j++)
+						teredo_bloom_destroy (l->shards[i].filters + j);
+				free (l);
+				return NULL;
+			}
+	}
+
+	for (unsigned i = 0; i < TEREDO_LIST_SHARDS; i++)
+	{
+		teredo_listshard *s = l->shards + i;
+
+		pthread_mutex_init (&s->lock, NULL);
+		s->recent = s->old = s->expired = NULL;
+		s->prob_head = s->prob_tail = NULL;
+		listshard_slabs_init (l, s);
+#ifdef HAVE_LIBJUDY
+		s->PJHSArray = (Pvoid_t)NULL;
+#else
+		teredo_addrmap_init (&s->map);
+#endif
+	}
+	teredo_queue_pool_init (&l->pool);
+	atomic_init (&l->left, 0);
+	list_set_max (l, max);
+	l->expiration = expiration;
+	l->has_gc = has_gc;
+
+	if (has_gc && pthread_create (&l->gc, NULL, garbage_collector, l))
+	{
+		for (unsigned i = 0; i < TEREDO_LIST_SHARDS; i++)
+		{
+			pthread_mutex_destroy (&l->shards[i].lock);
+			for (unsigned j = 0; j < 3; j++)
+				teredo_bloom_destroy (l->shards[i].filters + j);
+		}
+		teredo_queue_pool_destroy (&l->pool);
+		free (l);
+		return NULL;
+	}
+
+	return l;
+}
+
+
+teredo_peerlist *teredo_list_create (unsigned max, unsigned expiration)
+{
+	return list_create (max, expiration, true);
+}
+
+
+teredo_peerlist *teredo_list_create_manual (unsigned max,
+                                            unsigned expiration)
+{
+	return list_create (max, expiration, false);
+}
+
+
+void teredo_list_reset (teredo_peerlist *l, unsigned max)
+{
+	teredo_listshard detached[TEREDO_LIST_SHARDS];
+
+	/* All shards are locked (in order) so that the reset appears atomic */
+	for (unsigned i = 0; i < TEREDO_LIST_SHARDS; i++)
+		pthread_mutex_lock (&l->shards[i].lock);
+
+	for (unsigned i = 0; i < TEREDO_LIST_SHARDS; i++)
+	{
+		teredo_listshard *s = l->shards + i;
+
+		// detach old index and peers
+		detached[i] = *s;
+#ifdef HAVE_LIBJUDY
+		s->PJHSArray = (Pvoid_t)NULL;
+#else
+		if (s->map.fixed)
+		{	/* fixed-size tables are emptied in place */
+			teredo_addrmap_clear (&s->map);
+			teredo_addrmap_init (&detached[i].map);
+		}
+		else
+			teredo_addrmap_init (&s->map);
+#endif
+		// unlinks peers and resets lists
+		s->recent = s->old = s->expired = NULL;
+		s->prob_head = s->prob_tail = NULL;
+		listshard_slabs_init (l, s);
+		// filters are kept, as they may be in use
+		for (unsigned j = 0; j < 3; j++)
+			teredo_bloom_clear (s->filters + j);
+	}
+	if ((l->arena != NULL) && (max > l->arena_max))
+		max = l->arena_max;
+	list_set_max (l, max);
+
+	for (unsigned i = TEREDO_LIST_SHARDS; i-- > 0;)
+		pthread_mutex_unlock (&l->shards[i].lock);
+
+	/* the mutexes are not needed for actual memory release */
+	for (unsigned i = 0; i < TEREDO_LIST_SHARDS; i++)
+	{
+		teredo_listshard *s = detached + i;
+
+		listitem_recdestroy (l, s->expired);
+		listitem_recdestroy (l, s->old);
+		listitem_recdestroy (l, s->recent);
+		// returns all peers to the system at once
+		teredo_slab_destroy (&s->items);
+		teredo_slab_destroy (&s->colds);
+
+#ifdef HAVE_LIBJUDY
+		// destroy the old array that was detached before unlocking
+		intptr_t Rc_word;
+		JHSFA (Rc_word, s->PJHSArray);
+#else
+		teredo_addrmap_destroy (&s->map);
+#endif
+	}
+
+	if (l->reserved > 0)
+		(void)teredo_list_reserve (l, l->reserved);
+}
+
+
+void teredo_list_set_limit (teredo_peerlist *l, unsigned max)
+{
+	if ((l->arena != NULL) && (max > l->arena_max))
+		max = l->arena_max;
+	if (max > INT_MAX)
+		max = INT_MAX;
+
+	/* Serializes with teredo_list_reset() */
+	for (unsigned i = 0; i < TEREDO_LIST_SHARDS; i++)
+		pthread_mutex_lock (&l->shards[i].lock);
+
+	atomic_fetch_add_explicit (&l->left, (int)max - (int)l->max,
+	                           memory_order_relaxed);
+	l->max = max;
+
+	for (unsigned i = TEREDO_LIST_SHARDS; i-- > 0;)
+		pthread_mutex_unlock (&l->shards[i].lock);
+}
+
+
+int teredo_list_reserve (teredo_peerlist *l, unsigned count)
+{
+	/* Addresses are spread evenly across shards (barring bad luck) */
+	unsigned per_shard = (count + TEREDO_LIST_SHARDS - 1) / TEREDO_LIST_SHARDS;
+	int val = 0;
+
+	l->reserved = count;
+	if (l->arena != NULL)
+		return 0; /* all memory is preallocated already */
+
+	for (unsigned i = 0; i < TEREDO_LIST_SHARDS; i++)
+	{
+		teredo_listshard *s = l->shards + i;
+
+		pthread_mutex_lock (&s->lock);
+		if (teredo_slab_reserve (&s->items, per_shard)
+		 || teredo_slab_reserve (&s->colds, per_shard))
+			val = -1;
+		pthread_mutex_unlock (&s->lock);
+	}
+	return val;
+}
+
+
+/**
+ * Computes how many peers per shard fit in a memory budget.
+ * @param slotsp where to store the index table size of each shard
+ */
+static unsigned list_budget_peers (size_t bytes, size_t *restrict slotsp)
+{
+	const size_t per_shard = bytes / TEREDO_LIST_SHARDS;
+	const unsigned ipc = teredo_slab_arena_objects (sizeof (teredo_listitem));
+	const unsigned cpc = teredo_slab_arena_objects (sizeof (teredo_listcold));
+	unsigned best = 0;
+
+	*slotsp = 0;
+
+#ifdef HAVE_LIBJUDY
+	/* The Judy index is allocated from the heap */
+	const size_t min = 0, max = 0;
+#else
+	/* A bigger index table allows more peers, at the expense of records */
+	const size_t min = 16, max = per_shard / sizeof (teredo_addrmap_slot);
+#endif
+	for (size_t slots = min; slots <= max; slots = slots ? 2 * slots : 1)
+	{
+		size_t table = slots * sizeof (teredo_addrmap_slot);
+		size_t chunks = (per_shard - table) / TEREDO_ARENA_CHUNK;
+
+		/* Slack for the partially used chunks of uneven shards */
+		if (chunks <= 2)
+			continue;
+		chunks -= 2;
+
+		/* Records split between hot and cold chunks */
+		uint64_t n = (uint64_t)chunks * ipc * cpc / (ipc + cpc);
+		while ((n > 0)
+		 && (((n + ipc - 1) / ipc) + ((n + cpc - 1) / cpc) > chunks))
+			n--;
+		if ((slots != 0) && (n > 3 * slots / 4))
+			n = 3 * slots / 4; /* load factor at most 3/4 */
+		if (n > UINT_MAX / TEREDO_LIST_SHARDS)
+			n = UINT_MAX / TEREDO_LIST_SHARDS;
+
+		if (n > best)
+		{
+			best = n;
+			*slotsp = slots;
+		}
+		if (slots == 0)
+			break;
+	}
+	return best;
+}
+
+
+int teredo_list_set_budget (teredo_peerlist *l, size_t bytes)
+{
+	size_t slots;
+	unsigned per_shard = list_budget_peers (bytes, &slots);
+
+	if (per_shard == 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	teredo_arena *arena = malloc (sizeof (*arena));
+	if (arena == NULL)
+		return -1;
+	if (teredo_arena_init (arena, bytes))
+	{
+		free (arena);
+		return -1;
+	}
+
+	/* Empties the list, and returns its memory to the system */
+	teredo_list_reset (l, 0);
+
+	teredo_arena *old = l->arena;
+	for (unsigned i = 0; i < TEREDO_LIST_SHARDS; i++)
+		pthread_mutex_lock (&l->shards[i].lock);
+
+	l->arena = arena;
+	l->arena_max = per_shard * TEREDO_LIST_SHARDS;
+	for (unsigned i = 0; i < TEREDO_LIST_SHARDS; i++)
+	{
+		teredo_listshard *s = l->shards + i;
+
+		teredo_slab_destroy (&s->items);
+		teredo_slab_destroy (&s->colds);
+		listshard_slabs_init (l, s);
+#ifndef HAVE_LIBJUDY
+		teredo_addrmap_destroy (&s->map);
+		teredo_addrmap_init_fixed (&s->map,
+		                           teredo_arena_alloc_table (arena,
+		                                 slots * sizeof (teredo_addrmap_slot)),
+		                           slots);
+#endif
+	}
+	list_set_max (l, l->arena_max);
+
+	for (unsigned i = TEREDO_LIST_SHARDS; i-- > 0;)
+		pthread_mutex_unlock (&l->shards[i].lock);
+
+	if (old != NULL)
+	{
+		teredo_arena_destroy (old);
+		free (old);
+	}
+	return l->arena_max;
+}
+
+
+void teredo_list_set_queue_size (teredo_peerlist *l, size_t bytes)
+{
+	teredo_queue_pool *pool = &l->pool;
+
+	pthread_mutex_lock (&pool->lock);
+	teredo_slab_destroy (&pool->queues);
+	teredo_queue_pool_setup (pool, bytes);
+	pthread_mutex_unlock (&pool->lock);
+}
+
+
+void teredo_list_destroy (teredo_peerlist *l)
+{
+	l->reserved = 0;
+	teredo_list_reset (l, 0);
+
+	if (l->has_gc)
+	{
+		pthread_cancel (l->gc);
+		pthread_join (l->gc, NULL);
+	}
+	for (unsigned i = 0; i < TEREDO_LIST_SHARDS; i++)
+	{
+		pthread_mutex_destroy (&l->shards[i].lock);
+		for (unsigned j = 0; j < 3; j++)
+			teredo_bloom_destroy (l->shards[i].filters + j);
+	}
+	teredo_queue_pool_destroy (&l->pool);
+	if (l->arena != NULL)
+	{
+		teredo_arena_destroy (l->arena);
+		free (l->arena);
+	}
+
+	free (l);
+}
+
+
+/**
+ * Accounts for the use of a peer found in the list. The shard must be locked.
+ */
+static void listshard_hit (teredo_listshard *s, teredo_listitem *p,
+                           const struct in6_addr *addr, uint32_t hash)
+{
+	/* moves peer to the "recent" generation */
+	if (p->gen != s->gen)
+	{
+		generation_unlink (p);
+		generation_push (s, p, hash);
+	}
+
+	if (p->probation && (s->prob_head != p))
+	{
+		probation_unlink (s, p);
+		probation_push (s, p, teredo_clock ());
+	}
+	else if (p->probation)
+		p->cold->prob_time = teredo_clock ();
+
+	(void)addr;
+	TEREDO_PROBE (peer_hit, addr);
+}
+
+
+teredo_peer *teredo_list_lookup (teredo_peerlist *restrict list,
+                                 const struct in6_addr *restrict addr,
+                                 bool *restrict create)
+{
+	uint32_t hash = teredo_addr_hash ((const union teredo_addr *)addr);
+	teredo_listshard *s = list->shards + listshard_index (hash);
+	teredo_listitem *p;
+
+	if ((create == NULL) && !listshard_filter (s, hash))
+	{
+		teredo_stat_inc (TEREDO_STAT_PEERS_FILTERED);
+		TEREDO_PROBE (peer_miss, addr);
+		return NULL; /* definitely not in list */
+	}
+
+	pthread_mutex_lock (&s->lock);
+
+#ifdef HAVE_LIBJUDY
+	teredo_listitem **pp = NULL;
+
+	/* Judy dynamic array-based fast lookup */
+	{
+		void *PValue;
+
+		if (create != NULL)
+		{
+			JHSI (PValue, s->PJHSArray, (uint8_t *)addr, 16);
+			if (PValue == PJERR)
+				goto error; /* out of memory */
+			pp = (teredo_listitem **)PValue;
+			p = *pp;
+		}
+		else
+		{
+			JHSG (PValue, s->PJHSArray, (uint8_t *)addr, 16);
+			pp = (teredo_listitem **)PValue;
+			p = (pp != NULL) ? *pp : NULL;
+		}
+
+	}
+#else
+	/* Open-addressing hash table lookup */
+	p = teredo_addrmap_get_hashed (&s->map, (const union teredo_addr *)addr,
+	                               hash);
+#endif
+
+	if (p != NULL)
+	{
+		/* peer was already in list */
+		if (create != NULL)
+			*create = false;
+
+		listshard_hit (s, p, addr, hash);
+		return &p->peer;
 	}
 
 	/* otherwise, peer was not in list */
 	assert (p == NULL);
+	TEREDO_PROBE (peer_miss, addr);
 	if (create == NULL)
 		goto error; /* not found and not created */
 	*create = true;
 
 	/* Allocates a new peer entry */
-	if (list->left > 0)
-		p = listitem_create ();
+	if (list_reserve (list))
+	{
+		p = listitem_create (list, s);
+		if (p == NULL)
+			atomic_fetch_add_explicit (&list->left, 1,
+			                           memory_order_relaxed);
+	}
+	else
+	{
+		/* List full: takes the place of an expired peer, or of a peer
+		 * on probation */
+		p = listshard_evict (list, s);
+#ifdef HAVE_LIBJUDY
+		if (p != NULL)
+		{	/* The index slot may have moved */
+			void *PValue;
+
+			JHSG (PValue, s->PJHSArray, (uint8_t *)addr, 16);
+			pp = (teredo_listitem **)PValue;
+			assert (pp != NULL);
+		}
+#endif
+	}
+
+#ifndef HAVE_LIBJUDY
+	if ((p != NULL)
+	 && teredo_addrmap_insert (&s->map, (const union teredo_addr *)addr, p))
+	{
+		listitem_destroy (list, s, p);
+		atomic_fetch_add_explicit (&list->left, 1, memory_order_relaxed);
+		p = NULL;
+	}
+#endif
 
 	if (p == NULL)
 	{
 #ifdef HAVE_LIBJUDY
 		int Rc_int;
-		JHSD (Rc_int, list->PJHSArray, (uint8_t *)addr, sizeof (*addr));
-#else
-		tdelete (addr, &list->root, listitem_cmp);
+		JHSD (Rc_int, s->PJHSArray, (uint8_t *)addr, sizeof (*addr));
 #endif
+		teredo_stat_inc (TEREDO_STAT_PEERS_LIST_FULL);
+		TEREDO_PROBE (peer_full, addr);
 		goto error; /* out of memory */
 	}
 
-	/* Puts new entry at the head of the list */
-	p->next = list->recent;
-	if (p->next != NULL)
-		p->next->pprev = &p->next;
-
-	p->pprev = &list->recent;
-	list->recent = p;
-	p->pprev = &list->recent;
-
-	list->left--;
-
-	assert (*(p->pprev) == p);
-	assert ((p->next == NULL) || (p->next->pprev == &p->next));
+	teredo_stat_inc (TEREDO_STAT_PEERS_ADDED);
+	TEREDO_PROBE (peer_create, addr);
+	/* Puts new entry in the recent generation */
+	p->cold->key.ip6 = *addr;
+	p->cold->setup_pending = false;
+	/* Items are recycled: a stale timer bit would stall the peer */
+	p->peer.scheduled = 0;
+	generation_push (s, p, hash);
+	probation_push (s, p, teredo_clock ());
 
+#ifdef HAVE_LIBJUDY
 	*pp = p;
-	p->key.ip6 = *addr;
+#endif
 	return &p->peer;
 
 error:
-	pthread_mutex_unlock (&list->lock);
+	pthread_mutex_unlock (&s->lock);
 	return NULL;
 }
 
 
-void teredo_list_release (teredo_peerlist *l)
+#define TEREDO_LOOKUP_BATCH 64
+
+void teredo_list_lookup_batch (teredo_peerlist *restrict list,
+                               const struct in6_addr *const *addrs,
+                               unsigned n, teredo_lookup_cb cb, void *opaque)
+{
+	for (unsigned base = 0; base < n; base += TEREDO_LOOKUP_BATCH)
+	{
+		unsigned count = n - base;
+		if (count > TEREDO_LOOKUP_BATCH)
+			count = TEREDO_LOOKUP_BATCH;
+
+		uint32_t hash[TEREDO_LOOKUP_BATCH];
+		uint8_t order[TEREDO_LOOKUP_BATCH];
+		bool miss[TEREDO_LOOKUP_BATCH];
+		unsigned first[TEREDO_LIST_SHARDS + 1];
+
+		/* Counting sort of the addresses by shard, minus definite misses */
+		memset (first, 0, sizeof (first));
+		for (unsigned i = 0; i < count; i++)
+		{
+			hash[i] = teredo_addr_hash ((const union teredo_addr *)
+			                            addrs[base + i]);
+
+			unsigned k = listshard_index (hash[i]);
+			if (listshard_filter (list->shards + k, hash[i]))
+				first[k + 1]++;
+			else
+			{
+				teredo_stat_inc (TEREDO_STAT_PEERS_FILTERED);
+				TEREDO_PROBE (peer_miss, addrs[base + i]);
+				cb (opaque, base + i, NULL);
+				miss[i] = true;
+				continue;
+			}
+			miss[i] = false;
+		}
+		for (unsigned i = 0; i < TEREDO_LIST_SHARDS; i++)
+			first[i + 1] += first[i];
+
+		unsigned pos[TEREDO_LIST_SHARDS];
+		memcpy (pos, first, sizeof (pos));
+		for (unsigned i = 0; i < count; i++)
+			if (!miss[i])
+				order[pos[listshard_index (hash[i])]++] = i;
+
+		for (unsigned k = 0; k < TEREDO_LIST_SHARDS; k++)
+		{
+			unsigned lo = first[k], hi = first[k + 1];
+			if (lo == hi)
+				continue;
+
+			teredo_listshard *s = list->shards + k;
+			teredo_listitem *items[TEREDO_LOOKUP_BATCH];
+
+			pthread_mutex_lock (&s->lock);
+#ifndef HAVE_LIBJUDY
+			for (unsigned j = lo; j < hi; j++)
+				teredo_addrmap_prefetch (&s->map, hash[order[j]]);
+#endif
+			/* Finds all peers first, and prefetch their records */
+			for (unsigned j = lo; j < hi; j++)
+			{
+				unsigned i = order[j];
+				teredo_listitem *p;
+#ifdef HAVE_LIBJUDY
+				void *PValue;
+
+				JHSG (PValue, s->PJHSArray, (uint8_t *)addrs[base + i], 16);
+				p = (PValue != NULL) ? *(teredo_listitem **)PValue : NULL;
+#else
+				p = teredo_addrmap_get_hashed (&s->map,
+				                               (const union teredo_addr *)
+				                               addrs[base + i], hash[i]);
+#endif
+#ifdef __GNUC__
+				if (p != NULL)
+					__builtin_prefetch (p);
+#endif
+				items[j - lo] = p;
+			}
+
+			for (unsigned j = lo; j < hi; j++)
+			{
+				unsigned i = order[j];
+				teredo_listitem *p = items[j - lo];
+
+				if (p != NULL)
+					listshard_hit (s, p, addrs[base + i], hash[i]);
+				else
+					TEREDO_PROBE (peer_miss, addrs[base + i]);
+				cb (opaque, base + i, (p != NULL) ? &p->peer : NULL);
+			}
+			pthread_mutex_unlock (&s->lock);
+		}
+	}
+}
+
+
+/**
+ * Marks a peer as trusted, and takes it off probation.
+ * @param setup whether to account for the peer setup latency, from the
+ * first queued packet (peers trusted straight away are not accounted)
+ */
+static void listitem_trust (teredo_peerlist *l, teredo_listitem *p,
+                            bool setup)
+{
+	p->peer.trusted = 1;
+	if (p->probation)
+	{
+		teredo_listcold *c = p->cold;
+
+		probation_unlink (l->shards + p->shard, p);
+		if (setup && c->setup_pending)
+			teredo_hist_record (TEREDO_HIST_PEER_SETUP,
+			                    (uint32_t)(teredo_hist_now ()
+			                               - c->setup_start));
+		c->setup_pending = false;
+	}
+}
+
+
+void teredo_list_trust (teredo_peerlist *l, teredo_peer *peer)
+{
+	listitem_trust (l, listitem_of (peer), true);
+}
+
+
+void teredo_list_release (teredo_peerlist *l, teredo_peer *peer)
 {
-	pthread_mutex_unlock (&l->lock);
+	pthread_mutex_unlock (&l->shards[listitem_of (peer)->shard].lock);
+}
+
+
+/*** Peers list snapshots ***/
+
+/*
+ * A snapshot is a header followed by an array of fixed-size records, so
+ * that it can be mapped and scanned in place. Integers are in host byte
+ * order (snapshots are not meant to move across hosts) except for
+ * addresses and ports. Ages are relative to the save time (wall clock), as
+ * the Teredo clock does not survive a reboot.
+ */
+#define TEREDO_SNAPSHOT_MAGIC "TEREDOPL"
+#define TEREDO_SNAPSHOT_VERSION 1
+
+struct teredo_snapshot_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t count; /* number of records */
+	uint64_t saved; /* time() when saved */
+	uint32_t local_ip; /* local UDP/IPv4 address */
+	uint16_t local_port;
+	uint16_t reserved;
+};
+
+struct teredo_snapshot_record
+{
+	uint8_t addr[16]; /* peer Teredo or IPv6 address */
+	uint32_t mapped_addr;
+	uint32_t age; /* seconds since last reception */
+	uint16_t mapped_port;
+	uint8_t trusted;
+	uint8_t reserved;
+};
+
+static_assert (sizeof (struct teredo_snapshot_header) == 32,
+               "Snapshot header padding");
+static_assert (sizeof (struct teredo_snapshot_record) == 28,
+               "Snapshot record padding");
+
+
+struct teredo_snapshot_buf
+{
+	struct teredo_snapshot_record *records;
+	size_t count, size;
+};
+
+/**
+ * Appends the recent and old peers of a shard to an array of records.
+ * The shard must be locked.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int listshard_save (teredo_listshard *s, teredo_clock_t now,
+                           struct teredo_snapshot_buf *b)
+{
+	teredo_listitem *const gens[2] = { s->recent, s->old };
+
+	for (unsigned i = 0; i < 2; i++)
+		for (teredo_listitem *p = gens[i]; p != NULL; p = p->cold->next)
+		{
+			uint32_t age = teredo_peer_age (p->peer.last_rx, now);
+			if (age > TEREDO_TIMEOUT)
+				continue; /* not worth saving */
+
+			if (b->count >= b->size)
+			{
+				size_t n = b->size ? (2 * b->size) : 256;
+				void *buf = realloc (b->records, n * sizeof (*b->records));
+				if (buf == NULL)
+					return -1;
+				b->records = buf;
+				b->size = n;
+			}
+
+			struct teredo_snapshot_record *r = b->records + b->count++;
+
+			memcpy (r->addr, &p->cold->key, 16);
+			r->mapped_addr = p->peer.mapped_addr;
+			r->age = age;
+			r->mapped_port = p->peer.mapped_port;
+			r->trusted = p->peer.trusted;
+			r->reserved = 0;
+		}
+	return 0;
+}
+
+
+int teredo_list_save (teredo_peerlist *l, int fd, uint32_t ip, uint16_t port)
+{
+	struct teredo_snapshot_buf b = { NULL, 0, 0 };
+	teredo_clock_t now = teredo_clock ();
+
+	for (unsigned i = 0; i < TEREDO_LIST_SHARDS; i++)
+	{
+		teredo_listshard *s = l->shards + i;
+
+		pthread_mutex_lock (&s->lock);
+		int val = listshard_save (s, now, &b);
+		pthread_mutex_unlock (&s->lock);
+
+		if (val)
+		{
+			free (b.records);
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	struct teredo_snapshot_header h;
+
+	memset (&h, 0, sizeof (h));
+	memcpy (h.magic, TEREDO_SNAPSHOT_MAGIC, sizeof (h.magic));
+	h.version = TEREDO_SNAPSHOT_VERSION;
+	h.count = b.count;
+	h.saved = time (NULL);
+	h.local_ip = ip;
+	h.local_port = port;
+
+	size_t len = b.count * sizeof (*b.records);
+	struct iovec iov[2] = {
+		{ .iov_base = &h, .iov_len = sizeof (h) },
+		{ .iov_base = b.records, .iov_len = len },
+	};
+	int val = -1;
+
+	len += sizeof (h);
+	if ((ftruncate (fd, 0) == 0) && (lseek (fd, 0, SEEK_SET) == 0)
+	 && (writev (fd, iov, 2) == (ssize_t)len))
+		val = b.count;
+	free (b.records);
+	return val;
+}
+
+
+int teredo_list_load (teredo_peerlist *l, int fd, uint32_t ip, uint16_t port)
+{
+	struct stat st;
+
+	if (fstat (fd, &st))
+		return -1;
+	if ((size_t)st.st_size < sizeof (struct teredo_snapshot_header))
+		return 0; /* empty file: no snapshot yet */
+
+	const struct teredo_snapshot_header *h;
+	void *map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	h = map;
+	const struct teredo_snapshot_record *r = (const void *)(h + 1);
+
+	if (memcmp (h->magic, TEREDO_SNAPSHOT_MAGIC, sizeof (h->magic))
+	 || (h->version != TEREDO_SNAPSHOT_VERSION)
+	 || (h->count > ((st.st_size - sizeof (*h)) / sizeof (*r))))
+	{
+		munmap (map, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Trust only holds if the peers still see the same local mapping */
+	bool trust = (h->local_ip == ip) && (h->local_port == port);
+	uint64_t wall = time (NULL);
+	uint32_t elapsed = (wall > h->saved) ? (wall - h->saved) : 0;
+	teredo_clock_t now = teredo_clock ();
+	int count = 0;
+
+	for (uint32_t i = 0; i < h->count; i++, r++)
+	{
+		if ((elapsed > TEREDO_TIMEOUT)
+		 || (r->age > (TEREDO_TIMEOUT - elapsed)))
+			continue; /* stale */
+
+		struct in6_addr addr;
+		bool created;
+
+		memcpy (&addr, r->addr, sizeof (addr));
+		teredo_peer *p = teredo_list_lookup (l, &addr, &created);
+		if (p == NULL)
+			break; /* list full */
+
+		if (created)
+		{
+			memset (p, 0, sizeof (*p));
+			SetMapping (p, r->mapped_addr, r->mapped_port);
+			TouchReceive (p, now - (r->age + elapsed));
+			TouchTransmit (p, now - (r->age + elapsed));
+			if (trust && r->trusted)
+				listitem_trust (l, listitem_of (p), false);
+			count++;
+		}
+		teredo_list_release (l, p);
+	}
+
+	munmap (map, st.st_size);
+	return count;
+}
+
+
+/*** Peers list dump ***/
+
+/*
+ * Copy of a peer taken under its shard lock. Peers are copied one shard
+ * at a time, and only formatted once the shard is unlocked, so that
+ * packet threads never wait for the (much slower) text output, and only
+ * ever for the shard being copied.
+ */
+struct teredo_dump_record
+{
+	union teredo_addr key;
+	teredo_peer peer;
+	uint32_t queued_bytes;
+	uint16_t queued; /* packets */
+	uint8_t gen; /* 0: recent, 1: old, 2: expired */
+	bool probation;
+};
+
+struct teredo_dump_buf
+{
+	struct teredo_dump_record *records;
+	size_t count, size;
+};
+
+/**
+ * Copies all peers of a shard. The shard must be locked.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int listshard_copy (teredo_listshard *s, struct teredo_dump_buf *b)
+{
+	teredo_listitem *const gens[3] = { s->recent, s->old, s->expired };
+
+	for (unsigned i = 0; i < 3; i++)
+		for (teredo_listitem *p = gens[i]; p != NULL; p = p->cold->next)
+		{
+			if (b->count >= b->size)
+			{
+				size_t n = b->size ? (2 * b->size) : 256;
+				void *buf = realloc (b->records, n * sizeof (*b->records));
+				if (buf == NULL)
+					return -1;
+				b->records = buf;
+				b->size = n;
+			}
+
+			struct teredo_dump_record *r = b->records + b->count++;
+			const teredo_queue *q = p->cold->queue;
+
+			r->key = p->cold->key;
+			r->peer = p->peer;
+			r->queued = (q != NULL) ? q->count : 0;
+			r->queued_bytes = (q != NULL) ? q->bytes : 0;
+			r->gen = i;
+			r->probation = p->probation;
+		}
+	return 0;
+}
+
+
+int teredo_list_dump (teredo_peerlist *l, int fd)
+{
+	static const char *const gens[3] = { "recent", "old", "expired" };
+	struct teredo_dump_buf b = { NULL, 0, 0 };
+	int count = 0;
+
+	if ((ftruncate (fd, 0) != 0) || (lseek (fd, 0, SEEK_SET) != 0))
+		return -1;
+
+	int dfd = dup (fd);
+	if (dfd == -1)
+		return -1;
+
+	FILE *stream = fdopen (dfd, "w");
+	if (stream == NULL)
+	{
+		close (dfd);
+		return -1;
+	}
+
+	fputs ("# address mapping state generation rx_age tx_age bubbles pings"
+	       " queued queued_bytes shard\n", stream);
+
+	for (unsigned i = 0; i < TEREDO_LIST_SHARDS; i++)
+	{
+		teredo_listshard *s = l->shards + i;
+
+		b.count = 0;
+		pthread_mutex_lock (&s->lock);
+		int val = listshard_copy (s, &b);
+		pthread_mutex_unlock (&s->lock);
+
+		if (val)
+		{
+			errno = ENOMEM;
+			count = -1;
+			break;
+		}
+
+		teredo_clock_t now = teredo_clock ();
+
+		for (size_t j = 0; j < b.count; j++)
+		{
+			const struct teredo_dump_record *r = b.records + j;
+			char addr[INET6_ADDRSTRLEN], mapped[INET_ADDRSTRLEN];
+
+			inet_ntop (AF_INET6, &r->key, addr, sizeof (addr));
+			inet_ntop (AF_INET, &r->peer.mapped_addr, mapped,
+			           sizeof (mapped));
+			fprintf (stream, "%s %s:%u %s %s %"PRIu32" %"PRIu32
+			         " %u %u %u %"PRIu32" %u\n", addr, mapped,
+			         (unsigned)ntohs (r->peer.mapped_port),
+			         r->peer.trusted ? "trusted"
+			                         : r->probation ? "probation"
+			                                        : "untrusted",
+			         gens[r->gen], teredo_peer_age (r->peer.last_rx, now),
+			         teredo_peer_age (r->peer.last_tx, now),
+			         (unsigned)r->peer.bubbles, (unsigned)r->peer.pings,
+			         (unsigned)r->queued, r->queued_bytes, i);
+		}
+		count += b.count;
+	}
+	free (b.records);
+
+	/* The trailer tells readers that the dump is complete */
+	if (count >= 0)
+		fprintf (stream, "# end: %d peers, %u shards\n", count,
+		         (unsigned)TEREDO_LIST_SHARDS);
+	if (fclose (stream) && (count >= 0))
+		count = -1;
+	return count;
 }
@@ -24,22 +24,28 @@
 # define LIBTEREDO_PEERLIST_H
 
 # define TEREDO_TIMEOUT 30 // seconds
-# define MAXQUEUE 1280u // bytes
+# define MAXQUEUE 1280u // default bytes per peer queue
 
 typedef struct teredo_queue teredo_queue;
 
+/*
+ * Peer state checked for every forwarded packet. This is kept small so
+ * that it fits in a cache line along with the list internals (see
+ * peerlist.c). The packets queue lives elsewhere.
+ * Timestamps are truncated to 32 bits: use teredo_peer_age() to compare
+ * them with the current time.
+ */
 typedef struct teredo_peer
 {
-	teredo_queue *queue;
-	size_t queue_left;
-	teredo_clock_t last_rx;
-	teredo_clock_t last_tx;
+	uint32_t last_rx;
+	uint32_t last_tx;
 	uint32_t mapped_addr;
 	uint16_t mapped_port;
 	unsigned trusted:1;
 	unsigned bubbles:3;
 	unsigned pings:3;
-	unsigned last_ping:9;
+	unsigned last_ping:8;
+	unsigned scheduled:1; /* retransmission timer pending (relay.c) */
 } teredo_peer;
 
 
@@ -49,14 +55,22 @@ typedef void (*teredo_dequeue_cb) (void *, const void *, size_t);
 extern "C" {
 #endif
 
-void teredo_enqueue_in (teredo_peer *restrict peer, const void *restrict data,
+typedef struct teredo_peerlist teredo_peerlist;
+
+void teredo_enqueue_in (teredo_peerlist *restrict list,
+                        teredo_peer *restrict peer, const void *restrict data,
                         size_t len, uint32_t ip, uint16_t port);
 
-void teredo_enqueue_out (teredo_peer *restrict peer,
+void teredo_enqueue_out (teredo_peerlist *restrict list,
+                         teredo_peer *restrict peer,
                          const void *restrict data, size_t len);
 teredo_queue *teredo_peer_queue_yield (teredo_peer *peer);
-void teredo_queue_emit (teredo_queue *q, int fd, uint32_t ipv4, uint16_t port,
+bool teredo_peer_queued (const teredo_peer *peer);
+void teredo_queue_emit (teredo_peerlist *list, teredo_queue *q, int fd,
+                        uint32_t ipv4, uint16_t port,
                         teredo_dequeue_cb cb, void *r);
+void teredo_queue_discard (teredo_peerlist *list, teredo_queue *q,
+                           teredo_dequeue_cb cb, void *opaque);
 
 #ifdef __cplusplus
 }
@@ -79,15 +93,22 @@ static inline void TouchTransmit (teredo_peer *peer, teredo_clock_t now)
 }
 
 
+/**
+ * @return the number of seconds elapsed since a peer timestamp.
+ */
+static inline uint32_t teredo_peer_age (uint32_t stamp, teredo_clock_t now)
+{
+	return (uint32_t)now - stamp;
+}
+
+
 static inline
 bool IsValid (const teredo_peer *peer, teredo_clock_t now)
 {
-	return (now - peer->last_rx) <= 30;
+	return teredo_peer_age (peer->last_rx, now) <= 30;
 }
 
 
-typedef struct teredo_peerlist teredo_peerlist;
-
 struct in6_addr;
 
 # ifdef __cplusplus
@@ -105,6 +126,56 @@ extern "C" {
  */
 teredo_peerlist *teredo_list_create (unsigned max, unsigned expiration);
 
+/**
+ * Creates an empty peer list like teredo_list_create(), but without its
+ * garbage collector thread: teredo_list_gc() must then be called every
+ * @p expiration seconds instead.
+ */
+teredo_peerlist *teredo_list_create_manual (unsigned max,
+                                            unsigned expiration);
+
+/**
+ * Runs one pass of the garbage collector of a list created with
+ * teredo_list_create_manual(). Peers are removed by the second pass
+ * without any activity.
+ */
+void teredo_list_gc (teredo_peerlist *list);
+
+
+/**
+ * Changes the maximum number of peers of a list, keeping its peers
+ * (unlike teredo_list_reset()). If there are more peers than the new
+ * maximum already, no new peers are added until enough have expired.
+ * Memory is not preallocated for the extra peers, if any.
+ */
+void teredo_list_set_limit (teredo_peerlist *list, unsigned max);
+
+/**
+ * Allocates memory for a number of peers upfront. The reservation is
+ * renewed whenever the list is reset.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+int teredo_list_reserve (teredo_peerlist *list, unsigned count);
+
+/**
+ * Preallocates all peer records and index tables from a single arena of
+ * a given size, allocated and faulted in at once from huge pages if
+ * possible. The maximum number of peers is then derived from that
+ * budget, and later resets cannot exceed it. Existing peers are removed.
+ * The list must not be in use.
+ *
+ * @return the maximum number of peers, or -1 on error (e.g. the budget is
+ * too small or cannot be allocated).
+ */
+int teredo_list_set_budget (teredo_peerlist *list, size_t bytes);
+
+/**
+ * Sets how many bytes of packets can be queued for each peer
+ * (MAXQUEUE by default). No packets must be queued in the list.
+ */
+void teredo_list_set_queue_size (teredo_peerlist *list, size_t bytes);
+
 
 /**
  * Destroys an existing unlocked list.
@@ -123,10 +194,11 @@ void teredo_list_reset (teredo_peerlist *list, unsigned max);
 
 
 /**
- * Locks the list and looks up a peer in an unlocked list.
- * On success, the list must be unlocked with teredo_list_release(), otherwise
- * the next call to teredo_list_lookup will deadlock. Unlocking the list after
- * a failure is not defined.
+ * Locks the list shard of a peer and looks up that peer.
+ * On success, the shard must be unlocked with teredo_list_release(),
+ * otherwise the next lookup in the same shard will deadlock. Unlocking the
+ * list after a failure is not defined. Lookups of unknown peers without
+ * creation are mostly answered by the shard filter, without locking.
  *
  * @param list peers list
  * @param addr IPv6 address of the peer to search for
@@ -142,11 +214,76 @@ teredo_peer *teredo_list_lookup (teredo_peerlist *restrict list,
                                  const struct in6_addr *restrict addr,
                                  bool *restrict create);
 
+typedef void (*teredo_lookup_cb) (void *, unsigned, teredo_peer *);
+
+/**
+ * Looks up several existing peers at once. The addresses are hashed and
+ * grouped by list shard first. Then each shard is locked only once for all
+ * of its peers, and their index slots are prefetched before any of them is
+ * looked up, so that cache misses overlap rather than add up.
+ *
+ * @p cb is called for each address, in no particular order, with the
+ * index of the address, and the peer (or NULL if not found). The peer shard
+ * may be locked meanwhile: the callback must neither look up nor release
+ * peers. Addresses the shard filter rules out are reported without locking.
+ *
+ * @param addrs IPv6 addresses of the peers to search for
+ * @param n number of addresses
+ */
+void teredo_list_lookup_batch (teredo_peerlist *restrict list,
+                               const struct in6_addr *const *addrs,
+                               unsigned n, teredo_lookup_cb cb, void *opaque);
+
+/**
+ * Marks a peer as trusted. Until then, a peer is on probation, and may be
+ * evicted to make room for new peers if the list is full.
+ * The peer shard must be locked (by teredo_list_lookup()).
+ */
+void teredo_list_trust (teredo_peerlist *list, teredo_peer *peer);
+
+/**
+ * Writes a snapshot of the recently used peers to a file. The snapshot
+ * replaces the previous file contents.
+ *
+ * @param fd file descriptor (opened for writing)
+ * @param ip local UDP/IPv4 address of the list owner (network byte order)
+ * @param port local UDP port of the list owner (network byte order)
+ *
+ * @return the number of saved peers, or -1 on error.
+ */
+int teredo_list_save (teredo_peerlist *list, int fd,
+                      uint32_t ip, uint16_t port);
+
+/**
+ * Adds the peers from a snapshot written by teredo_list_save() to the
+ * list. Peers that have not been heard from for more than TEREDO_TIMEOUT
+ * seconds, including the time elapsed since the snapshot, are skipped, as
+ * are peers already in the list. Peers are only trusted if the local address
+ * and port match those of the snapshot.
+ *
+ * @return the number of loaded peers, or -1 on error (e.g. invalid file).
+ */
+int teredo_list_load (teredo_peerlist *list, int fd,
+                      uint32_t ip, uint16_t port);
+
+/**
+ * Writes all peers of the list to a file as text, one line per peer, for
+ * debugging. The dump replaces the previous file contents. Shards are
+ * locked one at a time, only while their peers are copied, so the dump
+ * is consistent per shard but not across shards.
+ *
+ * @param fd file descriptor (opened for writing)
+ *
+ * @return the number of peers, or -1 on error.
+ */
+int teredo_list_dump (teredo_peerlist *list, int fd);
+
 /**
- * Unlocks a list that was locked by teredo_list_lookup().
+ * Unlocks the list shard that was locked by teredo_list_lookup().
  * @param list peers list
+ * @param peer peer returned by teredo_list_lookup()
  */
-void teredo_list_release (teredo_peerlist *list);
+void teredo_list_release (teredo_peerlist *list, teredo_peer *peer);
 
 # ifdef __cplusplus
 }
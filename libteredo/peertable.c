@@ -0,0 +1,363 @@
+/*
+ * peertable.c - Peer mappings shared between processes
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "teredo.h"
+#include "tunnel.h"
+#include "addrmap.h" // teredo_addr_hash()
+#include "peertable.h"
+
+#define TEREDO_PEERTABLE_MAGIC "TEREDOPT"
+#define TEREDO_PEERTABLE_VERSION 1
+#define TEREDO_PEERTABLE_SHARDS 64
+#define TEREDO_PEERTABLE_WAYS 4
+#define TEREDO_PEERTABLE_MAX (1 << 24) /* entries */
+
+struct teredo_peertable_slot
+{
+	uint8_t addr[16];
+	teredo_peertable_entry entry;
+};
+
+struct teredo_peertable_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t buckets; /* power of two */
+	atomic_uint ready; /* set once initialized by the creator */
+};
+
+union teredo_peertable_shard
+{
+	pthread_mutex_t lock;
+	char pad[64]; /* one lock per cache line */
+};
+
+typedef struct teredo_peertable_slot
+	teredo_peertable_bucket[TEREDO_PEERTABLE_WAYS];
+
+static_assert (sizeof (struct teredo_peertable_slot) == 32,
+               "Wrong shared peer entry size");
+static_assert (sizeof (pthread_mutex_t) <= 64, "Mutex too big");
+
+struct teredo_peertable
+{
+	void *map;
+	size_t size;
+	struct teredo_peertable_header *header;
+	union teredo_peertable_shard *shards;
+	teredo_peertable_bucket *buckets;
+	uint32_t mask; /* number of buckets - 1 */
+};
+
+
+static size_t peertable_size (uint32_t buckets)
+{
+	return sizeof (struct teredo_peertable_header)
+	       + TEREDO_PEERTABLE_SHARDS * sizeof (union teredo_peertable_shard)
+	       + (size_t)buckets * sizeof (teredo_peertable_bucket);
+}
+
+
+static void peertable_layout (teredo_peertable *t, uint32_t buckets)
+{
+	t->header = t->map;
+	t->shards = (void *)(t->header + 1);
+	t->buckets = (void *)(t->shards + TEREDO_PEERTABLE_SHARDS);
+	t->mask = buckets - 1;
+}
+
+
+/**
+ * Initializes a segment that this process has just created.
+ */
+static int peertable_format (teredo_peertable *t, uint32_t buckets)
+{
+	pthread_mutexattr_t attr;
+
+	if (pthread_mutexattr_init (&attr))
+		return -1;
+	pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+	pthread_mutexattr_setrobust (&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+
+	/* The rest of the segment is zero-filled by ftruncate() */
+	for (unsigned i = 0; i < TEREDO_PEERTABLE_SHARDS; i++)
+		pthread_mutex_init (&t->shards[i].lock, &attr);
+	pthread_mutexattr_destroy (&attr);
+
+	memcpy (t->header->magic, TEREDO_PEERTABLE_MAGIC,
+	        sizeof (t->header->magic));
+	t->header->version = TEREDO_PEERTABLE_VERSION;
+	t->header->buckets = buckets;
+	atomic_store_explicit (&t->header->ready, 1, memory_order_release);
+	return 0;
+}
+
+
+/**
+ * Maps a segment created by another process, once it is initialized.
+ */
+static int peertable_attach (teredo_peertable *t, int fd)
+{
+	struct stat st;
+
+	/* The creator may not have sized the segment yet */
+	for (unsigned tries = 0;; tries++)
+	{
+		if (fstat (fd, &st))
+			return -1;
+		if ((size_t)st.st_size >= sizeof (struct teredo_peertable_header))
+			break;
+		if (tries >= 100)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+		nanosleep (&(struct timespec){ 0, 10000000 }, NULL);
+	}
+
+	t->size = st.st_size;
+	t->map = mmap (NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (t->map == MAP_FAILED)
+		return -1;
+	t->header = t->map;
+
+	for (unsigned tries = 0;
+	     !atomic_load_explicit (&t->header->ready, memory_order_acquire);
+	     tries++)
+	{
+		if (tries >= 100)
+		{
+			errno = EAGAIN;
+			goto error;
+		}
+		nanosleep (&(struct timespec){ 0, 10000000 }, NULL);
+	}
+
+	uint32_t buckets = t->header->buckets;
+	if (memcmp (t->header->magic, TEREDO_PEERTABLE_MAGIC,
+	            sizeof (t->header->magic))
+	 || (t->header->version != TEREDO_PEERTABLE_VERSION)
+	 || (buckets == 0) || (buckets & (buckets - 1))
+	 || (peertable_size (buckets) > t->size))
+	{
+		errno = EINVAL;
+		goto error;
+	}
+
+	peertable_layout (t, buckets);
+	return 0;
+
+error:
+	munmap (t->map, t->size);
+	return -1;
+}
+
+
+teredo_peertable *teredo_peertable_open (const char *name, unsigned capacity)
+{
+#ifdef HAVE_SHM_OPEN
+	if ((capacity == 0) || (capacity > TEREDO_PEERTABLE_MAX))
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	teredo_peertable *t = malloc (sizeof (*t));
+	if (t == NULL)
+		return NULL;
+
+	uint32_t buckets = 1;
+	while (buckets * TEREDO_PEERTABLE_WAYS < capacity)
+		buckets <<= 1;
+
+	int fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd != -1)
+	{	/* New segment */
+		t->size = peertable_size (buckets);
+		if (ftruncate (fd, t->size))
+			goto error;
+
+		t->map = mmap (NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		               fd, 0);
+		if (t->map == MAP_FAILED)
+			goto error;
+
+		peertable_layout (t, buckets);
+		if (peertable_format (t, buckets))
+		{
+			munmap (t->map, t->size);
+			goto error;
+		}
+	}
+	else
+	{	/* Existing segment: its size prevails */
+		if (errno != EEXIST)
+			goto error;
+
+		fd = shm_open (name, O_RDWR | O_CLOEXEC, 0);
+		if ((fd == -1) || peertable_attach (t, fd))
+			goto error;
+	}
+
+	close (fd);
+	return t;
+
+error:
+	if (fd != -1)
+	{
+		int saved_errno = errno;
+		close (fd);
+		errno = saved_errno;
+	}
+	free (t);
+	return NULL;
+#else
+	(void)name; (void)capacity;
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+
+void teredo_peertable_close (teredo_peertable *t)
+{
+	munmap (t->map, t->size);
+	free (t);
+}
+
+
+/**
+ * Locks the shard of a bucket.
+ */
+static void peertable_lock (teredo_peertable *t, uint32_t bucket)
+{
+	union teredo_peertable_shard *s =
+		t->shards + (bucket % TEREDO_PEERTABLE_SHARDS);
+
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+	if (pthread_mutex_lock (&s->lock) == EOWNERDEAD)
+	{
+		/* The owner died, possibly half-way through an update: entries
+		 * of the shard cannot be trusted anymore. */
+		for (uint32_t b = bucket % TEREDO_PEERTABLE_SHARDS; b <= t->mask;
+		     b += TEREDO_PEERTABLE_SHARDS)
+			memset (t->buckets[b], 0, sizeof (t->buckets[b]));
+		pthread_mutex_consistent (&s->lock);
+	}
+#else
+	pthread_mutex_lock (&s->lock);
+#endif
+}
+
+
+static void peertable_unlock (teredo_peertable *t, uint32_t bucket)
+{
+	pthread_mutex_unlock (&t->shards[bucket % TEREDO_PEERTABLE_SHARDS].lock);
+}
+
+
+bool teredo_peertable_lookup (teredo_peertable *restrict t,
+                              const struct in6_addr *restrict addr,
+                              teredo_peertable_entry *restrict entry)
+{
+	uint32_t b = teredo_addr_hash ((const union teredo_addr *)addr)
+	             & t->mask;
+	bool found = false;
+
+	peertable_lock (t, b);
+	for (unsigned i = 0; i < TEREDO_PEERTABLE_WAYS; i++)
+	{
+		const struct teredo_peertable_slot *slot = t->buckets[b] + i;
+
+		if ((slot->entry.seen != 0)
+		 && (memcmp (slot->addr, addr, sizeof (slot->addr)) == 0))
+		{
+			*entry = slot->entry;
+			found = true;
+			break;
+		}
+	}
+	peertable_unlock (t, b);
+	return found;
+}
+
+
+void teredo_peertable_publish (teredo_peertable *restrict t,
+                               const struct in6_addr *restrict addr,
+                               const teredo_peertable_entry *restrict entry)
+{
+	uint32_t b = teredo_addr_hash ((const union teredo_addr *)addr)
+	             & t->mask;
+	struct teredo_peertable_slot *victim = NULL;
+
+	assert (entry->seen != 0);
+
+	peertable_lock (t, b);
+	for (unsigned i = 0; i < TEREDO_PEERTABLE_WAYS; i++)
+	{
+		struct teredo_peertable_slot *slot = t->buckets[b] + i;
+
+		if (slot->entry.seen == 0)
+		{	/* Free entries are used first */
+			if ((victim == NULL) || (victim->entry.seen != 0))
+				victim = slot;
+			continue;
+		}
+		if (memcmp (slot->addr, addr, sizeof (slot->addr)) == 0)
+		{
+			victim = slot;
+			break;
+		}
+		/* Replaces the least recently seen entry otherwise */
+		if ((victim == NULL)
+		 || ((victim->entry.seen != 0)
+		  && ((int32_t)(slot->entry.seen - victim->entry.seen) < 0)))
+			victim = slot;
+	}
+
+	memcpy (victim->addr, addr, sizeof (victim->addr));
+	victim->entry = *entry;
+	peertable_unlock (t, b);
+}
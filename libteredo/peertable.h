@@ -0,0 +1,71 @@
+/**
+ * @file peertable.h
+ * @brief Peer mappings shared between processes
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_PEERTABLE_H
+# define LIBTEREDO_PEERTABLE_H
+
+/*
+ * The shared peer table is a fixed-size set-associative hash table in a
+ * named POSIX shared memory segment. Sibling processes on the same host
+ * publish the trusted mappings they learn into it, and look up the
+ * mappings of peers they do not know yet. Each bucket holds a few
+ * entries, replaced in least recently seen order. Buckets are grouped into
+ * shards, each with a process-shared robust mutex: a process dying with a
+ * shard locked only loses the entries of that shard.
+ *
+ * Timestamps are teredo_clock() values, which are consistent across
+ * processes of the same host as long as the monotonic clock is available.
+ */
+
+typedef struct teredo_peertable_entry
+{
+	uint32_t mapped_addr;
+	uint16_t mapped_port;
+	uint16_t local_port; /* UDP port of the publishing process */
+	uint32_t local_ip; /* IPv4 address of the publishing process */
+	uint32_t seen; /* last receive time (0: free entry) */
+} teredo_peertable_entry;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Looks up the last published mapping of a peer.
+ *
+ * @return true if found, false otherwise.
+ */
+bool teredo_peertable_lookup (teredo_peertable *restrict t,
+                              const struct in6_addr *restrict addr,
+                              teredo_peertable_entry *restrict entry);
+
+/**
+ * Publishes the trusted mapping of a peer, as seen by the calling process.
+ */
+void teredo_peertable_publish (teredo_peertable *restrict t,
+                               const struct in6_addr *restrict addr,
+                               const teredo_peertable_entry *restrict entry);
+
+# ifdef __cplusplus
+}
+# endif
+#endif /* ifndef LIBTEREDO_PEERTABLE_H */
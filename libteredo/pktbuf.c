@@ -0,0 +1,225 @@
+/*
+ * pktbuf.c - Reference-counted packet buffers
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "teredo-udp.h"
+#include "tunnel.h"
+#include "slab.h"
+#include "pktbuf.h"
+
+/* Free buffers per thread beyond which half of them go back to the pool */
+#define PKTBUF_CACHE_MAX 64
+#define PKTBUF_CHUNK 32
+
+struct pktbuf_cache
+{
+	teredo_pktbuf *head;
+	unsigned count;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static teredo_slab pool;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+static _Thread_local teredo_pktbuf *current = NULL;
+
+
+/**
+ * Returns the @a count first cached buffers to the pool.
+ * The pool must be locked.
+ */
+static void pool_put (struct pktbuf_cache *c, unsigned count)
+{
+	while ((count-- > 0) && (c->head != NULL))
+	{
+		teredo_pktbuf *b = c->head;
+
+		c->head = b->next;
+		c->count--;
+		teredo_slab_free (&pool, b);
+	}
+}
+
+
+static void cache_destroy (void *data)
+{
+	struct pktbuf_cache *c = data;
+
+	pthread_mutex_lock (&pool_lock);
+	pool_put (c, c->count);
+	pthread_mutex_unlock (&pool_lock);
+	free (c);
+}
+
+
+static void pool_init (void)
+{
+	teredo_slab_init (&pool, sizeof (teredo_pktbuf), PKTBUF_CHUNK);
+	pthread_key_create (&cache_key, cache_destroy);
+}
+
+
+static struct pktbuf_cache *cache_get (void)
+{
+	pthread_once (&pool_once, pool_init);
+
+	struct pktbuf_cache *c = pthread_getspecific (cache_key);
+	if (c == NULL)
+	{
+		c = malloc (sizeof (*c));
+		if (c == NULL)
+			return NULL;
+		c->head = NULL;
+		c->count = 0;
+		if (pthread_setspecific (cache_key, c))
+		{
+			free (c);
+			return NULL;
+		}
+	}
+	return c;
+}
+
+
+teredo_pktbuf *teredo_pktbuf_alloc (void)
+{
+	struct pktbuf_cache *c = cache_get ();
+	teredo_pktbuf *b;
+
+	if (c == NULL)
+		return NULL;
+
+	if (c->head == NULL)
+	{   /* Refills the thread cache in a bunch */
+		pthread_mutex_lock (&pool_lock);
+		for (unsigned i = 0; i < PKTBUF_CHUNK; i++)
+		{
+			b = teredo_slab_alloc (&pool);
+			if (b == NULL)
+				break;
+			b->next = c->head;
+			c->head = b;
+			c->count++;
+		}
+		pthread_mutex_unlock (&pool_lock);
+
+		if (c->head == NULL)
+			return NULL;
+	}
+
+	b = c->head;
+	c->head = b->next;
+	c->count--;
+	atomic_init (&b->refs, 1);
+	return b;
+}
+
+
+unsigned teredo_pktbuf_recycle (teredo_pktbuf **bufs, unsigned n)
+{
+	unsigned k = 0;
+
+	for (unsigned i = 0; i < n; i++)
+	{
+		teredo_pktbuf *b = bufs[i];
+
+		if ((b != NULL)
+		 && (atomic_load_explicit (&b->refs, memory_order_acquire) > 1))
+		{   /* Retained by someone else */
+			teredo_pktbuf_release (b);
+			b = NULL;
+		}
+		if (b == NULL)
+			b = teredo_pktbuf_alloc ();
+		if (b != NULL)
+			bufs[k++] = b;
+	}
+
+	for (unsigned i = k; i < n; i++)
+		bufs[i] = NULL;
+	return k;
+}
+
+
+teredo_pktbuf *teredo_pktbuf_swap_current (teredo_pktbuf *b)
+{
+	teredo_pktbuf *prev = current;
+
+	current = b;
+	return prev;
+}
+
+
+teredo_pktbuf *teredo_pktbuf_hold (const void *data, size_t len)
+{
+	teredo_pktbuf *b = current;
+
+	if (b == NULL)
+		return NULL;
+
+	const uint8_t *p = data, *buf = b->packet.buf.fill;
+
+	/* Large datagrams are not in the buffer */
+	if ((p < buf) || (len > sizeof (b->packet.buf.fill))
+	 || ((size_t)(p - buf) > sizeof (b->packet.buf.fill) - len))
+		return NULL;
+
+	atomic_fetch_add_explicit (&b->refs, 1, memory_order_relaxed);
+	return b;
+}
+
+
+void teredo_pktbuf_release (teredo_pktbuf *b)
+{
+	if (atomic_fetch_sub_explicit (&b->refs, 1, memory_order_acq_rel) != 1)
+		return;
+
+	struct pktbuf_cache *c = cache_get ();
+	if (c == NULL)
+	{
+		pthread_mutex_lock (&pool_lock);
+		teredo_slab_free (&pool, b);
+		pthread_mutex_unlock (&pool_lock);
+		return;
+	}
+
+	b->next = c->head;
+	c->head = b;
+	if (++c->count > PKTBUF_CACHE_MAX)
+	{
+		pthread_mutex_lock (&pool_lock);
+		pool_put (c, PKTBUF_CACHE_MAX / 2);
+		pthread_mutex_unlock (&pool_lock);
+	}
+}
@@ -0,0 +1,90 @@
+/**
+ * @file pktbuf.h
+ * @brief Reference-counted packet buffers
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_PKTBUF_H
+# define LIBTEREDO_PKTBUF_H
+
+# include <stddef.h>
+# include <stdatomic.h>
+
+/*
+ * Receive threads receive Teredo packets into buffers from a shared pool.
+ * The packet being processed is the "current" buffer of the thread: a
+ * peer queue or a receive callback can then retain it with
+ * teredo_pktbuf_hold() instead of copying the packet. Once the receive
+ * thread is done with a batch, it swaps any retained buffer for a new one,
+ * and the buffer returns to the pool when its last user releases it.
+ *
+ * Freed buffers are cached per thread, and recycled through the shared
+ * pool in bunches. Memory is never returned to the system.
+ */
+struct teredo_pktbuf
+{
+	atomic_uint refs;
+	struct teredo_pktbuf *next; /* thread cache link */
+	teredo_packet packet;
+};
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Allocates a buffer, with a single reference.
+ * @return NULL if out of memory.
+ */
+teredo_pktbuf *teredo_pktbuf_alloc (void);
+
+/**
+ * Makes sure that the first entries of a buffers array are allocated and
+ * not retained by anyone else, replacing the retained ones.
+ * @return the number of usable buffers, at the beginning of the array.
+ */
+unsigned teredo_pktbuf_recycle (teredo_pktbuf **bufs, unsigned n);
+
+/**
+ * Sets the current buffer of the calling thread.
+ * @param b new current buffer (or NULL if none)
+ * @return the previous current buffer.
+ */
+teredo_pktbuf *teredo_pktbuf_swap_current (teredo_pktbuf *b);
+
+static inline teredo_pktbuf *teredo_pktbuf_of (teredo_packet *p)
+{
+	return (teredo_pktbuf *)((char *)p - offsetof (teredo_pktbuf, packet));
+}
+
+/**
+ * Receives Teredo packets into pool buffers, somewhat like
+ * teredo_recv_batch(). Datagrams that are bigger than
+ * TEREDO_SMALL_PACKET_SIZE still end up in the large buffers of the batch.
+ * @param bufs buffers (as initialized by teredo_pktbuf_recycle())
+ * @param n number of buffers (must not be zero)
+ * @return the number of valid packets, or -1 on error.
+ */
+int teredo_pktbuf_recv_batch (int fd, teredo_packet_batch *b,
+                              teredo_pktbuf *const *bufs, unsigned n);
+
+# ifdef __cplusplus
+}
+# endif
+#endif /* ifndef LIBTEREDO_PKTBUF_H */
@@ -0,0 +1,54 @@
+/**
+ * @file probe.h
+ * @brief Static tracing probes
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_PROBE_H
+# define LIBTEREDO_PROBE_H
+
+/*
+ * SystemTap/USDT probes of the "libteredo" provider, for use with perf,
+ * bpftrace or stap (e.g. "bpftrace -e 'usdt:libteredo.so:peer_create
+ * { @[ntop(buf(arg0, 16))] = count(); }'"). A probe that is not attached
+ * costs a single NOP instruction. IPv4 addresses and UDP ports are in
+ * network byte order, IPv6 addresses are passed by reference.
+ *
+ * packet_recv (ipv4, port, length): a Teredo packet was received and parsed
+ * packet_encap (ipv4, port, length): a packet was sent to a peer
+ * peer_hit (ip6): a peer was found in the list
+ * peer_miss (ip6): a peer was not found in the list
+ * peer_create (ip6): a peer was added to the list
+ * peer_full (ip6): a peer could not be added to the full list
+ * peer_queue (ip6, length, incoming): a packet was queued for a peer
+ * peer_drop (ip6, length, incoming): the queue of a peer was full
+ * bubble_send (ipv4, port, ip6): a bubble was sent
+ * ping_send (ip6): an echo request was sent through the server
+ * gc_start (): the peer list garbage collector woke up
+ * gc_done (usec): the peer list garbage collector went back to sleep
+ * state_change (up, ip6, mtu): the qualification state changed
+ */
+# ifdef HAVE_USDT
+#  include <sys/sdt.h>
+#  define TEREDO_PROBE(name, ...) STAP_PROBEV (libteredo, name, ##__VA_ARGS__)
+# else
+#  define TEREDO_PROBE(name, ...) ((void)0)
+# endif
+
+#endif
@@ -31,8 +31,10 @@
 #include <stdbool.h>
 #include <time.h>
 #include <stdlib.h> // malloc()
+#include <string.h> // memset()
 #include <assert.h>
 #include <inttypes.h>
+#include <stdatomic.h>
 
 #include <sys/types.h>
 #include <sys/time.h>
@@ -40,6 +42,10 @@
 #include <netinet/ip6.h> // struct ip6_hdr
 #include <netinet/icmp6.h> // ICMP6_DST_UNREACH_*
 #include <arpa/inet.h> // inet_ntop()
+#include <sys/socket.h> // getsockname()
+#include <sys/uio.h> // struct iovec
+#include <fcntl.h> // fcntl()
+#include <errno.h>
 #include <pthread.h>
 
 #include "teredo.h"
@@ -51,16 +57,53 @@
 #include "maintain.h"
 #include "clock.h"
 #include "peerlist.h"
+#include "wheel.h"
+#include "bpf.h"
+#include "peertable.h"
+#include "addrmap.h"
+#include "stats.h" // teredo_addr_hash()
+#include "pktbuf.h"
+#include "probe.h"
+#ifdef HAVE_IO_URING
+# include "uring.h"
+#endif
 #ifdef MIREDO_TEREDO_CLIENT
 # include "security.h"
 #endif
 #include "debug.h"
-#ifndef NDEBUG
-# include <sys/socket.h>
+
+/* Receive worker: one UDP socket and one thread */
+struct teredo_worker
+{
+	struct teredo_tunnel *tunnel;
+	pthread_t thread;
+	teredo_packet_batch *batch;
+	teredo_pktbuf *bufs[TEREDO_BATCH_SIZE]; /* reception buffers */
+	teredo_sendq *sendq;
+#ifdef HAVE_IO_URING
+	teredo_uring *uring; /* NULL if not supported */
+	unsigned completions; /* packets in the current io_uring batch */
 #endif
+	int fd;
+	unsigned load; /* recent full batches (see teredo_worker_load()) */
+	bool overloaded;
+};
+
+/* Per-packet handlers of a tunnel mode (relay or client) */
+struct teredo_mode
+{
+	int (*transmit) (struct teredo_tunnel *restrict,
+	                 const struct ip6_hdr *restrict, size_t);
+	void (*receive) (struct teredo_tunnel *restrict,
+	                 const struct teredo_packet *restrict);
+	/* Handles the packets of a batch from trusted peers (optional) */
+	void (*lookahead) (struct teredo_tunnel *restrict,
+	                   const teredo_packet_batch *restrict, bool *restrict);
+};
 
 struct teredo_tunnel
 {
+	const struct teredo_mode *_Atomic mode; /* set by the mode setters */
 	struct teredo_peerlist *list;
 	void *opaque;
 #ifdef MIREDO_TEREDO_CLIENT
@@ -71,85 +114,322 @@ struct teredo_tunnel
 #endif
 	teredo_recv_cb recv_cb;
 	teredo_icmpv6_cb icmpv6_cb;
+	teredo_icmpv6_batch_cb icmpv6_batch_cb;
 
+	/*
+	 * The state is only modified with the state lock held, and then
+	 * published to the packet handling threads through a sequence lock,
+	 * so that they can read it without any write to shared memory.
+	 */
 	teredo_state state;
-	pthread_rwlock_t state_lock;
+	pthread_mutex_t state_lock;
+	atomic_uint state_seq;
+	atomic_uint_least32_t state_words[(sizeof (teredo_state) + 3) / 4];
 
-	// ICMPv6 rate limiting
-	struct
-	{
-		pthread_mutex_t lock;
-		int count;
-		teredo_clock_t last;
-	} ratelimit;
+	// ICMPv6 rate limiting: clock value (high 32 bits), tokens left
+	atomic_uint_least64_t ratelimit;
+	atomic_uint icmp_rate_ms; // minimum interval between errors (0: none)
+
+	unsigned max_peers;
+	unsigned refresh_max;
+	unsigned relay_plen; // relays cache prefix length (0: disabled)
+	int qualification_fd;
+	teredo_datapath *datapath; // in-kernel fast path (or NULL)
+	teredo_peertable *peertable; // peers shared with siblings (or NULL)
+	uint32_t local_ip; // local UDP socket address, if peertable is set
+	uint16_t local_port;
+
+	// Peer cache generation (see teredo_peer_cache_invalidate())
+	atomic_uint cache_gen;
+
+	// Number of overloaded receive workers (see teredo_worker_load())
+	atomic_uint overloaded;
+
+	bool pmtud; // per-peer path MTU discovery (see teredo_peer_mtu())
+
+	// Bubbles and pings retransmission timers
+	teredo_wheel wheel;
+	pthread_t timer;
 
 	// Asynchronous packet reception
-	struct
-	{
-		pthread_t thread;
-		bool running;
-	} recv;
+	struct teredo_worker *workers;
+	unsigned nworkers;
+	bool running;
+	bool embedded; // no library threads (see teredo_create_embedded())
+	teredo_clock_t gc_due; // next garbage collection, if embedded
 
-	int fd;
+	int fd; // first worker socket
 };
 
-#ifdef HAVE_LIBJUDY
-# define MAX_PEERS 1048576
-#else
-# define MAX_PEERS 1024
-#endif
+#define MAX_PEERS 1048576
+#define PEER_EXPIRATION 30 // seconds between garbage collections
 #define ICMP_RATE_LIMIT_MS 100
+/* Bubbles and pings must be separated by more than 2 seconds (§ 5.2.6) */
+#define TEREDO_RETRANSMIT_DELAY 3
+
+/*
+ * Each thread keeps a small direct-mapped cache of the mappings of trusted
+ * peers it recently sent packets to, so that teredo_transmit() need not look
+ * up (and lock) the peers list for every packet. Entries are only valid as
+ * long as the generation of their tunnel does not change, which happens
+ * whenever the tunnel state changes, the peers list is reset, or the mapping
+ * of a trusted peer changes. Entries also age out after TEREDO_CACHE_TTL
+ * seconds, well before the peer could expire from the list.
+ */
+#define TEREDO_CACHE_SIZE 64
+#define TEREDO_CACHE_TTL 10 // seconds
+
+struct teredo_peer_cache_entry
+{
+	const teredo_tunnel *tunnel;
+	unsigned gen;
+	uint32_t mapped_addr;
+	uint16_t mapped_port;
+	uint16_t mtu; // largest packet that may take the fast path
+	teredo_clock_t expiry;
+	struct in6_addr addr;
+};
+
+static _Thread_local struct teredo_peer_cache_entry
+	teredo_peer_cache[TEREDO_CACHE_SIZE];
+
+/**
+ * Invalidates all the peer cache entries of a tunnel, in all threads.
+ * Generation numbers are unique across tunnels, so that stale entries never
+ * match a tunnel created at the same address.
+ */
+static void teredo_peer_cache_invalidate (teredo_tunnel *tunnel)
+{
+	static atomic_uint next = 0;
+
+	unsigned gen = atomic_fetch_add_explicit (&next, 1, memory_order_relaxed);
+	atomic_store_explicit (&tunnel->cache_gen, gen + 1, memory_order_release);
+}
+
+
+static inline struct teredo_peer_cache_entry *
+teredo_peer_cache_get (const union teredo_addr *addr)
+{
+	return teredo_peer_cache + (teredo_addr_hash (addr) % TEREDO_CACHE_SIZE);
+}
+
+/**
+ * Publishes the tunnel state to readers. The state lock must be held.
+ */
+static void teredo_state_publish (teredo_tunnel *tunnel)
+{
+	union
+	{
+		teredo_state state;
+		uint32_t words[sizeof (tunnel->state_words) / 4];
+	} u;
+	unsigned seq;
+
+	memset (&u, 0, sizeof (u));
+	u.state = tunnel->state;
+
+	seq = atomic_load_explicit (&tunnel->state_seq, memory_order_relaxed);
+	atomic_store_explicit (&tunnel->state_seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence (memory_order_release);
+
+	teredo_peer_cache_invalidate (tunnel);
+
+	for (size_t i = 0; i < sizeof (u.words) / 4; i++)
+		atomic_store_explicit (tunnel->state_words + i, u.words[i],
+		                       memory_order_relaxed);
+
+	atomic_store_explicit (&tunnel->state_seq, seq + 2, memory_order_release);
+}
+
+
+/**
+ * Reads a consistent (though possibly slightly outdated) copy of the tunnel
+ * state without locking.
+ */
+static void teredo_state_read (teredo_tunnel *tunnel, teredo_state *state)
+{
+	union
+	{
+		teredo_state state;
+		uint32_t words[sizeof (tunnel->state_words) / 4];
+	} u;
+	unsigned seq;
+
+	do
+	{
+		seq = atomic_load_explicit (&tunnel->state_seq, memory_order_acquire);
+		if (seq & 1)
+			continue; /* update in progress */
+
+		for (size_t i = 0; i < sizeof (u.words) / 4; i++)
+			u.words[i] = atomic_load_explicit (tunnel->state_words + i,
+			                                   memory_order_relaxed);
+		atomic_thread_fence (memory_order_acquire);
+	}
+	while ((seq & 1)
+	    || (atomic_load_explicit (&tunnel->state_seq, memory_order_relaxed)
+	         != seq));
+
+	*state = u.state;
+}
+
 
 #if 0
 static unsigned QualificationRetries; // maintain.c
 static unsigned QualificationTimeOut; // maintain.c
 static unsigned ServerNonceLifetime;  // maintain.c
 static unsigned RestartDelay;         // maintain.c
-
-static unsigned MaxQueueBytes;        // peerlist.c
-static unsigned MaxPeers;             // here
-static unsigned IcmpRateLimitMs;      // here
 #endif
 
 /**
- * Rate limiter around ICMPv6 unreachable error packet emission callback.
+ * Takes an ICMPv6 error token. Tokens are refilled on every clock tick.
+ * Once they are exhausted, this only reads the shared rate limit state.
  *
- * @param code ICMPv6 unreachable error code.
+ * @return true if an error may be sent, false if the rate limit is exceeded.
+ */
+static bool teredo_ratelimit (teredo_tunnel *tunnel, teredo_clock_t now)
+{
+	unsigned rate_ms = atomic_load_explicit (&tunnel->icmp_rate_ms,
+	                                         memory_order_relaxed);
+	if (rate_ms == 0)
+		return true; /* no limit */
+
+	const uint_least64_t tick = (uint32_t)now;
+	uint_least64_t val = atomic_load_explicit (&tunnel->ratelimit,
+	                                           memory_order_relaxed);
+	for (;;)
+	{
+		unsigned tokens = ((val >> 32) == tick) ? (uint32_t)val
+		                : (1000 / rate_ms);
+		if (tokens == 0)
+			return false;
+
+		if (atomic_compare_exchange_weak_explicit (&tunnel->ratelimit, &val,
+		                                           (tick << 32) | (tokens - 1),
+		                                           memory_order_relaxed,
+		                                           memory_order_relaxed))
+			return true;
+	}
+}
+
+
+#define TEREDO_ICMP_BATCH 16
+
+/**
+ * ICMPv6 errors pending emission. The headers are built here, while the
+ * payloads refer to the offending packets, which must remain valid until
+ * the queue is flushed.
+ */
+struct teredo_icmp_queue
+{
+	teredo_tunnel *tunnel;
+	unsigned count;
+	struct icmp6_hdr hdr[TEREDO_ICMP_BATCH];
+	struct iovec iov[TEREDO_ICMP_BATCH][2];
+	teredo_icmpv6_msg msgs[TEREDO_ICMP_BATCH];
+};
+
+/** Queue of the running teredo_transmit_batch() call, if any */
+static _Thread_local struct teredo_icmp_queue *teredo_icmpq = NULL;
+
+
+/**
+ * Passes pending ICMPv6 errors to the emission callback.
+ */
+static void teredo_icmp_flush (struct teredo_icmp_queue *q)
+{
+	teredo_tunnel *tunnel = q->tunnel;
+
+	if (q->count == 0)
+		return;
+
+	if (tunnel->icmpv6_batch_cb != NULL)
+		tunnel->icmpv6_batch_cb (tunnel->opaque, q->msgs, q->count);
+	else
+		/* Legacy callback expects a contiguous message */
+		for (unsigned i = 0; i < q->count; i++)
+		{
+			const struct iovec *iov = q->msgs[i].iov;
+			struct
+			{
+				struct icmp6_hdr hdr;
+				char fill[1280 - sizeof (struct ip6_hdr)
+				          - sizeof (struct icmp6_hdr)];
+			} buf;
+
+			buf.hdr = q->hdr[i];
+			memcpy (buf.fill, iov[1].iov_base, iov[1].iov_len);
+			tunnel->icmpv6_cb (tunnel->opaque, &buf,
+			                   sizeof (buf.hdr) + iov[1].iov_len,
+			                   q->msgs[i].dst);
+		}
+
+	q->count = 0;
+}
+
+
+/**
+ * Rate limiter around ICMPv6 error packet emission callback.
+ * Within teredo_transmit_batch(), errors are queued and emitted together.
+ *
+ * @param type ICMPv6 error type.
+ * @param code ICMPv6 error code.
+ * @param info ICMPv6 error parameter (e.g. MTU), in host byte order.
  * @param in IPv6 packet that caused the error.
  * @param len byte length of the IPv6 packet at <in>.
  */
 static void
-teredo_send_unreach (teredo_tunnel *restrict tunnel, uint8_t code,
-                     const struct ip6_hdr *restrict in, size_t len)
+teredo_send_error (teredo_tunnel *restrict tunnel, uint8_t type, uint8_t code,
+                   uint32_t info, const struct ip6_hdr *restrict in,
+                   size_t len)
 {
-	struct
-	{
-		struct icmp6_hdr hdr;
-		char fill[1280 - sizeof (struct ip6_hdr) - sizeof (struct icmp6_hdr)];
-	} buf;
-	teredo_clock_t now = teredo_clock ();
-
 	/* ICMPv6 rate limit */
-	pthread_mutex_lock (&tunnel->ratelimit.lock);
-	if (now != tunnel->ratelimit.last)
+	if (!teredo_ratelimit (tunnel, teredo_clock ()))
 	{
-		tunnel->ratelimit.last = now;
-		tunnel->ratelimit.count =
-			ICMP_RATE_LIMIT_MS ? (int)(1000 / ICMP_RATE_LIMIT_MS) : -1;
+		teredo_stat_inc (TEREDO_STAT_RELAY_ICMP_LIMITED);
+		return; /* rate limit exceeded */
 	}
 
-	if (tunnel->ratelimit.count == 0)
+	struct teredo_icmp_queue *q = teredo_icmpq, single;
+
+	if ((q == NULL) || (q->tunnel != tunnel))
 	{
-		/* rate limit exceeded */
-		pthread_mutex_unlock (&tunnel->ratelimit.lock);
-		return;
+		single.tunnel = tunnel;
+		single.count = 0;
+		q = &single;
 	}
-	if (tunnel->ratelimit.count > 0)
-		tunnel->ratelimit.count--;
-	pthread_mutex_unlock (&tunnel->ratelimit.lock);
 
-	len = BuildICMPv6Error (&buf.hdr, ICMP6_DST_UNREACH, code, in, len);
-	tunnel->icmpv6_cb (tunnel->opaque, &buf.hdr, len, &in->ip6_src);
+	unsigned i = q->count;
+	len = BuildICMPv6Error (q->hdr + i, type, code, in, len);
+	if (len == 0)
+		return;
+	q->hdr[i].icmp6_data32[0] = htonl (info);
+
+	teredo_stat_inc (TEREDO_STAT_RELAY_ICMP);
+	q->iov[i][0].iov_base = q->hdr + i;
+	q->iov[i][0].iov_len = sizeof (q->hdr[i]);
+	q->iov[i][1].iov_base = (void *)in;
+	q->iov[i][1].iov_len = len;
+	q->msgs[i].dst = &in->ip6_src;
+	q->msgs[i].iov = q->iov[i];
+	q->msgs[i].iovcnt = 2;
+	q->count = i + 1;
+
+	if ((q == &single) || (q->count == TEREDO_ICMP_BATCH))
+		teredo_icmp_flush (q);
+}
+
+
+/**
+ * Sends an ICMPv6 Destination Unreachable error (see teredo_send_error()).
+ *
+ * @param code ICMPv6 unreachable error code.
+ */
+static inline void
+teredo_send_unreach (teredo_tunnel *restrict tunnel, uint8_t code,
+                     const struct ip6_hdr *restrict in, size_t len)
+{
+	teredo_send_error (tunnel, ICMP6_DST_UNREACH, code, 0, in, len);
 }
 
 #if 0
@@ -173,16 +453,91 @@ TeredoRelay::EmitICMPv6Error (const void *packet, size_t length,
 #endif
 
 
+/*
+ * Overload control: a receive worker whose batches keep coming back full
+ * is not keeping up with its socket receive queue. While any worker is in
+ * that state, new peers are only admitted one time out of
+ * TEREDO_OVERLOAD_ADMIT, so that packets of the established peers are
+ * not starved by the creation, queueing and bubbles of unknown ones
+ * (likely spoofed, during a flood).
+ */
+#define TEREDO_OVERLOAD_BATCHES 8 // full batches to enter overload
+#define TEREDO_OVERLOAD_ADMIT 8
+
+/**
+ * Updates the overload state of a receive worker after a batch.
+ * @param count number of packets in the batch
+ */
+static void teredo_worker_load (struct teredo_worker *w, unsigned count)
+{
+	if (count >= TEREDO_BATCH_SIZE)
+	{
+		if (w->load < 2 * TEREDO_OVERLOAD_BATCHES)
+			w->load++;
+	}
+	else /* backlog drained: recover quickly */
+		w->load = (count >= TEREDO_BATCH_SIZE / 2) && (w->load > 0)
+			? (w->load - 1) : (w->load / 2);
+
+	if (!w->overloaded && (w->load >= TEREDO_OVERLOAD_BATCHES))
+	{
+		w->overloaded = true;
+		atomic_fetch_add_explicit (&w->tunnel->overloaded, 1,
+		                           memory_order_relaxed);
+		teredo_stat_inc (TEREDO_STAT_RELAY_OVERLOADS);
+	}
+	else
+	if (w->overloaded && (w->load == 0))
+	{
+		w->overloaded = false;
+		atomic_fetch_sub_explicit (&w->tunnel->overloaded, 1,
+		                           memory_order_relaxed);
+	}
+}
+
+
+static inline bool teredo_overloaded (const teredo_tunnel *tunnel)
+{
+	return atomic_load_explicit (&tunnel->overloaded,
+	                             memory_order_relaxed) != 0;
+}
+
+
+/**
+ * Decides whether to create a new peer while overloaded.
+ * @return false if the new peer work should be shed.
+ */
+static bool teredo_admit_peer (void)
+{
+	static _Thread_local unsigned count = 0;
+
+	if ((++count % TEREDO_OVERLOAD_ADMIT) == 0)
+		return true;
+
+	teredo_stat_inc (TEREDO_STAT_RELAY_SHED);
+	return false;
+}
+
+
 #ifdef MIREDO_TEREDO_CLIENT
 static void
 teredo_state_change (const teredo_state *state, void *self)
 {
 	teredo_tunnel *tunnel = (teredo_tunnel *)self;
 
-	pthread_rwlock_wrlock (&tunnel->state_lock);
+	TEREDO_PROBE (state_change, state->up, &state->addr.ip6, state->mtu);
+
+	pthread_mutex_lock (&tunnel->state_lock);
 	bool previously_up = tunnel->state.up;
+	bool same = previously_up && state->up
+		&& IN6_ARE_ADDR_EQUAL (&tunnel->state.addr.ip6, &state->addr.ip6)
+		&& (tunnel->state.mtu == state->mtu);
 	tunnel->state = *state;
+	teredo_state_publish (tunnel);
 
+	if (same)
+		; /* only the refresh interval changed */
+	else
 	if (tunnel->state.up)
 	{
 		/*
@@ -191,7 +546,10 @@ teredo_state_change (const teredo_state *state, void *self)
 		 * the peer list is locked is STRICTLY FORBIDDEN to avoid an obvious
 		 * inter-locking deadlock.
 		 */
-		teredo_list_reset (tunnel->list, MAX_PEERS);
+		teredo_list_reset (tunnel->list, tunnel->max_peers);
+		teredo_peer_cache_invalidate (tunnel);
+		if (tunnel->datapath != NULL)
+			teredo_datapath_flush (tunnel->datapath);
 		tunnel->up_cb (tunnel->opaque,
 		               &tunnel->state.addr.ip6, tunnel->state.mtu);
 
@@ -210,7 +568,7 @@ teredo_state_change (const teredo_state *state, void *self)
 	 * properly ordered. Unfortunately, we cannot be re-entrant from within
 	 * up_cb/down_cb.
 	 */
-	pthread_rwlock_unlock (&tunnel->state_lock);
+	pthread_mutex_unlock (&tunnel->state_lock);
 }
 
 /**
@@ -228,7 +586,7 @@ static int CountPing (teredo_peer *peer, teredo_clock_t now)
 		res = -1;
 	// test must be separated by at least 2 seconds
 	else
-	if (((now - peer->last_ping) & 0x1ff) <= 2)
+	if (((now - peer->last_ping) & 0xff) <= 2)
 		res = 1;
 	else
 		res = 0; // can test again!
@@ -247,7 +605,168 @@ static inline bool IsClient (const teredo_tunnel *tunnel)
 {
 	return tunnel->maintenance != NULL;
 }
+
+
+/*
+ * Relays cache (client case 2): the Teredo relay that proved to serve a
+ * non-Teredo destination is remembered for the whole destination prefix,
+ * so new destinations in the same network can use it straight away. The
+ * cache entries are pseudo-peers of the peers list, with a reserved
+ * subnet anycast address (RFC 2526) as key: the prefix, zero subnet bits,
+ * and an all-ones interface identifier, which is not a unicast address.
+ * Entries are refreshed whenever a ping proves the relay again.
+ */
+#define TEREDO_RELAY_LIFETIME 300 // seconds
+
+static void teredo_relay_key (const teredo_tunnel *tunnel,
+                              const struct in6_addr *dst,
+                              struct in6_addr *key)
+{
+	unsigned bytes = tunnel->relay_plen / 8, bits = tunnel->relay_plen % 8;
+
+	memset (key->s6_addr, 0, 8);
+	memcpy (key->s6_addr, dst->s6_addr, bytes);
+	if (bits)
+		key->s6_addr[bytes] = dst->s6_addr[bytes] & (0xff << (8 - bits));
+	memset (key->s6_addr + 8, 0xff, 8);
+}
+
+
+/**
+ * Looks up the cached relay for a non-Teredo destination.
+ * The peers list must not be locked by the calling thread.
+ * @param relay [out] relay mapping
+ * @return true if a valid relay was found.
+ */
+static bool teredo_relay_lookup (teredo_tunnel *restrict tunnel,
+                                 const struct in6_addr *restrict dst,
+                                 teredo_peer *restrict relay,
+                                 teredo_clock_t now)
+{
+	struct in6_addr key;
+
+	teredo_relay_key (tunnel, dst, &key);
+
+	teredo_peer *p = teredo_list_lookup (tunnel->list, &key, NULL);
+	if (p == NULL)
+		return false;
+
+	bool found = p->trusted
+	          && (teredo_peer_age (p->last_rx, now) <= TEREDO_RELAY_LIFETIME);
+	if (found)
+		*relay = *p;
+	teredo_list_release (tunnel->list, p);
+	return found;
+}
+
+
+/**
+ * Records the relay that proved to serve a non-Teredo node.
+ * The peers list must not be locked by the calling thread.
+ */
+static void teredo_relay_learn (teredo_tunnel *restrict tunnel,
+                                const struct in6_addr *restrict src,
+                                uint32_t ipv4, uint16_t port,
+                                teredo_clock_t now)
+{
+	struct in6_addr key;
+	bool created;
+
+	teredo_relay_key (tunnel, src, &key);
+
+	teredo_peer *p = teredo_list_lookup (tunnel->list, &key, &created);
+	if (p == NULL)
+		return;
+
+	if (created)
+		p->bubbles = p->pings = p->scheduled = 0;
+	SetMapping (p, ipv4, port);
+	TouchReceive (p, now);
+	teredo_list_trust (tunnel->list, p);
+	teredo_list_release (tunnel->list, p);
+}
+#endif
+
+
+/*
+ * Trusted peers are published to the shared peer table (if any) at most
+ * once per TEREDO_SHARE_INTERVAL seconds of reception, so that the
+ * mappings of siblings remain fresh without a shared memory write for
+ * every packet.
+ */
+#define TEREDO_SHARE_INTERVAL 8 // seconds
+
+/**
+ * Publishes the mapping of a trusted peer, before it is touched.
+ * The peer must be locked.
+ */
+static void teredo_peer_share (teredo_tunnel *restrict tunnel,
+                               const struct in6_addr *restrict addr,
+                               const teredo_peer *restrict p,
+                               teredo_clock_t now)
+{
+	if ((tunnel->peertable == NULL)
+	 || (((uint32_t)now / TEREDO_SHARE_INTERVAL)
+	      == (p->last_rx / TEREDO_SHARE_INTERVAL)))
+		return;
+#ifdef MIREDO_TEREDO_CLIENT
+	if (IsClient (tunnel))
+		return; /* relays only */
+#endif
+
+	teredo_peertable_entry e =
+	{
+		.mapped_addr = p->mapped_addr,
+		.mapped_port = p->mapped_port,
+		.local_ip = tunnel->local_ip,
+		.local_port = tunnel->local_port,
+		.seen = ((uint32_t)now != 0) ? (uint32_t)now : 1,
+	};
+	teredo_peertable_publish (tunnel->peertable, addr, &e);
+}
+
+
+/**
+ * Trusts an untrusted peer if a sibling relay shared a valid mapping for
+ * it, and that mapping lets our packets through.
+ * The peer must be locked.
+ *
+ * @return true if the peer is now trusted, false otherwise.
+ */
+static bool teredo_peer_import (teredo_tunnel *restrict tunnel,
+                                teredo_peer *restrict p,
+                                const union teredo_addr *restrict dst,
+                                teredo_clock_t now)
+{
+	teredo_peertable_entry e;
+
+	if (tunnel->peertable == NULL)
+		return false;
+#ifdef MIREDO_TEREDO_CLIENT
+	if (IsClient (tunnel))
+		return false; /* relays only */
 #endif
+	if (!teredo_peertable_lookup (tunnel->peertable, &dst->ip6, &e))
+		return false;
+
+	/* The sibling may have read the clock a little after us */
+	if ((int32_t)teredo_peer_age (e.seen, now) < 0)
+		e.seen = now;
+	if (teredo_peer_age (e.seen, now) >= TEREDO_TIMEOUT)
+		return false;
+
+	/* Restricted NATs only accept packets from the sibling address */
+	if (((e.local_ip != tunnel->local_ip)
+	  || (e.local_port != tunnel->local_port))
+	 && !IN6_IS_TEREDO_ADDR_CONE (&dst->ip6))
+		return false;
+
+	SetMapping (p, e.mapped_addr, e.mapped_port);
+	TouchReceive (p, e.seen);
+	teredo_list_trust (tunnel->list, p);
+	teredo_stat_inc (TEREDO_STAT_PEERS_IMPORTED);
+	return true;
+}
 
 
 /*
@@ -264,7 +783,7 @@ static int CountBubble (teredo_peer *peer, teredo_clock_t now)
 		if (peer->bubbles >= 4)
 		{
 			// don't send if 4 bubbles already sent within 300 seconds
-			if ((now - peer->last_tx) <= 300)
+			if (teredo_peer_age (peer->last_tx, now) <= 300)
 				res = -1;
 			else
 			{
@@ -275,7 +794,7 @@ static int CountBubble (teredo_peer *peer, teredo_clock_t now)
 		}
 		else
 		// don't send if last tx was 2 seconds ago or fewer
-		if ((now - peer->last_tx) <= 2)
+		if (teredo_peer_age (peer->last_tx, now) <= 2)
 			res = 1;
 		else
 			res = 0;
@@ -293,17 +812,75 @@ static int CountBubble (teredo_peer *peer, teredo_clock_t now)
 }
 
 
-static inline void SetMappingFromPacket (teredo_peer *peer,
+static inline void SetMappingFromPacket (teredo_tunnel *tunnel,
+                                         teredo_peer *peer,
                                          const struct teredo_packet *p)
 {
+	if (peer->trusted
+	 && ((peer->mapped_addr != p->source_ipv4)
+	  || (peer->mapped_port != p->source_port)))
+		teredo_peer_cache_invalidate (tunnel);
 	SetMapping (peer, p->source_ipv4, p->source_port);
 }
 
 
+/* Worker of the calling thread, if it is a receive thread */
+static _Thread_local const struct teredo_worker *teredo_cur_worker = NULL;
+
+/**
+ * Selects the UDP socket to send packets through from the calling thread.
+ * Receive threads use their own socket (and send queue). Other threads are
+ * spread across the workers sockets in round-robin order.
+ */
+static int teredo_tx_fd (const teredo_tunnel *tunnel)
+{
+	const struct teredo_worker *w = teredo_cur_worker;
+
+	if (tunnel->nworkers <= 1)
+		return tunnel->fd;
+	if ((w != NULL) && (w->tunnel == tunnel))
+		return w->fd;
+
+	static atomic_uint next = 0;
+	static _Thread_local unsigned slot = 0;
+
+	if (slot == 0)
+		slot = atomic_fetch_add_explicit (&next, 1, memory_order_relaxed) + 1;
+	return tunnel->workers[(slot - 1) % tunnel->nworkers].fd;
+}
+
+
+/**
+ * Determines the largest IPv6 packet that fits the path toward a peer.
+ * The path MTU is only known from the ICMPv4 errors reporting it, per IPv4
+ * address rather than per peer, as it depends only on the former: until
+ * then, and after such a report expires, packets are sent as big as the
+ * local stack passed them, which probes whether the path carries larger
+ * sizes (again).
+ *
+ * @return the path MTU, or UINT16_MAX if unknown (or discovery disabled).
+ */
+static uint16_t teredo_peer_mtu (const teredo_tunnel *restrict tunnel,
+                                 const teredo_peer *restrict peer)
+{
+	if (!tunnel->pmtud)
+		return UINT16_MAX;
+
+	unsigned mtu = teredo_pmtu_get (peer->mapped_addr);
+	if (mtu == 0)
+		return UINT16_MAX;
+
+	/* Deducts the IPv4 and UDP headers. Paths narrower than the minimum
+	 * IPv6 MTU are left to IPv4 fragmentation. */
+	return (mtu >= 1280 + 28) ? (mtu - 28) : 1280;
+}
+
+
 /**
  * Encapsulates an IPv6 packet, forward it to a Teredo peer and release the
  * Teredo peers list. It is (obviously) assumed that the peers list lock is
- * held upon entry.
+ * held upon entry. Packets exceeding the path MTU toward the peer are
+ * dropped, with an ICMPv6 Packet Too Big error.
  *
  * @return 0 on success, -1 in case of UDP/IPv4 network error.
  */
@@ -311,20 +888,76 @@ static
 int teredo_encap (teredo_tunnel *restrict tunnel, teredo_peer *restrict peer,
                   const void *restrict data, size_t len, teredo_clock_t now)
 {
+	uint16_t mtu = (len > 1280) ? teredo_peer_mtu (tunnel, peer) : UINT16_MAX;
+	if (len > mtu)
+	{
+		teredo_list_release (tunnel->list, peer);
+		teredo_stat_inc (TEREDO_STAT_RELAY_TX_TOOBIG);
+		teredo_send_error (tunnel, ICMP6_PACKET_TOO_BIG, 0, mtu, data, len);
+		return 0;
+	}
+
 	uint32_t ipv4 = peer->mapped_addr;
 	uint16_t port = peer->mapped_port;
 	TouchTransmit (peer, now);
-	teredo_list_release (tunnel->list);
+	teredo_list_release (tunnel->list, peer);
+	teredo_stat_inc (TEREDO_STAT_RELAY_TX_ENCAP);
+	TEREDO_PROBE (packet_encap, ipv4, port, len);
 
-	return (teredo_send (tunnel->fd,
+	return (teredo_send (teredo_tx_fd (tunnel),
 	                     data, len, ipv4, port) == (int)len) ? 0 : -1;
 }
 
 
-int teredo_transmit (teredo_tunnel *restrict tunnel,
-                     const struct ip6_hdr *restrict packet, size_t length)
+/**
+ * Schedules the next bubble or ping to an untrusted peer, unless one is
+ * already scheduled. The peer shard must be locked (the wheel lock nests
+ * inside it). If the timer cannot be allocated, the peer is left
+ * unscheduled, and the next packet toward it tries again.
+ */
+static void teredo_schedule (teredo_tunnel *restrict tunnel,
+                             teredo_peer *restrict peer,
+                             const struct in6_addr *addr, teredo_clock_t due)
+{
+	if (!peer->scheduled && (teredo_wheel_add (&tunnel->wheel, addr, due) == 0))
+		peer->scheduled = 1;
+}
+
+
+/**
+ * Sends bubbles toward an untrusted Teredo peer.
+ */
+static int teredo_send_bubbles (teredo_tunnel *restrict tunnel,
+                                const teredo_state *restrict s,
+                                const struct in6_addr *dst)
+{
+	teredo_stat_inc (TEREDO_STAT_RELAY_BUBBLES);
+	/*
+	 * Open the return path if we are behind a
+	 * restricted NAT.
+	 */
+	if (!(s->addr.teredo.flags & htons (TEREDO_FLAG_CONE))
+	 && SendBubbleFromDst (teredo_tx_fd (tunnel), dst, false))
+		return -1;
+
+	return SendBubbleFromDst (teredo_tx_fd (tunnel), dst, true);
+}
+
+
+/**
+ * Transmits a packet toward the Teredo tunnel, as a relay or as a client.
+ * This is instantiated once per tunnel mode with a constant @a client,
+ * so that the relay handler carries none of the client logic.
+ */
+static LIBTEREDO_ALWAYS_INLINE int
+teredo_transmit_mode (teredo_tunnel *restrict tunnel,
+                      const struct ip6_hdr *restrict packet, size_t length,
+                      const bool client)
 {
 	assert (tunnel != NULL);
+#ifndef MIREDO_TEREDO_CLIENT
+	(void)client;
+#endif
 
 	const union teredo_addr *dst =
 		(const union teredo_addr *)&packet->ip6_dst;
@@ -332,23 +965,43 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
    	char b[INET6_ADDRSTRLEN];
 #endif
 
+	teredo_stat_inc (TEREDO_STAT_RELAY_TX);
+
 	/* Drops multicast destination, we cannot handle these */
 	if (dst->ip6.s6_addr[0] == 0xff)
+	{
+		teredo_stat_inc (TEREDO_STAT_RELAY_TX_MULTICAST);
 		return 0;
+	}
+
+	/* Fast path: recently used trusted peer */
+	struct teredo_peer_cache_entry *e = teredo_peer_cache_get (dst);
+	unsigned gen = atomic_load_explicit (&tunnel->cache_gen,
+	                                     memory_order_acquire);
+	teredo_clock_t now = teredo_clock ();
+
+	if ((e->tunnel == tunnel) && (e->gen == gen) && (now <= e->expiry)
+	 && (length <= e->mtu) && IN6_ARE_ADDR_EQUAL (&e->addr, &dst->ip6))
+	{
+		teredo_stat_inc (TEREDO_STAT_RELAY_TX_CACHED);
+		TEREDO_PROBE (packet_encap, e->mapped_addr, e->mapped_port, length);
+		return (teredo_send (teredo_tx_fd (tunnel), packet, length,
+		                     e->mapped_addr, e->mapped_port)
+		        == (int)length) ? 0 : -1;
+	}
 
-	teredo_state s;
-	pthread_rwlock_rdlock (&tunnel->state_lock);
-	s = tunnel->state;
 	/*
 	 * We can afford to use a slightly outdated state, but we cannot afford to
-	 * use an inconsistent state, hence this lock.
+	 * use an inconsistent state.
 	 */
-	pthread_rwlock_unlock (&tunnel->state_lock);
+	teredo_state s;
+	teredo_state_read (tunnel, &s);
 
 #ifdef MIREDO_TEREDO_CLIENT
-	if (IsClient (tunnel) && !s.up)
+	if (client && !s.up)
 	{
 		/* Client not qualified */
+		teredo_stat_inc (TEREDO_STAT_RELAY_TX_REJECTED);
 		teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADDR, packet, length);
 		return 0;
 	}
@@ -358,7 +1011,7 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 	{
 		/* Non-Teredo destination */
 #ifdef MIREDO_TEREDO_CLIENT
-		if (IsClient (tunnel))
+		if (client)
 		{
 			const union teredo_addr *src =
 				(const union teredo_addr *)&packet->ip6_src;
@@ -367,6 +1020,7 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 			{
 				// Teredo servers and relays would reject the packet
 				// if it does not have a Teredo source.
+				teredo_stat_inc (TEREDO_STAT_RELAY_TX_REJECTED);
 				teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADMIN,
 				                     packet, length);
 				return 0;
@@ -379,6 +1033,7 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 			// The routing table must be misconfigured.
 			debug ("Unacceptable destination: %s",
 			       inet_ntop (AF_INET6, &dst->ip6.s6_addr, b, sizeof b));
+			teredo_stat_inc (TEREDO_STAT_RELAY_TX_REJECTED);
 			teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADDR,
 			                     packet, length);
 			return 0;
@@ -409,28 +1064,54 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 			debug ("Non global server address: %s",
 			       inet_ntop (AF_INET, &peer_server, b, sizeof b));
 #endif
+			teredo_stat_inc (TEREDO_STAT_RELAY_TX_REJECTED);
 			return 0;
 		}
 	}
 
 	bool created;
-	teredo_clock_t now = teredo_clock ();
 	struct teredo_peerlist *list = tunnel->list;
 
-	teredo_peer *p = teredo_list_lookup (list, &dst->ip6, &created);
-	if (p == NULL)
-		return -1; /* error */
+	/* When overloaded, only known peers are looked up at first */
+	bool shed = teredo_overloaded (tunnel);
+	teredo_peer *p = teredo_list_lookup (list, &dst->ip6,
+	                                     shed ? NULL : &created);
+	if (shed)
+	{
+		created = false;
+		if ((p == NULL) && teredo_admit_peer ())
+			p = teredo_list_lookup (list, &dst->ip6, &created);
+	}
+	if (p == NULL)
+		return shed ? 0 : -1; /* error */
 
 	if (!created)
 	{
 		/* Case 1 (paragraphs 5.2.4 & 5.4.1): trusted peer */
 		if (p->trusted && IsValid (p, now))
+		{
 			/* Already known -valid- peer */
+			uint32_t ttl = TEREDO_TIMEOUT - teredo_peer_age (p->last_rx, now);
+			if (ttl > TEREDO_CACHE_TTL)
+				ttl = TEREDO_CACHE_TTL;
+
+			e->tunnel = tunnel;
+			e->gen = gen; /* as read before the lookup */
+			e->mapped_addr = p->mapped_addr;
+			e->mapped_port = p->mapped_port;
+			e->mtu = teredo_peer_mtu (tunnel, p);
+			e->expiry = now + ttl;
+			e->addr = dst->ip6;
+			if (tunnel->datapath != NULL)
+				teredo_datapath_update (tunnel->datapath, &dst->ip6,
+				                        p->mapped_addr, p->mapped_port,
+				                        ttl);
 			return teredo_encap (tunnel, p, packet, length, now);
+		}
 	}
  	else
 	{
- 		p->trusted = p->bubbles = p->pings = 0;
+ 		p->trusted = p->bubbles = p->pings = p->scheduled = 0;
 	}
 
 	debug ("Connecting %s: %strusted, %svalid, %u pings, %u bubbles",
@@ -444,13 +1125,11 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 	// (thereafter refered to as simply "untrusted")
 
 #ifdef MIREDO_TEREDO_CLIENT
-	/* Untrusted non-Teredo node */
-	if (dst->teredo.prefix != s.addr.teredo.prefix)
+	/* Untrusted non-Teredo node (relays rejected those above) */
+	if (client && (dst->teredo.prefix != s.addr.teredo.prefix))
 	{
 		int res;
 
-		assert (IsClient (tunnel));
-
 		/* Client case 2: direct IPv6 connectivity test */
 		// TODO: avoid code duplication
 		if (created)
@@ -459,12 +1138,69 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 			p->mapped_addr = 0;
 		}
 
-		teredo_enqueue_out (p, packet, length);
-		res = CountPing (p, now);
-		teredo_list_release (list);
+		teredo_peer relay;
+
+		if (created && (tunnel->relay_plen != 0))
+		{
+			/* The relays cache is looked up without the peer locked */
+			teredo_list_release (list, p);
+			bool cached = teredo_relay_lookup (tunnel, &dst->ip6, &relay, now);
+
+			p = teredo_list_lookup (list, &dst->ip6, &created);
+			if (p == NULL)
+				return -1;
+			if (created)
+			{
+				p->trusted = p->bubbles = p->pings = p->scheduled = 0;
+				p->mapped_port = 0;
+				p->mapped_addr = 0;
+			}
+
+			if (p->trusted && IsValid (p, now))
+				return teredo_encap (tunnel, p, packet, length, now);
+
+			if (cached)
+			{
+				/*
+				 * Races the relay serving the destination network against
+				 * the discovery of the relay serving the destination:
+				 * packets go through the former until the ping reply shows
+				 * the latter.
+				 */
+				SetMapping (p, relay.mapped_addr, relay.mapped_port);
+				TouchReceive (p, now);
+				teredo_list_trust (list, p);
+				res = CountPing (p, now);
+				teredo_stat_inc (TEREDO_STAT_RELAY_TX_RELAYS);
+
+				int val = teredo_encap (tunnel, p, packet, length, now);
+				if (res == 0)
+				{
+					teredo_stat_inc (TEREDO_STAT_RELAY_PINGS);
+					SendPing (teredo_tx_fd (tunnel), &s.addr, &dst->ip6);
+				}
+				return val;
+			}
+		}
+
+		teredo_enqueue_out (list, p, packet, length);
+		/* Once started, retransmissions are left to the timer */
+		res = 1;
+		if (!p->scheduled)
+		{
+			res = CountPing (p, now);
+			if (res != -1)
+				teredo_schedule (tunnel, p, &dst->ip6,
+				                 now + TEREDO_RETRANSMIT_DELAY);
+		}
+		teredo_list_release (list, p);
+		teredo_stat_inc (TEREDO_STAT_RELAY_TX_QUEUED);
 
 		if (res == 0)
-			res = SendPing (tunnel->fd, &s.addr, &dst->ip6);
+		{
+			teredo_stat_inc (TEREDO_STAT_RELAY_PINGS);
+			res = SendPing (teredo_tx_fd (tunnel), &s.addr, &dst->ip6);
+		}
 
 		if (res == -1)
 			teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADDR,
@@ -478,6 +1214,10 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 
 	// Untrusted Teredo client
 
+	/* Relay case 1 again, if a sibling relay trusts the peer */
+	if (teredo_peer_import (tunnel, p, dst, now))
+		return teredo_encap (tunnel, p, packet, length, now);
+
 	/* Client case 3: TODO: implement local discovery */
 
 	if (created)
@@ -488,30 +1228,30 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 	/* Client case 4 & relay case 2: new cone peer */
 	if (IN6_IS_TEREDO_ADDR_CONE (dst))
 	{
-		p->trusted = 1;
+		teredo_list_trust (list, p);
 		p->bubbles = /*p->pings -USELESS- =*/ 0;
 		return teredo_encap (tunnel, p, packet, length);
 	}
 #endif
 
 	/* Client case 5 & relay case 3: untrusted non-cone peer */
-	teredo_enqueue_out (p, packet, length);
+	teredo_enqueue_out (list, p, packet, length);
 
-	// Sends bubble, if rate limit allows
-	int res = CountBubble (p, now);
-	teredo_list_release (list);
+	// Sends bubble, if rate limit allows, and none is scheduled already
+	int res = 1;
+	if (!p->scheduled)
+	{
+		res = CountBubble (p, now);
+		if (res != -1)
+			teredo_schedule (tunnel, p, &dst->ip6,
+			                 now + TEREDO_RETRANSMIT_DELAY);
+	}
+	teredo_list_release (list, p);
+	teredo_stat_inc (TEREDO_STAT_RELAY_TX_QUEUED);
 	switch (res)
 	{
 		case 0:
-			/*
-			 * Open the return path if we are behind a
-			 * restricted NAT.
-			 */
-			if (!(s.addr.teredo.flags & htons (TEREDO_FLAG_CONE))
-			 && SendBubbleFromDst (tunnel->fd, &dst->ip6, false))
-				return -1;
-
-			return SendBubbleFromDst (tunnel->fd, &dst->ip6, true);
+			return teredo_send_bubbles (tunnel, &s, &dst->ip6);
 
 		case -1: // Too many bubbles already sent
 			teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADDR,
@@ -524,19 +1264,260 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 }
 
 
+static int teredo_transmit_relay (teredo_tunnel *restrict tunnel,
+                                  const struct ip6_hdr *restrict packet,
+                                  size_t length)
+{
+	return teredo_transmit_mode (tunnel, packet, length, false);
+}
+
+static void teredo_receive_relay (teredo_tunnel *restrict tunnel,
+                                  const struct teredo_packet *restrict packet);
+static void teredo_lookahead_relay (teredo_tunnel *restrict tunnel,
+                                    const teredo_packet_batch *restrict batch,
+                                    bool *restrict fast);
+
+static const struct teredo_mode teredo_relay_handlers =
+{
+	.transmit = teredo_transmit_relay,
+	.receive = teredo_receive_relay,
+	.lookahead = teredo_lookahead_relay,
+};
+
+#ifdef MIREDO_TEREDO_CLIENT
+static int teredo_transmit_client (teredo_tunnel *restrict tunnel,
+                                   const struct ip6_hdr *restrict packet,
+                                   size_t length)
+{
+	return teredo_transmit_mode (tunnel, packet, length, true);
+}
+
+static void teredo_receive_client (teredo_tunnel *restrict tunnel,
+                                   const struct teredo_packet *restrict packet);
+
+static const struct teredo_mode teredo_client_handlers =
+{
+	.transmit = teredo_transmit_client,
+	.receive = teredo_receive_client,
+};
+#endif
+
+
+/**
+ * @return the packet handlers for the current mode of a tunnel.
+ */
+static inline const struct teredo_mode *
+teredo_mode_get (const teredo_tunnel *tunnel)
+{
+	return atomic_load_explicit (&tunnel->mode, memory_order_acquire);
+}
+
+
+int teredo_transmit (teredo_tunnel *restrict tunnel,
+                     const struct ip6_hdr *restrict packet, size_t length)
+{
+	assert (tunnel != NULL);
+	return teredo_mode_get (tunnel)->transmit (tunnel, packet, length);
+}
+
+
+static pthread_key_t teredo_sendq_key;
+
+static void teredo_sendq_key_init (void)
+{
+	(void)pthread_key_create (&teredo_sendq_key, free);
+}
+
+
+/**
+ * @return the calling thread send queue (or NULL if out of memory).
+ */
+static teredo_sendq *teredo_sendq_get (void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once (&once, teredo_sendq_key_init);
+
+	teredo_sendq *q = pthread_getspecific (teredo_sendq_key);
+	if (q == NULL)
+	{
+		q = malloc (sizeof (*q));
+		if ((q != NULL) && pthread_setspecific (teredo_sendq_key, q))
+		{
+			free (q);
+			q = NULL;
+		}
+	}
+	return q;
+}
+
+
+int teredo_transmit_batch (teredo_tunnel *restrict tunnel,
+                           const struct iovec *restrict pkts, unsigned count)
+{
+	assert (tunnel != NULL);
+
+	/* Receive threads already have their send queue */
+	teredo_sendq *q = (teredo_cur_worker == NULL) ? teredo_sendq_get () : NULL;
+	struct teredo_icmp_queue icmpq = { .tunnel = tunnel, .count = 0 };
+	struct teredo_icmp_queue *oldq = teredo_icmpq;
+	const struct teredo_mode *mode = teredo_mode_get (tunnel);
+	int retval = 0;
+
+	if (q != NULL)
+	{
+		teredo_sendq_init (q, teredo_tx_fd (tunnel));
+		teredo_sendq_start (q);
+	}
+
+	teredo_icmpq = &icmpq;
+	for (unsigned i = 0; i < count; i++)
+		if (mode->transmit (tunnel, pkts[i].iov_base, pkts[i].iov_len))
+			retval = -1;
+	teredo_icmpq = oldq;
+
+	if (q != NULL)
+		teredo_sendq_stop (q);
+	teredo_icmp_flush (&icmpq);
+	return retval;
+}
+
+
+static void teredo_unreach_cb (void *opaque, const void *packet, size_t len)
+{
+	teredo_send_unreach ((teredo_tunnel *)opaque, ICMP6_DST_UNREACH_ADDR,
+	                     (const struct ip6_hdr *)packet, len);
+}
+
+
+/**
+ * Retransmits bubbles or pings toward the untrusted peers whose timer
+ * expired, as long as they have packets queued. Once the peer is deemed
+ * unreachable, its queued packets are dropped with an ICMPv6 error.
+ */
+static void teredo_retransmit (void *opaque, const struct in6_addr *addrs,
+                               unsigned count, teredo_clock_t now)
+{
+	teredo_tunnel *tunnel = (teredo_tunnel *)opaque;
+	teredo_peerlist *list = tunnel->list;
+	teredo_sendq *q = teredo_sendq_get ();
+	teredo_state s;
+
+	teredo_state_read (tunnel, &s);
+
+	/* Bubbles and pings of all expired timers are sent at once */
+	if (q != NULL)
+	{
+		teredo_sendq_init (q, teredo_tx_fd (tunnel));
+		teredo_sendq_start (q);
+	}
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		const struct in6_addr *addr = addrs + i;
+		teredo_peer *p = teredo_list_lookup (list, addr, NULL);
+
+		if (p == NULL)
+			continue; /* expired peer */
+
+		if (!p->scheduled || !teredo_peer_queued (p))
+		{   /* Stale timer, or peer proven (queue flushed) in the mean time */
+			p->scheduled = 0;
+			teredo_list_release (list, p);
+			continue;
+		}
+		p->scheduled = 0;
+
+		int res;
+#ifdef MIREDO_TEREDO_CLIENT
+		bool ping = p->pings > 0;
+
+		if (IsClient (tunnel) && !s.up)
+			res = -1;
+		else
+		if (ping)
+			res = CountPing (p, now);
+		else
+#endif
+			res = CountBubble (p, now);
+
+		teredo_queue *dropped = NULL;
+		if (res == -1)
+			dropped = teredo_peer_queue_yield (p);
+		else
+			teredo_schedule (tunnel, p, addr,
+			                 now + ((res == 0) ? TEREDO_RETRANSMIT_DELAY : 1));
+		teredo_list_release (list, p);
+
+		if (res == 0)
+		{
+#ifdef MIREDO_TEREDO_CLIENT
+			if (ping)
+			{
+				teredo_stat_inc (TEREDO_STAT_RELAY_PINGS);
+				SendPing (teredo_tx_fd (tunnel), &s.addr, addr);
+			}
+			else
+#endif
+				teredo_send_bubbles (tunnel, &s, addr);
+		}
+
+		teredo_queue_discard (list, dropped, teredo_unreach_cb, tunnel);
+	}
+
+	if (q != NULL)
+		teredo_sendq_stop (q);
+}
+
+
+/**
+ * Retransmission timer thread entry point.
+ *
+ * @return never ever.
+ */
+static LIBTEREDO_NORETURN void *teredo_timer_thread (void *data)
+{
+	teredo_tunnel *tunnel = (teredo_tunnel *)data;
+
+	teredo_thread_setup (TEREDO_THREAD_HOUSEKEEPING, "teredo-timer");
+
+	for (;;)
+	{
+		struct timespec delay = { .tv_sec = 1 };
+		int state;
+
+		while (clock_nanosleep (CLOCK_REALTIME, 0, &delay, &delay));
+
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &state);
+		teredo_wheel_expire (&tunnel->wheel, teredo_clock (),
+		                     teredo_retransmit, tunnel);
+		pthread_setcancelstate (state, NULL);
+	}
+}
+
+
 static
 void teredo_predecap (teredo_tunnel *restrict tunnel,
-                      teredo_peer *restrict peer, teredo_clock_t now)
+                      teredo_peer *restrict peer,
+                      const struct in6_addr *addr, teredo_clock_t now)
 {
+	uint32_t ipv4 = peer->mapped_addr;
+	uint16_t port = peer->mapped_port;
+
+	if (peer->trusted)
+		teredo_peer_share (tunnel, addr, peer, now);
 	TouchReceive (peer, now);
 	peer->bubbles = peer->pings = 0;
 	teredo_queue *q = teredo_peer_queue_yield (peer);
-	teredo_list_release (tunnel->list);
+	teredo_list_release (tunnel->list, peer);
 
-	if (q != NULL)
-		teredo_queue_emit (q, tunnel->fd,
-		                   peer->mapped_addr, peer->mapped_port,
-		                   tunnel->recv_cb, tunnel->opaque);
+	/* Subsequent packets from and to that peer may bypass userspace */
+	if (tunnel->datapath != NULL)
+		teredo_datapath_update (tunnel->datapath, addr, ipv4, port,
+		                        TEREDO_TIMEOUT);
+
+	teredo_queue_emit (tunnel->list, q, teredo_tx_fd (tunnel), ipv4, port,
+	                   tunnel->recv_cb, tunnel->opaque);
 }
 
 
@@ -548,23 +1529,32 @@ void teredo_predecap (teredo_tunnel *restrict tunnel,
  * will return immediatly.
  *
  * Thread-safety: This function is thread-safe.
+ *
+ * Like teredo_transmit_mode(), this is instantiated once per tunnel mode.
  */
-static void
-teredo_run_inner (teredo_tunnel *restrict tunnel,
-                  const struct teredo_packet *restrict packet)
+static LIBTEREDO_ALWAYS_INLINE void
+teredo_receive_mode (teredo_tunnel *restrict tunnel,
+                     const struct teredo_packet *restrict packet,
+                     const bool client)
 {
 	assert (tunnel != NULL);
 	assert (packet != NULL);
+#ifndef MIREDO_TEREDO_CLIENT
+	(void)client;
+#endif
 
 #ifndef NDEBUG
 	char b[INET6_ADDRSTRLEN];
 #endif
 	struct ip6_hdr *ip6 = packet->ip6;
 
+	teredo_stat_inc (TEREDO_STAT_RELAY_RX);
+
 	// Checks packet
 	if (packet->ip6_len < sizeof (*ip6))
      	{
 		debug ("Packet size invalid: %zu bytes.", packet->ip6_len);
+		teredo_stat_inc (TEREDO_STAT_RELAY_RX_MALFORMED);
 		return; // invalid packet
 	}
 
@@ -573,23 +1563,20 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 	 || (length > packet->ip6_len))
      	{
 	   	debug ("Received malformed IPv6 packet.");
+		teredo_stat_inc (TEREDO_STAT_RELAY_RX_MALFORMED);
 		return; // malformatted IPv6 packet
 	}
 
-	teredo_state s;
-	pthread_rwlock_rdlock (&tunnel->state_lock);
-	s = tunnel->state;
 	/*
 	 * We can afford to use a slightly outdated state, but we cannot afford to
-	 * use an inconsistent state, hence this lock. Also, we cannot call
-	 * teredo_maintenance_process() while holding the lock, as that would
-	 * cause a deadlock at StateChange().
+	 * use an inconsistent state.
 	 */
-	pthread_rwlock_unlock (&tunnel->state_lock);
+	teredo_state s;
+	teredo_state_read (tunnel, &s);
 
 #ifdef MIREDO_TEREDO_CLIENT
 	/* Maintenance */
-	if (IsClient (tunnel))
+	if (client)
 	{
 		if (teredo_maintenance_process (tunnel->maintenance, packet) == 0)
 		{
@@ -624,7 +1611,7 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 			if (ipv4)
 			{
 				/* TODO: record sending of bubble, create a peer, etc ? */
-				teredo_reply_bubble (tunnel->fd, ipv4, port, ip6);
+				teredo_reply_bubble (teredo_tx_fd (tunnel), ipv4, port, ip6);
 				debug (" bubble sent");
 				if (IsBubble (ip6))
 					return; // don't pass bubble to kernel
@@ -667,6 +1654,7 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 	{
 		debug ("Source %s is not a teredo address.",
 		       inet_ntop (AF_INET6, &ip6->ip6_src.s6_addr, b, sizeof b));
+		teredo_stat_inc (TEREDO_STAT_RELAY_RX_DROPPED);
 		return;
 	}
 
@@ -713,7 +1701,8 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 		 && (packet->source_ipv4 == p->mapped_addr)
 		 && (packet->source_port == p->mapped_port))
 		{
-			teredo_predecap (tunnel, p, now);
+			teredo_predecap (tunnel, p, &ip6->ip6_src, now);
+			teredo_stat_inc (TEREDO_STAT_RELAY_RX_DECAP);
 			tunnel->recv_cb (tunnel->opaque, ip6, length);
 			return;
 		}
@@ -724,12 +1713,17 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 		 * Mismatching trusted non-Teredo nodes are also accepted to recover
 		 * faster from a Teredo relay change. This is legal (client case 6).
 		 */
-		if (IsClient (tunnel) && (CheckPing (packet) == 0))
+		if (client && (CheckPing (packet) == 0))
 		{
-			p->trusted = 1;
-			SetMappingFromPacket (p, packet);
-
-			teredo_predecap (tunnel, p, now);
+			SetMappingFromPacket (tunnel, p, packet);
+			teredo_list_trust (list, p);
+
+			teredo_predecap (tunnel, p, &ip6->ip6_src, now);
+			if ((tunnel->relay_plen != 0)
+			 && (IN6_TEREDO_PREFIX (&ip6->ip6_src) != s.addr.teredo.prefix))
+				teredo_relay_learn (tunnel, &ip6->ip6_src,
+				                    packet->source_ipv4, packet->source_port,
+				                    now);
 			return; /* don't pass ping to kernel */
 		}
 #endif /* ifdef MIREDO_TEREDO_CLIENT */
@@ -748,8 +1742,15 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 		 || (IsBubble (ip6) && (CheckBubble (packet) == 0)))
 		{
 #ifdef MIREDO_TEREDO_CLIENT
-			if (IsClient (tunnel) && (p == NULL))
-				p = teredo_list_lookup (list, &ip6->ip6_src, &(bool){ false });
+			if (client && (p == NULL)
+			 && (!teredo_overloaded (tunnel) || teredo_admit_peer ()))
+			{
+				bool create;
+
+				p = teredo_list_lookup (list, &ip6->ip6_src, &create);
+				if ((p != NULL) && create)
+					p->trusted = p->bubbles = p->pings = p->scheduled = 0;
+			}
 #endif
 			/*
 			 * Relays are explicitly allowed to drop packets from
@@ -763,15 +1764,19 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 				debug ("No peer for %s found. Dropping packet.",
 				       inet_ntop (AF_INET6, &ip6->ip6_src.s6_addr, b,
 				                  sizeof b));
+				teredo_stat_inc (TEREDO_STAT_RELAY_RX_DROPPED);
 				return; // list not locked (p = NULL)
 			}
 
-			SetMappingFromPacket (p, packet);
-			p->trusted = 1;
-			teredo_predecap (tunnel, p, now);
+			SetMappingFromPacket (tunnel, p, packet);
+			teredo_list_trust (list, p);
+			teredo_predecap (tunnel, p, &ip6->ip6_src, now);
 
 			if (!IsBubble (ip6)) // discard Teredo bubble
+			{
+				teredo_stat_inc (TEREDO_STAT_RELAY_RX_DECAP);
 				tunnel->recv_cb (tunnel->opaque, ip6, length);
+			}
 			return;
 		}
 
@@ -779,9 +1784,9 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 	}
 #ifdef MIREDO_TEREDO_CLIENT
 	else
+	if (client) /* relays dropped non-Teredo sources above */
 	{
 		assert (IN6_TEREDO_PREFIX (&ip6->ip6_src) != s.addr.teredo.prefix);
-		assert (IsClient (tunnel));
 
 		// TODO: implement client cases 4 & 5 for local Teredo
 	
@@ -797,6 +1802,9 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 		// TODO: avoid code duplication (direct IPv6 connectivity test)
 		if (p == NULL)
 		{
+			if (teredo_overloaded (tunnel) && !teredo_admit_peer ())
+				return;
+
 			bool create;
 			p = teredo_list_lookup (list, &ip6->ip6_src, &create);
 			if (p == NULL)
@@ -815,28 +1823,188 @@ teredo_run_inner (teredo_tunnel *restrict tunnel,
 			{
 				p->mapped_port = 0;
 				p->mapped_addr = 0;
-				p->trusted = p->bubbles = p->pings = 0;
+				p->trusted = p->bubbles = p->pings = p->scheduled = 0;
 			}
 		}
 
-		teredo_enqueue_in (p, ip6, length,
+		teredo_enqueue_in (list, p, ip6, length,
 		                   packet->source_ipv4, packet->source_port);
 		TouchReceive (p, now);
 
-		int res = CountPing (p, now);
-		teredo_list_release (list);
+		int res = 1;
+		if (!p->scheduled)
+		{
+			res = CountPing (p, now);
+			if (res != -1)
+				teredo_schedule (tunnel, p, &ip6->ip6_src,
+				                 now + TEREDO_RETRANSMIT_DELAY);
+		}
+		teredo_list_release (list, p);
 
 		if (res == 0)
-			SendPing (tunnel->fd, &s.addr, &ip6->ip6_src);
+		{
+			teredo_stat_inc (TEREDO_STAT_RELAY_PINGS);
+			SendPing (teredo_tx_fd (tunnel), &s.addr, &ip6->ip6_src);
+		}
 
 		return;
 	}
 #endif /* ifdef MIREDO_TEREDO_CLIENT */
 
 	debug ("Dropping packet.");
+	teredo_stat_inc (TEREDO_STAT_RELAY_RX_DROPPED);
 	// Rejected packet
 	if (p != NULL)
-		teredo_list_release (list);
+		teredo_list_release (list, p);
+}
+
+
+static void teredo_receive_relay (teredo_tunnel *restrict tunnel,
+                                  const struct teredo_packet *restrict packet)
+{
+	teredo_receive_mode (tunnel, packet, false);
+}
+
+#ifdef MIREDO_TEREDO_CLIENT
+static void teredo_receive_client (teredo_tunnel *restrict tunnel,
+                                   const struct teredo_packet *restrict packet)
+{
+	teredo_receive_mode (tunnel, packet, true);
+}
+#endif
+
+
+/*
+ * Batched reception: the source peers of a whole batch are looked up at
+ * once (see teredo_list_lookup_batch()), and packets from trusted peers
+ * with matching mappings (relay case 1, by far the most common) are
+ * accounted for right away. Those are then passed to the receive callback
+ * without any further lookup, and the other packets take the usual path.
+ */
+struct teredo_lookahead
+{
+	teredo_tunnel *tunnel;
+	const teredo_packet_batch *batch;
+	unsigned index[TEREDO_BATCH_SIZE]; /* batch index of each lookup */
+	bool *fast;
+	teredo_clock_t now;
+};
+
+static void teredo_lookahead_cb (void *opaque, unsigned i, teredo_peer *p)
+{
+	struct teredo_lookahead *la = opaque;
+	unsigned j = la->index[i];
+	const teredo_packet *packet = la->batch->packets[j];
+
+	/* Peers with queued packets are left to teredo_predecap() */
+	if ((p == NULL) || !p->trusted
+	 || (packet->source_ipv4 != p->mapped_addr)
+	 || (packet->source_port != p->mapped_port) || teredo_peer_queued (p))
+		return;
+
+	teredo_peer_share (la->tunnel, &packet->ip6->ip6_src, p, la->now);
+	TouchReceive (p, la->now);
+	p->bubbles = p->pings = 0;
+	la->fast[j] = true;
+}
+
+
+static void teredo_lookahead_relay (teredo_tunnel *restrict tunnel,
+                                    const teredo_packet_batch *restrict batch,
+                                    bool *restrict fast)
+{
+	struct teredo_lookahead la =
+		{ .tunnel = tunnel, .batch = batch, .fast = fast,
+		  .now = teredo_clock () };
+	const struct in6_addr *addrs[TEREDO_BATCH_SIZE];
+	const teredo_packet *bubbles[TEREDO_BATCH_SIZE];
+	unsigned n = 0, nbubbles = 0;
+	teredo_state s;
+
+	teredo_state_read (tunnel, &s);
+
+	/* Same checks as teredo_receive_mode() before the peer lookup */
+	for (unsigned i = 0; i < batch->count; i++)
+	{
+		const teredo_packet *packet = batch->packets[i];
+		const struct ip6_hdr *ip6 = packet->ip6;
+
+		fast[i] = false;
+		if ((packet->ip6_len < sizeof (*ip6))
+		 || ((ip6->ip6_vfc >> 4) != 6)
+		 || (sizeof (*ip6) + ntohs (ip6->ip6_plen) > packet->ip6_len)
+		 || (IN6_TEREDO_PREFIX (&ip6->ip6_src) != s.addr.teredo.prefix)
+		 || (ip6->ip6_dst.s6_addr[0] == 0xff))
+			continue;
+
+		addrs[n] = &ip6->ip6_src;
+		la.index[n++] = i;
+
+		/* Bubbles with mismatched mappings will need CheckBubble() */
+		if (IsBubble (ip6)
+		 && !IN6_MATCHES_TEREDO_CLIENT (&ip6->ip6_src, packet->source_ipv4,
+		                                packet->source_port))
+			bubbles[nbubbles++] = packet;
+	}
+
+	if (nbubbles > 1)
+		PrepareBubbleChecks (bubbles, nbubbles);
+	if (n > 0)
+		teredo_list_lookup_batch (tunnel->list, addrs, n,
+		                          teredo_lookahead_cb, &la);
+}
+
+
+/**
+ * Finishes the reception of a packet accounted for by the lookahead.
+ */
+static void teredo_receive_fast (teredo_tunnel *restrict tunnel,
+                                 const struct teredo_packet *restrict packet)
+{
+	struct ip6_hdr *ip6 = packet->ip6;
+
+	teredo_stat_inc (TEREDO_STAT_RELAY_RX);
+	teredo_stat_inc (TEREDO_STAT_RELAY_RX_DECAP);
+
+	if (tunnel->datapath != NULL)
+		teredo_datapath_update (tunnel->datapath, &ip6->ip6_src,
+		                        packet->source_ipv4, packet->source_port,
+		                        TEREDO_TIMEOUT);
+
+	tunnel->recv_cb (tunnel->opaque, ip6,
+	                 sizeof (*ip6) + ntohs (ip6->ip6_plen));
+}
+
+
+/**
+ * Processes a batch of received packets from a worker.
+ *
+ * @param pktbufs whether the packets are in reference-counted buffers
+ */
+static void teredo_receive_batch (teredo_tunnel *restrict tunnel,
+                                  const teredo_packet_batch *restrict batch,
+                                  bool pktbufs)
+{
+	const struct teredo_mode *mode = teredo_mode_get (tunnel);
+	bool fast[TEREDO_BATCH_SIZE];
+
+	if (mode->lookahead != NULL)
+		mode->lookahead (tunnel, batch, fast);
+	else
+		memset (fast, 0, sizeof (fast));
+
+	for (unsigned i = 0; i < batch->count; i++)
+	{
+		teredo_packet *p = batch->packets[i];
+
+		if (pktbufs)
+			teredo_pktbuf_swap_current (teredo_pktbuf_of (p));
+		if (fast[i])
+			teredo_receive_fast (tunnel, p);
+		else
+			mode->receive (tunnel, p);
+	}
+	teredo_pktbuf_swap_current (NULL);
 }
 
 
@@ -876,8 +2044,49 @@ static void teredo_dummy_state_down_cb (void *o)
 #endif
 
 
-teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port)
+/**
+ * Prepares a worker for teredo_process_batch(): the socket is made
+ * non-blocking, and the receive resources are allocated upfront.
+ */
+static int teredo_worker_embed (struct teredo_worker *w)
+{
+	int flags = fcntl (w->fd, F_GETFL, 0);
+
+	if ((flags == -1) || fcntl (w->fd, F_SETFL, flags | O_NONBLOCK))
+		return -1;
+
+	w->batch = calloc (1, sizeof (*w->batch));
+	w->sendq = malloc (sizeof (*w->sendq));
+	if ((w->batch == NULL) || (w->sendq == NULL))
+	{
+		free (w->sendq);
+		free (w->batch);
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Releases the receive resources of a worker.
+ */
+static void teredo_worker_cleanup (struct teredo_worker *w)
+{
+	free (w->sendq);
+	teredo_packet_batch_destroy (w->batch);
+	free (w->batch);
+	for (unsigned j = 0; j < TEREDO_BATCH_SIZE; j++)
+		if (w->bufs[j] != NULL)
+			teredo_pktbuf_release (w->bufs[j]);
+}
+
+
+static teredo_tunnel *teredo_create_inner (uint32_t ipv4, uint16_t port,
+                                           unsigned workers, bool embedded)
 {
+	if (workers == 0)
+		workers = 1;
+
 	teredo_tunnel *tunnel = (teredo_tunnel *)malloc (sizeof (*tunnel));
 	if (tunnel == NULL)
 		return NULL;
@@ -895,31 +2104,130 @@ teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port)
 	tunnel->state.addr.teredo.client_ip = ~ipv4;
 
 	tunnel->state.up = false;
-	tunnel->ratelimit.count = 1;
+	atomic_init (&tunnel->ratelimit, 1);
+	atomic_init (&tunnel->icmp_rate_ms, ICMP_RATE_LIMIT_MS);
+	tunnel->max_peers = MAX_PEERS;
+	tunnel->qualification_fd = -1;
+	tunnel->datapath = NULL;
+	tunnel->peertable = NULL;
+	atomic_init (&tunnel->mode, &teredo_relay_handlers);
 
 	tunnel->recv_cb = teredo_dummy_recv_cb;
 	tunnel->icmpv6_cb = teredo_dummy_icmpv6_cb;
+	tunnel->icmpv6_batch_cb = NULL;
 #ifdef MIREDO_TEREDO_CLIENT
 	tunnel->up_cb = teredo_dummy_state_up_cb;
 	tunnel->down_cb = teredo_dummy_state_down_cb;
 #endif
 
-	if ((tunnel->fd = teredo_socket (ipv4, port)) != -1)
+	tunnel->workers = calloc (workers, sizeof (*tunnel->workers));
+	if (tunnel->workers == NULL)
 	{
-		if ((tunnel->list = teredo_list_create (MAX_PEERS, 30)) != NULL)
-		{
-			(void)pthread_rwlock_init (&tunnel->state_lock, NULL);
-			(void)pthread_mutex_init (&tunnel->ratelimit.lock, NULL);
-			return tunnel;
+		free (tunnel);
+		return NULL;
+	}
+
+	unsigned i;
+
+	for (i = 0; i < workers; i++)
+	{
+		int fd = (workers > 1) ? teredo_socket_shared (ipv4, port)
+		                       : teredo_socket (ipv4, port);
+		if (fd == -1)
+			break;
+
+		tunnel->workers[i].fd = fd;
+
+		if ((workers > 1) && (port == 0))
+		{   /* Other workers must bind the port the kernel selected */
+			struct sockaddr_in addr;
+			socklen_t addrlen = sizeof (addr);
+
+			if (getsockname (fd, (struct sockaddr *)&addr, &addrlen))
+			{
+				i++;
+				break;
+			}
+			port = addr.sin_port;
 		}
-		teredo_close (tunnel->fd);
 	}
 
+	unsigned embedded_workers = 0;
+
+	if (i == workers)
+	{
+		for (i = 0; i < workers; i++)
+			tunnel->workers[i].tunnel = tunnel;
+		tunnel->nworkers = workers;
+		tunnel->fd = tunnel->workers[0].fd;
+
+		if (embedded)
+			while ((embedded_workers < workers)
+			    && (teredo_worker_embed (tunnel->workers
+			                             + embedded_workers) == 0))
+				embedded_workers++;
+
+		if (!embedded)
+			tunnel->list = teredo_list_create (MAX_PEERS, PEER_EXPIRATION);
+		else
+		if (embedded_workers == workers)
+			tunnel->list = teredo_list_create_manual (MAX_PEERS,
+			                                          PEER_EXPIRATION);
+
+		if (tunnel->list != NULL)
+		{
+			(void)pthread_mutex_init (&tunnel->state_lock, NULL);
+			teredo_state_publish (tunnel);
+			teredo_wheel_init (&tunnel->wheel, teredo_clock ());
+
+			if (embedded)
+			{
+				tunnel->embedded = true;
+				tunnel->gc_due = teredo_clock () + PEER_EXPIRATION;
+				return tunnel;
+			}
+
+			if (pthread_create (&tunnel->timer, NULL, teredo_timer_thread,
+			                    tunnel) == 0)
+				return tunnel;
+
+			teredo_wheel_destroy (&tunnel->wheel);
+			pthread_mutex_destroy (&tunnel->state_lock);
+			teredo_list_destroy (tunnel->list);
+		}
+	}
+
+	while (embedded_workers > 0)
+		teredo_worker_cleanup (tunnel->workers + --embedded_workers);
+
+	while (i > 0)
+		teredo_close (tunnel->workers[--i].fd);
+	free (tunnel->workers);
 	free (tunnel);
 	return NULL;
 }
 
 
+teredo_tunnel *teredo_create_workers (uint32_t ipv4, uint16_t port,
+                                      unsigned workers)
+{
+	return teredo_create_inner (ipv4, port, workers, false);
+}
+
+
+teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port)
+{
+	return teredo_create_workers (ipv4, port, 1);
+}
+
+
+teredo_tunnel *teredo_create_embedded (uint32_t ipv4, uint16_t port,
+                                       unsigned workers)
+{
+	return teredo_create_inner (ipv4, port, workers, true);
+}
+
+
 void teredo_destroy (teredo_tunnel *t)
 {
 	assert (t != NULL);
@@ -935,32 +2243,112 @@ void teredo_destroy (teredo_tunnel *t)
 		teredo_maintenance_stop (t->maintenance);
 #endif
 
-	if (t->recv.running)
+	if (t->running)
 	{
-		pthread_cancel (t->recv.thread);
-		pthread_join (t->recv.thread, NULL);
+#ifdef HAVE_IO_URING
+		for (unsigned i = 0; i < t->nworkers; i++)
+			if (t->workers[i].uring != NULL)
+				teredo_uring_stop (t->workers[i].uring);
+#endif
+		for (unsigned i = 0; i < t->nworkers; i++)
+			pthread_cancel (t->workers[i].thread);
+
+		for (unsigned i = 0; i < t->nworkers; i++)
+		{
+			struct teredo_worker *w = t->workers + i;
+
+			pthread_join (w->thread, NULL);
+#ifdef HAVE_IO_URING
+			if (w->uring != NULL)
+				teredo_uring_destroy (w->uring);
+#endif
+			teredo_worker_cleanup (w);
+		}
+	}
+
+	if (t->embedded)
+		for (unsigned i = 0; i < t->nworkers; i++)
+			teredo_worker_cleanup (t->workers + i);
+	else
+	{
+		pthread_cancel (t->timer);
+		pthread_join (t->timer, NULL);
 	}
+	teredo_wheel_destroy (&t->wheel);
 
 	teredo_list_destroy (t->list);
-	pthread_rwlock_destroy (&t->state_lock);
-	pthread_mutex_destroy (&t->ratelimit.lock);
-	teredo_close (t->fd);
+	pthread_mutex_destroy (&t->state_lock);
+	for (unsigned i = 0; i < t->nworkers; i++)
+		teredo_close (t->workers[i].fd);
+	free (t->workers);
 	free (t);
 }
 
 
-static LIBTEREDO_NORETURN void *teredo_recv_thread (void *t)
+#ifdef HAVE_IO_URING
+static void teredo_uring_recv (void *opaque, unsigned index,
+                               struct teredo_packet *packet)
 {
-	teredo_tunnel *tunnel = (teredo_tunnel *)t;
+	struct teredo_worker *w = (struct teredo_worker *)opaque;
 
-	for (;;)
+	(void)index;
+	if (packet != NULL)
 	{
-		struct teredo_packet packet;
+		teredo_mode_get (w->tunnel)->receive (w->tunnel, packet);
+		w->completions++;
+	}
+	else
+	{   /* End of the batch of completions */
+		teredo_worker_load (w, w->completions);
+		w->completions = 0;
+	}
+}
+#endif
+
+
+static LIBTEREDO_NORETURN void *teredo_recv_thread (void *data)
+{
+	struct teredo_worker *w = (struct teredo_worker *)data;
+	teredo_tunnel *tunnel = w->tunnel;
 
-		if (teredo_wait_recv (tunnel->fd, &packet) == 0)
+	teredo_packet_batch *batch = w->batch;
+	teredo_sendq *sendq = w->sendq;
+
+	teredo_thread_setup (TEREDO_THREAD_PACKETS, "teredo-rx%u",
+	                     (unsigned)(w - tunnel->workers));
+	teredo_cur_worker = w;
+	teredo_sendq_init (sendq, w->fd);
+
+#ifdef HAVE_IO_URING
+	if (w->uring != NULL)
+	{
+		/* Stopped through teredo_uring_stop() rather than cancelled */
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+		if (teredo_uring_run (w->uring, sendq, teredo_uring_recv, w) == 0)
+			pthread_exit (NULL);
+		pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+		/* Falls back to system calls on error */
+	}
+#endif
+
+	for (;;)
+	{
+		/* Packets retained by peer queues or by the receive callback
+		 * are received into new buffers. Without any, the batch inline
+		 * storage is used, and packets are copied if they are retained. */
+		unsigned n = teredo_pktbuf_recycle (w->bufs, TEREDO_BATCH_SIZE);
+		int val = (n > 0)
+			? teredo_pktbuf_recv_batch (w->fd, batch, w->bufs, n)
+			: teredo_recv_batch (w->fd, batch, TEREDO_BATCH_SIZE);
+
+		if (val > 0)
 		{
 			pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
-			teredo_run_inner (tunnel, &packet);
+			/* Replies (bubbles, dequeued packets...) are sent at once */
+			teredo_sendq_start (sendq);
+			teredo_receive_batch (tunnel, batch, n > 0);
+			teredo_sendq_stop (sendq);
+			teredo_worker_load (w, batch->count);
 			pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
 		}
 	}
@@ -971,14 +2359,56 @@ int teredo_run_async (teredo_tunnel *t)
 {
 	assert (t != NULL);
 
-	/* already running */
-	if (t->recv.running)
+	/* already running, or driven by the caller */
+	if (t->running || t->embedded)
 		return -1;
 
-	if (pthread_create (&t->recv.thread, NULL, teredo_recv_thread, t))
+	unsigned i;
+
+	for (i = 0; i < t->nworkers; i++)
+	{
+		struct teredo_worker *w = t->workers + i;
+
+		w->batch = calloc (1, sizeof (*w->batch));
+		w->sendq = malloc (sizeof (*w->sendq));
+#ifdef HAVE_IO_URING
+		w->uring = teredo_uring_create (&w->fd, 1);
+#endif
+		if ((w->batch == NULL) || (w->sendq == NULL)
+		 || pthread_create (&w->thread, NULL, teredo_recv_thread, w))
+		{
+#ifdef HAVE_IO_URING
+			if (w->uring != NULL)
+				teredo_uring_destroy (w->uring);
+#endif
+			free (w->sendq);
+			free (w->batch);
+			break;
+		}
+	}
+
+	if (i < t->nworkers)
+	{
+		while (i > 0)
+		{
+			struct teredo_worker *w = t->workers + --i;
+
+#ifdef HAVE_IO_URING
+			if (w->uring != NULL)
+				teredo_uring_stop (w->uring);
+#endif
+			pthread_cancel (w->thread);
+			pthread_join (w->thread, NULL);
+#ifdef HAVE_IO_URING
+			if (w->uring != NULL)
+				teredo_uring_destroy (w->uring);
+#endif
+			teredo_worker_cleanup (w);
+		}
 		return -1;
+	}
 
-	t->recv.running = true;
+	t->running = true;
 	return 0;
 }
 
@@ -992,7 +2422,114 @@ void teredo_run (teredo_tunnel *tunnel)
 	if (teredo_recv (tunnel->fd, &packet))
 		return;
 
-	teredo_run_inner (tunnel, &packet);
+	teredo_mode_get (tunnel)->receive (tunnel, &packet);
+}
+
+
+unsigned teredo_get_fds (const teredo_tunnel *t, int *fds, unsigned max)
+{
+	assert (t != NULL);
+
+	for (unsigned i = 0; (i < max) && (i < t->nworkers); i++)
+		fds[i] = t->workers[i].fd;
+	return t->nworkers;
+}
+
+
+/**
+ * Processes a received batch from the calling thread, on behalf of an
+ * embedded tunnel worker.
+ */
+static void teredo_worker_process (teredo_tunnel *t, struct teredo_worker *w,
+                                   const teredo_packet_batch *batch,
+                                   bool pktbufs)
+{
+	const struct teredo_worker *oldw = teredo_cur_worker;
+
+	teredo_cur_worker = w;
+	teredo_sendq_init (w->sendq, w->fd);
+	teredo_sendq_start (w->sendq);
+	teredo_receive_batch (t, batch, pktbufs);
+	teredo_sendq_stop (w->sendq);
+	teredo_cur_worker = oldw;
+	teredo_worker_load (w, batch->count);
+}
+
+
+int teredo_process_batch (teredo_tunnel *t, unsigned worker)
+{
+	assert (t != NULL);
+
+	if (!t->embedded || (worker >= t->nworkers))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct teredo_worker *w = t->workers + worker;
+	teredo_packet_batch *batch = w->batch;
+
+	/* See teredo_recv_thread() */
+	unsigned n = teredo_pktbuf_recycle (w->bufs, TEREDO_BATCH_SIZE);
+	int val = (n > 0)
+		? teredo_pktbuf_recv_batch (w->fd, batch, w->bufs, n)
+		: teredo_recv_batch (w->fd, batch, TEREDO_BATCH_SIZE);
+	if (val <= 0)
+		return val;
+
+	teredo_worker_process (t, w, batch, n > 0);
+	return batch->count;
+}
+
+
+int teredo_replay_batch (teredo_tunnel *t, const teredo_packet_batch *batch)
+{
+	assert (t != NULL);
+
+	if (!t->embedded)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	teredo_worker_process (t, t->workers, batch, false);
+	return batch->count;
+}
+
+
+int teredo_next_deadline (teredo_tunnel *t)
+{
+	assert (t != NULL);
+
+	if (!t->embedded)
+		return -1;
+
+	teredo_clock_t now = teredo_clock (), due = t->gc_due, next;
+
+	if ((teredo_wheel_next (&t->wheel, &next) == 0)
+	 && ((long)(next - due) < 0))
+		due = next;
+
+	long secs = (long)(due - now);
+	return (secs > 0) ? (int)(secs * 1000) : 0;
+}
+
+
+void teredo_tick (teredo_tunnel *t)
+{
+	assert (t != NULL);
+
+	if (!t->embedded)
+		return;
+
+	teredo_clock_t now = teredo_clock ();
+
+	teredo_wheel_expire (&t->wheel, now, teredo_retransmit, t);
+	if ((long)(now - t->gc_due) >= 0)
+	{
+		teredo_list_gc (t->list);
+		t->gc_due = now + PEER_EXPIRATION;
+	}
 }
 
 
@@ -1004,39 +2541,273 @@ int teredo_set_prefix (teredo_tunnel *t, uint32_t prefix)
 
 	int retval = 0;
 
-	pthread_rwlock_wrlock (&t->state_lock);
+	pthread_mutex_lock (&t->state_lock);
 
 #ifdef MIREDO_TEREDO_CLIENT
 	if (t->maintenance != NULL)
 		retval = -1;
 	else
 #endif
+	{
 		t->state.addr.teredo.prefix = prefix;
+		teredo_state_publish (t);
+	}
 
-	pthread_rwlock_unlock (&t->state_lock);
+	pthread_mutex_unlock (&t->state_lock);
 	return retval;
 }
 
 
+int teredo_set_max_peers (teredo_tunnel *t, unsigned max)
+{
+	assert (t != NULL);
+
+	if (t->running || (max == 0))
+		return -1;
+
+	t->max_peers = max;
+	teredo_list_reset (t->list, max);
+	teredo_peer_cache_invalidate (t);
+	return teredo_list_reserve (t->list, max);
+}
+
+
+int teredo_set_peer_limit (teredo_tunnel *t, unsigned max)
+{
+	assert (t != NULL);
+
+	if (max == 0)
+		return -1;
+
+	/* Same locking order as teredo_state_change() */
+	pthread_mutex_lock (&t->state_lock);
+	t->max_peers = max;
+	teredo_list_set_limit (t->list, max);
+	pthread_mutex_unlock (&t->state_lock);
+	return 0;
+}
+
+
+int teredo_set_peer_memory (teredo_tunnel *t, size_t bytes)
+{
+	assert (t != NULL);
+
+	if (t->running)
+		return -1;
+
+	int max = teredo_list_set_budget (t->list, bytes);
+	if (max < 0)
+		return -1;
+
+	/* The budget can only lower the maximum number of peers */
+	if (t->max_peers > (unsigned)max)
+		t->max_peers = max;
+	teredo_list_reset (t->list, t->max_peers);
+	teredo_peer_cache_invalidate (t);
+	return 0;
+}
+
+
+int teredo_set_max_refresh_interval (teredo_tunnel *t, unsigned sec)
+{
+	assert (t != NULL);
+
+	if (sec > 65535)
+		return -1;
+
+#ifdef MIREDO_TEREDO_CLIENT
+	pthread_mutex_lock (&t->state_lock);
+	bool started = t->maintenance != NULL;
+	if (!started)
+		t->refresh_max = sec;
+	pthread_mutex_unlock (&t->state_lock);
+	return started ? -1 : 0;
+#else
+	return -1;
+#endif
+}
+
+
+int teredo_set_relay_cache (teredo_tunnel *t, unsigned prefix_len)
+{
+	assert (t != NULL);
+
+	if (prefix_len > 64)
+		return -1;
+
+#ifdef MIREDO_TEREDO_CLIENT
+	pthread_mutex_lock (&t->state_lock);
+	bool started = t->maintenance != NULL;
+	if (!started)
+		t->relay_plen = prefix_len;
+	pthread_mutex_unlock (&t->state_lock);
+	return started ? -1 : 0;
+#else
+	return -1;
+#endif
+}
+
+
+int teredo_set_qualification_cache (teredo_tunnel *t, int fd)
+{
+	assert (t != NULL);
+
+#ifdef MIREDO_TEREDO_CLIENT
+	pthread_mutex_lock (&t->state_lock);
+	bool started = t->maintenance != NULL;
+	if (!started)
+		t->qualification_fd = fd;
+	pthread_mutex_unlock (&t->state_lock);
+	return started ? -1 : 0;
+#else
+	(void)fd;
+	return -1;
+#endif
+}
+
+
+int teredo_set_queue_size (teredo_tunnel *t, size_t bytes)
+{
+	assert (t != NULL);
+
+	/* A queue must fit at least one full packet at the minimum MTU */
+	if (t->running || (bytes < 1280) || (bytes > 65535))
+		return -1;
+
+	teredo_list_set_queue_size (t->list, bytes);
+	return 0;
+}
+
+
+int teredo_set_datapath (teredo_tunnel *t, teredo_datapath *dp)
+{
+	assert (t != NULL);
+
+	if (t->running)
+		return -1;
+
+	t->datapath = dp;
+	return 0;
+}
+
+
+int teredo_set_pmtud (teredo_tunnel *t, bool on)
+{
+	assert (t != NULL);
+
+	if (t->running)
+		return -1;
+
+	for (unsigned i = 0; i < t->nworkers; i++)
+		if (teredo_socket_pmtud (t->workers[i].fd, on))
+			return -1;
+
+	t->pmtud = on;
+	teredo_peer_cache_invalidate (t);
+	return 0;
+}
+
+
+int teredo_set_icmp_rate_limit (teredo_tunnel *t, unsigned ms)
+{
+	assert (t != NULL);
+
+	if (ms > 1000)
+		return -1;
+
+	atomic_store_explicit (&t->icmp_rate_ms, ms, memory_order_relaxed);
+	return 0;
+}
+
+
+/**
+ * Gets the local address of the tunnel socket.
+ * @return 0 on success, -1 on error.
+ */
+static int teredo_local_addr (teredo_tunnel *t, uint32_t *ip, uint16_t *port)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof (addr);
+
+	if (getsockname (t->fd, (struct sockaddr *)&addr, &addrlen))
+		return -1;
+	*ip = addr.sin_addr.s_addr;
+	*port = addr.sin_port;
+	return 0;
+}
+
+
+int teredo_set_peer_table (teredo_tunnel *t, teredo_peertable *table)
+{
+	assert (t != NULL);
+
+	if (t->running)
+		return -1;
+
+	if ((table != NULL) && teredo_local_addr (t, &t->local_ip, &t->local_port))
+		return -1;
+	t->peertable = table;
+	return 0;
+}
+
+
+int teredo_save_peers (teredo_tunnel *t, int fd)
+{
+	uint32_t ip;
+	uint16_t port;
+
+	assert (t != NULL);
+
+	if (teredo_local_addr (t, &ip, &port))
+		return -1;
+	return teredo_list_save (t->list, fd, ip, port);
+}
+
+
+int teredo_load_peers (teredo_tunnel *t, int fd)
+{
+	uint32_t ip;
+	uint16_t port;
+
+	assert (t != NULL);
+
+	if (teredo_local_addr (t, &ip, &port))
+		return -1;
+
+	return teredo_list_load (t->list, fd, ip, port);
+}
+
+
+int teredo_dump_peers (teredo_tunnel *t, int fd)
+{
+	assert (t != NULL);
+
+	return teredo_list_dump (t->list, fd);
+}
+
+
 int teredo_set_cone_flag (teredo_tunnel *t, bool cone)
 {
 	assert (t != NULL);
 
 	int retval = 0;
 
-	pthread_rwlock_wrlock (&t->state_lock);
+	pthread_mutex_lock (&t->state_lock);
 
 #ifdef MIREDO_TEREDO_CLIENT
 	if (t->maintenance != NULL)
 		retval = -1;
 	else
 #endif
-	if (cone)
-		t->state.addr.teredo.flags |= htons (TEREDO_FLAG_CONE);
-	else
-		t->state.addr.teredo.flags &= ~htons (TEREDO_FLAG_CONE);
+	{
+		if (cone)
+			t->state.addr.teredo.flags |= htons (TEREDO_FLAG_CONE);
+		else
+			t->state.addr.teredo.flags &= ~htons (TEREDO_FLAG_CONE);
+		teredo_state_publish (t);
+	}
 
-	pthread_rwlock_unlock (&t->state_lock);
+	pthread_mutex_unlock (&t->state_lock);
 
 	return retval;
 }
@@ -1047,9 +2818,9 @@ int teredo_set_relay_mode (teredo_tunnel *t)
 	int retval;
 
 #ifdef MIREDO_TEREDO_CLIENT
-	pthread_rwlock_wrlock (&t->state_lock);
+	pthread_mutex_lock (&t->state_lock);
 	retval = (t->maintenance != NULL) ? -1 : 0;
-	pthread_rwlock_unlock (&t->state_lock);
+	pthread_mutex_unlock (&t->state_lock);
 #else
 	(void)t;
 	retval = 0;
@@ -1065,18 +2836,26 @@ int teredo_set_client_mode (teredo_tunnel *restrict t,
 #ifdef MIREDO_TEREDO_CLIENT
 	assert (t != NULL);
 
-	pthread_rwlock_wrlock (&t->state_lock);
+	/* The maintenance procedure needs its own thread */
+	if (t->embedded)
+		return -1;
+
+	pthread_mutex_lock (&t->state_lock);
 	if (t->maintenance != NULL)
 	{
-		pthread_rwlock_unlock (&t->state_lock);
+		pthread_mutex_unlock (&t->state_lock);
 		return -1;
 	}
 
 	struct teredo_maintenance *m;
 	m = teredo_maintenance_start (t->fd, teredo_state_change, t, s, s2,
-	                              0, 0, 0, 0);
+	                              0, 0, 0, t->refresh_max, 0,
+	                              t->qualification_fd);
 	t->maintenance = m;
-	pthread_rwlock_unlock (&t->state_lock);
+	if (m != NULL)
+		atomic_store_explicit (&t->mode, &teredo_client_handlers,
+		                       memory_order_release);
+	pthread_mutex_unlock (&t->state_lock);
 
 	if (m != NULL)
 		return 0;
@@ -1131,16 +2910,27 @@ void teredo_set_icmpv6_callback (teredo_tunnel *restrict t,
 }
 
 
+/**
+ * Thread-safety: FIXME.
+ */
+void teredo_set_icmpv6_batch_callback (teredo_tunnel *restrict t,
+                                       teredo_icmpv6_batch_cb cb)
+{
+	assert (t != NULL);
+	t->icmpv6_batch_cb = cb;
+}
+
+
 void teredo_set_state_cb (teredo_tunnel *restrict t, teredo_state_up_cb u,
                           teredo_state_down_cb d)
 {
 #ifdef MIREDO_TEREDO_CLIENT
 	assert (t != NULL);
 
-	pthread_rwlock_wrlock (&t->state_lock);
+	pthread_mutex_lock (&t->state_lock);
 	t->up_cb = (u != NULL) ? u : teredo_dummy_state_up_cb;
 	t->down_cb = (d != NULL) ? d : teredo_dummy_state_down_cb;
-	pthread_rwlock_unlock (&t->state_lock);
+	pthread_mutex_unlock (&t->state_lock);
 #else
 	(void)t;
 	(void)u;
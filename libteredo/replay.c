@@ -0,0 +1,859 @@
+/*
+ * replay.c - Teredo relay and server capture replay benchmark
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#ifdef HAVE_GETOPT_H
+# include <getopt.h>
+#endif
+#ifdef HAVE_MALLINFO2
+# include <malloc.h>
+#endif
+
+#include <libteredo/teredo.h>
+#include <libteredo/teredo-udp.h>
+#include <libteredo/tunnel.h>
+#include "server.h"
+#include "stats.h"
+
+/*
+ * The whole capture is loaded in memory first. Datagrams toward the relay
+ * (or server) are then fed to it in batches, as if they had just been
+ * received, and IPv6 packets to teredo_transmit(), as fast as possible.
+ * Whatever the relay or server sends is counted then discarded, so the
+ * replay needs neither privileges nor network access.
+ */
+
+/** pcap link types */
+enum
+{
+	REPLAY_DLT_EN10MB = 1,
+	REPLAY_DLT_RAW = 101,
+	REPLAY_DLT_LINUX_SLL = 113,
+	REPLAY_DLT_IPV4 = 228,
+	REPLAY_DLT_IPV6 = 229,
+};
+
+typedef struct replay_frame
+{
+	const uint8_t *data; /* UDP payload or IPv6 packet */
+	uint32_t len;
+	uint32_t src_ipv4, dst_ipv4; /* network byte order, UDP only */
+	uint16_t src_port, dst_port; /* network byte order, UDP only */
+	bool ipv6;
+} replay_frame;
+
+typedef struct replay_samples
+{
+	double *v; /* nanoseconds per packet, one sample per batch */
+	size_t count, size;
+	uint64_t packets, ns, cycles;
+} replay_samples;
+
+enum
+{
+	REPLAY_RX,
+	REPLAY_TX,
+	REPLAY_MEASURES
+};
+
+static const char *const replay_measures[REPLAY_MEASURES] =
+{
+	"receive", "transmit",
+};
+
+static struct
+{
+	bool server;
+	uint32_t ipv4; /* relay or primary server address */
+	uint32_t ipv4_2; /* secondary server address */
+	unsigned loops;
+	unsigned max_peers;
+} cfg =
+{
+	.loops = 1,
+};
+
+static replay_frame *frames;
+static size_t n_frames, n_skipped;
+
+static replay_samples samples[REPLAY_MEASURES];
+
+static struct
+{
+	uint64_t udp, udp_bytes;
+	uint64_t ipv6, ipv6_bytes;
+	uint64_t tun, tun_bytes;
+	uint64_t icmp;
+} out;
+
+
+static uint64_t replay_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+
+static inline uint64_t replay_cycles (void)
+{
+#if defined (__x86_64__) || defined (__i386__)
+	return __builtin_ia32_rdtsc ();
+#else
+	return 0;
+#endif
+}
+
+
+static void replay_sample (unsigned measure, unsigned packets,
+                           uint64_t ns, uint64_t cycles)
+{
+	replay_samples *s = samples + measure;
+
+	s->packets += packets;
+	s->ns += ns;
+	s->cycles += cycles;
+
+	if (s->count >= s->size)
+	{
+		size_t size = s->size ? (2 * s->size) : 4096;
+		double *v = realloc (s->v, size * sizeof (*v));
+		if (v == NULL)
+			return;
+		s->v = v;
+		s->size = size;
+	}
+	s->v[s->count++] = (double)ns / packets;
+}
+
+
+/*** Output sinks ***/
+static void replay_sink (void *opaque, const struct iovec *iov, size_t count,
+                         uint32_t ip, uint16_t port)
+{
+	size_t len = 0;
+
+	for (size_t i = 0; i < count; i++)
+		len += iov[i].iov_len;
+
+	if ((ip == 0) && (port == 0))
+	{
+		out.ipv6++;
+		out.ipv6_bytes += len;
+	}
+	else
+	{
+		out.udp++;
+		out.udp_bytes += len;
+	}
+	(void)opaque;
+}
+
+
+static void replay_recv (void *opaque, const void *data, size_t len)
+{
+	out.tun++;
+	out.tun_bytes += len;
+	(void)opaque; (void)data;
+}
+
+
+static void replay_icmpv6 (void *opaque, const void *data, size_t len,
+                           const struct in6_addr *dst)
+{
+	out.icmp++;
+	(void)opaque; (void)data; (void)len; (void)dst;
+}
+
+
+/*** Capture parsing ***/
+static uint32_t replay_u32 (const uint8_t *p, bool swap)
+{
+	uint32_t v;
+
+	memcpy (&v, p, 4);
+	return swap ? __builtin_bswap32 (v) : v;
+}
+
+
+static uint16_t replay_be16 (const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+
+/**
+ * Finds the IP header in a link-layer frame.
+ * @return IP version (4 or 6), or 0 if the frame is not IP.
+ */
+static unsigned replay_network (unsigned linktype, const uint8_t **pp,
+                                size_t *plen)
+{
+	const uint8_t *p = *pp;
+	size_t len = *plen, hlen;
+	uint16_t type;
+
+	switch (linktype)
+	{
+		case REPLAY_DLT_EN10MB:
+			if (len < 14)
+				return 0;
+			type = replay_be16 (p + 12);
+			hlen = 14;
+			/* Skips VLAN tags */
+			while (((type == 0x8100) || (type == 0x88A8))
+			    && (len >= hlen + 4))
+			{
+				type = replay_be16 (p + hlen + 2);
+				hlen += 4;
+			}
+			break;
+
+		case REPLAY_DLT_LINUX_SLL:
+			if (len < 16)
+				return 0;
+			type = replay_be16 (p + 14);
+			hlen = 16;
+			break;
+
+		case REPLAY_DLT_RAW:
+		case REPLAY_DLT_IPV4:
+		case REPLAY_DLT_IPV6:
+			if (len < 1)
+				return 0;
+			type = ((p[0] >> 4) == 6) ? 0x86DD : 0x0800;
+			hlen = 0;
+			break;
+
+		default:
+			return 0;
+	}
+
+	*pp = p + hlen;
+	*plen = len - hlen;
+
+	switch (type)
+	{
+		case 0x0800:
+			return 4;
+		case 0x86DD:
+			return 6;
+	}
+	return 0;
+}
+
+
+/**
+ * Extracts the payload of an UDP/IPv4 datagram.
+ * @return 0 on success, -1 if not UDP or fragmented.
+ */
+static int replay_ipv4 (replay_frame *f, const uint8_t *p, size_t len)
+{
+	if ((len < 20) || ((p[0] >> 4) != 4))
+		return -1;
+
+	size_t hlen = (p[0] & 0xf) * 4, tot = replay_be16 (p + 2);
+
+	if ((hlen < 20) || (tot < hlen + 8) || (tot > len) || (p[9] != 17)
+	 || (replay_be16 (p + 6) & 0x3fff) /* fragment */)
+		return -1;
+
+	const uint8_t *udp = p + hlen;
+	size_t ulen = replay_be16 (udp + 4);
+
+	if ((ulen < 8) || (ulen > tot - hlen))
+		return -1;
+
+	memcpy (&f->src_ipv4, p + 12, 4);
+	memcpy (&f->dst_ipv4, p + 16, 4);
+	memcpy (&f->src_port, udp, 2);
+	memcpy (&f->dst_port, udp + 2, 2);
+	f->data = udp + 8;
+	f->len = ulen - 8;
+	f->ipv6 = false;
+	return 0;
+}
+
+
+static int replay_ipv6 (replay_frame *f, const uint8_t *p, size_t len)
+{
+	if ((len < sizeof (struct ip6_hdr)) || ((p[0] >> 4) != 6))
+		return -1;
+
+	size_t tot = sizeof (struct ip6_hdr) + replay_be16 (p + 4);
+	if ((tot > len) || (tot > 65535))
+		return -1;
+
+	f->data = p;
+	f->len = tot;
+	f->ipv6 = true;
+	return 0;
+}
+
+
+/**
+ * Tells whether a frame is meant for the relay or server under test.
+ */
+static bool replay_wanted (const replay_frame *f)
+{
+	if (cfg.server)
+		return !f->ipv6 && (f->dst_port == htons (IPPORT_TEREDO))
+		    && ((f->dst_ipv4 == cfg.ipv4) || (f->dst_ipv4 == cfg.ipv4_2));
+
+	if (f->ipv6 || (cfg.ipv4 == 0))
+		return true;
+	return f->dst_ipv4 == cfg.ipv4;
+}
+
+
+/**
+ * Loads a whole capture file in memory.
+ * @return the file content (to be freed), or NULL on error.
+ */
+static uint8_t *replay_load (const char *path)
+{
+	FILE *stream = fopen (path, "rb");
+	if (stream == NULL)
+	{
+		perror (path);
+		return NULL;
+	}
+
+	uint8_t *buf = NULL;
+	size_t size = 0, len = 0;
+
+	for (;;)
+	{
+		if (len == size)
+		{
+			size = size ? (2 * size) : (1 << 20);
+			uint8_t *nbuf = realloc (buf, size);
+			if (nbuf == NULL)
+			{
+				perror ("Error");
+				goto error;
+			}
+			buf = nbuf;
+		}
+
+		size_t val = fread (buf + len, 1, size - len, stream);
+		if (val == 0)
+			break;
+		len += val;
+	}
+
+	if (ferror (stream))
+	{
+		perror (path);
+		goto error;
+	}
+	fclose (stream);
+
+	bool swap;
+	uint32_t magic;
+
+	memcpy (&magic, buf, (len >= 24) ? 4 : 0);
+	if ((len < 24) || ((magic != 0xa1b2c3d4) && (magic != 0xd4c3b2a1)
+	                && (magic != 0xa1b23c4d) && (magic != 0x4d3cb2a1)))
+	{
+		fprintf (stderr, "%s: not a pcap capture file "
+		         "(pcapng is not supported)\n", path);
+		free (buf);
+		return NULL;
+	}
+
+	swap = (magic == 0xd4c3b2a1) || (magic == 0x4d3cb2a1);
+	unsigned linktype = replay_u32 (buf + 20, swap) & 0xffff;
+	size_t nalloc = 0;
+
+	for (size_t off = 24; off + 16 <= len;)
+	{
+		size_t caplen = replay_u32 (buf + off + 8, swap);
+		if (caplen > len - off - 16)
+			break; /* truncated capture */
+
+		const uint8_t *p = buf + off + 16;
+		size_t plen = caplen;
+		replay_frame f;
+		int val = -1;
+
+		off += 16 + caplen;
+
+		switch (replay_network (linktype, &p, &plen))
+		{
+			case 4:
+				val = replay_ipv4 (&f, p, plen);
+				break;
+			case 6:
+				val = replay_ipv6 (&f, p, plen);
+				break;
+		}
+
+		if (val || !replay_wanted (&f))
+		{
+			n_skipped++;
+			continue;
+		}
+
+		if (n_frames >= nalloc)
+		{
+			nalloc = nalloc ? (2 * nalloc) : 4096;
+			replay_frame *nf = realloc (frames, nalloc * sizeof (*nf));
+			if (nf == NULL)
+			{
+				perror ("Error");
+				free (buf);
+				return NULL;
+			}
+			frames = nf;
+		}
+		frames[n_frames++] = f;
+	}
+	return buf;
+
+error:
+	fclose (stream);
+	free (buf);
+	return NULL;
+}
+
+
+/*** Replay ***/
+/* Datagram buffers, as if freshly received (8-bytes aligned) */
+static alignas (8) uint8_t dgrams[TEREDO_BATCH_SIZE][65536];
+
+static teredo_packet_batch batch;
+static teredo_tunnel *tunnel;
+static teredo_server *server;
+
+
+/**
+ * Parses and processes up to a batch of consecutive datagrams.
+ */
+static void replay_udp (const replay_frame *f, unsigned n, bool sec)
+{
+	struct sockaddr_in addr[TEREDO_BATCH_SIZE];
+	union
+	{
+		struct cmsghdr hdr;
+#ifdef IP_PKTINFO
+		char buf[CMSG_SPACE (sizeof (struct in_pktinfo))];
+#else
+		char buf[CMSG_SPACE (sizeof (struct in_addr))];
+#endif
+	} cmsg[TEREDO_BATCH_SIZE];
+	struct msghdr msg[TEREDO_BATCH_SIZE];
+
+	/* Copies are not part of the measure */
+	for (unsigned i = 0; i < n; i++)
+	{
+		memcpy (dgrams[i], f[i].data, f[i].len);
+
+		memset (addr + i, 0, sizeof (addr[i]));
+		addr[i].sin_family = AF_INET;
+#ifdef HAVE_SA_LEN
+		addr[i].sin_len = sizeof (addr[i]);
+#endif
+		addr[i].sin_addr.s_addr = f[i].src_ipv4;
+		addr[i].sin_port = f[i].src_port;
+
+		memset (msg + i, 0, sizeof (msg[i]));
+		msg[i].msg_name = addr + i;
+		msg[i].msg_namelen = sizeof (addr[i]);
+		msg[i].msg_control = cmsg[i].buf;
+		msg[i].msg_controllen = sizeof (cmsg[i].buf);
+
+		struct cmsghdr *cm = CMSG_FIRSTHDR (msg + i);
+		cm->cmsg_level = IPPROTO_IP;
+#ifdef IP_PKTINFO
+		struct in_pktinfo info = { .ipi_addr.s_addr = f[i].dst_ipv4 };
+
+		cm->cmsg_type = IP_PKTINFO;
+		cm->cmsg_len = CMSG_LEN (sizeof (info));
+		memcpy (CMSG_DATA (cm), &info, sizeof (info));
+#else
+		cm->cmsg_type = IP_RECVDSTADDR;
+		cm->cmsg_len = CMSG_LEN (sizeof (struct in_addr));
+		memcpy (CMSG_DATA (cm), &f[i].dst_ipv4, sizeof (struct in_addr));
+#endif
+	}
+
+	uint64_t t0 = replay_now (), c0 = replay_cycles ();
+
+	batch.count = 0;
+	for (unsigned i = 0; i < n; i++)
+	{
+		teredo_packet *p = batch.storage + batch.count;
+
+		if (teredo_parse_msg (p, msg + i, dgrams[i], 0, f[i].len) == 0)
+			batch.packets[batch.count++] = p;
+	}
+
+	if (server != NULL)
+		teredo_server_replay (server, &batch, sec);
+	else
+		teredo_replay_batch (tunnel, &batch);
+
+	uint64_t c1 = replay_cycles (), t1 = replay_now ();
+	replay_sample (REPLAY_RX, n, t1 - t0, c1 - c0);
+}
+
+
+static void replay_ipv6_tx (const replay_frame *f)
+{
+	memcpy (dgrams[0], f->data, f->len);
+
+	uint64_t t0 = replay_now (), c0 = replay_cycles ();
+	teredo_transmit (tunnel, (const struct ip6_hdr *)dgrams[0], f->len);
+	uint64_t c1 = replay_cycles (), t1 = replay_now ();
+	replay_sample (REPLAY_TX, 1, t1 - t0, c1 - c0);
+}
+
+
+static void replay_run (void)
+{
+	for (size_t i = 0; i < n_frames;)
+	{
+		const replay_frame *f = frames + i;
+
+		if (f->ipv6)
+		{
+			replay_ipv6_tx (f);
+			i++;
+		}
+		else
+		{
+			bool sec = server && (f->dst_ipv4 == cfg.ipv4_2);
+			unsigned n = 1;
+
+			while ((n < TEREDO_BATCH_SIZE) && (i + n < n_frames)
+			    && !f[n].ipv6 && (!server
+			                   || ((f[n].dst_ipv4 == cfg.ipv4_2) == sec)))
+				n++;
+
+			replay_udp (f, n, sec);
+			i += n;
+		}
+
+		if ((tunnel != NULL) && (teredo_next_deadline (tunnel) == 0))
+			teredo_tick (tunnel);
+	}
+}
+
+
+/*** Report ***/
+static int cmp_double (const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+static void replay_report (const uint64_t *before, const uint64_t *after,
+                           long long heap)
+{
+	for (unsigned m = 0; m < REPLAY_MEASURES; m++)
+	{
+		replay_samples *s = samples + m;
+
+		if (s->packets == 0)
+			continue;
+
+		printf ("%-9s %9"PRIu64" packets  %8.1f ns/packet", replay_measures[m],
+		        s->packets, (double)s->ns / s->packets);
+		if (s->cycles > 0)
+			printf ("  %8.1f cycles/packet", (double)s->cycles / s->packets);
+		putchar ('\n');
+
+		if (s->v == NULL)
+			continue;
+
+		qsort (s->v, s->count, sizeof (*s->v), cmp_double);
+#define PC(pc) (s->v[(size_t)((pc) * (s->count - 1) / 100.)])
+		printf ("%-9s per batch  p50 %8.1f  p90 %8.1f  p99 %8.1f  "
+		        "max %8.1f ns/packet\n", "", PC (50.), PC (90.), PC (99.),
+		        PC (100.));
+#undef PC
+	}
+
+	printf ("output    %9"PRIu64" datagrams (%"PRIu64" bytes), "
+	        "%"PRIu64" IPv6 packets (%"PRIu64" bytes)\n",
+	        out.udp, out.udp_bytes, out.ipv6, out.ipv6_bytes);
+	if (tunnel != NULL)
+		printf ("tunnel    %9"PRIu64" packets (%"PRIu64" bytes), "
+		        "%"PRIu64" ICMPv6 errors\n", out.tun, out.tun_bytes, out.icmp);
+
+	uint64_t delta[TEREDO_STAT_MAX];
+	for (unsigned i = 0; i < TEREDO_STAT_MAX; i++)
+		delta[i] = after[i] - before[i];
+
+	if (tunnel != NULL)
+	{
+		uint64_t rx = delta[TEREDO_STAT_RELAY_RX];
+		uint64_t tx = delta[TEREDO_STAT_RELAY_TX];
+		uint64_t hits = delta[TEREDO_STAT_RELAY_TX_CACHED];
+
+		if (tx > 0)
+			printf ("lookups   %8.2f%% transmit peer cache misses\n",
+			        100. * (tx - hits) / tx);
+		if (rx + tx > 0)
+			printf ("          %8.2f%% packets creating a peer, "
+			        "%.2f%% filtered out\n",
+			        100. * delta[TEREDO_STAT_PEERS_ADDED] / (rx + tx),
+			        100. * delta[TEREDO_STAT_PEERS_FILTERED] / (rx + tx));
+	}
+
+#ifdef HAVE_MALLINFO2
+	printf ("heap      %+9lld bytes\n", heap);
+#else
+	(void)heap;
+#endif
+
+	for (unsigned i = 0; i < TEREDO_STAT_MAX; i++)
+		if (delta[i] != 0)
+			printf ("  %-28s %12"PRIu64"\n", teredo_stats_name (i), delta[i]);
+}
+
+
+/**
+ * @return the number of heap bytes in use.
+ */
+static long long replay_heap (void)
+{
+#ifdef HAVE_MALLINFO2
+# pragma GCC diagnostic push
+# pragma GCC diagnostic ignored "-Waggregate-return"
+	return mallinfo2 ().uordblks;
+# pragma GCC diagnostic pop
+#else
+	return 0;
+#endif
+}
+
+
+static int usage (const char *path)
+{
+	printf ("Usage: %s [OPTIONS] <capture file>\n"
+	        "Replays a packet capture through a Teredo relay or server.\n\n"
+	        "  -a, --address  relay IPv4 address, or primary server address\n"
+	        "  -b, --secondary secondary server IPv4 address "
+	                          "(default: next address)\n"
+	        "  -h, --help     display this help and exit\n"
+	        "  -l, --loops    number of times to replay (default: 1)\n"
+	        "  -p, --peers    maximum number of relay peers\n"
+	        "  -S, --server   replays through a Teredo server\n"
+	        "  -V, --version  display program version and exit\n", path);
+	return 0;
+}
+
+
+static int version (void)
+{
+	puts (PACKAGE_NAME" v"PACKAGE_VERSION);
+	return 0;
+}
+
+
+static int parse_uint (const char *str, unsigned min, unsigned max,
+                       unsigned *res)
+{
+	char *end;
+	unsigned long v = strtoul (str, &end, 0);
+
+	if ((*str == '\0') || (*end != '\0') || (v < min) || (v > max))
+	{
+		fprintf (stderr, "Invalid value: %s\n", str);
+		return -1;
+	}
+	*res = v;
+	return 0;
+}
+
+
+static int parse_ipv4 (const char *str, uint32_t *res)
+{
+	if (inet_pton (AF_INET, str, res) != 1)
+	{
+		fprintf (stderr, "Invalid IPv4 address: %s\n", str);
+		return -1;
+	}
+	return 0;
+}
+
+
+int main (int argc, char *argv[])
+{
+	static const struct option opts[] =
+	{
+		{ "address",    required_argument, NULL, 'a' },
+		{ "secondary",  required_argument, NULL, 'b' },
+		{ "help",       no_argument,       NULL, 'h' },
+		{ "loops",      required_argument, NULL, 'l' },
+		{ "peers",      required_argument, NULL, 'p' },
+		{ "server",     no_argument,       NULL, 'S' },
+		{ "version",    no_argument,       NULL, 'V' },
+		{ NULL,         no_argument,       NULL, '\0'}
+	};
+
+	int c;
+
+	while ((c = getopt_long (argc, argv, "a:b:hl:p:SV", opts, NULL)) != -1)
+		switch (c)
+		{
+			case 'a':
+				if (parse_ipv4 (optarg, &cfg.ipv4))
+					return 1;
+				break;
+
+			case 'b':
+				if (parse_ipv4 (optarg, &cfg.ipv4_2))
+					return 1;
+				break;
+
+			case 'h':
+				return usage (argv[0]);
+
+			case 'l':
+				if (parse_uint (optarg, 1, 1000000, &cfg.loops))
+					return 1;
+				break;
+
+			case 'p':
+				if (parse_uint (optarg, 1, 100000000, &cfg.max_peers))
+					return 1;
+				break;
+
+			case 'S':
+				cfg.server = true;
+				break;
+
+			case 'V':
+				return version ();
+
+			default:
+				return 1;
+		}
+
+	if ((argc - optind) != 1)
+	{
+		usage (argv[0]);
+		return 1;
+	}
+	if (cfg.server)
+	{
+		if (cfg.ipv4 == 0)
+		{
+			fputs ("Server mode requires the server address\n", stderr);
+			return 1;
+		}
+		if (cfg.ipv4_2 == 0)
+			cfg.ipv4_2 = htonl (ntohl (cfg.ipv4) + 1);
+	}
+
+	uint8_t *capture = replay_load (argv[optind]);
+	if (capture == NULL)
+		return 1;
+
+	int retval = 1;
+
+	if (teredo_startup (false))
+	{
+		fputs ("Teredo initialization error\n", stderr);
+		goto out;
+	}
+
+	if (cfg.server)
+	{
+		server = teredo_server_create_replay (cfg.ipv4, cfg.ipv4_2);
+		if (server == NULL)
+		{
+			fputs ("Teredo server error\n", stderr);
+			goto cleanup;
+		}
+	}
+	else
+	{
+		/* The loopback socket is never actually used */
+		tunnel = teredo_create_embedded (htonl (INADDR_LOOPBACK), 0, 1);
+		if (tunnel == NULL)
+		{
+			perror ("Teredo relay");
+			goto cleanup;
+		}
+		if (cfg.max_peers && teredo_set_max_peers (tunnel, cfg.max_peers))
+		{
+			perror ("Maximum peers");
+			goto cleanup;
+		}
+		teredo_set_recv_callback (tunnel, replay_recv);
+		teredo_set_icmpv6_callback (tunnel, replay_icmpv6);
+	}
+
+	printf ("%zu packets to replay, %zu skipped\n", n_frames, n_skipped);
+
+	uint64_t before[TEREDO_STAT_MAX], after[TEREDO_STAT_MAX];
+
+	teredo_set_sink (replay_sink, NULL);
+	teredo_stats_read (before);
+	long long heap = replay_heap ();
+
+	for (unsigned i = 0; i < cfg.loops; i++)
+		replay_run ();
+
+	heap = replay_heap () - heap;
+	teredo_stats_read (after);
+	teredo_set_sink (NULL, NULL);
+
+	replay_report (before, after, heap);
+	retval = 0;
+
+cleanup:
+	if (tunnel != NULL)
+		teredo_destroy (tunnel);
+	if (server != NULL)
+		teredo_server_destroy (server);
+	teredo_cleanup (false);
+out:
+	for (unsigned m = 0; m < REPLAY_MEASURES; m++)
+		free (samples[m].v);
+	free (frames);
+	free (capture);
+	return retval;
+}
@@ -28,6 +28,7 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <assert.h>
+#include <stdatomic.h>
 
 #include <sys/types.h>
 #include <fcntl.h> /* open() */
@@ -39,6 +40,7 @@
 #include "security.h"
 #include "debug.h"
 #include "md5.h"
+#include "siphash.h"
 
 #if defined (__OpenBSD__) || defined (__OpenBSD_kernel__)
 static const char randfile[] = "/dev/srandom";
@@ -54,21 +56,17 @@ static const char randfile[] = "/dev/random";
 # error HMAC key too long.
 #endif
 
-static union
-{
-	unsigned char key[LIBTEREDO_KEY_LEN];
-	unsigned char ipad[HMAC_BLOCK_LEN];
-} inner_key;
+static unsigned char hmac_key[LIBTEREDO_KEY_LEN];
 
-static union
-{
-	unsigned char key[LIBTEREDO_KEY_LEN];
-	unsigned char opad[HMAC_BLOCK_LEN];
-} outer_key;
+/* MD5 states after the HMAC inner and outer padding blocks */
+static md5_state_t inner_ctx, outer_ctx;
 
 // PID cannot be zero (otherwise, have fun using fork()!)
 static uint16_t hmac_pid = 0;
 
+/* Bumped whenever hashes change, so as to invalidate cached nonces */
+static atomic_uint hash_generation = 1;
+
 int teredo_init_HMAC (void)
 {
 	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -84,26 +82,38 @@ int teredo_init_HMAC (void)
 		if (fd == -1)
 			goto error;
 
-		memset (&inner_key, 0, sizeof (inner_key));
-
 		for (unsigned len = 0; len < LIBTEREDO_KEY_LEN;)
 		{
-			int val = read (fd, inner_key.key + len, LIBTEREDO_KEY_LEN - len);
+			int val = read (fd, hmac_key + len, LIBTEREDO_KEY_LEN - len);
 			if (val > 0)
-				len -= val;
+				len += val;
+			else if ((val == 0) || (errno != EINTR))
+			{
+				close (fd);
+				goto error;
+			}
 		}
 		close (fd);
 
 		/* Precomputes HMAC padding */
-		memcpy (&outer_key, &inner_key, sizeof (outer_key));
-	
-		for (unsigned i = 0; i < sizeof (inner_key); i++)
+		unsigned char ipad[HMAC_BLOCK_LEN], opad[HMAC_BLOCK_LEN];
+
+		memset (ipad, 0x36, sizeof (ipad));
+		memset (opad, 0x5c, sizeof (opad));
+		for (unsigned i = 0; i < sizeof (hmac_key); i++)
 		{
-			inner_key.ipad[i] ^= 0x36;
-			outer_key.opad[i] ^= 0x5c;
+			ipad[i] ^= hmac_key[i];
+			opad[i] ^= hmac_key[i];
 		}
 
+		md5_init (&inner_ctx);
+		md5_append (&inner_ctx, ipad, sizeof (ipad));
+		md5_init (&outer_ctx);
+		md5_append (&outer_ctx, opad, sizeof (opad));
+
 		hmac_pid = htons ((uint16_t)getpid ());
+		atomic_fetch_add_explicit (&hash_generation, 1,
+		                           memory_order_relaxed);
 	}
 	retval = 0;
 
@@ -122,27 +132,132 @@ void teredo_deinit_HMAC (void)
 
 #define LIBTEREDO_HASH_LEN 16
 
-static void
-teredo_hash (const void *src, size_t slen, const void *dst, size_t dlen,
-             uint8_t *restrict hash, uint32_t timestamp)
+typedef void (*teredo_mac_fn) (const void *, size_t, uint8_t *restrict);
+typedef void (*teredo_mac_multi_fn) (const void *const *, size_t,
+                                     uint8_t (*)[LIBTEREDO_HASH_LEN],
+                                     unsigned);
+
+static void teredo_mac_md5 (const void *msg, size_t len,
+                            uint8_t *restrict hash)
 {
-	/* compute hash */
-	md5_state_t ctx;
-	md5_init (&ctx);
-	md5_append (&ctx, inner_key.ipad, sizeof (inner_key.ipad));
-	md5_append (&ctx, (const unsigned char *)src, slen);
-	md5_append (&ctx, (const unsigned char *)dst, dlen);
-	md5_append (&ctx, (const unsigned char *)&hmac_pid, sizeof (hmac_pid));
-	md5_append (&ctx, (const unsigned char *)&timestamp, sizeof (timestamp));
+	md5_state_t ctx = inner_ctx;
+	md5_append (&ctx, (const unsigned char *)msg, len);
 	md5_finish (&ctx, hash);
 
-	md5_init (&ctx);
-	md5_append (&ctx, outer_key.opad, sizeof (outer_key.opad));
+	ctx = outer_ctx;
 	md5_append (&ctx, hash, LIBTEREDO_HASH_LEN);
 	md5_finish (&ctx, hash);
 }
 
 
+/**
+ * Computes the HMAC-MD5 of several messages of the same length at once,
+ * with the multi-buffer MD5 functions.
+ */
+static void teredo_mac_md5_multi (const void *const *msgs, size_t len,
+                                  uint8_t (*hashes)[LIBTEREDO_HASH_LEN],
+                                  unsigned n)
+{
+	const md5_byte_t *ptrs[n];
+
+	md5_finish_multi (&inner_ctx, (const md5_byte_t *const *)msgs, len,
+	                  hashes, n);
+	for (unsigned i = 0; i < n; i++)
+		ptrs[i] = hashes[i];
+	md5_finish_multi (&outer_ctx, ptrs, LIBTEREDO_HASH_LEN, hashes, n);
+}
+
+
+static void teredo_mac_siphash (const void *msg, size_t len,
+                                uint8_t *restrict hash)
+{
+	siphash (hmac_key, msg, len, hash, LIBTEREDO_HASH_LEN);
+}
+
+
+static void teredo_mac_siphash_multi (const void *const *msgs, size_t len,
+                                      uint8_t (*hashes)[LIBTEREDO_HASH_LEN],
+                                      unsigned n)
+{
+	/* SipHash is cheaper than multi-buffer MD5 as is */
+	for (unsigned i = 0; i < n; i++)
+		teredo_mac_siphash (msgs[i], len, hashes[i]);
+}
+
+
+static const struct
+{
+	const char *name;
+	teredo_mac_fn mac;
+	teredo_mac_multi_fn mac_multi;
+} teredo_macs[] =
+{
+	{ "siphash", teredo_mac_siphash, teredo_mac_siphash_multi },
+	{ "hmac-md5", teredo_mac_md5, teredo_mac_md5_multi },
+};
+
+static teredo_mac_fn teredo_mac = teredo_mac_siphash;
+static teredo_mac_multi_fn teredo_mac_multi = teredo_mac_siphash_multi;
+
+
+int teredo_select_mac (const char *name)
+{
+	for (size_t i = 0; i < sizeof (teredo_macs) / sizeof (teredo_macs[0]); i++)
+		if (strcmp (name, teredo_macs[i].name) == 0)
+		{
+			teredo_mac = teredo_macs[i].mac;
+			teredo_mac_multi = teredo_macs[i].mac_multi;
+			atomic_fetch_add_explicit (&hash_generation, 1,
+			                           memory_order_relaxed);
+			return 0;
+		}
+	return -1;
+}
+
+
+#define LIBTEREDO_MSG_MAX \
+	(2 * sizeof (struct in6_addr) + sizeof (hmac_pid) + sizeof (uint32_t))
+
+/**
+ * Formats the message authenticated by a hash.
+ * @return the message length.
+ */
+static size_t
+teredo_hash_msg (const void *src, size_t slen, const void *dst, size_t dlen,
+                 uint32_t timestamp, uint8_t msg[LIBTEREDO_MSG_MAX])
+{
+	uint8_t *ptr = msg;
+
+	assert (slen + dlen <= 2 * sizeof (struct in6_addr));
+	if (slen > 0)
+	{
+		memcpy (ptr, src, slen);
+		ptr += slen;
+	}
+	if (dlen > 0)
+	{
+		memcpy (ptr, dst, dlen);
+		ptr += dlen;
+	}
+	memcpy (ptr, &hmac_pid, sizeof (hmac_pid));
+	ptr += sizeof (hmac_pid);
+	memcpy (ptr, &timestamp, sizeof (timestamp));
+	ptr += sizeof (timestamp);
+	return ptr - msg;
+}
+
+
+static void
+teredo_hash (const void *src, size_t slen, const void *dst, size_t dlen,
+             uint8_t *restrict hash, uint32_t timestamp)
+{
+	uint8_t msg[LIBTEREDO_MSG_MAX];
+	size_t len = teredo_hash_msg (src, slen, dst, dlen, timestamp, msg);
+
+	teredo_mac (msg, len, hash);
+}
+
+
 #ifdef MIREDO_TEREDO_CLIENT
 /**
  * Generates a cryptographically strong hash to use a payload for ping
@@ -237,12 +352,121 @@ uint16_t teredo_get_flbits (uint32_t timestamp)
 #if LIBTEREDO_HASH_LEN < LIBTEREDO_NONCE_LEN
 # error Inconsistent hash size
 #endif
+
+/*
+ * Nonces only depend on the peer mapping and on a timestamp (the time
+ * bucket), so that a burst of bubbles from or to the same mapping yields
+ * the same nonce over and over. Each thread keeps the most recent nonces in
+ * a small direct-mapped cache, so such bursts cost only one hash.
+ */
+#define TEREDO_NONCE_CACHE_BITS 6
+#define TEREDO_NONCE_CACHE_SIZE (1 << TEREDO_NONCE_CACHE_BITS)
+#define TEREDO_NONCE_BATCH 32 /* nonces hashed at once */
+
+struct teredo_nonce_entry
+{
+	uint32_t ipv4;
+	uint32_t timestamp;
+	uint16_t port;
+	unsigned generation; // zero if the entry is unused
+	uint8_t nonce[LIBTEREDO_NONCE_LEN];
+};
+
+static _Thread_local struct teredo_nonce_entry
+	nonce_cache[TEREDO_NONCE_CACHE_SIZE];
+
+static inline unsigned
+teredo_nonce_slot (uint32_t timestamp, uint32_t ipv4, uint16_t port)
+{
+	uint32_t h = (ipv4 ^ timestamp ^ port) * UINT32_C(0x9e3779b1);
+	return h >> (32 - TEREDO_NONCE_CACHE_BITS);
+}
+
+
 void
 teredo_get_nonce (uint32_t timestamp, uint32_t ipv4, uint16_t port,
                   uint8_t *restrict nonce)
 {
-	uint8_t buf[LIBTEREDO_HASH_LEN];
+	unsigned gen = atomic_load_explicit (&hash_generation,
+	                                     memory_order_relaxed);
+	struct teredo_nonce_entry *e =
+		nonce_cache + teredo_nonce_slot (timestamp, ipv4, port);
+
+	if ((e->generation != gen) || (e->ipv4 != ipv4) || (e->port != port)
+	 || (e->timestamp != timestamp))
+	{
+		uint8_t buf[LIBTEREDO_HASH_LEN];
+
+		teredo_hash (&ipv4, 4, &port, 2, buf, timestamp);
+		memcpy (e->nonce, buf, LIBTEREDO_NONCE_LEN);
+		e->ipv4 = ipv4;
+		e->port = port;
+		e->timestamp = timestamp;
+		e->generation = gen;
+	}
+
+	memcpy (nonce, e->nonce, LIBTEREDO_NONCE_LEN);
+}
+
+
+void
+teredo_get_nonces (uint32_t timestamp, const uint32_t *ipv4,
+                   const uint16_t *port,
+                   uint8_t (*restrict nonces)[LIBTEREDO_NONCE_LEN], unsigned n)
+{
+	unsigned gen = atomic_load_explicit (&hash_generation,
+	                                     memory_order_relaxed);
 
-	teredo_hash (&ipv4, 4, &port, 2, buf, timestamp);
-	memcpy (nonce, buf, LIBTEREDO_NONCE_LEN);
+	while (n > 0)
+	{
+		uint8_t msgs[TEREDO_NONCE_BATCH][LIBTEREDO_MSG_MAX];
+		const void *ptrs[TEREDO_NONCE_BATCH];
+		uint8_t hashes[TEREDO_NONCE_BATCH][LIBTEREDO_HASH_LEN];
+		unsigned index[TEREDO_NONCE_BATCH], misses = 0, count = n;
+		size_t len = 0;
+
+		if (count > TEREDO_NONCE_BATCH)
+			count = TEREDO_NONCE_BATCH;
+
+		/* Cache hits are served right away, misses are hashed together */
+		for (unsigned i = 0; i < count; i++)
+		{
+			const struct teredo_nonce_entry *e =
+				nonce_cache + teredo_nonce_slot (timestamp, ipv4[i], port[i]);
+
+			if ((e->generation == gen) && (e->ipv4 == ipv4[i])
+			 && (e->port == port[i]) && (e->timestamp == timestamp))
+			{
+				memcpy (nonces[i], e->nonce, LIBTEREDO_NONCE_LEN);
+				continue;
+			}
+
+			len = teredo_hash_msg (ipv4 + i, 4, port + i, 2, timestamp,
+			                       msgs[misses]);
+			ptrs[misses] = msgs[misses];
+			index[misses++] = i;
+		}
+
+		if (misses > 0)
+			teredo_mac_multi (ptrs, len, hashes, misses);
+
+		for (unsigned j = 0; j < misses; j++)
+		{
+			unsigned i = index[j];
+			struct teredo_nonce_entry *e =
+				nonce_cache + teredo_nonce_slot (timestamp, ipv4[i], port[i]);
+
+			memcpy (nonces[i], hashes[j], LIBTEREDO_NONCE_LEN);
+			memcpy (e->nonce, hashes[j], LIBTEREDO_NONCE_LEN);
+			e->ipv4 = ipv4[i];
+			e->port = port[i];
+			e->timestamp = timestamp;
+			e->generation = gen;
+		}
+
+		ipv4 += count;
+		port += count;
+		nonces += count;
+		n -= count;
+	}
 }
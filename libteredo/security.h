@@ -32,6 +32,17 @@ extern "C" {
 #define LIBTEREDO_HMAC_LEN 22
 
 int teredo_init_HMAC (void);
+
+/**
+ * Selects the keyed hash function used to authenticate pings and nonces,
+ * either "siphash" (the default) or "hmac-md5". Those hashes are only
+ * ever verified by the host that generated them, so the choice does not
+ * affect interoperability. This must be called before any hash is
+ * generated, as changing the function invalidates outstanding hashes.
+ *
+ * @return 0 on success, -1 if the function is unknown.
+ */
+int teredo_select_mac (const char *name);
 void teredo_deinit_HMAC (void);
 void teredo_get_pinghash (uint32_t timestamp, const struct in6_addr *src,
                           const struct in6_addr *dst, uint8_t *restrict hash);
@@ -41,6 +52,17 @@ int teredo_verify_pinghash (uint32_t now, const struct in6_addr *src,
 
 void teredo_get_nonce (uint32_t timestamp, uint32_t ipv4, uint16_t port,
                        uint8_t *restrict nonce);
+
+/**
+ * Computes the nonces of several mappings at once, as teredo_get_nonce()
+ * would. Nonces that are not cached are hashed together, which is much
+ * faster with HMAC-MD5. This also primes the cache of the calling thread
+ * for subsequent teredo_get_nonce() calls.
+ */
+void teredo_get_nonces (uint32_t timestamp, const uint32_t *ipv4,
+                        const uint16_t *port,
+                        uint8_t (*restrict nonces)[LIBTEREDO_NONCE_LEN],
+                        unsigned n);
 uint16_t teredo_get_flbits (uint32_t timestamp);
 
 # ifdef __cplusplus
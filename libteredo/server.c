@@ -28,12 +28,12 @@
 #include <stddef.h>
 #include <string.h> /* memcpy(), memset() */
 #include <inttypes.h>
-#include <limits.h>
 
 #include <stdbool.h>
 #include <errno.h> // errno
 #include <stdio.h> // snprintf()
 #include <stdlib.h>
+#include <assert.h>
 
 #include <sys/types.h>
 #include <unistd.h> // close()
@@ -44,6 +44,7 @@
 #include <netinet/icmp6.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <syslog.h>
 
 #include "server.h"
@@ -54,41 +55,144 @@
 #include "checksum.h"
 #include "debug.h"
 #include "packets.h"
+#include "stats.h"
+#include "clock.h"
+#include "sketch.h"
+#ifdef HAVE_IO_URING
+# include "uring.h"
+#endif
 
-static pthread_mutex_t raw_mutex = PTHREAD_MUTEX_INITIALIZER;
-static int raw_fd; // raw IPv6 socket
-static unsigned raw_users = 0;
+/* Queue of IPv6 packets to be sent through a raw IPv6 socket */
+struct teredo_rawq
+{
+	int fd; // raw IPv6 socket (non-blocking)
+	unsigned count;
+	size_t used;
+	struct teredo_rawq_entry
+	{
+		size_t offset;
+		size_t length;
+	} entries[TEREDO_SENDQ_SIZE];
+	uint8_t buf[65536];
+};
 
-struct teredo_server
+/* Router Advertisement, as sent by the server */
+struct teredo_ra
+{
+	struct ip6_hdr            ip6;
+	struct nd_router_advert   ra;
+	struct nd_opt_prefix_info pi;
+	struct nd_opt_mtu         mtu;
+};
+
+/*
+ * Each worker thread owns one UDP/IPv4 socket on each server address. With
+ * several workers, sockets share their address (SO_REUSEPORT), so that the
+ * kernel spreads clients across workers.
+ */
+struct teredo_server_worker
 {
+	teredo_server *server;
 	pthread_t t1, t2;
+#ifdef HAVE_IO_URING
+	teredo_uring *uring; // single thread for both sockets if not NULL
+	bool t2_running;
+#endif
+	int cpu; // CPU to run on, or -1 for any
+
+	int fd[2]; // UDP/IPv4 sockets (primary, secondary)
 
-	int fd_primary, fd_secondary; // UDP/IPv4 sockets
+	teredo_packet_batch batch[2]; // reception buffers (primary, secondary)
+	teredo_sendq sendq[2]; // replies queues (primary, secondary)
+	struct teredo_rawq rawq[2]; // forwarding queues (primary, secondary)
+	teredo_sketch *limit[2]; // per-client budgets, or NULL if unlimited
+};
+
+struct teredo_server
+{
+	struct teredo_server_worker *workers;
+	unsigned nworkers;
 
 	/* These are all in network byte order (including MTU!!) */
 	uint32_t server_ip, server_ip2, prefix, advLinkMTU;
 
 	union teredo_addr lladdr; // server link-local IPv6 address
+
+	/* Router Advertisement with unspecified destination, and checksum */
+	struct teredo_ra ra;
 };
 
+/**
+ * Builds the Router Advertisement template from the server configuration.
+ * Everything but the destination address is constant.
+ */
+static void teredo_server_build_RA (teredo_server *s)
+{
+	struct teredo_ra *ra = &s->ra;
+	struct in6_addr *addr;
+
+	// IPv6 header
+	memset (ra, 0, sizeof (*ra));
+	ra->ip6.ip6_flow = htonl (0x60000000);
+	ra->ip6.ip6_plen = htons (sizeof (*ra) - sizeof (ra->ip6));
+	ra->ip6.ip6_nxt = IPPROTO_ICMPV6;
+	ra->ip6.ip6_hlim = 255;
+	ra->ip6.ip6_src = s->lladdr.ip6;
+	//ra->ip6.ip6_dst = in6addr_any;
+
+	// ICMPv6: Router Advertisement
+	ra->ra.nd_ra_type = ND_ROUTER_ADVERT;
+	//ra->ra.nd_ra_code = 0;
+	//ra->ra.nd_ra_cksum = 0;
+	//ra->ra.nd_ra_curhoplimit = 0;
+	//ra->ra.nd_ra_flags_reserved = 0;
+	//ra->ra.nd_ra_router_lifetime = 0;
+	//ra->ra.nd_ra_reachable = 0;
+	ra->ra.nd_ra_retransmit = htonl (2000);
+
+	// ICMPv6 option: Prefix information
+	ra->pi.nd_opt_pi_type = ND_OPT_PREFIX_INFORMATION;
+	ra->pi.nd_opt_pi_len = sizeof (ra->pi) >> 3;
+	ra->pi.nd_opt_pi_prefix_len = 64;
+	ra->pi.nd_opt_pi_flags_reserved = ND_OPT_PI_FLAG_AUTO;
+	ra->pi.nd_opt_pi_valid_time = 0xffffffff;
+	ra->pi.nd_opt_pi_preferred_time = 0xffffffff;
+	addr = &ra->pi.nd_opt_pi_prefix;
+	memcpy (&addr->s6_addr[0], &s->prefix, sizeof (s->prefix));
+	memcpy (&addr->s6_addr[4], &s->server_ip, sizeof (s->server_ip));
+	//memset (addr->ip6.s6_addr + 8, 0, 8);
+
+	// ICMPv6 option : MTU
+	ra->mtu.nd_opt_mtu_type = ND_OPT_MTU;
+	ra->mtu.nd_opt_mtu_len = sizeof (ra->mtu) >> 3;
+	//ra->mtu.nd_opt_mtu_reserved = 0;
+	ra->mtu.nd_opt_mtu_mtu = s->advLinkMTU;
+
+	// ICMPv6 checksum computation
+	ra->ra.nd_ra_cksum = icmp6_checksum (&ra->ip6,
+	                                     (struct icmp6_hdr *)&ra->ra);
+}
+
+
 /**
  * Sends a Teredo-encapsulated Router Advertisement.
+ *
+ * This is not offloaded to the eBPF datapath (see bpf.c): the reply
+ * depends on the per-client rate limiter, an optional authentication
+ * header shifts the packet layout, cone clients get it from the other
+ * server address, and the prefix and MTU can change at run time. Replies
+ * are batched on the server sockets instead (see teredo_sendq_start()).
  */
 static bool
-SendRA (const teredo_server *restrict s, const struct teredo_packet *p,
-        const struct in6_addr *dest_ip6, bool secondary)
+SendRA (const struct teredo_server_worker *restrict w,
+        const struct teredo_packet *p, const struct in6_addr *dest_ip6,
+        bool secondary)
 {
+	const teredo_server *s = w->server;
 	const uint8_t *nonce;
-	struct in6_addr *addr;
 	uint8_t auth[13] = { 0, 1 };
 	struct teredo_orig_ind orig;
-	struct
-	{
-		struct ip6_hdr            ip6;
-		struct nd_router_advert   ra;
-		struct nd_opt_prefix_info pi;
-		struct nd_opt_mtu         mtu;
-	} ra;
+	struct teredo_ra ra;
 	struct iovec iov[] =
 	{
 		{ auth, 13 },
@@ -111,51 +215,18 @@ SendRA (const teredo_server *restrict s, const struct teredo_packet *p,
 	orig.orig_port = ~p->source_port; // obfuscate
 	orig.orig_addr = ~p->source_ipv4; // obfuscate
 
-	// IPv6 header
-	memset (&ra, 0, sizeof (ra));
-	ra.ip6.ip6_flow = htonl (0x60000000);
-	ra.ip6.ip6_plen = htons (sizeof (ra) - sizeof (ra.ip6));
-	ra.ip6.ip6_nxt = IPPROTO_ICMPV6;
-	ra.ip6.ip6_hlim = 255;
-	ra.ip6.ip6_src = s->lladdr.ip6;
+	// Router Advertisement: only the destination differs
+	memcpy (&ra, &s->ra, sizeof (ra));
 	ra.ip6.ip6_dst = *dest_ip6;
-
-	// ICMPv6: Router Advertisement
-	ra.ra.nd_ra_type = ND_ROUTER_ADVERT;
-	//ra.ra.nd_ra_code = 0;
-	//ra.ra.nd_ra_cksum = 0;
-	//ra.ra.nd_ra_curhoplimit = 0;
-	//ra.ra.nd_ra_flags_reserved = 0;
-	//ra.ra.nd_ra_router_lifetime = 0;
-	//ra.ra.nd_ra_reachable = 0;
-	ra.ra.nd_ra_retransmit = htonl (2000);
-
-	// ICMPv6 option: Prefix information
-	ra.pi.nd_opt_pi_type = ND_OPT_PREFIX_INFORMATION;
-	ra.pi.nd_opt_pi_len = sizeof (ra.pi) >> 3;
-	ra.pi.nd_opt_pi_prefix_len = 64;
-	ra.pi.nd_opt_pi_flags_reserved = ND_OPT_PI_FLAG_AUTO;
-	ra.pi.nd_opt_pi_valid_time = 0xffffffff;
-	ra.pi.nd_opt_pi_preferred_time = 0xffffffff;
-	addr = &ra.pi.nd_opt_pi_prefix;
-	memcpy (&addr->s6_addr[0], &s->prefix, sizeof (s->prefix));
-	memcpy (&addr->s6_addr[4], &s->server_ip, sizeof (s->server_ip));
-	//memset (addr->ip6.s6_addr + 8, 0, 8);
-
-	// ICMPv6 option : MTU
-	ra.mtu.nd_opt_mtu_type = ND_OPT_MTU;
-	ra.mtu.nd_opt_mtu_len = sizeof (ra.mtu) >> 3;
-	//ra.mtu.nd_opt_mtu_reserved = 0;
-	ra.mtu.nd_opt_mtu_mtu = s->advLinkMTU;
-
-	// ICMPv6 checksum computation
-	ra.ra.nd_ra_cksum = icmp6_checksum (&ra.ip6, (struct icmp6_hdr *)&ra.ra);
+	ra.ra.nd_ra_cksum = teredo_cksum_adjust (ra.ra.nd_ra_cksum,
+	                                         &in6addr_any, dest_ip6,
+	                                         sizeof (*dest_ip6));
 
 	if (IN6_IS_TEREDO_ADDR_CONE (dest_ip6))
 		secondary = !secondary;
 
-	return teredo_sendv (secondary ? s->fd_secondary : s->fd_primary,
-	                     iov, 3, p->source_ipv4, p->source_port) > 0;
+	return teredo_sendv (w->fd[secondary], iov, 3,
+	                     p->source_ipv4, p->source_port) > 0;
 }
 
 
@@ -199,47 +270,182 @@ teredo_forward_udp (int fd, const struct teredo_packet *packet,
 }
 
 
+static int teredo_raw_socket (void)
+{
+	int fd = socket (AF_INET6, SOCK_RAW, IPPROTO_RAW);
+	if (fd != -1)
+	{
+		int flags = fcntl (fd, F_GETFL, 0);
+		//shutdown (fd, SHUT_RD); -- won't work
+		fcntl (fd, F_SETFL, O_NONBLOCK | ((flags != -1) ? flags : 0));
+		fcntl (fd, F_SETFD, FD_CLOEXEC);
+	}
+	return fd;
+}
+
+
 /**
- * Sends an IPv6 packet of *payload* length <plen> with a raw IPv6 socket.
+ * @return true if a send error reports an earlier ICMPv6 error, rather
+ * than a problem with the packet being sent.
  */
-static bool
-teredo_send_ipv6 (const struct ip6_hdr *p, size_t len)
+static bool teredo_raw_icmp_error (int err)
 {
-	struct sockaddr_in6 dst;
+	switch (err)
+	{
+		case ENETUNREACH: /* ICMPv6 unreach no route */
+		case EACCES: /* ICMPv6 unreach administravely prohibited */
+		case EHOSTUNREACH: /* ICMPv6 unreach addres unreachable */
+			               /* ICMPv6 time exceeded */
+		case ECONNREFUSED: /* ICMPv6 unreach port unreachable */
+		case EMSGSIZE: /* ICMPv6 packet too big */
+#ifdef EPROTO
+		case EPROTO: /* ICMPv6 param prob (and other errors) */
+#endif
+			return true;
+	}
+	return false;
+}
 
-	memset (&dst, 0, sizeof (dst));
-	dst.sin6_family = AF_INET6;
+
+static void teredo_raw_dest (struct sockaddr_in6 *dst, const void *p)
+{
+	memset (dst, 0, sizeof (*dst));
+	dst->sin6_family = AF_INET6;
 #ifdef HAVE_SA_LEN
-	dst.sin6_len = sizeof (dst);
+	dst->sin6_len = sizeof (*dst);
 #endif
-	dst.sin6_addr = p->ip6_dst;
+	memcpy (&dst->sin6_addr,
+	        (const uint8_t *)p + offsetof (struct ip6_hdr, ip6_dst),
+	        sizeof (dst->sin6_addr));
+}
+
+
+/**
+ * Sends an IPv6 packet immediately. Never blocks.
+ */
+static bool teredo_raw_send (int fd, const void *p, size_t len)
+{
+	struct sockaddr_in6 dst;
 
-	for (int tries = 0; tries < 10; tries++)
+	if (teredo_sink (&(struct iovec){ (void *)p, len }, 1, 0, 0))
+		return true;
+
+	teredo_raw_dest (&dst, p);
+
+	/* A pending asynchronous error is consumed by the failed call, so
+	 * one retry is enough to tell it from an error with this packet. */
+	for (int tries = 0; tries < 2; tries++)
 	{
-		ssize_t res = sendto (raw_fd, p, len, 0,
-		                      (struct sockaddr *)&dst, sizeof (dst));
+		ssize_t res = sendto (fd, p, len, 0, (struct sockaddr *)&dst,
+		                      sizeof (dst));
 		if (res != -1)
 			return res == (ssize_t)len;
+		if (!teredo_raw_icmp_error (errno))
+			break;
+	}
+	return false;
+}
+
+
+/**
+ * Sends all queued IPv6 packets, with as few system calls as possible.
+ * Packets that cannot be sent right away are dropped.
+ */
+static void teredo_rawq_flush (struct teredo_rawq *q)
+{
+	unsigned done = 0;
 
-		switch (errno)
+	for (; done < q->count; done++)
+	{
+		const struct teredo_rawq_entry *e = q->entries + done;
+		struct iovec iov = { q->buf + e->offset, e->length };
+
+		if (!teredo_sink (&iov, 1, 0, 0))
+			break;
+	}
+#ifdef HAVE_SENDMMSG
+	struct sockaddr_in6 dst[TEREDO_SENDQ_SIZE];
+	struct iovec iov[TEREDO_SENDQ_SIZE];
+	struct mmsghdr vec[TEREDO_SENDQ_SIZE];
+
+	memset (vec, 0, q->count * sizeof (vec[0]));
+	for (unsigned i = 0; i < q->count; i++)
+	{
+		const struct teredo_rawq_entry *e = q->entries + i;
+
+		iov[i].iov_base = q->buf + e->offset;
+		iov[i].iov_len = e->length;
+		teredo_raw_dest (dst + i, iov[i].iov_base);
+		vec[i].msg_hdr.msg_name = dst + i;
+		vec[i].msg_hdr.msg_namelen = sizeof (dst[i]);
+		vec[i].msg_hdr.msg_iov = iov + i;
+		vec[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	bool retried = false;
+
+	while (done < q->count)
+	{
+		int val = sendmmsg (q->fd, vec + done, q->count - done, 0);
+		if (val > 0)
 		{
-			case ENETUNREACH: /* ICMPv6 unreach no route */
-			case EACCES: /* ICMPv6 unreach administravely prohibited */
-			case EHOSTUNREACH: /* ICMPv6 unreach addres unreachable */
-				               /* ICMPv6 time exceeded */
-			case ECONNREFUSED: /* ICMPv6 unreach port unreachable */
-			case EMSGSIZE: /* ICMPv6 packet too big */
-#ifdef EPROTO
-			case EPROTO: /* ICMPv6 param prob (and other errors) */
-#endif
-				break;
+			done += val;
+			retried = false;
+			continue;
+		}
 
-			default:
-				return false;
+		if (val == -1)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)
+			 || (errno == ENOBUFS))
+				break; /* socket buffer full: do not wait */
+			if (!retried && teredo_raw_icmp_error (errno))
+			{
+				retried = true; /* earlier error now consumed */
+				continue;
+			}
 		}
+		done++; /* skips a packet that cannot be sent */
+		retried = false;
+	}
+#else
+	for (; done < q->count; done++)
+	{
+		const struct teredo_rawq_entry *e = q->entries + done;
+
+		teredo_raw_send (q->fd, q->buf + e->offset, e->length);
 	}
+#endif
+	q->count = 0;
+	q->used = 0;
+}
 
-	return false;
+
+/**
+ * Queues an IPv6 packet of total length <len> to be sent with a raw IPv6
+ * socket, when the queue is flushed.
+ */
+static bool
+teredo_send_ipv6 (struct teredo_rawq *q, const struct ip6_hdr *p, size_t len)
+{
+	if (len > sizeof (q->buf))
+		return teredo_raw_send (q->fd, p, len);
+
+	/* Packets are kept 8-bytes aligned */
+	size_t offset = (q->used + 7) & ~(size_t)7;
+
+	if ((q->count >= TEREDO_SENDQ_SIZE) || (len > sizeof (q->buf) - offset))
+	{
+		teredo_rawq_flush (q);
+		offset = 0;
+	}
+
+	struct teredo_rawq_entry *e = q->entries + q->count++;
+	e->offset = offset;
+	e->length = len;
+	memcpy (q->buf + offset, p, len);
+	q->used = offset + len;
+	return true;
 }
 
 
@@ -284,32 +490,32 @@ static void debug_error_header (const uint32_t *v4src,
  * Thread-safety note: prefix and advLinkMTU might be changed by another
  * thread.
  * @return -1 in case of I/O error, -2 if the packet was discarded,
- * 1 if it was processed as a qualification probe,
- * 2 if it was processed as a request for direct IPv6 connectivity check,
+ * -3 if the client exceeded its rate limit, 1 if it was processed as a
+ * qualification probe, 2 if it was processed as a request for direct IPv6
+ * connectivity check,
  * 3 if it was forwarded over UDP/IPv4 (hole punching).
  */
 static int
-teredo_process_packet (const teredo_server *s, bool sec)
+teredo_process_packet (const struct teredo_server_worker *w,
+                       struct teredo_rawq *rawq,
+                       const struct teredo_packet *packet, bool sec)
 {
-	struct teredo_packet packet;
-
-	if (teredo_wait_recv (sec ? s->fd_secondary : s->fd_primary, &packet))
-		return -1;
+	const teredo_server *s = w->server;
 
 	// Check IPv6 packet (Teredo server case number 1)
-	const struct ip6_hdr *ip6 = packet.ip6;
-	if (packet.ip6_len < sizeof (*ip6))
+	const struct ip6_hdr *ip6 = packet->ip6;
+	if (packet->ip6_len < sizeof (*ip6))
      	{
-		debug_error_header (&packet.source_ipv4, NULL, NULL);
-		debug ("Packet too small: %d bytes", packet.ip6_len);
+		debug_error_header (&packet->source_ipv4, NULL, NULL);
+		debug ("Packet too small: %d bytes", packet->ip6_len);
 		return -2; // too small
 	}
 
 	size_t plen = ntohs (ip6->ip6_plen);
 	if (((ip6->ip6_vfc >> 4) != 6)
-	 || ((sizeof (*ip6) + plen) > packet.ip6_len))
+	 || ((sizeof (*ip6) + plen) > packet->ip6_len))
      	{
-		debug_error_header (&packet.source_ipv4, NULL, NULL);
+		debug_error_header (&packet->source_ipv4, NULL, NULL);
 		debug ("Not an IPv6 packet: Version %d", ip6->ip6_vfc >> 4);
 		return -2; // not an IPv6 packet
 	}
@@ -320,16 +526,16 @@ teredo_process_packet (const teredo_server *s, bool sec)
 	if (!IsBubble (ip6) // neither a bubble...
 	 && (ip6->ip6_nxt != IPPROTO_ICMPV6)) // nor an ICMPv6 message
      	{
-		debug_error_header (&packet.source_ipv4,
+		debug_error_header (&packet->source_ipv4,
 		                    &ip6->ip6_src, &ip6->ip6_dst);
 		debug ("Packet not allowed: Protocol %d", ip6->ip6_nxt);
 		return -2; // packet not allowed through server
 	}
 
 	// Teredo server case number 3
-	if (!is_ipv4_global_unicast (packet.source_ipv4))
+	if (!is_ipv4_global_unicast (packet->source_ipv4))
      	{
-	   	debug_error_header (&packet.source_ipv4,
+	   	debug_error_header (&packet->source_ipv4,
 		                    &ip6->ip6_src, &ip6->ip6_dst);
 		debug ("Source is not IPv4 unicast.");
 		return -2;
@@ -349,8 +555,8 @@ teredo_process_packet (const teredo_server *s, bool sec)
 	{
 		/** Source address is Teredo **/
 		// Teredo server case number 5
-		if (IN6_MATCHES_TEREDO_CLIENT (&ip6->ip6_src, packet.source_ipv4,
-		                               packet.source_port))
+		if (IN6_MATCHES_TEREDO_CLIENT (&ip6->ip6_src, packet->source_ipv4,
+		                               packet->source_port))
 			goto accept;
 	}
 	else
@@ -363,7 +569,7 @@ teredo_process_packet (const teredo_server *s, bool sec)
 	}
 
 	// Teredo server case number 7
-	debug_error_header (&packet.source_ipv4, &ip6->ip6_src, &ip6->ip6_dst);
+	debug_error_header (&packet->source_ipv4, &ip6->ip6_src, &ip6->ip6_dst);
 	debug ("Drop packet.");
 	return -2;
 
@@ -371,17 +577,29 @@ accept:
 	/** Packet "accepted" for processing **/
 
 	/* Security fix: Prevent infinite local UDP packet loops */
-	if (((packet.source_ipv4 == s->server_ip)
-	  || (packet.source_ipv4 == s->server_ip2))
-	 && (packet.source_port == htons (IPPORT_TEREDO)))
+	if (((packet->source_ipv4 == s->server_ip)
+	  || (packet->source_ipv4 == s->server_ip2))
+	 && (packet->source_port == htons (IPPORT_TEREDO)))
      	{
-	   	debug_error_header (&packet.source_ipv4, &ip6->ip6_src,
+	   	debug_error_header (&packet->source_ipv4, &ip6->ip6_src,
 		                    &ip6->ip6_dst);
 		debug ("Prevent infinite local UDP packet loops from port %d",
-		       ntohs (packet.source_port));
+		       ntohs (packet->source_port));
 		return -2;
 	}
 
+	/* Rate limiting: only accepted packets cost anything to process */
+	teredo_sketch *limit = w->limit[sec];
+	if ((limit != NULL)
+	 && !teredo_sketch_admit (limit, packet->source_ipv4, packet->source_port,
+	                          teredo_clock ()))
+	{
+		debug_error_header (&packet->source_ipv4, &ip6->ip6_src,
+		                    &ip6->ip6_dst);
+		debug ("Client exceeded rate limit");
+		return -3;
+	}
+
 	if (IN6_ARE_ADDR_EQUAL (&in6addr_allrouters, &ip6->ip6_dst)
 	 || IN6_ARE_ADDR_EQUAL (&s->lladdr.ip6, &ip6->ip6_dst))
 	{
@@ -390,15 +608,15 @@ accept:
 		if ((ip6->ip6_nxt == IPPROTO_ICMPV6)
 		 && (plen >= sizeof (struct nd_router_solicit))
 		 && (icmp->icmp6_type == ND_ROUTER_SOLICIT))
-			return SendRA (s, &packet, &ip6->ip6_src, sec) ? 1 : -1;
+			return SendRA (w, packet, &ip6->ip6_src, sec) ? 1 : -1;
 		if(ip6->ip6_nxt == IPPROTO_ICMPV6)
 	     	{
-			debug_error_header(&packet.source_ipv4,
+			debug_error_header(&packet->source_ipv4,
 			                   &ip6->ip6_src, &ip6->ip6_dst);
 			debug ("Unhandled router message: ICMP type %d",
 			       icmp->icmp6_type);
 		} else {
-			debug_error_header(&packet.source_ipv4,
+			debug_error_header(&packet->source_ipv4,
 			                   &ip6->ip6_src, &ip6->ip6_dst);
 			debug ("Unhandled router message: Protocol %d",
 			       ip6->ip6_nxt);
@@ -409,7 +627,7 @@ accept:
 	/* Servers must not forward packets with non-global destination */
 	if (!IN6_IS_ADDR_GLOBAL (&ip6->ip6_dst))
      	{
-		debug_error_header (&packet.source_ipv4,
+		debug_error_header (&packet->source_ipv4,
 		                    &ip6->ip6_src, &ip6->ip6_dst);
 		debug ("Destination is no global IPv6 address");
 		return -2;
@@ -431,22 +649,54 @@ accept:
 	 */
 	if ((ip6->ip6_nxt != IPPROTO_NONE) && (plen > 88))
      	{
-		debug_error_header (&packet.source_ipv4,
+		debug_error_header (&packet->source_ipv4,
 		                    &ip6->ip6_src, &ip6->ip6_dst);
 		debug ("ICMPv6 too large (%zu bytes)", plen);
 		return -2;
 	}
 
 	if (IN6_TEREDO_PREFIX (&ip6->ip6_dst) != myprefix)
-		return teredo_send_ipv6 (packet.ip6,
+		return teredo_send_ipv6 (rawq, packet->ip6,
 		                         sizeof (*ip6) + plen) ? 2 : -1;
 
 	// Forwards packet over Teredo (destination is a Teredo IPv6 address)
-	return teredo_forward_udp (s->fd_primary, &packet,
+	return teredo_forward_udp (w->fd[0], packet,
 		IN6_TEREDO_SERVER (&ip6->ip6_dst) == s->server_ip) ? 3 : -1;
 }
 
 
+/**
+ * Handles a Teredo-encapsulated packet, and accounts for the outcome.
+ */
+static void
+teredo_server_handle (const struct teredo_server_worker *w,
+                      struct teredo_rawq *rawq,
+                      const struct teredo_packet *packet, bool sec)
+{
+	enum teredo_stat outcome;
+
+	switch (teredo_process_packet (w, rawq, packet, sec))
+	{
+		case 1:
+			outcome = TEREDO_STAT_SERVER_RA;
+			break;
+		case 2:
+			outcome = TEREDO_STAT_SERVER_FWD_IPV6;
+			break;
+		case 3:
+			outcome = TEREDO_STAT_SERVER_FWD_TEREDO;
+			break;
+		case -3:
+			outcome = TEREDO_STAT_SERVER_RX_LIMITED;
+			break;
+		default:
+			outcome = TEREDO_STAT_SERVER_RX_DROPPED;
+	}
+	teredo_stat_inc (TEREDO_STAT_SERVER_RX);
+	teredo_stat_inc (outcome);
+}
+
+
 int teredo_server_check (char *errmsg, size_t len)
 {
 	int fd = socket (AF_INET6, SOCK_RAW, IPPROTO_RAW);
@@ -464,57 +714,194 @@ int teredo_server_check (char *errmsg, size_t len)
 }
 
 
-static LIBTEREDO_NORETURN void *thread_primary (void *data)
+
+
+/**
+ * Names the calling thread and binds it to the CPU assigned to its worker,
+ * if any (which takes precedence over the packets threads policy).
+ */
+static void teredo_server_pin (const struct teredo_server_worker *w,
+                               bool sec)
+{
+	teredo_thread_setup (TEREDO_THREAD_PACKETS,
+	                     sec ? "teredo-srv%u.2" : "teredo-srv%u",
+	                     (unsigned)(w - w->server->workers));
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	if (w->cpu >= 0)
+	{
+		cpu_set_t set;
+
+		CPU_ZERO (&set);
+		CPU_SET (w->cpu, &set);
+		errno = pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+		if (errno)
+			syslog (LOG_WARNING, _("Error (%s): %m"),
+			        "pthread_setaffinity_np");
+	}
+#else
+	(void)w;
+#endif
+}
+
+
+static LIBTEREDO_NORETURN void
+teredo_server_thread (struct teredo_server_worker *w, bool sec)
 {
+	teredo_packet_batch *batch = w->batch + sec;
+	teredo_sendq *sendq = w->sendq + sec;
+	struct teredo_rawq *rawq = w->rawq + sec;
+	int fd = w->fd[sec];
+
+	teredo_sendq_init (sendq, fd);
+
 	for (;;)
 	{
 		pthread_testcancel ();
-		teredo_process_packet ((teredo_server *)data, false);
+		if (teredo_recv_batch (fd, batch, TEREDO_BATCH_SIZE) <= 0)
+			continue;
+
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+		/* Replies to a batch of requests are sent at once */
+		teredo_sendq_start (sendq);
+		for (unsigned i = 0; i < batch->count; i++)
+			teredo_server_handle (w, rawq, batch->packets[i], sec);
+		teredo_sendq_stop (sendq);
+		teredo_rawq_flush (rawq);
+		pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
 	}
 }
 
 
+static LIBTEREDO_NORETURN void *thread_primary (void *data)
+{
+	struct teredo_server_worker *w = data;
+
+	teredo_server_pin (w, false);
+	teredo_server_thread (w, false);
+}
+
+
 static LIBTEREDO_NORETURN void *thread_secondary (void *data)
 {
-	for (;;)
+	struct teredo_server_worker *w = data;
+
+	teredo_server_pin (w, true);
+	teredo_server_thread (w, true);
+}
+
+
+#ifdef HAVE_IO_URING
+static void teredo_server_uring_cb (void *opaque, unsigned index,
+                                    struct teredo_packet *packet)
+{
+	struct teredo_server_worker *w = opaque;
+	struct teredo_rawq *rawq = w->rawq;
+
+	if (packet != NULL)
+		teredo_server_handle (w, rawq, packet, index != 0);
+	else
+		teredo_rawq_flush (rawq);
+}
+
+
+static LIBTEREDO_NORETURN void *thread_uring (void *data)
+{
+	struct teredo_server_worker *w = data;
+
+	teredo_server_pin (w, false);
+
+	/* Most replies go through the primary socket */
+	teredo_sendq_init (w->sendq, w->fd[0]);
+	pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+	if (teredo_uring_run (w->uring, w->sendq, teredo_server_uring_cb,
+	                      w) == 0)
+		pthread_exit (NULL);
+
+	/* Falls back to one thread per socket on error */
+	syslog (LOG_WARNING, _("Error (%s): %m"), "io_uring_enter");
+	w->t2_running = pthread_create (&w->t2, NULL, thread_secondary, w) == 0;
+	if (!w->t2_running)
+		syslog (LOG_ERR, _("Error (%s): %m"), "pthread_create");
+	pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+	teredo_server_thread (w, false);
+}
+#endif
+
+
+static void teredo_server_socket_error (uint32_t ip)
+{
+	char str[INET_ADDRSTRLEN];
+
+	inet_ntop (AF_INET, &ip, str, sizeof (str));
+	syslog (LOG_ERR, _("Error (%s): %m"), str);
+}
+
+
+/**
+ * Releases the sockets of a worker.
+ */
+static void teredo_server_worker_close (struct teredo_server_worker *w)
+{
+	for (unsigned i = 0; i < 2; i++)
 	{
-		pthread_testcancel ();
-		teredo_process_packet ((teredo_server *)data, true);
+		if (w->fd[i] != -1)
+			teredo_close (w->fd[i]);
+		if (w->rawq[i].fd != -1)
+			close (w->rawq[i].fd);
 	}
 }
 
 
-teredo_server *teredo_server_create (uint32_t ip1, uint32_t ip2)
+/**
+ * Opens the sockets of a worker.
+ * @param shared whether the UDP sockets share their address with other
+ * workers' (SO_REUSEPORT).
+ * @return 0 on success, -1 on error.
+ */
+static int teredo_server_worker_open (struct teredo_server_worker *w,
+                                      const uint32_t *ip, bool shared)
 {
-	(void)bindtextdomain (PACKAGE_NAME, LOCALEDIR);
+	w->cpu = -1;
+	w->fd[0] = w->fd[1] = w->rawq[0].fd = w->rawq[1].fd = -1;
 
-	/* Initializes shared raw IPv6 socket */
-	pthread_mutex_lock (&raw_mutex);
-	if (raw_users == UINT_MAX) /* integer overflow */
+	/* Raw IPv6 sockets: one per thread to avoid contention */
+	w->rawq[0].fd = teredo_raw_socket ();
+	w->rawq[1].fd = teredo_raw_socket ();
+	if ((w->rawq[0].fd == -1) || (w->rawq[1].fd == -1))
 	{
-		/* piece of code that will probably never ever be executed */
-		pthread_mutex_unlock (&raw_mutex);
-		return NULL;
+		syslog (LOG_ERR, _("Raw IPv6 socket not working: %m"));
+		goto error;
 	}
-	if (raw_users++ == 0)
+
+	for (unsigned i = 0; i < 2; i++)
 	{
-		raw_fd = socket (AF_INET6, SOCK_RAW, IPPROTO_RAW);
-		if (raw_fd != -1)
+		w->fd[i] = shared ? teredo_socket_shared (ip[i], htons (IPPORT_TEREDO))
+		                  : teredo_socket (ip[i], htons (IPPORT_TEREDO));
+		if (w->fd[i] == -1)
 		{
-			int flags = fcntl (raw_fd, F_GETFL, 0);
-			//shutdown (fd, SHUT_RD); -- won't work
-			fcntl (raw_fd, F_SETFL,
-			       O_NONBLOCK | ((flags != -1) ? flags : 0));
-			fcntl (raw_fd, F_SETFD, FD_CLOEXEC);
+			teredo_server_socket_error (ip[i]);
+			goto error;
 		}
 	}
-	pthread_mutex_unlock (&raw_mutex);
+	return 0;
 
-	if (raw_fd == -1)
-	{
-		syslog (LOG_ERR, _("Raw IPv6 socket not working: %m"));
-		return NULL;
-	}
+error:
+	teredo_server_worker_close (w);
+	return -1;
+}
+
+
+/**
+ * Allocates a Teredo server handler.
+ * @param replay true to skip opening sockets (see teredo_server_create_replay)
+ */
+static teredo_server *teredo_server_new (uint32_t ip1, uint32_t ip2,
+                                         unsigned workers, bool replay)
+{
+	(void)bindtextdomain (PACKAGE_NAME, LOCALEDIR);
+
+	assert (workers > 0);
 
 	/* Initializes exclusive UDP/IPv4 sockets */
 	if (!is_ipv4_global_unicast (ip1) || !is_ipv4_global_unicast (ip2))
@@ -525,49 +912,87 @@ teredo_server *teredo_server_create (uint32_t ip1, uint32_t ip2)
 	}
 
 	teredo_server *s = malloc (sizeof (*s));
+	if (s == NULL)
+		return NULL;
 
-	if (s != NULL)
+	memset (s, 0, sizeof (*s));
+	s->workers = calloc (workers, sizeof (*s->workers));
+	if (s->workers == NULL)
 	{
-		int fd;
+		free (s);
+		return NULL;
+	}
 
-		memset (s, 0, sizeof (*s));
-		s->server_ip = ip1;
-		s->server_ip2 = ip2;
-		s->prefix = htonl (TEREDO_PREFIX);
-		s->advLinkMTU = htonl (1280);
-		s->lladdr.teredo.prefix = htonl (0xfe800000);
-		//s->lladdr.teredo.server_ip = 0;
-		s->lladdr.teredo.flags = htons (TEREDO_FLAG_CONE);
-		s->lladdr.teredo.client_port = ~htons (IPPORT_TEREDO);
-		s->lladdr.teredo.client_ip = ~s->server_ip;
+	s->server_ip = ip1;
+	s->server_ip2 = ip2;
+	s->prefix = htonl (TEREDO_PREFIX);
+	s->advLinkMTU = htonl (1280);
+	s->lladdr.teredo.prefix = htonl (0xfe800000);
+	//s->lladdr.teredo.server_ip = 0;
+	s->lladdr.teredo.flags = htons (TEREDO_FLAG_CONE);
+	s->lladdr.teredo.client_port = ~htons (IPPORT_TEREDO);
+	s->lladdr.teredo.client_ip = ~s->server_ip;
+	teredo_server_build_RA (s);
 
-		fd = s->fd_primary = teredo_socket (ip1, htons (IPPORT_TEREDO));
-		if (fd != -1)
-		{
-			fd = s->fd_secondary = teredo_socket (ip2, htons (IPPORT_TEREDO));
-			if (fd != -1)
-				return s;
-			else
-			{
-				char str[INET_ADDRSTRLEN];
+	const uint32_t ip[2] = { ip1, ip2 };
 
-				inet_ntop (AF_INET, &ip2, str, sizeof (str));
-				syslog (LOG_ERR, _("Error (%s): %m"), str);
-			}
+	for (unsigned i = 0; i < workers; i++)
+	{
+		struct teredo_server_worker *w = s->workers + i;
 
-			teredo_close (s->fd_primary);
+		if (replay)
+		{
+			w->cpu = -1;
+			w->fd[0] = w->fd[1] = w->rawq[0].fd = w->rawq[1].fd = -1;
 		}
 		else
+		if (teredo_server_worker_open (w, ip, workers > 1))
 		{
-			char str[INET_ADDRSTRLEN];
-
-			inet_ntop (AF_INET, &ip1, str, sizeof (str));
-			syslog (LOG_ERR, _("Error (%s): %m"), str);
+			while (i > 0)
+				teredo_server_worker_close (s->workers + --i);
+			free (s->workers);
+			free (s);
+			return NULL;
 		}
-
-		free (s);
+		w->server = s;
 	}
-	return NULL;
+	s->nworkers = workers;
+	return s;
+}
+
+
+teredo_server *teredo_server_create_workers (uint32_t ip1, uint32_t ip2,
+                                             unsigned workers)
+{
+	return teredo_server_new (ip1, ip2, workers, false);
+}
+
+
+teredo_server *teredo_server_create (uint32_t ip1, uint32_t ip2)
+{
+	return teredo_server_new (ip1, ip2, 1, false);
+}
+
+
+teredo_server *teredo_server_create_replay (uint32_t ip1, uint32_t ip2)
+{
+	return teredo_server_new (ip1, ip2, 1, true);
+}
+
+
+void teredo_server_replay (teredo_server *s,
+                           const struct teredo_packet_batch *batch, bool sec)
+{
+	struct teredo_server_worker *w = s->workers;
+	teredo_sendq *sendq = w->sendq + sec;
+	struct teredo_rawq *rawq = w->rawq + sec;
+
+	teredo_sendq_init (sendq, w->fd[sec]);
+	teredo_sendq_start (sendq);
+	for (unsigned i = 0; i < batch->count; i++)
+		teredo_server_handle (w, rawq, batch->packets[i], sec);
+	teredo_sendq_stop (sendq);
+	teredo_rawq_flush (rawq);
 }
 
 
@@ -576,6 +1001,7 @@ int teredo_server_set_prefix (teredo_server *s, uint32_t prefix)
 	if (is_valid_teredo_prefix (prefix))
 	{
 		s->prefix = prefix;
+		teredo_server_build_RA (s);
 		return 0;
 	}
 	return -1;
@@ -593,6 +1019,7 @@ int teredo_server_set_MTU (teredo_server *s, uint16_t mtu)
 		return -1;
 
 	s->advLinkMTU = htonl (mtu);
+	teredo_server_build_RA (s);
 	return 0;
 }
 
@@ -603,37 +1030,162 @@ uint16_t teredo_server_get_MTU (const teredo_server *s)
 }
 
 
-int teredo_server_start (teredo_server *s)
+int teredo_server_set_rate_limit (teredo_server *s, unsigned budget)
+{
+	if (budget > TEREDO_SKETCH_MAX_BUDGET)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (unsigned i = 0; i < s->nworkers; i++)
+		for (unsigned j = 0; j < 2; j++)
+		{
+			teredo_sketch **limit = s->workers[i].limit + j;
+
+			if (budget == 0)
+			{
+				free (*limit);
+				*limit = NULL;
+				continue;
+			}
+
+			if (*limit == NULL)
+			{
+				*limit = malloc (sizeof (**limit));
+				if (*limit == NULL)
+					return -1;
+			}
+
+			if (teredo_sketch_init (*limit, budget))
+				return -1;
+		}
+
+	return 0;
+}
+
+
+int teredo_server_set_cpu_affinity (teredo_server *s, bool on)
+{
+	for (unsigned i = 0; i < s->nworkers; i++)
+		s->workers[i].cpu = -1;
+
+	if (!on)
+		return 0;
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t set;
+
+	if (sched_getaffinity (0, sizeof (set), &set))
+		return -1;
+
+	unsigned ncpu = CPU_COUNT (&set);
+	if (ncpu == 0)
+		return -1;
+
+	/* Worker i runs on the (i modulo ncpu)-th allowed CPU */
+	for (unsigned i = 0; i < s->nworkers; i++)
+	{
+		unsigned n = i % ncpu;
+		int cpu = 0;
+
+		for (;; cpu++)
+			if (CPU_ISSET (cpu, &set) && (n-- == 0))
+				break;
+		s->workers[i].cpu = cpu;
+	}
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
+static int teredo_server_worker_start (struct teredo_server_worker *w)
 {
-	if (pthread_create (&s->t1, NULL, thread_primary, s) == 0)
+#ifdef HAVE_IO_URING
+	w->t2_running = false;
+	w->uring = teredo_uring_create (w->fd, 2);
+	if (w->uring != NULL)
 	{
-		if (pthread_create (&s->t2, NULL, thread_secondary, s) == 0)
+		if (pthread_create (&w->t1, NULL, thread_uring, w) == 0)
 			return 0;
-		pthread_cancel (s->t1);
-		pthread_join (s->t1, NULL);
+		teredo_uring_destroy (w->uring);
+		w->uring = NULL;
+	}
+#endif
+
+	if (pthread_create (&w->t1, NULL, thread_primary, w) == 0)
+	{
+		if (pthread_create (&w->t2, NULL, thread_secondary, w) == 0)
+			return 0;
+		pthread_cancel (w->t1);
+		pthread_join (w->t1, NULL);
 	}
 
 	return -1;
 }
 
 
+static void teredo_server_worker_stop (struct teredo_server_worker *w)
+{
+#ifdef HAVE_IO_URING
+	if (w->uring != NULL)
+	{
+		teredo_uring_stop (w->uring);
+		pthread_cancel (w->t1);
+		pthread_join (w->t1, NULL);
+		if (w->t2_running)
+		{
+			pthread_cancel (w->t2);
+			pthread_join (w->t2, NULL);
+		}
+		teredo_uring_destroy (w->uring);
+		w->uring = NULL;
+		return;
+	}
+#endif
+	pthread_cancel (w->t1);
+	pthread_cancel (w->t2);
+	pthread_join (w->t1, NULL);
+	pthread_join (w->t2, NULL);
+}
+
+
+int teredo_server_start (teredo_server *s)
+{
+	for (unsigned i = 0; i < s->nworkers; i++)
+		if (teredo_server_worker_start (s->workers + i))
+		{
+			while (i > 0)
+				teredo_server_worker_stop (s->workers + --i);
+			return -1;
+		}
+
+	return 0;
+}
+
+
 void teredo_server_stop (teredo_server *s)
 {
-	pthread_cancel (s->t1);
-	pthread_cancel (s->t2);
-	pthread_join (s->t1, NULL);
-	pthread_join (s->t2, NULL);
+	for (unsigned i = 0; i < s->nworkers; i++)
+		teredo_server_worker_stop (s->workers + i);
 }
 
 
 void teredo_server_destroy (teredo_server *s)
 {
-	teredo_close (s->fd_primary);
-	teredo_close (s->fd_secondary);
-	free (s);
+	for (unsigned i = 0; i < s->nworkers; i++)
+	{
+		struct teredo_server_worker *w = s->workers + i;
 
-	pthread_mutex_lock (&raw_mutex);
-	if (--raw_users == 0)
-		close (raw_fd);
-	pthread_mutex_unlock (&raw_mutex);
+		teredo_server_worker_close (w);
+		teredo_packet_batch_destroy (w->batch);
+		teredo_packet_batch_destroy (w->batch + 1);
+		free (w->limit[0]);
+		free (w->limit[1]);
+	}
+	free (s->workers);
+	free (s);
 }
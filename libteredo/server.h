@@ -25,6 +25,7 @@
 
 
 typedef struct teredo_server teredo_server;
+struct teredo_packet_batch;
 
 #ifdef __cplusplus
 extern "C" {
@@ -45,6 +46,40 @@ int teredo_server_check (char *errmsg, size_t len);
  */
 teredo_server *teredo_server_create (uint32_t ip1, uint32_t ip2);
 
+/**
+ * Creates a Teredo server handler with several workers, much like
+ * teredo_server_create(). Each worker gets its own UDP/IPv4 socket on both
+ * server addresses, bound with SO_REUSEPORT, so that the kernel spreads
+ * clients across workers. Once teredo_server_start() is called, each worker
+ * runs in its own thread(s).
+ *
+ * @param workers number of workers (one is the same as
+ * teredo_server_create()).
+ *
+ * @return NULL on error (e.g. the system lacks SO_REUSEPORT).
+ */
+teredo_server *teredo_server_create_workers (uint32_t ip1, uint32_t ip2,
+                                             unsigned workers);
+
+/**
+ * Creates a Teredo server handler without any socket, to replay captured
+ * traffic with teredo_server_replay(). Replies are only ever handed to the
+ * sink of the calling thread (see teredo_set_sink()).
+ * Do not call teredo_server_start() on this handler.
+ *
+ * @return NULL on error.
+ */
+teredo_server *teredo_server_create_replay (uint32_t ip1, uint32_t ip2);
+
+/**
+ * Processes a batch of datagrams as if they had been received by a server
+ * handler from teredo_server_create_replay(), in the calling thread.
+ *
+ * @param sec whether the datagrams were received on the secondary address.
+ */
+void teredo_server_replay (teredo_server *s,
+                           const struct teredo_packet_batch *batch, bool sec);
+
 /**
  * Changes the Teredo prefix to be advertised by a Teredo server.
  * If not set, the internal default will be used.
@@ -52,6 +87,8 @@ teredo_server *teredo_server_create (uint32_t ip1, uint32_t ip2);
  * @param s server handler as returned from teredo_server_create(),
  * @param prefix 32-bits IPv6 address prefix (network byte order).
  *
+ * Not thread-safe: call before teredo_server_start().
+ *
  * @return 0 on success, -1 if the prefix is not acceptable.
  */
 int teredo_server_set_prefix (teredo_server *s, uint32_t prefix);
@@ -71,6 +108,8 @@ uint32_t teredo_server_get_prefix (const teredo_server *s);
  * @param s server handler as returned from teredo_server_create(),
  * @param prefix MTU (in bytes) (host byte order).
  *
+ * Not thread-safe: call before teredo_server_start().
+ *
  * @return 0 on success, -1 if the MTU is not acceptable.
  */
 int teredo_server_set_MTU (teredo_server *s, uint16_t mtu);
@@ -82,6 +121,37 @@ int teredo_server_set_MTU (teredo_server *s, uint16_t mtu);
  */
 uint16_t teredo_server_get_MTU (const teredo_server *s);
 
+/**
+ * Limits how many packets each client (UDP/IPv4 source) may have processed
+ * per second, in any one server worker and address. Further packets are
+ * dropped. Clients are counted in a fixed-size sketch, so that a flood from
+ * many sources cannot exhaust memory; hash collisions may make a client
+ * appear busier than it really is, never the opposite.
+ *
+ * @param s server handler as returned from teredo_server_create(),
+ * @param budget packets per second and per client, or 0 for no limit
+ * (the default).
+ *
+ * Not thread-safe: call before teredo_server_start().
+ *
+ * @return 0 on success, -1 on error.
+ */
+int teredo_server_set_rate_limit (teredo_server *s, unsigned budget);
+
+/**
+ * Enables or disables binding of the server workers to CPUs. If enabled,
+ * each worker thread runs on a single CPU, in a round-robin fashion across
+ * the CPUs that the process is allowed to run on.
+ *
+ * @param s server handler as returned from teredo_server_create(),
+ * @param on whether to bind workers to CPUs.
+ *
+ * Not thread-safe: call before teredo_server_start().
+ *
+ * @return 0 on success, -1 if not supported.
+ */
+int teredo_server_set_cpu_affinity (teredo_server *s, bool on);
+
 /**
  * Starts a Teredo server processing.
  *
@@ -0,0 +1,114 @@
+/*
+ * siphash.c - SipHash-2-4 keyed hash function
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+/*
+ * See Aumasson & Bernstein, "SipHash: a fast short-input PRF" (2012).
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "siphash.h"
+
+static inline uint64_t rotl (uint64_t x, unsigned b)
+{
+	return (x << b) | (x >> (64 - b));
+}
+
+static inline uint64_t load64_le (const uint8_t *p)
+{
+	uint64_t v = 0;
+
+	for (unsigned i = 0; i < 8; i++)
+		v |= ((uint64_t)p[i]) << (8 * i);
+	return v;
+}
+
+static inline void store64_le (uint8_t *p, uint64_t v)
+{
+	for (unsigned i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = rotl (v1, 13); v1 ^= v0; v0 = rotl (v0, 32); \
+		v2 += v3; v3 = rotl (v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = rotl (v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = rotl (v1, 17); v1 ^= v2; v2 = rotl (v2, 32); \
+	} while (0)
+
+
+void siphash (const uint8_t key[SIPHASH_KEY_LEN], const void *data,
+              size_t len, uint8_t *restrict out, size_t outlen)
+{
+	const uint8_t *p = data;
+	uint64_t k0 = load64_le (key), k1 = load64_le (key + 8);
+	uint64_t v0 = k0 ^ UINT64_C(0x736f6d6570736575);
+	uint64_t v1 = k1 ^ UINT64_C(0x646f72616e646f6d);
+	uint64_t v2 = k0 ^ UINT64_C(0x6c7967656e657261);
+	uint64_t v3 = k1 ^ UINT64_C(0x7465646279746573);
+	uint64_t b = ((uint64_t)len) << 56;
+
+	assert ((outlen == 8) || (outlen == 16));
+	if (outlen == 16)
+		v1 ^= 0xee;
+
+	for (; len >= 8; len -= 8, p += 8)
+	{
+		uint64_t m = load64_le (p);
+
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	for (unsigned i = 0; i < len; i++)
+		b |= ((uint64_t)p[i]) << (8 * i);
+
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+
+	v2 ^= (outlen == 16) ? 0xee : 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	store64_le (out, v0 ^ v1 ^ v2 ^ v3);
+
+	if (outlen == 16)
+	{
+		v1 ^= 0xdd;
+		SIPROUND;
+		SIPROUND;
+		SIPROUND;
+		SIPROUND;
+		store64_le (out + 8, v0 ^ v1 ^ v2 ^ v3);
+	}
+}
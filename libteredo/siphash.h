@@ -0,0 +1,47 @@
+/**
+ * @file siphash.h
+ * @brief SipHash-2-4 keyed hash function
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_SIPHASH_H
+# define LIBTEREDO_SIPHASH_H
+
+# define SIPHASH_KEY_LEN 16
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Computes a SipHash-2-4 message authentication code.
+ *
+ * @param key 128-bits secret key
+ * @param data message
+ * @param len message length (bytes)
+ * @param out [OUT] MAC
+ * @param outlen MAC length: 8 (SipHash-2-4) or 16 (SipHash-2-4-128)
+ */
+void siphash (const uint8_t key[SIPHASH_KEY_LEN], const void *data,
+              size_t len, uint8_t *restrict out, size_t outlen);
+
+# ifdef __cplusplus
+}
+# endif
+#endif /* ifndef LIBTEREDO_SIPHASH_H */
@@ -0,0 +1,135 @@
+/*
+ * sketch.c - Per-source packet budgets in fixed memory
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_GETRANDOM
+# include <sys/random.h>
+#endif
+
+#include "clock.h"
+#include "siphash.h"
+#include "sketch.h"
+
+/**
+ * Gets a non-predictable key, so that sources cannot be chosen to collide.
+ */
+static int sketch_random (uint8_t *buf, size_t len)
+{
+#ifdef HAVE_GETRANDOM
+	/* Works inside a chroot too */
+	while (len > 0)
+	{
+		ssize_t val = getrandom (buf, len, 0);
+		if (val > 0)
+		{
+			buf += val;
+			len -= val;
+		}
+		else if (errno != EINTR)
+			break;
+	}
+	if (len == 0)
+		return 0;
+#endif
+	int fd = open ("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	while (len > 0)
+	{
+		ssize_t val = read (fd, buf, len);
+		if (val > 0)
+		{
+			buf += val;
+			len -= val;
+		}
+		else if ((val == 0) || (errno != EINTR))
+			break;
+	}
+	close (fd);
+	return (len == 0) ? 0 : -1;
+}
+
+
+int teredo_sketch_init (teredo_sketch *s, unsigned budget)
+{
+	if ((budget == 0) || (budget > TEREDO_SKETCH_MAX_BUDGET))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (sketch_random (s->key, sizeof (s->key)))
+		return -1;
+
+	s->epoch = teredo_clock ();
+	s->budget = budget;
+	memset (s->counts, 0, sizeof (s->counts));
+	return 0;
+}
+
+
+bool teredo_sketch_admit (teredo_sketch *s, uint32_t ipv4, uint16_t port,
+                          teredo_clock_t now)
+{
+	if (now != s->epoch)
+	{
+		s->epoch = now;
+		memset (s->counts, 0, sizeof (s->counts));
+	}
+
+	uint8_t src[6], hash[8];
+	memcpy (src, &ipv4, 4);
+	memcpy (src + 4, &port, 2);
+	siphash (s->key, src, sizeof (src), hash, sizeof (hash));
+
+	/* Each row takes 16 bits of the hash */
+	uint16_t *counters[TEREDO_SKETCH_ROWS];
+	unsigned min = UINT16_MAX;
+
+	for (unsigned i = 0; i < TEREDO_SKETCH_ROWS; i++)
+	{
+		unsigned col = (hash[2 * i] | (hash[2 * i + 1] << 8))
+		               & (TEREDO_SKETCH_COLS - 1);
+
+		counters[i] = s->counts[i] + col;
+		if (*counters[i] < min)
+			min = *counters[i];
+	}
+
+	if (min >= s->budget)
+		return false;
+
+	/* Conservative update: only the smallest counters are incremented */
+	for (unsigned i = 0; i < TEREDO_SKETCH_ROWS; i++)
+		if (*counters[i] == min)
+			(*counters[i])++;
+	return true;
+}
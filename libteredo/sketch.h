@@ -0,0 +1,74 @@
+/**
+ * @file sketch.h
+ * @brief Per-source packet budgets in fixed memory
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_SKETCH_H
+# define LIBTEREDO_SKETCH_H
+
+/*
+ * Packets are counted per UDP/IPv4 source in a count-min sketch: each
+ * source maps to one counter per row, through a keyed hash, and its count
+ * is the smallest of its counters. Collisions can only overestimate the
+ * count of a source, never underestimate it. Counts are reset every
+ * second. The sketch is not thread-safe: each thread needs its own.
+ */
+# define TEREDO_SKETCH_ROWS 4
+# define TEREDO_SKETCH_COLS 8192 // must be a power of two, at most 65536
+# define TEREDO_SKETCH_MAX_BUDGET UINT16_MAX
+
+typedef struct teredo_sketch
+{
+	uint8_t key[16]; /* SipHash key */
+	teredo_clock_t epoch; /* second of the current counts */
+	unsigned budget; /* packets per second and per source */
+	uint16_t counts[TEREDO_SKETCH_ROWS][TEREDO_SKETCH_COLS];
+} teredo_sketch;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Initializes a sketch with a random key.
+ *
+ * @param budget packets allowed per second from each source
+ * (1 to TEREDO_SKETCH_MAX_BUDGET)
+ *
+ * @return 0 on success, -1 on error (no random key).
+ */
+int teredo_sketch_init (teredo_sketch *s, unsigned budget);
+
+/**
+ * Accounts for a packet from a source, if it is within the budget.
+ *
+ * @param ipv4 source IPv4 address (network byte order)
+ * @param port source UDP port (network byte order)
+ * @param now current clock value
+ *
+ * @return true if the packet is allowed, false if over budget.
+ */
+bool teredo_sketch_admit (teredo_sketch *s, uint32_t ipv4, uint16_t port,
+                          teredo_clock_t now);
+
+# ifdef __cplusplus
+}
+# endif
+#endif /* ifndef LIBTEREDO_SKETCH_H */
@@ -0,0 +1,160 @@
+/*
+ * slab.c - Fixed-size objects allocator
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <assert.h>
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "slab.h"
+
+/*
+ * Chunks are cache line aligned, so that objects whose size divides the
+ * cache line size never straddle two lines.
+ */
+#define TEREDO_SLAB_ALIGN 64
+
+struct teredo_slab_chunk
+{
+	teredo_slab_chunk *next;
+	alignas (TEREDO_SLAB_ALIGN) max_align_t data[];
+};
+
+
+static size_t slab_object_size (size_t size)
+{
+	const size_t align = sizeof (max_align_t);
+
+	if (size < sizeof (void *))
+		size = sizeof (void *);
+	return (size + align - 1) & ~(align - 1);
+}
+
+
+void teredo_slab_init (teredo_slab *slab, size_t size, unsigned per_chunk)
+{
+	assert (per_chunk > 0);
+
+	slab->free = NULL;
+	slab->chunks = NULL;
+	slab->size = slab_object_size (size);
+	slab->per_chunk = per_chunk;
+	slab->arena = NULL;
+}
+
+
+unsigned teredo_slab_arena_objects (size_t size)
+{
+	return (TEREDO_ARENA_CHUNK - sizeof (teredo_slab_chunk))
+	       / slab_object_size (size);
+}
+
+
+void teredo_slab_init_arena (teredo_slab *slab, size_t size,
+                             teredo_arena *arena)
+{
+	teredo_slab_init (slab, size, teredo_slab_arena_objects (size));
+	slab->arena = arena;
+}
+
+
+void teredo_slab_destroy (teredo_slab *slab)
+{
+	teredo_slab_chunk *c = slab->chunks;
+
+	while (c != NULL)
+	{
+		teredo_slab_chunk *next = c->next;
+		if (slab->arena != NULL)
+			teredo_arena_free_chunk (slab->arena, c);
+		else
+			free (c);
+		c = next;
+	}
+
+	slab->free = NULL;
+	slab->chunks = NULL;
+}
+
+
+/**
+ * Allocates a new chunk.
+ * @return the first object of the chunk, all others being put into the
+ * free list, or NULL if out of memory.
+ */
+static void *teredo_slab_grow (teredo_slab *slab)
+{
+	size_t size = sizeof (teredo_slab_chunk)
+	              + slab->size * slab->per_chunk;
+	teredo_slab_chunk *c;
+
+	if (slab->arena != NULL)
+		c = teredo_arena_alloc_chunk (slab->arena);
+	else
+		c = aligned_alloc (TEREDO_SLAB_ALIGN,
+		                   (size + TEREDO_SLAB_ALIGN - 1)
+		                   & ~(TEREDO_SLAB_ALIGN - 1));
+	if (c == NULL)
+		return NULL;
+
+	c->next = slab->chunks;
+	slab->chunks = c;
+
+	/* Links all new objects but the first one into the free list */
+	uint8_t *base = (uint8_t *)c->data;
+	for (unsigned i = slab->per_chunk - 1; i > 0; i--)
+		teredo_slab_free (slab, base + i * slab->size);
+	return base;
+}
+
+
+int teredo_slab_reserve (teredo_slab *slab, unsigned count)
+{
+	for (unsigned n = 0; n < count; n += slab->per_chunk)
+	{
+		void *obj = teredo_slab_grow (slab);
+		if (obj == NULL)
+			return -1;
+		teredo_slab_free (slab, obj);
+	}
+	return 0;
+}
+
+
+void *teredo_slab_alloc (teredo_slab *slab)
+{
+	void *obj = slab->free;
+
+	if (obj == NULL)
+		return teredo_slab_grow (slab);
+
+	slab->free = *(void **)obj;
+	return obj;
+}
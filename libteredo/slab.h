@@ -0,0 +1,116 @@
+/**
+ * @file slab.h
+ * @brief Fixed-size objects allocator
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_SLAB_H
+# define LIBTEREDO_SLAB_H
+
+/*
+ * Objects are carved out of big chunks, and recycled through a LIFO free
+ * list linked through the first pointer-sized word of each free object.
+ * Chunks are only returned to the system (or to their arena) all at once
+ * by teredo_slab_destroy(). A slab is not thread-safe.
+ */
+
+typedef struct teredo_slab_chunk teredo_slab_chunk;
+struct teredo_arena;
+
+typedef struct teredo_slab
+{
+	void *free; /* free objects list */
+	teredo_slab_chunk *chunks; /* allocated chunks list */
+	size_t size; /* object size */
+	unsigned per_chunk; /* objects per chunk */
+	struct teredo_arena *arena; /* chunks provider (NULL: heap) */
+} teredo_slab;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Initializes an empty slab. Memory is only allocated when needed.
+ *
+ * @param size object size (bytes)
+ * @param per_chunk number of objects allocated at once
+ */
+void teredo_slab_init (teredo_slab *slab, size_t size, unsigned per_chunk);
+
+/**
+ * Initializes an empty slab whose chunks come from an arena (see arena.h),
+ * as many objects as fit in TEREDO_ARENA_CHUNK bytes at a time.
+ *
+ * @param size object size (bytes)
+ */
+void teredo_slab_init_arena (teredo_slab *slab, size_t size,
+                             struct teredo_arena *arena);
+
+/**
+ * @return the number of objects per arena chunk for a given object size.
+ */
+unsigned teredo_slab_arena_objects (size_t size);
+
+/**
+ * Releases all chunks (and hence all objects) of a slab at once.
+ */
+void teredo_slab_destroy (teredo_slab *slab);
+
+/**
+ * Allocates memory for at least count more objects upfront, so that later
+ * allocations need not call the system allocator.
+ * @return 0 on success, -1 if out of memory (some memory may still have
+ * been allocated).
+ */
+int teredo_slab_reserve (teredo_slab *slab, unsigned count);
+
+/**
+ * Allocates an object.
+ * @return NULL if out of memory.
+ */
+void *teredo_slab_alloc (teredo_slab *slab);
+
+/**
+ * Returns an object to its slab.
+ */
+static inline void teredo_slab_free (teredo_slab *slab, void *obj)
+{
+	*(void **)obj = slab->free;
+	slab->free = obj;
+}
+
+/**
+ * Returns a whole list of objects to their slab in constant time.
+ * The objects must be linked through their first pointer-sized word.
+ *
+ * @param first first object of the list
+ * @param last last object of the list
+ */
+static inline void teredo_slab_free_list (teredo_slab *slab,
+                                          void *first, void *last)
+{
+	*(void **)last = slab->free;
+	slab->free = first;
+}
+
+# ifdef __cplusplus
+}
+# endif
+#endif /* ifndef LIBTEREDO_SLAB_H */
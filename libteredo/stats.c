@@ -0,0 +1,280 @@
+/*
+ * stats.c - Performance counters
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h> // snprintf()
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h> // pwrite(), ftruncate()
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "stats.h"
+
+_Thread_local teredo_stats_block teredo_stats_local;
+
+static const char *const teredo_stats_names[TEREDO_STAT_MAX] =
+{
+#define TEREDO_STAT_NAME(id, name) name,
+	TEREDO_STATS_LIST (TEREDO_STAT_NAME)
+#undef TEREDO_STAT_NAME
+};
+
+static const char *const teredo_hist_names[TEREDO_HIST_MAX] =
+{
+#define TEREDO_HIST_NAME(id, name) name,
+	TEREDO_HISTS_LIST (TEREDO_HIST_NAME)
+#undef TEREDO_HIST_NAME
+};
+
+static _Atomic uint64_t teredo_hists[TEREDO_HIST_MAX][TEREDO_HIST_BUCKETS];
+
+static pthread_mutex_t teredo_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static teredo_stats_block *teredo_stats_blocks = NULL;
+static uint64_t teredo_stats_retired[TEREDO_STAT_MAX];
+static pthread_key_t teredo_stats_key;
+static pthread_once_t teredo_stats_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Retains the counters of an exiting thread, and unregisters its block.
+ */
+static void teredo_stats_retire (void *data)
+{
+	teredo_stats_block *b = data;
+
+	pthread_mutex_lock (&teredo_stats_lock);
+	for (unsigned i = 0; i < TEREDO_STAT_MAX; i++)
+		teredo_stats_retired[i] += atomic_load_explicit (b->counters + i,
+		                                                 memory_order_relaxed);
+
+	for (teredo_stats_block **pp = &teredo_stats_blocks; *pp != NULL;
+	     pp = &(*pp)->next)
+		if (*pp == b)
+		{
+			*pp = b->next;
+			break;
+		}
+	pthread_mutex_unlock (&teredo_stats_lock);
+}
+
+
+static void teredo_stats_init (void)
+{
+	(void)pthread_key_create (&teredo_stats_key, teredo_stats_retire);
+}
+
+
+void teredo_stats_register (void)
+{
+	teredo_stats_block *b = &teredo_stats_local;
+
+	pthread_once (&teredo_stats_once, teredo_stats_init);
+	/* If this fails, the counters of the thread are lost when it exits */
+	(void)pthread_setspecific (teredo_stats_key, b);
+
+	pthread_mutex_lock (&teredo_stats_lock);
+	b->next = teredo_stats_blocks;
+	teredo_stats_blocks = b;
+	pthread_mutex_unlock (&teredo_stats_lock);
+	b->registered = true;
+}
+
+
+void teredo_stats_read (uint64_t *values)
+{
+	pthread_mutex_lock (&teredo_stats_lock);
+	memcpy (values, teredo_stats_retired, sizeof (teredo_stats_retired));
+
+	for (const teredo_stats_block *b = teredo_stats_blocks; b != NULL;
+	     b = b->next)
+		for (unsigned i = 0; i < TEREDO_STAT_MAX; i++)
+			values[i] += atomic_load_explicit (b->counters + i,
+			                                   memory_order_relaxed);
+	pthread_mutex_unlock (&teredo_stats_lock);
+}
+
+
+const char *teredo_stats_name (enum teredo_stat id)
+{
+	return (id < TEREDO_STAT_MAX) ? teredo_stats_names[id] : NULL;
+}
+
+
+uint64_t teredo_hist_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
+
+void teredo_hist_record (enum teredo_hist id, uint64_t usec)
+{
+	unsigned bucket;
+
+	assert (id < TEREDO_HIST_MAX);
+
+	if (usec < TEREDO_HIST_SUB)
+		bucket = usec;
+	else
+	{
+		if (usec >> TEREDO_HIST_BITS)
+			usec = (UINT64_C(1) << TEREDO_HIST_BITS) - 1;
+
+		unsigned e = 63 - __builtin_clzll (usec);
+		unsigned shift = e - TEREDO_HIST_SUB_BITS;
+
+		bucket = ((shift + 1) << TEREDO_HIST_SUB_BITS)
+		       | ((usec >> shift) & (TEREDO_HIST_SUB - 1));
+	}
+	atomic_fetch_add_explicit (teredo_hists[id] + bucket, 1,
+	                           memory_order_relaxed);
+}
+
+
+void teredo_hist_read (enum teredo_hist id, uint64_t *counts)
+{
+	assert (id < TEREDO_HIST_MAX);
+
+	for (unsigned i = 0; i < TEREDO_HIST_BUCKETS; i++)
+		counts[i] = atomic_load_explicit (teredo_hists[id] + i,
+		                                  memory_order_relaxed);
+}
+
+
+/**
+ * @return the middle value of a histogram bucket.
+ */
+static uint64_t teredo_hist_value (unsigned bucket)
+{
+	if (bucket < TEREDO_HIST_SUB)
+		return bucket;
+
+	unsigned shift = (bucket >> TEREDO_HIST_SUB_BITS) - 1;
+	uint64_t low = (uint64_t)(TEREDO_HIST_SUB
+	                          | (bucket & (TEREDO_HIST_SUB - 1))) << shift;
+	return low + ((UINT64_C(1) << shift) >> 1);
+}
+
+
+uint64_t teredo_hist_percentile (const uint64_t *counts, double pc)
+{
+	uint64_t total = 0;
+
+	for (unsigned i = 0; i < TEREDO_HIST_BUCKETS; i++)
+		total += counts[i];
+	if (total == 0)
+		return 0;
+
+	uint64_t rank = pc * total / 100.;
+	if (rank >= total)
+		rank = total - 1;
+
+	for (unsigned i = 0;; i++)
+	{
+		if (rank < counts[i])
+			return teredo_hist_value (i);
+		rank -= counts[i];
+	}
+}
+
+
+const char *teredo_hist_name (enum teredo_hist id)
+{
+	return (id < TEREDO_HIST_MAX) ? teredo_hist_names[id] : NULL;
+}
+
+
+/* Exported percentiles of each histogram */
+static const struct
+{
+	const char *suffix;
+	double pc;
+} teredo_hist_exports[] =
+{
+	{ "p50", 50. }, { "p90", 90. }, { "p99", 99. }, { "max", 100. },
+};
+
+#define TEREDO_HIST_EXPORTS \
+	(sizeof (teredo_hist_exports) / sizeof (teredo_hist_exports[0]))
+
+int teredo_stats_dump (int fd)
+{
+	uint64_t values[TEREDO_STAT_MAX];
+	char buf[(TEREDO_STAT_MAX + TEREDO_HIST_MAX * (1 + TEREDO_HIST_EXPORTS))
+	         * 48];
+	size_t len = 0;
+
+	teredo_stats_read (values);
+
+	for (unsigned i = 0; i < TEREDO_STAT_MAX; i++)
+	{
+		int n = snprintf (buf + len, sizeof (buf) - len, "%s %"PRIu64"\n",
+		                  teredo_stats_names[i], values[i]);
+		if ((n < 0) || ((size_t)n >= sizeof (buf) - len))
+			return -1;
+		len += n;
+	}
+
+	/* Histograms as a count and a few percentiles */
+	for (unsigned i = 0; i < TEREDO_HIST_MAX; i++)
+	{
+		uint64_t counts[TEREDO_HIST_BUCKETS], total = 0;
+
+		teredo_hist_read (i, counts);
+		for (unsigned j = 0; j < TEREDO_HIST_BUCKETS; j++)
+			total += counts[j];
+
+		int n = snprintf (buf + len, sizeof (buf) - len,
+		                  "%s_count %"PRIu64"\n", teredo_hist_names[i], total);
+		if ((n < 0) || ((size_t)n >= sizeof (buf) - len))
+			return -1;
+		len += n;
+
+		for (unsigned j = 0; j < TEREDO_HIST_EXPORTS; j++)
+		{
+			n = snprintf (buf + len, sizeof (buf) - len, "%s_%s %"PRIu64"\n",
+			              teredo_hist_names[i], teredo_hist_exports[j].suffix,
+			              teredo_hist_percentile (counts,
+			                                      teredo_hist_exports[j].pc));
+			if ((n < 0) || ((size_t)n >= sizeof (buf) - len))
+				return -1;
+			len += n;
+		}
+	}
+
+	if (pwrite (fd, buf, len, 0) != (ssize_t)len)
+		return -1;
+	return ftruncate (fd, len);
+}
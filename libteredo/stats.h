@@ -0,0 +1,191 @@
+/**
+ * @file stats.h
+ * @brief Performance counters
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_STATS_H
+# define LIBTEREDO_STATS_H
+
+# include <stdbool.h>
+# include <stdint.h>
+# include <stdalign.h>
+# include <stdatomic.h>
+
+/*
+ * Each thread increments its own cache line aligned block of counters,
+ * without atomic read-modify-write operations nor memory barriers. Blocks
+ * are summed up only when the counters are read. The counters of exited
+ * threads are retained.
+ */
+# define TEREDO_STATS_LIST(X) \
+	X (RELAY_RX,           "relay_rx_packets") \
+	X (RELAY_RX_MALFORMED, "relay_rx_malformed") \
+	X (RELAY_RX_DROPPED,   "relay_rx_dropped") \
+	X (RELAY_RX_DECAP,     "relay_rx_decapsulated") \
+	X (RELAY_TX,           "relay_tx_packets") \
+	X (RELAY_TX_CACHED,    "relay_tx_cache_hits") \
+	X (RELAY_TX_RELAYS,    "relay_tx_relay_cache_hits") \
+	X (RELAY_TX_ENCAP,     "relay_tx_encapsulated") \
+	X (RELAY_TX_MULTICAST, "relay_tx_multicast") \
+	X (RELAY_TX_REJECTED,  "relay_tx_rejected") \
+	X (RELAY_TX_QUEUED,    "relay_tx_queued") \
+	X (RELAY_TX_TOOBIG,    "relay_tx_too_big") \
+	X (RELAY_BUBBLES,      "relay_bubbles_sent") \
+	X (RELAY_PINGS,        "relay_pings_sent") \
+	X (RELAY_ICMP,         "relay_icmpv6_sent") \
+	X (RELAY_ICMP_LIMITED, "relay_icmpv6_rate_limited") \
+	X (RELAY_OVERLOADS,    "relay_overloads") \
+	X (RELAY_SHED,         "relay_overload_shed") \
+	X (QUEUE_FULL,         "queue_full_drops") \
+	X (PEERS_ADDED,        "peers_added") \
+	X (PEERS_REMOVED,      "peers_removed") \
+	X (PEERS_EVICTED,      "peers_evicted") \
+	X (PEERS_LIST_FULL,    "peers_list_full") \
+	X (PEERS_FILTERED,     "peers_filtered") \
+	X (PEERS_IMPORTED,     "peers_imported") \
+	X (GC_RUNS,            "gc_runs") \
+	X (GC_USEC,            "gc_usec") \
+	X (MAINT_RS,           "maintenance_solicitations") \
+	X (MAINT_RA,           "maintenance_advertisements") \
+	X (MAINT_FAILURES,     "maintenance_failures") \
+	X (SERVER_RX,          "server_rx_packets") \
+	X (SERVER_RX_DROPPED,  "server_rx_dropped") \
+	X (SERVER_RX_LIMITED,  "server_rate_limited") \
+	X (SERVER_RA,          "server_advertisements") \
+	X (SERVER_FWD_TEREDO,  "server_forwarded_teredo") \
+	X (SERVER_FWD_IPV6,    "server_forwarded_ipv6")
+
+enum teredo_stat
+{
+# define TEREDO_STAT_ENUM(id, name) TEREDO_STAT_##id,
+	TEREDO_STATS_LIST (TEREDO_STAT_ENUM)
+# undef TEREDO_STAT_ENUM
+	TEREDO_STAT_MAX
+};
+
+/*
+ * Latency histograms (in microseconds) have a bucket per power of two,
+ * split in TEREDO_HIST_SUB linear sub-buckets, like HDR histograms: the
+ * relative error is below 1/TEREDO_HIST_SUB. Their buckets are shared by
+ * all threads, and updated with relaxed atomic increments, which is cheap
+ * enough for seldom events such as connection setups.
+ */
+# define TEREDO_HISTS_LIST(X) \
+	X (PEER_SETUP,         "peer_setup_usec") \
+	X (QUALIFICATION,      "qualification_usec") \
+	X (TUNNEL_UP,          "tunnel_up_usec")
+
+enum teredo_hist
+{
+# define TEREDO_HIST_ENUM(id, name) TEREDO_HIST_##id,
+	TEREDO_HISTS_LIST (TEREDO_HIST_ENUM)
+# undef TEREDO_HIST_ENUM
+	TEREDO_HIST_MAX
+};
+
+# define TEREDO_HIST_SUB_BITS 4
+# define TEREDO_HIST_SUB (1 << TEREDO_HIST_SUB_BITS)
+/* Values from 2^36 microseconds (about 19 hours) go in the last bucket */
+# define TEREDO_HIST_BITS 36
+# define TEREDO_HIST_BUCKETS \
+	((TEREDO_HIST_BITS - TEREDO_HIST_SUB_BITS + 1) << TEREDO_HIST_SUB_BITS)
+
+typedef struct teredo_stats_block
+{
+	alignas (64) _Atomic uint64_t counters[TEREDO_STAT_MAX];
+	struct teredo_stats_block *next;
+	bool registered;
+} teredo_stats_block;
+
+extern _Thread_local teredo_stats_block teredo_stats_local;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Registers the counters block of the calling thread.
+ */
+void teredo_stats_register (void);
+
+/**
+ * Sums up the counters of all threads.
+ * @param values [OUT] array of TEREDO_STAT_MAX counters
+ */
+void teredo_stats_read (uint64_t *values);
+
+/**
+ * @return the name of a counter.
+ */
+const char *teredo_stats_name (enum teredo_stat id);
+
+/**
+ * @return the current time for latency measures (microseconds).
+ */
+uint64_t teredo_hist_now (void);
+
+/**
+ * Records a latency sample.
+ */
+void teredo_hist_record (enum teredo_hist id, uint64_t usec);
+
+/**
+ * Reads the buckets of a histogram.
+ * @param counts [OUT] array of TEREDO_HIST_BUCKETS counts
+ */
+void teredo_hist_read (enum teredo_hist id, uint64_t *counts);
+
+/**
+ * Computes a percentile from histogram buckets.
+ * @param pc percentile (from 0 to 100)
+ * @return the approximate value (microseconds), or 0 if there are no samples.
+ */
+uint64_t teredo_hist_percentile (const uint64_t *counts, double pc);
+
+/**
+ * @return the name of a histogram.
+ */
+const char *teredo_hist_name (enum teredo_hist id);
+
+# ifdef __cplusplus
+}
+# endif
+
+/**
+ * Adds to a counter of the calling thread.
+ */
+static inline void teredo_stat_add (enum teredo_stat id, unsigned n)
+{
+	teredo_stats_block *b = &teredo_stats_local;
+
+	if (!b->registered)
+		teredo_stats_register ();
+
+	/* Only this thread writes: no need for an atomic increment */
+	uint64_t v = atomic_load_explicit (b->counters + id, memory_order_relaxed);
+	atomic_store_explicit (b->counters + id, v + n, memory_order_relaxed);
+}
+
+static inline void teredo_stat_inc (enum teredo_stat id)
+{
+	teredo_stat_add (id, 1);
+}
+
+#endif /* ifndef LIBTEREDO_STATS_H */
@@ -34,6 +34,19 @@
 /** Buffer size for Teredo packet reception */
 # define TEREDO_PACKET_SIZE MAX_TEREDO_PACKET_SIZE
 
+/**
+ * Inline buffer size for Teredo packet reception. Bigger datagrams spill
+ * over to a large buffer (see teredo_recv() and teredo_recv_batch()).
+ * This fits any datagram that was not fragmented on an Ethernet path.
+ */
+# define TEREDO_SMALL_PACKET_SIZE 1536
+
+/*
+ * Reception headroom: datagrams can be received at an offset into the
+ * buffer so that the IPv6 packet behind the Teredo headers is aligned.
+ */
+# define TEREDO_PACKET_HEADROOM 8
+
 
 /**
  * Structure to receive Teredo-encapsulated IPv6 packets
@@ -71,10 +84,53 @@ typedef struct teredo_packet
 	union
 	{
 		uint64_t align[1];
-		uint8_t fill[TEREDO_PACKET_SIZE];
+		uint8_t fill[TEREDO_PACKET_HEADROOM + TEREDO_SMALL_PACKET_SIZE];
 	} buf;
 } teredo_packet;
 
+/** Maximum number of packets received at once */
+# define TEREDO_BATCH_SIZE 32
+
+/**
+ * Structure to receive several Teredo packets at once
+ */
+typedef struct teredo_packet_batch
+{
+	/** Number of valid received packets */
+	unsigned count;
+	/** Valid received packets (only the first @a count ones are set) */
+	teredo_packet *packets[TEREDO_BATCH_SIZE];
+	/** Reception headroom guess (zero-initialize before first use) */
+	unsigned headroom;
+	/** Large buffers (zero-initialize before first use) */
+	uint8_t *large;
+	/** Internal storage for packets reception */
+	teredo_packet storage[TEREDO_BATCH_SIZE];
+} teredo_packet_batch;
+
+/** Maximum number of datagrams in a send queue */
+# define TEREDO_SENDQ_SIZE 32
+
+/**
+ * Queue of outgoing datagrams, flushed with as few system calls as
+ * possible. This is an internal interface; fields are private.
+ */
+typedef struct teredo_sendq
+{
+	int fd;
+	unsigned count;
+	size_t used;
+	bool gso;
+	struct teredo_sendq_entry
+	{
+		size_t offset;
+		size_t length;
+		uint32_t ipv4;
+		uint16_t port;
+	} entries[TEREDO_SENDQ_SIZE];
+	uint8_t buf[65536];
+} teredo_sendq;
+
 struct iovec;
 
 # ifdef __cplusplus
@@ -89,6 +145,44 @@ extern "C" {
  */
 int teredo_socket (uint32_t bind_ip, uint16_t port);
 
+/**
+ * Opens a Teredo UDP/IPv4 socket that can share its address with other
+ * sockets opened likewise (using SO_REUSEPORT). The kernel then spreads
+ * incoming datagrams across all sockets bound to the same address.
+ * Thread-safe, not cancellation-safe.
+ *
+ * @return -1 on error (including if the system lacks SO_REUSEPORT).
+ */
+int teredo_socket_shared (uint32_t bind_ip, uint16_t port);
+
+/**
+ * Enables or disables path MTU discovery on a Teredo socket. Teredo sockets
+ * do not set the Don't Fragment flag by default, as Teredo specifies.
+ * With path MTU discovery, they set it whenever the datagram fits the known
+ * path MTU, and the path MTU reported by ICMPv4 errors is remembered (see
+ * teredo_pmtu_get()).
+ *
+ * @return 0 on success, -1 on error (e.g. not supported).
+ */
+int teredo_socket_pmtud (int fd, bool on);
+
+/**
+ * Looks up the IPv4 path MTU toward a host, as last reported to any Teredo
+ * socket. Reports expire after 10 minutes, so that larger sizes are probed
+ * again. Thread-safe.
+ *
+ * @param ip IPv4 address of the host (network byte order).
+ *
+ * @return the path MTU (including IPv4 and UDP headers), or 0 if unknown.
+ */
+uint16_t teredo_pmtu_get (uint32_t ip);
+
+/**
+ * Records the IPv4 path MTU toward a host.
+ * Thread-safe.
+ */
+void teredo_pmtu_update (uint32_t ip, uint16_t mtu);
+
 /**
  * Sends an UDP/IPv4 datagram.
  * Thread-safe, cancellation safe, cancellation point.
@@ -113,10 +207,108 @@ int teredo_send (int fd, const void *data, size_t len,
 int teredo_sendv (int fd, const struct iovec *iov, size_t count,
                   uint32_t ip, uint16_t port);
 
+/**
+ * Sends several UDP/IPv4 datagrams to the same destination, with as few
+ * system calls as possible.
+ * Thread-safe, cancellation point.
+ *
+ * @param fd socket from which to send.
+ * @param dgrams array of datagrams (one contiguous buffer each).
+ * @param count number of datagrams.
+ * @param ip destination IPv4 (network byte order).
+ * @param port destination UDP port (network byte order).
+ *
+ * @return number of datagrams sent, or -1 if none could be sent.
+ */
+int teredo_sendmv (int fd, const struct iovec *dgrams, size_t count,
+                   uint32_t ip, uint16_t port);
+
+/**
+ * Initializes an empty send queue.
+ *
+ * @param fd socket from which queued datagrams will be sent.
+ */
+void teredo_sendq_init (teredo_sendq *q, int fd);
+
+/**
+ * Makes a send queue current for the calling thread: until
+ * teredo_sendq_stop() is called, datagrams sent by that thread through
+ * teredo_send() or teredo_sendv() on the queue socket are queued
+ * (and always reported as sent in full), rather than sent immediately.
+ * Only one queue can be current per thread at a time.
+ */
+void teredo_sendq_start (teredo_sendq *q);
+
+/**
+ * Sends all queued datagrams.
+ * Thread-safe, cancellation point.
+ *
+ * @return 0 on success, -1 if any datagram could not be sent.
+ */
+int teredo_sendq_flush (teredo_sendq *q);
+
+/**
+ * Flushes a send queue, and stops queueing datagrams from the calling
+ * thread.
+ */
+void teredo_sendq_stop (teredo_sendq *q);
+
+/**
+ * Callback receiving outgoing datagrams diverted by teredo_set_sink().
+ *
+ * @param iov scatter-gather array containing the datagram.
+ * @param count number of entries in the scatter-gather array.
+ * @param ip destination IPv4 (network byte order), or 0 for a native
+ * IPv6 packet.
+ * @param port destination UDP port (network byte order), or 0 for a
+ * native IPv6 packet.
+ */
+typedef void (*teredo_sink_cb) (void *opaque, const struct iovec *iov,
+                                size_t count, uint32_t ip, uint16_t port);
+
+/**
+ * Diverts all datagrams and native IPv6 packets that the calling thread
+ * sends, from any socket, to a callback instead of the network. This is
+ * meant to replay captured traffic without privileges nor side effects.
+ *
+ * @param cb callback, or NULL to send to the network again.
+ */
+void teredo_set_sink (teredo_sink_cb cb, void *opaque);
+
+/**
+ * Hands a datagram to the sink of the calling thread, if any.
+ *
+ * @return true if the datagram was diverted, false if it must be sent.
+ */
+bool teredo_sink (const struct iovec *iov, size_t count,
+                  uint32_t ip, uint16_t port);
+
+struct msghdr;
+
+/**
+ * Parses a Teredo datagram that was received by other means than
+ * teredo_recv() and friends. The packet is parsed in place, and points into
+ * the datagram buffer rather than into its inline buffer.
+ * This is an internal interface.
+ *
+ * @param msg message header (source address and ancillary data)
+ * @param buf buffer containing the datagram (8-bytes aligned)
+ * @param offset offset of the datagram in the buffer
+ * @param length datagram length (bytes)
+ *
+ * @return 0 on success, -1 if the packet is malformatted or truncated.
+ */
+int teredo_parse_msg (teredo_packet *p, struct msghdr *msg, void *buf,
+                      size_t offset, size_t length);
+
 /**
  * Receives and parses a Teredo packet from a socket. Never blocks.
  * Thread-safe, cancellation-safe, cancellation point.
  *
+ * Datagrams bigger than TEREDO_SMALL_PACKET_SIZE are stored in a buffer
+ * private to the calling thread instead of @a p, and only remain valid until
+ * the thread receives another such datagram.
+ *
  * @param fd socket file descriptor
  * @param p teredo_packet receive buffer
  *
@@ -131,6 +323,7 @@ int teredo_recv (int fd, struct teredo_packet *p);
 /**
  * Waits for, receives and parses a Teredo packet from a socket.
  * Thread-safe, cancellation-safe, cancellation point.
+ * Big datagrams are handled as with teredo_recv().
  *
  * @param fd socket file descriptor
  * @param p teredo_packet receive buffer
@@ -144,6 +337,29 @@ int teredo_recv (int fd, struct teredo_packet *p);
  */
 int teredo_wait_recv (int fd, struct teredo_packet *p);
 
+/**
+ * Waits for, receives and parses up to @a n Teredo packets from a socket,
+ * with a single system call where supported. Only one packet is waited for;
+ * the other ones are received only if they are already pending.
+ * Malformatted packets are silently dropped.
+ * Thread-safe, cancellation-safe, cancellation point.
+ *
+ * @param fd socket file descriptor
+ * @param b packets batch receive buffer
+ * @param n maximum number of packets to receive (at most TEREDO_BATCH_SIZE)
+ *
+ * @return the number of valid packets received (possibly 0),
+ * or -1 on I/O error.
+ */
+int teredo_recv_batch (int fd, teredo_packet_batch *b, unsigned n);
+
+/**
+ * Releases the large buffers of a packets batch (allocated by
+ * teredo_recv_batch() to receive datagrams bigger than
+ * TEREDO_SMALL_PACKET_SIZE). The batch can still be reused afterward.
+ */
+void teredo_packet_batch_destroy (teredo_packet_batch *b);
+
 /**
  * Computes an IPv6 layer-3 checksum.
  * The input buffers do not need to be aligned neither of even length.
@@ -152,6 +368,66 @@ int teredo_wait_recv (int fd, struct teredo_packet *p);
 uint16_t teredo_cksum (const void *src, const void *dst, uint8_t protocol,
                        const struct iovec *data, size_t n);
 
+/**
+ * Updates an Internet checksum after some data it covers was rewritten
+ * (see RFC1624), without going through the whole data again.
+ * The data must be rewritten at an even offset.
+ *
+ * @param cksum checksum (as stored in the packet) before the rewrite
+ * @param oldp data before the rewrite
+ * @param newp data after the rewrite
+ * @param len byte length of the rewritten data
+ *
+ * @return the updated checksum.
+ */
+uint16_t teredo_cksum_adjust (uint16_t cksum, const void *oldp,
+                              const void *newp, size_t len);
+
+/**
+ * Writes the performance counters of the process as text, one
+ * "name value" pair per line, to a file, replacing its previous content.
+ * @return 0 on success, -1 on error (see errno).
+ */
+int teredo_stats_dump (int fd);
+
+/**
+ * Roles of the threads, for the purpose of their placement.
+ */
+enum teredo_thread_role
+{
+	TEREDO_THREAD_PACKETS, /* packets reception and forwarding */
+	TEREDO_THREAD_HOUSEKEEPING, /* garbage collection, maintenance, timers */
+	TEREDO_THREAD_ROLES
+};
+
+/**
+ * Defines where and how the threads of a given role are scheduled. This
+ * applies to the threads started afterward. Real-time priorities require
+ * a suitable RLIMIT_RTPRIO limit (or privileges) when the threads start.
+ *
+ * @param cpus list of CPUs in the Linux format (e.g. "0-3,8"),
+ * or NULL for any
+ * @param numa_node NUMA node whose CPUs to use, or -1 for any
+ * @param priority SCHED_FIFO priority, or 0 for normal scheduling
+ *
+ * @return 0 on success, -1 on error (see errno).
+ */
+int teredo_set_thread_policy (enum teredo_thread_role role, const char *cpus,
+                              int numa_node, int priority);
+
+/**
+ * Names the calling thread (where supported) and applies the policy
+ * defined for its role with teredo_set_thread_policy().
+ *
+ * @param fmt printf-like format string of the thread name
+ * (at most 15 characters are retained)
+ */
+void teredo_thread_setup (enum teredo_thread_role role, const char *fmt, ...)
+# ifdef __GNUC__
+	__attribute__ ((format (printf, 2, 3)))
+# endif
+	;
+
 # ifdef __cplusplus
 }
 # endif
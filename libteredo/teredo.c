@@ -27,6 +27,7 @@
 #endif
 
 #include <string.h> // memcpy()
+#include <stdlib.h> // malloc()
 #include <stdbool.h>
 #include <assert.h>
 
@@ -39,7 +40,13 @@
 
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <netinet/udp.h> // UDP_SEGMENT
 #include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef HAVE_LINUX_ERRQUEUE_H
+# include <linux/errqueue.h> // struct sock_extended_err
+#endif
 
 #ifndef SOL_IP
 # define SOL_IP IPPROTO_IP
@@ -47,6 +54,10 @@
 
 #include "teredo.h"
 #include "teredo-udp.h"
+#include "tunnel.h"
+#include "pktbuf.h"
+#include "clock.h"
+#include "probe.h"
 
 /*
  * Teredo addresses
@@ -64,7 +75,7 @@ const struct in6_addr teredo_cone =
 	{ { { 0xfe, 0x80, 0, 0, 0, 0, 0, 0,
 		    0x80, 0, 'T', 'E', 'R', 'E', 'D', 'O' } } };
 
-int teredo_socket (uint32_t bind_ip, uint16_t port)
+static int teredo_socket_inner (uint32_t bind_ip, uint16_t port, bool shared)
 {
 	struct sockaddr_in myaddr =
 	{
@@ -82,6 +93,20 @@ int teredo_socket (uint32_t bind_ip, uint16_t port)
 
 	fcntl (fd, F_SETFD, FD_CLOEXEC);
 
+	if (shared)
+	{
+#ifdef SO_REUSEPORT
+		if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &(int){ 1 },
+		                sizeof (int)))
+#else
+		errno = ENOPROTOOPT;
+#endif
+		{
+			close (fd);
+			return -1;
+		}
+	}
+
 	if (bind (fd, (struct sockaddr *)&myaddr, sizeof (myaddr)))
 	{
 		close (fd);
@@ -114,14 +139,121 @@ int teredo_socket (uint32_t bind_ip, uint16_t port)
 }
 
 
+int teredo_socket_pmtud (int fd, bool on)
+{
+#if defined (IP_PMTUDISC_WANT) && defined (IP_PMTUDISC_DONT)
+	/*
+	 * The kernel sets the Don't Fragment flag as long as datagrams fit the
+	 * known path MTU, and fragments them locally otherwise. Datagrams are
+	 * thus still delivered along paths that need fragmentation, while
+	 * ICMPv4 errors report the path MTU (see teredo_recverr()).
+	 */
+	int val = on ? IP_PMTUDISC_WANT : IP_PMTUDISC_DONT;
+	return setsockopt (fd, SOL_IP, IP_MTU_DISCOVER, &val, sizeof (val));
+#else
+	(void)fd;
+	if (!on)
+		return 0;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
+/*
+ * Path MTU cache: a small direct-mapped table of the IPv4 path MTU reports,
+ * shared by all sockets. Each entry packs its IPv4 address (high 32 bits),
+ * MTU (16 bits) and the low 16 bits of the clock when it was reported, so
+ * that it can be read and written atomically.
+ */
+#define TEREDO_PMTU_SLOTS 256
+#define TEREDO_PMTU_EXPIRY 600 // seconds, as the kernel PMTU cache
+
+static atomic_uint_least64_t teredo_pmtu_cache[TEREDO_PMTU_SLOTS];
+
+static inline atomic_uint_least64_t *teredo_pmtu_slot (uint32_t ip)
+{
+	return teredo_pmtu_cache + ((ip * UINT32_C(0x9e3779b1)) >> 24);
+}
+
+
+void teredo_pmtu_update (uint32_t ip, uint16_t mtu)
+{
+	uint_least64_t val = ((uint_least64_t)ip << 32)
+	                   | ((uint_least64_t)mtu << 16)
+	                   | (teredo_clock () & 0xffff);
+
+	atomic_store_explicit (teredo_pmtu_slot (ip), val, memory_order_relaxed);
+}
+
+
+uint16_t teredo_pmtu_get (uint32_t ip)
+{
+	uint_least64_t val = atomic_load_explicit (teredo_pmtu_slot (ip),
+	                                           memory_order_relaxed);
+
+	if ((val == 0) || ((uint32_t)(val >> 32) != ip)
+	 || (((teredo_clock () - val) & 0xffff) > TEREDO_PMTU_EXPIRY))
+		return 0;
+	return (uint16_t)(val >> 16);
+}
+
+
+int teredo_socket (uint32_t bind_ip, uint16_t port)
+{
+	return teredo_socket_inner (bind_ip, port, false);
+}
+
+
+int teredo_socket_shared (uint32_t bind_ip, uint16_t port)
+{
+	return teredo_socket_inner (bind_ip, port, true);
+}
+
+
 static ssize_t
 teredo_recverr (int fd)
 {
 #if defined (MSG_ERRQUEUE)
-	/* TODO: handle ICMP for real one day */
 	struct msghdr msg;
 	memset (&msg, 0, sizeof (msg));
+# if defined (HAVE_LINUX_ERRQUEUE_H) && defined (IP_RECVERR)
+	/* The name is the destination of the datagram which caused the error */
+	struct sockaddr_in addr;
+	union
+	{
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE (sizeof (struct sock_extended_err)
+		                     + sizeof (struct sockaddr_in))];
+	} cmsg;
+
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof (addr);
+	msg.msg_control = &cmsg;
+	msg.msg_controllen = sizeof (cmsg);
+
+	ssize_t val = recvmsg (fd, &msg, MSG_ERRQUEUE);
+	if (val == -1)
+		return -1;
+
+	for (struct cmsghdr *c = CMSG_FIRSTHDR (&msg); c != NULL;
+	     c = CMSG_NXTHDR (&msg, c))
+	{
+		if ((c->cmsg_level != SOL_IP) || (c->cmsg_type != IP_RECVERR))
+			continue;
+
+		/* ICMPv4 fragmentation needed, or local path MTU exceeded */
+		const struct sock_extended_err *ee = (void *)CMSG_DATA (c);
+		if ((ee->ee_errno == EMSGSIZE) && (ee->ee_info >= 68)
+		 && (ee->ee_info <= UINT16_MAX)
+		 && (msg.msg_namelen >= sizeof (addr))
+		 && (addr.sin_family == AF_INET))
+			teredo_pmtu_update (addr.sin_addr.s_addr, ee->ee_info);
+	}
+	return val;
+# else
 	return recvmsg (fd, &msg, MSG_ERRQUEUE);
+# endif
 #else
 	(void)fd;
 	errno = EAGAIN;
@@ -129,10 +261,56 @@ teredo_recverr (int fd)
 #endif
 }
 
-		
+
+/* Send queue active for the calling thread, if any */
+static _Thread_local teredo_sendq *teredo_cur_sendq = NULL;
+
+/* Output diverted from the network for the calling thread, if any */
+static _Thread_local teredo_sink_cb teredo_cur_sink = NULL;
+static _Thread_local void *teredo_cur_sink_opaque;
+
+void teredo_set_sink (teredo_sink_cb cb, void *opaque)
+{
+	teredo_cur_sink = cb;
+	teredo_cur_sink_opaque = opaque;
+}
+
+
+bool teredo_sink (const struct iovec *iov, size_t count,
+                  uint32_t ip, uint16_t port)
+{
+	if (teredo_cur_sink == NULL)
+		return false;
+
+	teredo_cur_sink (teredo_cur_sink_opaque, iov, count, ip, port);
+	return true;
+}
+
+
+static int teredo_sendq_add (teredo_sendq *q, const struct iovec *iov,
+                             size_t count, uint32_t ip, uint16_t port);
+
 int teredo_sendv (int fd, const struct iovec *iov, size_t count,
                   uint32_t dest_ip, uint16_t dest_port)
 {
+	teredo_sendq *q = teredo_cur_sendq;
+	if ((q != NULL) && (q->fd == fd))
+	{
+		int val = teredo_sendq_add (q, iov, count, dest_ip, dest_port);
+		if (val >= 0)
+			return val;
+	}
+
+	if (teredo_cur_sink != NULL)
+	{
+		size_t len = 0;
+
+		for (size_t i = 0; i < count; i++)
+			len += iov[i].iov_len;
+		teredo_sink (iov, count, dest_ip, dest_port);
+		return len;
+	}
+
 	struct sockaddr_in addr =
 	{
 		.sin_family = AF_INET,
@@ -170,48 +348,384 @@ int teredo_send (int fd, const void *packet, size_t plen,
 }
 
 
-static int teredo_recv_inner (int fd, struct teredo_packet *p, int flags)
+int teredo_sendmv (int fd, const struct iovec *dgrams, size_t count,
+                   uint32_t dest_ip, uint16_t dest_port)
 {
-	struct sockaddr_in ad;
+	teredo_sendq *q = teredo_cur_sendq;
+	if (((q != NULL) && (q->fd == fd)) || (teredo_cur_sink != NULL))
+	{
+		for (size_t i = 0; i < count; i++)
+			teredo_sendv (fd, dgrams + i, 1, dest_ip, dest_port);
+		return count;
+	}
+
+	size_t sent = 0;
+#ifdef HAVE_SENDMMSG
+	struct sockaddr_in addr =
+	{
+		.sin_family = AF_INET,
+# ifdef HAVE_SA_LEN
+		.sin_len = sizeof (struct sockaddr_in),
+# endif
+		.sin_port = dest_port,
+		.sin_addr.s_addr = dest_ip
+	};
+#endif
+
+	while (sent < count)
+	{
+#ifdef HAVE_SENDMMSG
+		struct mmsghdr vec[TEREDO_SENDQ_SIZE];
+		unsigned n = 0;
+
+		while ((n < TEREDO_SENDQ_SIZE) && (sent + n < count))
+		{
+			memset (vec + n, 0, sizeof (vec[n]));
+			vec[n].msg_hdr.msg_name = &addr;
+			vec[n].msg_hdr.msg_namelen = sizeof (addr);
+			vec[n].msg_hdr.msg_iov = (struct iovec *)(dgrams + sent + n);
+			vec[n].msg_hdr.msg_iovlen = 1;
+			n++;
+		}
+
+		int val;
+		/* Try to send until we have dequeued all pending errors */
+		do
+			val = sendmmsg (fd, vec, n, 0);
+		while ((val == -1) && (teredo_recverr (fd) != -1));
+#else
+		int val = teredo_sendv (fd, dgrams + sent, 1, dest_ip, dest_port);
+		if (val >= 0)
+			val = 1;
+#endif
+		if (val <= 0)
+			break;
+		sent += val;
+	}
+
+	return (sent > 0) ? (int)sent : -1;
+}
+
+
+/*** Batched transmission ***/
+#ifdef UDP_SEGMENT
+/* Maximum number of segments in a single GSO datagram */
+# define TEREDO_GSO_SEGS 64
+#endif
+
+void teredo_sendq_init (teredo_sendq *q, int fd)
+{
+	q->fd = fd;
+	q->count = 0;
+	q->used = 0;
+#ifdef UDP_SEGMENT
+	q->gso = true;
+#else
+	q->gso = false;
+#endif
+}
+
+
+void teredo_sendq_start (teredo_sendq *q)
+{
+	assert (teredo_cur_sendq == NULL);
+	teredo_cur_sendq = q;
+}
+
+
+void teredo_sendq_stop (teredo_sendq *q)
+{
+	assert (teredo_cur_sendq == q);
+	teredo_sendq_flush (q);
+	teredo_cur_sendq = NULL;
+}
+
+
+/**
+ * Queues a datagram.
+ * @return number of bytes queued, or -1 if the datagram is too big to be
+ * queued at all (and should be sent directly).
+ */
+static int teredo_sendq_add (teredo_sendq *q, const struct iovec *iov,
+                             size_t count, uint32_t ip, uint16_t port)
+{
+	size_t len = 0;
+
+	for (size_t i = 0; i < count; i++)
+		len += iov[i].iov_len;
+	if (len > sizeof (q->buf))
+		return -1;
+
+	if ((q->count >= TEREDO_SENDQ_SIZE) || (len > sizeof (q->buf) - q->used))
+		teredo_sendq_flush (q);
+
+	struct teredo_sendq_entry *e = q->entries + q->count++;
+	e->offset = q->used;
+	e->length = len;
+	e->ipv4 = ip;
+	e->port = port;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		memcpy (q->buf + q->used, iov[i].iov_base, iov[i].iov_len);
+		q->used += iov[i].iov_len;
+	}
+	return len;
+}
+
+
+/**
+ * Counts how many consecutive datagrams can be sent as one with UDP GSO:
+ * same destination, same size, except for the last one which may be
+ * shorter.
+ */
+static unsigned teredo_sendq_group (const teredo_sendq *q, unsigned i)
+{
+	unsigned n = 1;
+#ifdef UDP_SEGMENT
+	const struct teredo_sendq_entry *e = q->entries + i;
+	size_t total = e->length;
+
+	if (!q->gso)
+		return 1;
+
+	while ((i + n < q->count) && (n < TEREDO_GSO_SEGS))
+	{
+		const struct teredo_sendq_entry *f = e + n;
+
+		if ((f->ipv4 != e->ipv4) || (f->port != e->port)
+		 || (f->length > e->length)
+		 || (total + f->length > MAX_TEREDO_PACKET_SIZE))
+			break;
+		total += f->length;
+		n++;
+		if (f->length < e->length)
+			break; /* shorter segment must come last */
+	}
+#else
+	(void)q; (void)i;
+#endif
+	return n;
+}
+
+
+int teredo_sendq_flush (teredo_sendq *q)
+{
+	unsigned i = 0;
+	int retval = 0;
+
+	if (teredo_cur_sink != NULL)
+	{
+		for (; i < q->count; i++)
+		{
+			const struct teredo_sendq_entry *e = q->entries + i;
+			struct iovec iov = { q->buf + e->offset, e->length };
+
+			teredo_sink (&iov, 1, e->ipv4, e->port);
+		}
+	}
+
+	while (i < q->count)
+	{
+		unsigned n = 0, segs[TEREDO_SENDQ_SIZE];
+		struct sockaddr_in addr[TEREDO_SENDQ_SIZE];
+		struct iovec iov[TEREDO_SENDQ_SIZE];
+		struct msghdr msg[TEREDO_SENDQ_SIZE];
+#ifdef UDP_SEGMENT
+		union
+		{
+			struct cmsghdr hdr;
+			char buf[CMSG_SPACE (sizeof (uint16_t))];
+		} cmsg[TEREDO_SENDQ_SIZE];
+#endif
+
+		for (unsigned j = i; j < q->count; j += segs[n++])
+		{
+			const struct teredo_sendq_entry *e = q->entries + j;
+
+			segs[n] = teredo_sendq_group (q, j);
+
+			memset (addr + n, 0, sizeof (addr[n]));
+			addr[n].sin_family = AF_INET;
+#ifdef HAVE_SA_LEN
+			addr[n].sin_len = sizeof (struct sockaddr_in);
+#endif
+			addr[n].sin_port = e->port;
+			addr[n].sin_addr.s_addr = e->ipv4;
+
+			iov[n].iov_base = q->buf + e->offset;
+			iov[n].iov_len = e[segs[n] - 1].offset + e[segs[n] - 1].length
+			                 - e->offset;
+
+			memset (msg + n, 0, sizeof (msg[n]));
+			msg[n].msg_name = addr + n;
+			msg[n].msg_namelen = sizeof (addr[n]);
+			msg[n].msg_iov = iov + n;
+			msg[n].msg_iovlen = 1;
+#ifdef UDP_SEGMENT
+			if (segs[n] > 1)
+			{
+				msg[n].msg_control = cmsg[n].buf;
+				msg[n].msg_controllen = sizeof (cmsg[n].buf);
+
+				struct cmsghdr *cm = CMSG_FIRSTHDR (msg + n);
+				cm->cmsg_level = IPPROTO_UDP;
+				cm->cmsg_type = UDP_SEGMENT;
+				cm->cmsg_len = CMSG_LEN (sizeof (uint16_t));
+				memcpy (CMSG_DATA (cm), &(uint16_t){ e->length },
+				        sizeof (uint16_t));
+			}
+#endif
+		}
+
+		unsigned sent = 0;
+		bool failed; /* errno is only meaningful if set */
+#ifdef HAVE_SENDMMSG
+		struct mmsghdr vec[TEREDO_SENDQ_SIZE];
+
+		for (unsigned k = 0; k < n; k++)
+		{
+			vec[k].msg_hdr = msg[k];
+			vec[k].msg_len = 0;
+		}
+
+		int val;
+		/* Try to send until we have dequeued all pending errors */
+		do
+			val = sendmmsg (q->fd, vec, n, 0);
+		while ((val == -1) && (teredo_recverr (q->fd) != -1));
+
+		failed = val == -1;
+		if (val > 0)
+			sent = val;
+#else
+		failed = false;
+		while (sent < n)
+		{
+			ssize_t val;
+
+			do
+				val = sendmsg (q->fd, msg + sent, 0);
+			while ((val == -1) && (teredo_recverr (q->fd) != -1));
+
+			if (val == -1)
+			{
+				failed = true;
+				break;
+			}
+			sent++;
+		}
+#endif
+
+		for (unsigned k = 0; k < sent; k++)
+			i += segs[k];
+
+		/* A short count is retried from the first unsent datagram */
+		if (failed)
+		{
+#ifdef UDP_SEGMENT
+			/* Kernel or device without UDP GSO support */
+			if ((segs[sent] > 1) && ((errno == EIO) || (errno == EINVAL)
+			                      || (errno == ENOPROTOOPT)))
+			{
+				q->gso = false;
+				continue;
+			}
+#endif
+			/* Skip the datagram that could not be sent */
+			i += segs[sent];
+			retval = -1;
+		}
+	}
+
+	q->count = 0;
+	q->used = 0;
+	return retval;
+}
+
+
 #ifdef IP_PKTINFO
-	char cbuf[CMSG_SPACE (sizeof (struct in_pktinfo))];
+# define TEREDO_CMSG_SPACE CMSG_SPACE (sizeof (struct in_pktinfo))
 #elif defined(IP_RECVDSTADDR)
-	char cbuf[CMSG_SPACE (sizeof (struct in_addr))];
+# define TEREDO_CMSG_SPACE CMSG_SPACE (sizeof (struct in_addr))
 #endif
-	struct iovec iov =
+
+/**
+ * Per-datagram reception context (buffers not part of teredo_packet).
+ */
+typedef struct teredo_recv_ctx
+{
+	struct sockaddr_in addr;
+	struct iovec iov[2];
+	uint8_t *large;
+#ifdef TEREDO_CMSG_SPACE
+	union
 	{
-		.iov_base = p->buf.fill,
-		.iov_len = TEREDO_PACKET_SIZE
-	};
-	struct msghdr msg =
+		struct cmsghdr hdr;
+		char buf[TEREDO_CMSG_SPACE];
+	} cmsg;
+#endif
+} teredo_recv_ctx;
+
+
+/*
+ * Large buffer layout: headroom, room for the inline buffer content, and
+ * the spill-over area beyond TEREDO_SMALL_PACKET_SIZE bytes.
+ */
+#define TEREDO_LARGE_SIZE \
+	((TEREDO_PACKET_HEADROOM + TEREDO_PACKET_SIZE + 7) & ~7)
+
+/**
+ * Prepares reception of a datagram into a packet inline buffer, and the
+ * large buffer (if not NULL) beyond TEREDO_SMALL_PACKET_SIZE bytes.
+ */
+static void teredo_recv_setup (struct teredo_packet *p, teredo_recv_ctx *ctx,
+                               struct msghdr *msg, unsigned headroom,
+                               uint8_t *large)
+{
+	assert (headroom < TEREDO_PACKET_HEADROOM);
+	ctx->iov[0].iov_base = p->buf.fill + headroom;
+	ctx->iov[0].iov_len = TEREDO_SMALL_PACKET_SIZE;
+	ctx->large = large;
+
+	memset (msg, 0, sizeof (*msg));
+	msg->msg_iov = ctx->iov;
+	msg->msg_iovlen = 1;
+
+	if (large != NULL)
 	{
-		.msg_iov = &iov,
-		.msg_iovlen = 1,
-		.msg_name = &ad,
-		.msg_namelen = sizeof (ad),
-#if defined(IP_PKTINFO) || defined(IP_RECVDSTADDR)
-		.msg_control = cbuf,
-		.msg_controllen = sizeof (cbuf),
+		ctx->iov[1].iov_base = large + headroom + TEREDO_SMALL_PACKET_SIZE;
+		ctx->iov[1].iov_len = TEREDO_PACKET_SIZE - TEREDO_SMALL_PACKET_SIZE;
+		msg->msg_iovlen = 2;
+	}
+	msg->msg_name = &ctx->addr;
+	msg->msg_namelen = sizeof (ctx->addr);
+#ifdef TEREDO_CMSG_SPACE
+	msg->msg_control = ctx->cmsg.buf;
+	msg->msg_controllen = sizeof (ctx->cmsg.buf);
 #endif
-	};
+}
 
-	// Receive a UDP packet
-	ssize_t length = recvmsg (fd, &msg, flags);
-	if (length == -1)
-		teredo_recverr (fd);
-	if (length < 2) // too small or error
-		return -1;
 
-	p->source_ipv4 = ad.sin_addr.s_addr;
-	p->source_port = ad.sin_port;
+/**
+ * Parses a complete Teredo datagram from a contiguous buffer.
+ */
+static int teredo_parse_inner (struct teredo_packet *p, struct msghdr *msg,
+                               uint8_t *buf, size_t headroom,
+                               ssize_t length, unsigned *hint)
+{
+	const struct sockaddr_in *ad = msg->msg_name;
+
+	p->source_ipv4 = ad->sin_addr.s_addr;
+	p->source_port = ad->sin_port;
 	p->dest_ipv4 = 0;
 
 #if defined(IP_PKTINFO) || defined(IP_RECVDSTADDR)
 	// Internal outer destination IPv4 address
 	// (mostly useful for funky multi-homed hosts)
-	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (msg);
 	     cmsg != NULL;
-	     cmsg = CMSG_NXTHDR (&msg, cmsg))
+	     cmsg = CMSG_NXTHDR (msg, cmsg))
 	{
 # ifdef IP_PKTINFO
 		if ((cmsg->cmsg_level == IPPROTO_IP)
@@ -233,7 +747,8 @@ static int teredo_recv_inner (int fd, struct teredo_packet *p, int flags)
 	}
 #endif
 
-	uint8_t *ptr = p->buf.fill;
+	uint8_t *const base = buf + headroom;
+	uint8_t *ptr = base;
 
 	p->auth_present = false;
 	p->orig_ipv4 = 0;
@@ -266,12 +781,6 @@ static int teredo_recv_inner (int fd, struct teredo_packet *p, int flags)
 		ptr += 8;
 		p->auth_fail = !!*ptr;
 		ptr++;
-
-		/* Restore 64-bits alignment of IPv6 and ICMPv6 headers */
-		/* Per ISO/IEC 9899:TC2 §6.5.8.8: All pointers to members of the same
-		 * union object compare equal. */
-		memmove (p->buf.align, ptr, length);
-		ptr = p->buf.fill;
 	}
 
 	// Teredo Origin Indication
@@ -296,13 +805,121 @@ static int teredo_recv_inner (int fd, struct teredo_packet *p, int flags)
 		p->orig_ipv4 = ~addr;
 	}
 
+	/* Restore 64-bits alignment of IPv6 and ICMPv6 headers */
+	size_t offset = ptr - buf;
+
+	*hint = (-(ptr - base)) & (TEREDO_PACKET_HEADROOM - 1);
+	if (offset & 7)
+	{
+		uint8_t *aligned = buf + (offset & ~(size_t)7);
+
+		memmove (aligned, ptr, length);
+		ptr = aligned;
+	}
+
 	p->ip6_len = length;
 	p->ip6 = (struct ip6_hdr *)ptr;
 
+	TEREDO_PROBE (packet_recv, p->source_ipv4, p->source_port, length);
 	return 0;
 }
 
 
+/**
+ * Parses a received Teredo datagram.
+ *
+ * The IPv6 packet is only moved if the Teredo headers left it misaligned,
+ * that is unless the datagram was received at the right headroom offset.
+ *
+ * @param headroom offset of the datagram into the packet buffer
+ * @param hint [OUT] headroom that would have aligned this packet
+ *
+ * @return 0 on success, -1 if the packet is malformatted.
+ */
+static int teredo_parse (struct teredo_packet *p, const teredo_recv_ctx *ctx,
+                         struct msghdr *msg, ssize_t length,
+                         unsigned headroom, unsigned *hint)
+{
+	uint8_t *buf = p->buf.fill;
+
+	if (length < 2) // too small
+		return -1;
+	if (msg->msg_flags & MSG_TRUNC)
+		return -1; // no large buffer
+	if (length > TEREDO_SMALL_PACKET_SIZE)
+	{   /* Makes the datagram contiguous in the large buffer */
+		buf = ctx->large;
+		memcpy (buf + headroom, p->buf.fill + headroom,
+		        TEREDO_SMALL_PACKET_SIZE);
+	}
+
+	return teredo_parse_inner (p, msg, buf, headroom, length, hint);
+}
+
+
+int teredo_parse_msg (teredo_packet *p, struct msghdr *msg, void *buf,
+                      size_t offset, size_t length)
+{
+	unsigned hint;
+
+	if ((length < 2) || (msg->msg_flags & MSG_TRUNC))
+		return -1;
+	return teredo_parse_inner (p, msg, buf, offset, length, &hint);
+}
+
+
+static pthread_key_t teredo_large_key;
+
+static void teredo_large_init (void)
+{
+	(void)pthread_key_create (&teredo_large_key, free);
+}
+
+
+/**
+ * @return the calling thread large buffer (or NULL if out of memory).
+ */
+static uint8_t *teredo_large_get (void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once (&once, teredo_large_init);
+
+	uint8_t *large = pthread_getspecific (teredo_large_key);
+	if (large == NULL)
+	{
+		large = malloc (TEREDO_LARGE_SIZE);
+		if ((large != NULL)
+		 && pthread_setspecific (teredo_large_key, large))
+		{
+			free (large);
+			large = NULL;
+		}
+	}
+	return large;
+}
+
+
+static int teredo_recv_inner (int fd, struct teredo_packet *p, int flags)
+{
+	teredo_recv_ctx ctx;
+	struct msghdr msg;
+	unsigned hint;
+
+	teredo_recv_setup (p, &ctx, &msg, 0, teredo_large_get ());
+
+	// Receive a UDP packet
+	ssize_t length = recvmsg (fd, &msg, flags);
+	if (length == -1)
+	{
+		teredo_recverr (fd);
+		return -1;
+	}
+
+	return teredo_parse (p, &ctx, &msg, length, 0, &hint);
+}
+
+
 int teredo_recv (int fd, struct teredo_packet *p)
 {
 	return teredo_recv_inner (fd, p, MSG_DONTWAIT);
@@ -327,79 +944,120 @@ int teredo_wait_recv (int fd, struct teredo_packet *p)
 }
 
 
-/* This does not fit anywhere and is needed by both relay and server */
-#include <stdbool.h>
-
 /**
- * Computes an Internet checksum over a scatter-gather array.
- * Buffers need not be aligned neither of even length.
- * Jumbograms are supported (though you probably don't care).
+ * Receives several Teredo packets into the specified packet structures.
  */
-static uint16_t in_cksum (const struct iovec *iov, size_t n)
+static int teredo_recv_slots (int fd, teredo_packet_batch *b,
+                              teredo_packet *const *slots, unsigned n)
 {
-	uint32_t sum = 0;
-	union
+	assert (n > 0 && n <= TEREDO_BATCH_SIZE);
+	b->count = 0;
+
+	/*
+	 * Datagrams are received at the headroom which aligned the last one.
+	 * A Teredo server mostly receives authenticated datagrams while a
+	 * relay mostly receives plain ones, so the guess is usually right.
+	 */
+	unsigned headroom = b->headroom % TEREDO_PACKET_HEADROOM;
+
+	/* Large buffers are only touched (hence backed by memory) if used */
+	if (b->large == NULL)
+		b->large = malloc (TEREDO_BATCH_SIZE * TEREDO_LARGE_SIZE);
+
+#ifdef HAVE_BROKEN_RECVFROM
+	struct pollfd ufd = { .fd = fd, .events = POLLIN };
+	if (poll (&ufd, 1, -1) == -1)
+		return -1;
+#endif
+
+#ifdef HAVE_RECVMMSG
+	teredo_recv_ctx ctx[n];
+	struct mmsghdr vec[n];
+
+	for (unsigned i = 0; i < n; i++)
+	{
+		teredo_recv_setup (slots[i], ctx + i, &vec[i].msg_hdr,
+		                   headroom, (b->large != NULL)
+		                       ? (b->large + i * TEREDO_LARGE_SIZE) : NULL);
+		vec[i].msg_len = 0;
+	}
+
+	/* Waits for the first datagram, then gets whatever else is pending */
+	int val = recvmmsg (fd, vec, n, MSG_WAITFORONE, NULL);
+	if (val == -1)
 	{
-		uint16_t word;
-		uint8_t  bytes[2];
-	} w;
-	bool odd = false;
+		teredo_recverr (fd);
+		return -1;
+	}
 
-	while (n > 0)
+	for (int i = 0; i < val; i++)
 	{
-		const uint8_t *ptr = iov->iov_base;
+		teredo_packet *p = slots[i];
 
-		for (size_t len = iov->iov_len; len > 0; len--)
+		if (teredo_parse (p, ctx + i, &vec[i].msg_hdr, vec[i].msg_len,
+		                  headroom, &b->headroom) == 0)
+			b->packets[b->count++] = p;
+	}
+#else
+	for (unsigned i = 0; i < n; i++)
+	{
+		/* Malformatted packets storage is reused */
+		teredo_packet *p = slots[b->count];
+		teredo_recv_ctx ctx;
+		struct msghdr msg;
+
+		teredo_recv_setup (p, &ctx, &msg, headroom, (b->large != NULL)
+		                   ? (b->large + b->count * TEREDO_LARGE_SIZE) : NULL);
+
+		ssize_t length = recvmsg (fd, &msg, i ? MSG_DONTWAIT : 0);
+		if (length == -1)
 		{
-			if (odd)
-			{
-				w.bytes[1] = *ptr++;
-				sum += w.word;
-				if (sum > 0xffff)
-					sum -= 0xffff;
-			}
-			else
-				w.bytes[0] = *ptr++;
-			odd = !odd;
+			teredo_recverr (fd);
+			if (i == 0)
+				return -1;
+			break;
 		}
 
-		iov++;
-		n--;
+		if (teredo_parse (p, &ctx, &msg, length, headroom,
+		                  &b->headroom) == 0)
+			b->packets[b->count++] = p;
 	}
+#endif
+	return b->count;
+}
 
-	if (odd)
-	{
-		w.bytes[1] = 0;
-		sum += w.word;
-		if (sum > 0xffff)
-			sum -= 0xffff;
-	}
 
-	return sum ^ 0xffff;
+int teredo_recv_batch (int fd, teredo_packet_batch *b, unsigned n)
+{
+	if (n > TEREDO_BATCH_SIZE)
+		n = TEREDO_BATCH_SIZE;
+
+	teredo_packet *slots[n];
+
+	for (unsigned i = 0; i < n; i++)
+		slots[i] = b->storage + i;
+	return teredo_recv_slots (fd, b, slots, n);
 }
 
 
-uint16_t
-teredo_cksum (const void *src, const void *dst, uint8_t protocol,
-              const struct iovec *data, size_t n)
+int teredo_pktbuf_recv_batch (int fd, teredo_packet_batch *b,
+                              teredo_pktbuf *const *bufs, unsigned n)
 {
-	struct iovec iov[3 + n];
-	size_t plen = 0;
-	for (size_t i = 0; i < n; i++)
-	{
-		iov[3 + i].iov_base = data[i].iov_base;
-		plen += (iov[3 + i].iov_len = data[i].iov_len);
-	}
+	if (n > TEREDO_BATCH_SIZE)
+		n = TEREDO_BATCH_SIZE;
 
-	uint32_t pseudo[4] = { htonl (plen), htonl (protocol) };
-	iov[0].iov_base = (void *)src;
-	iov[0].iov_len = 16;
-	iov[1].iov_base = (void *)dst;
-	iov[1].iov_len = 16;
-	iov[2].iov_base = pseudo;
-	iov[2].iov_len = 8;
+	teredo_packet *slots[n];
 
-	return in_cksum (iov, 3 + n);
+	for (unsigned i = 0; i < n; i++)
+		slots[i] = &bufs[i]->packet;
+	return teredo_recv_slots (fd, b, slots, n);
+}
+
+
+void teredo_packet_batch_destroy (teredo_packet_batch *b)
+{
+	free (b->large);
+	b->large = NULL;
 }
 
 
@@ -0,0 +1,108 @@
+/*
+ * addrmap.c - Libteredo address hash table tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "teredo.h"
+#include "addrmap.h"
+
+#define COUNT 20000
+
+static union teredo_addr keys[COUNT];
+
+static void make_address (union teredo_addr *addr, unsigned i)
+{
+	/* Teredo-like addresses: only the mapping differs */
+	addr->teredo.prefix = htonl (TEREDO_PREFIX);
+	addr->teredo.server_ip = htonl (0xc0000201);
+	addr->teredo.flags = 0;
+	addr->teredo.client_port = htons (i & 0xffff);
+	addr->teredo.client_ip = htonl (0xc6336400 + (i >> 16));
+}
+
+
+static void *value (unsigned i)
+{
+	return keys + i;
+}
+
+
+int main (void)
+{
+	teredo_addrmap map;
+
+	teredo_addrmap_init (&map);
+	assert (teredo_addrmap_get (&map, keys) == NULL);
+	assert (teredo_addrmap_remove (&map, keys) == NULL);
+
+	puts ("Insertion test...");
+	for (unsigned i = 0; i < COUNT; i++)
+	{
+		make_address (keys + i, i);
+		assert (teredo_addrmap_insert (&map, keys + i, value (i)) == 0);
+
+		/* lookups while migrations are ongoing */
+		assert (teredo_addrmap_get (&map, keys + i / 2) == value (i / 2));
+	}
+	assert (teredo_addrmap_count (&map) == COUNT);
+
+	puts ("Lookup test...");
+	for (unsigned i = 0; i < COUNT; i++)
+		assert (teredo_addrmap_get (&map, keys + i) == value (i));
+
+	puts ("Removal test...");
+	for (unsigned i = 0; i < COUNT; i += 2)
+		assert (teredo_addrmap_remove (&map, keys + i) == value (i));
+	assert (teredo_addrmap_count (&map) == COUNT / 2);
+
+	for (unsigned i = 0; i < COUNT; i++)
+		assert (teredo_addrmap_get (&map, keys + i)
+		        == ((i & 1) ? value (i) : NULL));
+
+	puts ("Reinsertion test...");
+	for (unsigned i = 0; i < COUNT; i += 2)
+		assert (teredo_addrmap_insert (&map, keys + i, value (i)) == 0);
+	for (unsigned i = 0; i < COUNT; i++)
+		assert (teredo_addrmap_get (&map, keys + i) == value (i));
+
+	puts ("Full removal test...");
+	for (unsigned i = COUNT; i-- > 0;)
+	{
+		assert (teredo_addrmap_remove (&map, keys + i) == value (i));
+		assert (teredo_addrmap_get (&map, keys + i) == NULL);
+	}
+	assert (teredo_addrmap_count (&map) == 0);
+
+	teredo_addrmap_destroy (&map);
+	puts ("Done.");
+	return 0;
+}
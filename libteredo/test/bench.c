@@ -0,0 +1,958 @@
+/*
+ * bench.c - Libteredo microbenchmarks
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "tunnel.h"
+#include "clock.h"
+#include "peerlist.h"
+#include "checksum.h"
+#include "security.h"
+#include "stats.h"
+
+/*
+ * Each benchmark times batches of operations; every batch yields one
+ * sample, from which percentiles of the cost per operation are reported.
+ */
+#define BENCH_BATCH 64
+#define BENCH_SAMPLES_MAX (1 << 20)
+
+static double bench_duration = 1.; /* seconds per benchmark */
+
+typedef struct bench_samples
+{
+	uint64_t *v; /* nanoseconds per batch */
+	size_t count;
+	unsigned batch; /* operations per batch */
+	uint64_t ops;
+	uint64_t elapsed; /* nanoseconds */
+} bench_samples;
+
+
+static uint64_t bench_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+
+static uint64_t bench_deadline (void)
+{
+	return bench_now () + (uint64_t)(bench_duration * 1e9);
+}
+
+
+static int bench_init (bench_samples *s, unsigned batch)
+{
+	s->v = malloc (BENCH_SAMPLES_MAX * sizeof (*s->v));
+	s->count = 0;
+	s->batch = batch;
+	s->ops = 0;
+	s->elapsed = 0;
+	return (s->v != NULL) ? 0 : -1;
+}
+
+
+static inline bool bench_add (bench_samples *s, uint64_t ns)
+{
+	if (s->count >= BENCH_SAMPLES_MAX)
+		return false;
+	s->v[s->count++] = ns;
+	s->ops += s->batch;
+	return true;
+}
+
+
+/**
+ * Appends the samples of b to those of a (both with the same batch size).
+ */
+static void bench_merge (bench_samples *a, const bench_samples *b)
+{
+	size_t n = b->count;
+
+	if (n > BENCH_SAMPLES_MAX - a->count)
+		n = BENCH_SAMPLES_MAX - a->count;
+	memcpy (a->v + a->count, b->v, n * sizeof (*b->v));
+	a->count += n;
+	a->ops += b->ops;
+}
+
+
+static int cmp_u64 (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+static double bench_percentile (const bench_samples *s, double pc)
+{
+	size_t i = (size_t)(pc * (s->count - 1) / 100.);
+	return (double)s->v[i] / s->batch;
+}
+
+
+static void bench_report (const char *name, bench_samples *s)
+{
+	if (s->count == 0)
+	{
+		printf ("%-24s no samples\n", name);
+		return;
+	}
+
+	qsort (s->v, s->count, sizeof (*s->v), cmp_u64);
+	if (s->elapsed == 0)
+		for (size_t i = 0; i < s->count; i++)
+			s->elapsed += s->v[i];
+
+	printf ("%-24s %11.0f ops/s  p50 %8.1f  p90 %8.1f  p99 %8.1f  "
+	        "p99.9 %9.1f  max %9.1f ns/op\n", name,
+	        s->ops * 1e9 / s->elapsed,
+	        bench_percentile (s, 50.), bench_percentile (s, 90.),
+	        bench_percentile (s, 99.), bench_percentile (s, 99.9),
+	        bench_percentile (s, 100.));
+	fflush (stdout);
+}
+
+
+static void bench_free (bench_samples *s)
+{
+	free (s->v);
+}
+
+
+/* Deterministic pseudo-random peer addresses (splitmix64) */
+static uint64_t mix64 (uint64_t x)
+{
+	x += UINT64_C(0x9e3779b97f4a7c15);
+	x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+	x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+	return x ^ (x >> 31);
+}
+
+
+static void make_address (struct in6_addr *addr, uint64_t n)
+{
+	uint64_t hi = mix64 (n), lo = mix64 (~n);
+
+	memcpy (addr->s6_addr, &hi, 8);
+	memcpy (addr->s6_addr + 8, &lo, 8);
+}
+
+
+/*** Peer list ***/
+
+#define BENCH_PEERS 100000
+
+static teredo_peerlist *bench_list_create (unsigned expiration, unsigned n)
+{
+	teredo_peerlist *l = teredo_list_create (UINT_MAX, expiration);
+	if (l == NULL)
+		return NULL;
+
+	for (unsigned i = 0; i < n; i++)
+	{
+		struct in6_addr addr;
+		bool create;
+
+		make_address (&addr, i);
+		teredo_peer *p = teredo_list_lookup (l, &addr, &create);
+		if (p == NULL)
+		{
+			teredo_list_destroy (l);
+			return NULL;
+		}
+		teredo_list_release (l, p);
+	}
+	return l;
+}
+
+
+typedef struct bench_lookup_thread
+{
+	pthread_t thread;
+	teredo_peerlist *list;
+	uint64_t seed;
+	uint64_t deadline;
+	bench_samples samples;
+} bench_lookup_thread;
+
+
+static void *bench_lookup_run (void *data)
+{
+	bench_lookup_thread *t = data;
+	uint64_t seed = t->seed;
+
+	for (;;)
+	{
+		uint64_t start = bench_now ();
+		if (start >= t->deadline)
+			break;
+
+		for (unsigned i = 0; i < BENCH_BATCH; i++)
+		{
+			struct in6_addr addr;
+
+			seed = mix64 (seed);
+			make_address (&addr, seed % BENCH_PEERS);
+			teredo_peer *p = teredo_list_lookup (t->list, &addr, NULL);
+			if (p != NULL)
+				teredo_list_release (t->list, p);
+		}
+
+		if (!bench_add (&t->samples, bench_now () - start))
+			break;
+	}
+	return NULL;
+}
+
+
+/**
+ * Looks up known peers from several threads at once.
+ */
+static int bench_lookup (void)
+{
+	teredo_peerlist *l = bench_list_create (TEREDO_TIMEOUT, BENCH_PEERS);
+	if (l == NULL)
+		return -1;
+
+	long ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+
+	for (unsigned n = 1; n <= 2 * ncpu; n *= 2)
+	{
+		bench_lookup_thread t[n];
+		bench_samples all;
+		uint64_t start = bench_now (), deadline = bench_deadline ();
+		unsigned started = 0;
+
+		if (bench_init (&all, BENCH_BATCH))
+			break;
+
+		for (unsigned i = 0; i < n; i++)
+		{
+			t[i].list = l;
+			t[i].seed = i;
+			t[i].deadline = deadline;
+			if (bench_init (&t[i].samples, BENCH_BATCH))
+				break;
+			if (pthread_create (&t[i].thread, NULL, bench_lookup_run, t + i))
+			{
+				bench_free (&t[i].samples);
+				break;
+			}
+			started++;
+		}
+
+		for (unsigned i = 0; i < started; i++)
+		{
+			pthread_join (t[i].thread, NULL);
+			bench_merge (&all, &t[i].samples);
+			bench_free (&t[i].samples);
+		}
+		all.elapsed = bench_now () - start;
+
+		char name[32];
+		snprintf (name, sizeof (name), "list-lookup-%ut", n);
+		bench_report (name, &all);
+		bench_free (&all);
+
+		if (started < n)
+			break;
+	}
+
+	teredo_list_destroy (l);
+	return 0;
+}
+
+
+/**
+ * Inserts peers at a steady rate while the garbage collector expires others.
+ * Every insertion is timed on its own, so as to catch collector pauses.
+ */
+static int bench_gc (void)
+{
+	bench_samples s;
+	uint64_t values[TEREDO_STAT_MAX], before[TEREDO_STAT_MAX];
+
+	teredo_peerlist *l = bench_list_create (1, 4 * BENCH_PEERS);
+	if ((l == NULL) || bench_init (&s, 1))
+	{
+		if (l != NULL)
+			teredo_list_destroy (l);
+		return -1;
+	}
+
+	teredo_stats_read (before);
+
+	/* Collection happens every second: run at least three of them */
+	double duration = bench_duration;
+	if (bench_duration < 3.)
+		bench_duration = 3.;
+
+	uint64_t deadline = bench_deadline (), n = 4 * BENCH_PEERS;
+	uint64_t next = bench_now ();
+
+	bench_duration = duration;
+	for (;;)
+	{
+		/* BENCH_PEERS insertions per second, so the collector keeps up */
+		uint64_t start;
+		do
+			start = bench_now ();
+		while (start < next);
+
+		if (start >= deadline)
+			break;
+		next += 1000000000 / BENCH_PEERS;
+
+		struct in6_addr addr;
+		bool create;
+
+		make_address (&addr, n++);
+		teredo_peer *p = teredo_list_lookup (l, &addr, &create);
+		if (p != NULL)
+			teredo_list_release (l, p);
+
+		if (!bench_add (&s, bench_now () - start))
+			break;
+	}
+
+	teredo_list_destroy (l);
+	bench_report ("list-insert-during-gc", &s);
+	bench_free (&s);
+
+	teredo_stats_read (values);
+	uint64_t runs = values[TEREDO_STAT_GC_RUNS] - before[TEREDO_STAT_GC_RUNS];
+	uint64_t us = values[TEREDO_STAT_GC_USEC] - before[TEREDO_STAT_GC_USEC];
+	if (runs > 0)
+		printf ("%-24s %11"PRIu64" runs   mean %"PRIu64" us/run\n",
+		        "list-gc", runs, us / runs);
+	return 0;
+}
+
+
+/*** Checksum and hashing ***/
+
+static int bench_cksum (void)
+{
+	static const char *const kernels[] = { "scalar", "sse2", "avx2", "neon" };
+	uint8_t src[16], dst[16], payload[1240];
+
+	memset (src, 0x20, sizeof (src));
+	memset (dst, 0x30, sizeof (dst));
+	for (size_t i = 0; i < sizeof (payload); i++)
+		payload[i] = i * 37;
+
+	struct iovec iov = { payload, sizeof (payload) };
+
+	for (size_t k = 0; k < sizeof (kernels) / sizeof (kernels[0]); k++)
+	{
+		bench_samples s;
+		volatile uint16_t sum;
+
+		if (teredo_cksum_select (kernels[k]))
+			continue; /* not supported by this CPU */
+		if (bench_init (&s, BENCH_BATCH))
+			return -1;
+
+		for (uint64_t deadline = bench_deadline ();;)
+		{
+			uint64_t start = bench_now ();
+			if (start >= deadline)
+				break;
+
+			for (unsigned i = 0; i < BENCH_BATCH; i++)
+				sum = teredo_cksum (src, dst, IPPROTO_UDP, &iov, 1);
+			if (!bench_add (&s, bench_now () - start))
+				break;
+		}
+		(void)sum;
+
+		char name[32];
+		snprintf (name, sizeof (name), "cksum-1280-%s", kernels[k]);
+		bench_report (name, &s);
+		bench_free (&s);
+	}
+
+	teredo_cksum_select (NULL);
+	return 0;
+}
+
+
+#ifdef MIREDO_TEREDO_CLIENT
+static int bench_hash (void)
+{
+	static const char *const macs[] = { "siphash", "hmac-md5" };
+	struct in6_addr src, dst;
+	uint8_t hash[LIBTEREDO_HMAC_LEN];
+
+	make_address (&src, 1);
+	make_address (&dst, 2);
+
+	for (size_t k = 0; k < sizeof (macs) / sizeof (macs[0]); k++)
+	{
+		bench_samples s;
+
+		if (teredo_select_mac (macs[k]) || teredo_init_HMAC ())
+			continue;
+		if (bench_init (&s, BENCH_BATCH))
+		{
+			teredo_deinit_HMAC ();
+			return -1;
+		}
+
+		for (uint64_t deadline = bench_deadline ();;)
+		{
+			uint64_t start = bench_now ();
+			if (start >= deadline)
+				break;
+
+			for (unsigned i = 0; i < BENCH_BATCH; i++)
+				teredo_get_pinghash (i, &src, &dst, hash);
+			if (!bench_add (&s, bench_now () - start))
+				break;
+		}
+
+		char name[32];
+		snprintf (name, sizeof (name), "pinghash-%s", macs[k]);
+		bench_report (name, &s);
+		bench_free (&s);
+
+		/* Uncached nonces, one by one then all at once */
+		uint32_t ipv4[BENCH_BATCH], stamp = 0;
+		uint16_t port[BENCH_BATCH];
+		uint8_t nonces[BENCH_BATCH][LIBTEREDO_NONCE_LEN];
+
+		for (unsigned i = 0; i < BENCH_BATCH; i++)
+		{
+			ipv4[i] = htonl (0xc0000200 + i);
+			port[i] = htons (40000 + i);
+		}
+
+		for (unsigned multi = 0; multi < 2; multi++)
+		{
+			if (bench_init (&s, BENCH_BATCH))
+			{
+				teredo_deinit_HMAC ();
+				return -1;
+			}
+
+			for (uint64_t deadline = bench_deadline ();;)
+			{
+				uint64_t start = bench_now ();
+				if (start >= deadline)
+					break;
+
+				stamp++;
+				if (multi)
+					teredo_get_nonces (stamp, ipv4, port, nonces,
+					                   BENCH_BATCH);
+				else
+					for (unsigned i = 0; i < BENCH_BATCH; i++)
+						teredo_get_nonce (stamp, ipv4[i], port[i], nonces[i]);
+				if (!bench_add (&s, bench_now () - start))
+					break;
+			}
+
+			snprintf (name, sizeof (name), "%s-%s",
+			          multi ? "nonces" : "nonce", macs[k]);
+			bench_report (name, &s);
+			bench_free (&s);
+		}
+		teredo_deinit_HMAC ();
+	}
+
+	teredo_select_mac ("siphash");
+	return 0;
+}
+#endif
+
+
+/*** Packets parsing and reception ***/
+
+#define BENCH_IPV6_SIZE 1280
+
+/**
+ * Builds a Teredo datagram carrying an UDP over IPv6 packet, with an
+ * optional origin indication.
+ * @return the datagram size.
+ */
+static size_t make_datagram (uint8_t *buf, bool orig,
+                             const struct in6_addr *src,
+                             const struct in6_addr *dst)
+{
+	static const uint8_t orig_hdr[8] =
+		{ 0, 0, 0xcf, 0xc6, 0x3f, 0xff, 0xfd, 0x74 };
+	size_t offset = 0;
+
+	if (orig)
+	{
+		memcpy (buf, orig_hdr, sizeof (orig_hdr));
+		offset = sizeof (orig_hdr);
+	}
+
+	struct ip6_hdr ip6 =
+	{
+		.ip6_flow = htonl (0x60000000),
+		.ip6_plen = htons (BENCH_IPV6_SIZE - sizeof (ip6)),
+		.ip6_nxt = IPPROTO_UDP,
+		.ip6_hlim = 64,
+		.ip6_src = *src,
+		.ip6_dst = *dst,
+	};
+
+	memcpy (buf + offset, &ip6, sizeof (ip6));
+	memset (buf + offset + sizeof (ip6), 0, BENCH_IPV6_SIZE - sizeof (ip6));
+	return offset + BENCH_IPV6_SIZE;
+}
+
+
+static int bench_parse (void)
+{
+	union
+	{
+		uint64_t align;
+		uint8_t buf[8 + BENCH_IPV6_SIZE];
+	} dgram;
+	struct sockaddr_in sin =
+	{
+		.sin_family = AF_INET,
+		.sin_port = htons (IPPORT_TEREDO),
+		.sin_addr = { htonl (INADDR_LOOPBACK) },
+	};
+	struct in6_addr src, dst;
+
+	make_address (&src, 1);
+	make_address (&dst, 2);
+
+	for (unsigned orig = 0; orig < 2; orig++)
+	{
+		bench_samples s;
+		size_t len = make_datagram (dgram.buf, orig, &src, &dst);
+
+		if (bench_init (&s, BENCH_BATCH))
+			return -1;
+
+		for (uint64_t deadline = bench_deadline ();;)
+		{
+			uint64_t start = bench_now ();
+			if (start >= deadline)
+				break;
+
+			for (unsigned i = 0; i < BENCH_BATCH; i++)
+			{
+				struct msghdr msg =
+				{
+					.msg_name = &sin,
+					.msg_namelen = sizeof (sin),
+				};
+				teredo_packet p;
+
+				if (teredo_parse_msg (&p, &msg, dgram.buf, 0, len))
+					abort ();
+			}
+			if (!bench_add (&s, bench_now () - start))
+				break;
+		}
+
+		bench_report (orig ? "parse-origin" : "parse-plain", &s);
+		bench_free (&s);
+	}
+	return 0;
+}
+
+
+/**
+ * Receives datagrams over the loopback interface, one system call each.
+ */
+static int bench_recv (void)
+{
+	const uint32_t lo = htonl (INADDR_LOOPBACK);
+	uint8_t buf[8 + BENCH_IPV6_SIZE];
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof (addr);
+	struct in6_addr src, dst;
+	bench_samples s;
+
+	int fd = teredo_socket (lo, 0);
+	if (fd == -1)
+	{
+		perror ("Loopback socket");
+		return 0; /* skip */
+	}
+
+	if (getsockname (fd, (struct sockaddr *)&addr, &addrlen)
+	 || bench_init (&s, BENCH_BATCH))
+	{
+		teredo_close (fd);
+		return -1;
+	}
+
+	make_address (&src, 1);
+	make_address (&dst, 2);
+
+	size_t len = make_datagram (buf, true, &src, &dst);
+	teredo_packet *p = malloc (sizeof (*p));
+
+	for (uint64_t deadline = bench_deadline (); p != NULL;)
+	{
+		/* The socket buffer must fit a whole batch */
+		for (unsigned i = 0; i < BENCH_BATCH; i++)
+			teredo_send (fd, buf, len, lo, addr.sin_port);
+
+		uint64_t start = bench_now ();
+		if (start >= deadline)
+			break;
+
+		unsigned i;
+		for (i = 0; i < BENCH_BATCH; i++)
+			if (teredo_recv (fd, p))
+				break;
+		if (i < BENCH_BATCH)
+		{
+			fputs ("recv: datagrams lost, skipped\n", stderr);
+			break;
+		}
+		if (!bench_add (&s, bench_now () - start))
+			break;
+	}
+
+	free (p);
+	teredo_close (fd);
+	bench_report ("recv-loopback", &s);
+	bench_free (&s);
+	return 0;
+}
+
+
+/*** End-to-end relaying ***/
+
+typedef struct bench_relay
+{
+	teredo_tunnel *tunnel;
+	int fd; /* the Teredo client socket */
+	struct in6_addr client; /* the Teredo client address */
+	struct in6_addr host; /* the native IPv6 host address */
+	atomic_uint_fast64_t received;
+	uint64_t deadline;
+} bench_relay;
+
+
+static void bench_relay_recv (void *opaque, const void *data, size_t len)
+{
+	bench_relay *r = opaque;
+
+	(void)data;
+	(void)len;
+	atomic_fetch_add_explicit (&r->received, 1, memory_order_release);
+}
+
+
+static void *bench_relay_flood (void *data)
+{
+	bench_relay *r = data;
+	uint8_t buf[BENCH_IPV6_SIZE];
+	size_t len = make_datagram (buf, false, &r->client, &r->host);
+
+	while (bench_now () < r->deadline)
+		for (unsigned i = 0; i < BENCH_BATCH; i++)
+			(void)send (r->fd, buf, len, 0);
+	return NULL;
+}
+
+
+/**
+ * Waits until the relay has received a number of packets.
+ * @return 0 on success, -1 on timeout (100 ms).
+ */
+static int bench_relay_wait (bench_relay *r, uint64_t count)
+{
+	uint64_t deadline = bench_now () + 100000000;
+
+	while (atomic_load_explicit (&r->received, memory_order_acquire) < count)
+		if (bench_now () >= deadline)
+			return -1;
+	return 0;
+}
+
+
+/**
+ * Sets up a relay and a Teredo client on the loopback interface.
+ * The client is known to the relay, as if the native host had sent it a
+ * packet (the indirect bubble goes to a documentation server address).
+ */
+static int bench_relay_setup (bench_relay *r)
+{
+	const uint32_t lo = htonl (INADDR_LOOPBACK);
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof (addr);
+
+	/* Finds a free port for the relay */
+	int fd = teredo_socket (lo, 0);
+	if (fd == -1)
+	{
+		perror ("Loopback socket");
+		return -1;
+	}
+	getsockname (fd, (struct sockaddr *)&addr, &addrlen);
+	teredo_close (fd);
+
+	r->tunnel = teredo_create (lo, addr.sin_port);
+	if (r->tunnel == NULL)
+		return -1;
+
+	r->fd = teredo_socket (lo, 0);
+	if (r->fd == -1)
+		goto error;
+	if (connect (r->fd, (struct sockaddr *)&addr, sizeof (addr)))
+		goto error;
+
+	addrlen = sizeof (addr);
+	getsockname (r->fd, (struct sockaddr *)&addr, &addrlen);
+
+	union teredo_addr *client = (union teredo_addr *)&r->client;
+	client->teredo.prefix = htonl (TEREDO_PREFIX);
+	client->teredo.server_ip = htonl (0xc6336401); /* 198.51.100.1 */
+	client->teredo.flags = 0;
+	client->teredo.client_port = ~addr.sin_port;
+	client->teredo.client_ip = ~lo;
+	inet_pton (AF_INET6, "2001:db8::1", &r->host);
+
+	atomic_init (&r->received, 0);
+	teredo_set_privdata (r->tunnel, r);
+	teredo_set_recv_callback (r->tunnel, bench_relay_recv);
+	if (teredo_set_relay_mode (r->tunnel) || teredo_run_async (r->tunnel))
+		goto error;
+
+	/* Host to client: the relay adds the peer and sends bubbles */
+	union
+	{
+		struct ip6_hdr ip6;
+		uint8_t buf[BENCH_IPV6_SIZE];
+	} pkt;
+
+	/* Sending the indirect bubble fails without a default route */
+	make_datagram (pkt.buf, false, &r->host, &r->client);
+	(void)teredo_transmit (r->tunnel, &pkt.ip6, BENCH_IPV6_SIZE);
+
+	/* Client to host: the relay trusts the client */
+	make_datagram (pkt.buf, false, &r->client, &r->host);
+	if ((send (r->fd, pkt.buf, BENCH_IPV6_SIZE, 0) != BENCH_IPV6_SIZE)
+	 || bench_relay_wait (r, 1))
+		goto error;
+	return 0;
+
+error:
+	if (r->fd != -1)
+		teredo_close (r->fd);
+	teredo_destroy (r->tunnel);
+	return -1;
+}
+
+
+/**
+ * Measures relay reception throughput, latency, and transmission costs.
+ */
+static int bench_relay_run (void)
+{
+	bench_relay r = { .fd = -1 };
+	bench_samples s;
+
+	if (teredo_startup (false))
+		return -1;
+	if (bench_relay_setup (&r))
+	{
+		fputs ("relay: cannot set up loopback relay, skipped\n", stderr);
+		teredo_cleanup (false);
+		return 0;
+	}
+
+	/* Throughput: relay receive threads against a flooding client */
+	pthread_t th;
+	uint64_t count = atomic_load (&r.received);
+	uint64_t start = bench_now ();
+
+	r.deadline = bench_deadline ();
+	if (pthread_create (&th, NULL, bench_relay_flood, &r) == 0)
+	{
+		pthread_join (th, NULL);
+
+		uint64_t elapsed = bench_now () - start;
+		count = atomic_load (&r.received) - count;
+		printf ("%-24s %11.0f pkt/s\n", "relay-rx-flood",
+		        count * 1e9 / elapsed);
+	}
+
+	/* Latency: one packet in flight at a time */
+	uint8_t buf[BENCH_IPV6_SIZE];
+	size_t len = make_datagram (buf, false, &r.client, &r.host);
+	unsigned lost = 0;
+
+	usleep (100000); /* drains the flood */
+	if (bench_init (&s, 1))
+		goto out;
+
+	for (uint64_t deadline = bench_deadline ();;)
+	{
+		count = atomic_load (&r.received);
+		start = bench_now ();
+		if (start >= deadline)
+			break;
+
+		if (send (r.fd, buf, len, 0) != (ssize_t)len)
+			break;
+		if (bench_relay_wait (&r, count + 1))
+		{
+			lost++;
+			continue;
+		}
+		if (!bench_add (&s, bench_now () - start))
+			break;
+	}
+	bench_report ("relay-rx-latency", &s);
+	if (lost > 0)
+		printf ("%-24s %11u packets lost\n", "relay-rx-latency", lost);
+	bench_free (&s);
+
+	/* Transmission to the trusted client: encapsulation and sending */
+	union
+	{
+		struct ip6_hdr ip6;
+		uint8_t buf[BENCH_IPV6_SIZE];
+	} pkt;
+
+	make_datagram (pkt.buf, false, &r.host, &r.client);
+	if (bench_init (&s, BENCH_BATCH))
+		goto out;
+
+	for (uint64_t deadline = bench_deadline ();;)
+	{
+		start = bench_now ();
+		if (start >= deadline)
+			break;
+
+		for (unsigned i = 0; i < BENCH_BATCH; i++)
+			teredo_transmit (r.tunnel, &pkt.ip6, BENCH_IPV6_SIZE);
+		if (!bench_add (&s, bench_now () - start))
+			break;
+	}
+	bench_report ("relay-tx", &s);
+	bench_free (&s);
+
+out:
+	teredo_close (r.fd);
+	teredo_destroy (r.tunnel);
+	teredo_cleanup (false);
+	return 0;
+}
+
+
+static const struct
+{
+	const char *name;
+	int (*run) (void);
+} benchmarks[] =
+{
+	{ "cksum", bench_cksum },
+#ifdef MIREDO_TEREDO_CLIENT
+	{ "hash", bench_hash },
+#endif
+	{ "parse", bench_parse },
+	{ "recv", bench_recv },
+	{ "lookup", bench_lookup },
+	{ "gc", bench_gc },
+	{ "relay", bench_relay_run },
+};
+
+
+static void usage (const char *path)
+{
+	printf ("Usage: %s [-t SECONDS] [BENCHMARK...]\n"
+	        "Runs libteredo benchmarks (all by default):\n", path);
+	for (size_t i = 0; i < sizeof (benchmarks) / sizeof (benchmarks[0]); i++)
+		printf (" %s", benchmarks[i].name);
+	puts ("");
+}
+
+
+int main (int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt (argc, argv, "ht:")) != -1)
+		switch (c)
+		{
+			case 't':
+				bench_duration = strtod (optarg, NULL);
+				if (bench_duration > 0.)
+					break;
+			/* fall through */
+			default:
+				usage (argv[0]);
+				return c != 'h';
+		}
+
+	int ret = 0;
+
+	for (size_t i = 0; i < sizeof (benchmarks) / sizeof (benchmarks[0]); i++)
+	{
+		bool selected = optind >= argc;
+
+		for (int j = optind; j < argc; j++)
+			if (strcmp (argv[j], benchmarks[i].name) == 0)
+				selected = true;
+
+		if (selected && benchmarks[i].run ())
+		{
+			fprintf (stderr, "%s: benchmark failed\n", benchmarks[i].name);
+			ret = 1;
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,81 @@
+/*
+ * bloom.c - Libteredo negative lookup filter tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bloom.h"
+
+#define COUNT 4096
+
+static uint32_t make_hash (uint32_t i)
+{
+	/* Spreads consecutive values somewhat like teredo_addr_hash() */
+	uint64_t h = (i + 1) * UINT64_C(0xc2b2ae3d27d4eb4f);
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+
+int main (void)
+{
+	teredo_bloom f;
+
+	assert (teredo_bloom_init (&f, COUNT) == 0);
+	assert (f.mask + 1 == COUNT * TEREDO_BLOOM_BITS_PER_ENTRY / 64);
+
+	/* Empty filter */
+	for (uint32_t i = 0; i < 2 * COUNT; i++)
+		assert (!teredo_bloom_test (&f, make_hash (i)));
+
+	/* No false negatives */
+	for (uint32_t i = 0; i < COUNT; i++)
+		teredo_bloom_add (&f, make_hash (i));
+	for (uint32_t i = 0; i < COUNT; i++)
+		assert (teredo_bloom_test (&f, make_hash (i)));
+
+	/* Few false positives at nominal capacity */
+	unsigned fp = 0;
+	for (uint32_t i = COUNT; i < 11 * COUNT; i++)
+		fp += teredo_bloom_test (&f, make_hash (i));
+	printf ("False positives: %u/%u\n", fp, 10 * COUNT);
+	assert (fp < COUNT); /* i.e. below 10% */
+
+	teredo_bloom_clear (&f);
+	for (uint32_t i = 0; i < COUNT; i++)
+		assert (!teredo_bloom_test (&f, make_hash (i)));
+	teredo_bloom_destroy (&f);
+
+	/* Tiny filter: still a single functional word */
+	assert (teredo_bloom_init (&f, 0) == 0);
+	assert (f.mask == 0);
+	teredo_bloom_add (&f, 42);
+	assert (teredo_bloom_test (&f, 42));
+	teredo_bloom_destroy (&f);
+	return 0;
+}
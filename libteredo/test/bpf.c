@@ -0,0 +1,265 @@
+/*
+ * bpf.c - Libteredo in-kernel datapath tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "tunnel.h"
+#include "bpf.h"
+
+/*
+ * A tun interface stands for the Teredo tunnel, and the loopback interface
+ * for the IPv4 network. The relay is bound to 127.0.0.1:RELAY_PORT (with
+ * no actual socket: packets that are not handled by the kernel are lost),
+ * and a trusted peer sits at 127.0.0.1:PEER_PORT.
+ */
+#define RELAY_PORT 35441
+#define PEER_PORT  35442
+#define APP_PORT   35443
+
+struct in6_ifreq
+{
+	struct in6_addr ifr6_addr;
+	uint32_t ifr6_prefixlen;
+	int ifr6_ifindex;
+};
+
+static const struct in6_addr local_ip6 =
+	{ { { 0x20, 0x01, 0x0d, 0xb8, 0x7e, 0x4e, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 } } };
+static const struct in6_addr peer_ip6 =
+	{ { { 0x20, 0x01, 0x0d, 0xb8, 0x7e, 0x4e, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2 } } };
+
+static int tun_open (unsigned *ifindex)
+{
+	struct ifreq req;
+
+	int fd = open ("/dev/net/tun", O_RDWR | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	memset (&req, 0, sizeof (req));
+	req.ifr_flags = IFF_TUN | IFF_NO_PI;
+	if (ioctl (fd, TUNSETIFF, &req))
+	{
+		close (fd);
+		return -1;
+	}
+
+	int s = socket (AF_INET6, SOCK_DGRAM, 0);
+	assert (s != -1);
+	assert (ioctl (s, SIOCGIFFLAGS, &req) == 0);
+	req.ifr_flags |= IFF_UP;
+	assert (ioctl (s, SIOCSIFFLAGS, &req) == 0);
+	*ifindex = if_nametoindex (req.ifr_name);
+
+	struct in6_ifreq req6 =
+	{
+		.ifr6_addr = local_ip6,
+		.ifr6_prefixlen = 64,
+		.ifr6_ifindex = *ifindex,
+	};
+	assert (ioctl (s, SIOCSIFADDR, &req6) == 0);
+	close (s);
+	return fd;
+}
+
+static int udp_socket (int family, uint16_t port)
+{
+	int fd = socket (family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	assert (fd != -1);
+
+	if (family == AF_INET)
+	{
+		struct sockaddr_in addr =
+		{
+			.sin_family = AF_INET,
+			.sin_port = htons (port),
+			.sin_addr.s_addr = htonl (INADDR_LOOPBACK),
+		};
+		assert (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) == 0);
+	}
+	else
+	{
+		struct sockaddr_in6 addr =
+		{
+			.sin6_family = AF_INET6,
+			.sin6_port = htons (port),
+			.sin6_addr = local_ip6,
+		};
+		assert (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) == 0);
+	}
+	return fd;
+}
+
+static ssize_t recv_timeout (int fd, void *buf, size_t len)
+{
+	struct pollfd ufd = { .fd = fd, .events = POLLIN };
+
+	if (poll (&ufd, 1, 1000) <= 0)
+		return -1;
+	return read (fd, buf, len);
+}
+
+/* Sends an encapsulated UDP datagram from the peer to the application */
+static void peer_send (int fd, const char *data, size_t len)
+{
+	struct
+	{
+		struct ip6_hdr ip6;
+		struct udphdr udp;
+		char data[64];
+	} pkt;
+
+	assert (len <= sizeof (pkt.data));
+	memset (&pkt, 0, sizeof (pkt));
+	pkt.ip6.ip6_flow = htonl (0x60000000);
+	pkt.ip6.ip6_plen = htons (sizeof (pkt.udp) + len);
+	pkt.ip6.ip6_nxt = IPPROTO_UDP;
+	pkt.ip6.ip6_hlim = 64;
+	pkt.ip6.ip6_src = peer_ip6;
+	pkt.ip6.ip6_dst = local_ip6;
+	pkt.udp.uh_sport = htons (APP_PORT);
+	pkt.udp.uh_dport = htons (APP_PORT);
+	pkt.udp.uh_ulen = pkt.ip6.ip6_plen;
+	memcpy (pkt.data, data, len);
+
+	struct iovec iov = { &pkt.udp, sizeof (pkt.udp) + len };
+	pkt.udp.uh_sum = teredo_cksum (&pkt.ip6.ip6_src, &pkt.ip6.ip6_dst,
+	                               IPPROTO_UDP, &iov, 1);
+
+	struct sockaddr_in dst =
+	{
+		.sin_family = AF_INET,
+		.sin_port = htons (RELAY_PORT),
+		.sin_addr.s_addr = htonl (INADDR_LOOPBACK),
+	};
+	size_t total = sizeof (pkt.ip6) + sizeof (pkt.udp) + len;
+	assert (sendto (fd, &pkt, total, 0, (struct sockaddr *)&dst,
+	                sizeof (dst)) == (ssize_t)total);
+}
+
+int main (void)
+{
+	unsigned tun_ifindex, lo_ifindex = if_nametoindex ("lo");
+
+	int tunfd = tun_open (&tun_ifindex);
+	if (tunfd == -1)
+		return 77; /* skip: not privileged */
+
+	teredo_datapath *dp = teredo_datapath_create (tun_ifindex, lo_ifindex,
+	                                              htonl (INADDR_LOOPBACK),
+	                                              htons (RELAY_PORT));
+	if (dp == NULL)
+	{
+		perror ("teredo_datapath_create");
+		close (tunfd);
+		/* Only a verifier rejection (EACCES) is an actual failure */
+		return (errno == EACCES) ? 1 : 77;
+	}
+
+	int peer = udp_socket (AF_INET, PEER_PORT);
+	int app = udp_socket (AF_INET6, APP_PORT);
+	char buf[1500];
+
+	/* Unknown peer: nothing goes through the kernel datapath */
+	peer_send (peer, "hello", 5);
+	assert (recv_timeout (app, buf, sizeof (buf)) == -1);
+
+	teredo_datapath_update (dp, &peer_ip6, htonl (INADDR_LOOPBACK),
+	                        htons (PEER_PORT), 30);
+
+	/* Decapsulation */
+	peer_send (peer, "hello", 5);
+	assert (recv_timeout (app, buf, sizeof (buf)) == 5);
+	assert (memcmp (buf, "hello", 5) == 0);
+
+	/* Encapsulation */
+	struct sockaddr_in6 dst =
+	{
+		.sin6_family = AF_INET6,
+		.sin6_port = htons (APP_PORT),
+		.sin6_addr = peer_ip6,
+	};
+	assert (sendto (app, "world", 5, 0, (struct sockaddr *)&dst,
+	                sizeof (dst)) == 5);
+	ssize_t val = recv_timeout (peer, buf, sizeof (buf));
+	assert (val == 40 + 8 + 5);
+	const struct ip6_hdr *ip6 = (const struct ip6_hdr *)buf;
+	assert (IN6_ARE_ADDR_EQUAL (&ip6->ip6_src, &local_ip6));
+	assert (IN6_ARE_ADDR_EQUAL (&ip6->ip6_dst, &peer_ip6));
+	assert (memcmp (buf + 48, "world", 5) == 0);
+
+	/* Mismatching mapping: the packet goes to userspace */
+	teredo_datapath_update (dp, &peer_ip6, htonl (INADDR_LOOPBACK),
+	                        htons (PEER_PORT + 1), 30);
+	peer_send (peer, "hello", 5);
+	assert (recv_timeout (app, buf, sizeof (buf)) == -1);
+
+	/* Expired peer */
+	teredo_datapath_update (dp, &peer_ip6, htonl (INADDR_LOOPBACK),
+	                        htons (PEER_PORT), 0);
+	assert (sendto (app, "world", 5, 0, (struct sockaddr *)&dst,
+	                sizeof (dst)) == 5);
+	assert (recv_timeout (peer, buf, sizeof (buf)) == -1);
+	/* The tunnel interface also sends ICMPv6 packets of its own */
+	do
+		assert (recv_timeout (tunfd, buf, sizeof (buf)) >= 40);
+	while (!IN6_ARE_ADDR_EQUAL (&ip6->ip6_dst, &peer_ip6));
+	assert (memcmp (buf + 48, "world", 5) == 0);
+
+	/* Flushed peer */
+	teredo_datapath_update (dp, &peer_ip6, htonl (INADDR_LOOPBACK),
+	                        htons (PEER_PORT), 30);
+	teredo_datapath_flush (dp);
+	peer_send (peer, "hello", 5);
+	assert (recv_timeout (app, buf, sizeof (buf)) == -1);
+
+	close (app);
+	close (peer);
+	teredo_datapath_destroy (dp);
+	close (tunfd);
+	return 0;
+}
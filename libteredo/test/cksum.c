@@ -0,0 +1,204 @@
+/*
+ * cksum.c - Libteredo Internet checksum tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "checksum.h"
+
+/* Former byte-by-byte implementation, as a reference */
+static uint16_t ref_cksum (const struct iovec *iov, size_t n)
+{
+	uint32_t sum = 0;
+	union
+	{
+		uint16_t word;
+		uint8_t  bytes[2];
+	} w;
+	bool odd = false;
+
+	while (n > 0)
+	{
+		const uint8_t *ptr = iov->iov_base;
+
+		for (size_t len = iov->iov_len; len > 0; len--)
+		{
+			if (odd)
+			{
+				w.bytes[1] = *ptr++;
+				sum += w.word;
+				if (sum > 0xffff)
+					sum -= 0xffff;
+			}
+			else
+				w.bytes[0] = *ptr++;
+			odd = !odd;
+		}
+
+		iov++;
+		n--;
+	}
+
+	if (odd)
+	{
+		w.bytes[1] = 0;
+		sum += w.word;
+		if (sum > 0xffff)
+			sum -= 0xffff;
+	}
+
+	return sum ^ 0xffff;
+}
+
+
+static uint16_t ref_teredo_cksum (const void *src, const void *dst,
+                                  uint8_t protocol, const struct iovec *data,
+                                  size_t n)
+{
+	struct iovec iov[3 + n];
+	size_t plen = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		iov[3 + i] = data[i];
+		plen += data[i].iov_len;
+	}
+
+	uint32_t pseudo[4] = { htonl (plen), htonl (protocol) };
+	iov[0].iov_base = (void *)src;
+	iov[0].iov_len = 16;
+	iov[1].iov_base = (void *)dst;
+	iov[1].iov_len = 16;
+	iov[2].iov_base = pseudo;
+	iov[2].iov_len = 8;
+
+	return ref_cksum (iov, 3 + n);
+}
+
+
+static uint8_t buf[300000];
+
+static void test_kernel (void)
+{
+	const uint8_t *src = buf, *dst = buf + 16;
+
+	for (unsigned round = 0; round < 2000; round++)
+	{
+		struct iovec iov[4];
+		size_t n = 1 + rand () % 4;
+
+		for (size_t i = 0; i < n; i++)
+		{
+			/* Random (mis)alignments and (odd) lengths */
+			size_t len = (round < 1990) ? (size_t)(rand () % 1600)
+			                            : (rand () % (sizeof (buf) / 4));
+			size_t off = rand () % (sizeof (buf) - len);
+
+			iov[i].iov_base = buf + off;
+			iov[i].iov_len = len;
+		}
+
+		assert (teredo_cksum (src, dst, IPPROTO_ICMPV6, iov, n)
+		        == ref_teredo_cksum (src, dst, IPPROTO_ICMPV6, iov, n));
+	}
+
+	/* Worst case values: vector lanes must not overflow */
+	memset (buf, 0xff, sizeof (buf));
+	struct iovec iov = { buf, sizeof (buf) };
+	assert (teredo_cksum (src, dst, IPPROTO_UDP, &iov, 1)
+	        == ref_teredo_cksum (src, dst, IPPROTO_UDP, &iov, 1));
+	iov.iov_len--;
+	assert (teredo_cksum (src, dst, IPPROTO_UDP, &iov, 1)
+	        == ref_teredo_cksum (src, dst, IPPROTO_UDP, &iov, 1));
+	for (size_t i = 0; i < sizeof (buf); i++)
+		buf[i] = rand ();
+}
+
+
+static void test_adjust (void)
+{
+	for (unsigned round = 0; round < 1000; round++)
+	{
+		uint8_t pkt[64];
+		for (size_t i = 0; i < sizeof (pkt); i++)
+			pkt[i] = rand ();
+
+		struct iovec iov = { pkt, sizeof (pkt) };
+		uint16_t cksum = ref_cksum (&iov, 1);
+
+		/* Rewrites some words at an even offset */
+		size_t off = 2 * (rand () % 16), len = 2 * (1 + rand () % 8);
+		uint8_t old[16];
+		memcpy (old, pkt + off, len);
+		for (size_t i = 0; i < len; i++)
+			pkt[off + i] = (round & 1) ? rand () : 0;
+
+		uint16_t adjusted = teredo_cksum_adjust (cksum, old, pkt + off, len);
+		uint16_t full = ref_cksum (&iov, 1);
+
+		/* One's complement has two zeros */
+		assert ((adjusted == full)
+		     || ((adjusted ^ full) == 0xffff && (full == 0 || full == 0xffff)));
+	}
+}
+
+
+int main (void)
+{
+	static const char *const kernels[] =
+		{ "scalar", "sse2", "avx2", "neon", NULL };
+
+	srand (0);
+	for (size_t i = 0; i < sizeof (buf); i++)
+		buf[i] = rand ();
+
+	for (unsigned i = 0; i < sizeof (kernels) / sizeof (kernels[0]); i++)
+	{
+		if (teredo_cksum_select (kernels[i]))
+		{
+			printf ("%s kernel not supported\n", kernels[i]);
+			continue;
+		}
+		printf ("Testing %s kernel...\n",
+		        (kernels[i] != NULL) ? kernels[i] : "default");
+		test_kernel ();
+		test_adjust ();
+	}
+
+	assert (teredo_cksum_select ("foobar") == -1);
+	return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * embed.c - Libteredo event loop API tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "tunnel.h"
+
+static unsigned sunk;
+
+static void sink (void *opaque, const struct iovec *iov, size_t count,
+                  uint32_t ip, uint16_t port)
+{
+	assert (opaque == &sunk);
+	assert ((count > 0) && (iov[0].iov_len > 0));
+	assert ((ip != 0) && (port != 0));
+	sunk++;
+}
+
+int main (void)
+{
+	const uint32_t lo = htonl (INADDR_LOOPBACK);
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof (addr);
+	int fds[2];
+
+	assert (teredo_startup (false) == 0);
+
+	teredo_tunnel *t = teredo_create_embedded (lo, 0, 1);
+	if (t == NULL)
+	{
+		perror ("Loopback tunnel");
+		return 77; /* skip */
+	}
+
+	assert (teredo_get_fds (t, fds, 2) == 1);
+	assert (fcntl (fds[0], F_GETFL) & O_NONBLOCK);
+	assert (teredo_run_async (t) == -1);
+	assert (teredo_set_client_mode (t, "192.0.2.1", NULL) == -1);
+
+	/* Nothing pending: garbage collection only */
+	int ms = teredo_next_deadline (t);
+	assert ((ms > 3000) && (ms <= 30000));
+	errno = 0;
+	assert ((teredo_process_batch (t, 0) == -1) && (errno == EAGAIN));
+	errno = 0;
+	assert ((teredo_process_batch (t, 1) == -1) && (errno == EINVAL));
+	teredo_tick (t);
+
+	/* Datagram from a Teredo client: a bubble */
+	int peer = socket (AF_INET, SOCK_DGRAM, 0);
+	assert (peer != -1);
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = lo;
+	assert (bind (peer, (struct sockaddr *)&addr, sizeof (addr)) == 0);
+
+	struct sockaddr_in taddr;
+	assert (getsockname (fds[0], (struct sockaddr *)&taddr, &addrlen) == 0);
+
+	struct ip6_hdr bubble;
+	memset (&bubble, 0, sizeof (bubble));
+	bubble.ip6_vfc = 0x60;
+	bubble.ip6_nxt = IPPROTO_NONE;
+	bubble.ip6_src.s6_addr32[0] = htonl (TEREDO_PREFIX);
+	bubble.ip6_src.s6_addr32[1] = htonl (0x08080808);
+	bubble.ip6_dst.s6_addr[0] = 0xfe;
+	bubble.ip6_dst.s6_addr[1] = 0x80;
+	assert (sendto (peer, &bubble, sizeof (bubble), 0,
+	                (struct sockaddr *)&taddr, sizeof (taddr))
+	        == sizeof (bubble));
+
+	struct pollfd ufd = { .fd = fds[0], .events = POLLIN };
+	assert (poll (&ufd, 1, 1000) == 1);
+	assert (teredo_process_batch (t, 0) == 1);
+	assert ((teredo_process_batch (t, 0) == -1) && (errno == EAGAIN));
+
+	/* Early ticks are harmless */
+	teredo_tick (t);
+	assert (teredo_next_deadline (t) > 3000);
+
+	/* Replayed datagram, with output diverted */
+	union
+	{
+		uint64_t align;
+		uint8_t buf[sizeof (bubble)];
+	} dgram;
+	struct msghdr msg =
+	{
+		.msg_name = &addr,
+		.msg_namelen = sizeof (addr),
+	};
+	teredo_packet_batch *batch = calloc (1, sizeof (*batch));
+
+	assert (batch != NULL);
+	assert (getsockname (peer, (struct sockaddr *)&addr, &addrlen) == 0);
+	memcpy (dgram.buf, &bubble, sizeof (bubble));
+	assert (teredo_parse_msg (batch->storage, &msg, dgram.buf, 0,
+	                          sizeof (bubble)) == 0);
+	batch->packets[0] = batch->storage;
+	batch->count = 1;
+
+	teredo_set_sink (sink, &sunk);
+	assert (teredo_replay_batch (t, batch) == 1);
+
+	/* Toward a Teredo peer: bubbles go to the sink, not the network */
+	struct ip6_hdr packet = bubble;
+	packet.ip6_src = bubble.ip6_dst;
+	packet.ip6_dst = bubble.ip6_src;
+	packet.ip6_dst.s6_addr32[1] = htonl (0x08080809);
+	packet.ip6_dst.s6_addr32[3] = ~htonl (0x0b000001);
+	teredo_transmit (t, &packet, sizeof (packet));
+	assert (sunk > 0);
+	teredo_set_sink (NULL, NULL);
+	ufd.fd = peer;
+	assert (poll (&ufd, 1, 0) == 0);
+	free (batch);
+
+	close (peer);
+	teredo_destroy (t);
+	teredo_cleanup (false);
+	return 0;
+}
@@ -98,15 +98,87 @@ static int test_rs (void)
 	if (memcmp (buf, nonce, LIBTEREDO_NONCE_LEN))
 		return 1;
 
+	/* other mappings and timestamps, more than fit in the cache */
+	for (unsigned i = 1; i < 1000; i++)
+	{
+		teredo_get_nonce (stamp, ipv4, port ^ htons (i), buf);
+		if (!memcmp (buf, nonce, LIBTEREDO_NONCE_LEN))
+			return 1;
+		teredo_get_nonce (stamp + i, ipv4, port, buf);
+		if (!memcmp (buf, nonce, LIBTEREDO_NONCE_LEN))
+			return 1;
+	}
+
+	teredo_get_nonce (stamp, ipv4, port, buf);
+	if (memcmp (buf, nonce, LIBTEREDO_NONCE_LEN))
+		return 1;
+
+	return 0;
+}
+
+
+static int test_nonces (void)
+{
+	uint32_t ipv4[100];
+	uint16_t port[100];
+	uint8_t nonces[100][LIBTEREDO_NONCE_LEN], buf[LIBTEREDO_NONCE_LEN];
+
+	/* 100 mappings, some of them twice */
+	for (unsigned i = 0; i < 100; i++)
+	{
+		ipv4[i] = htonl (0xc0000200 + (i % 70));
+		port[i] = htons (40000 + (i % 70));
+	}
+
+	/* uncached, then cached */
+	for (unsigned round = 0; round < 2; round++)
+	{
+		memset (nonces, 0, sizeof (nonces));
+		teredo_get_nonces (stamp + 1000, ipv4, port, nonces, 100);
+		for (unsigned i = 0; i < 100; i++)
+		{
+			teredo_get_nonce (stamp + 1000, ipv4[i], port[i], buf);
+			if (memcmp (buf, nonces[i], LIBTEREDO_NONCE_LEN))
+				return 1;
+		}
+	}
+
+	/* the scalar results come first this time */
+	for (unsigned i = 0; i < 100; i++)
+	{
+		teredo_get_nonce (stamp + 2000, ipv4[i], port[i], nonces[i]);
+		teredo_get_nonce (stamp + 3000 + i, ipv4[i], port[i], buf);
+	}
+	for (unsigned i = 0; i < 100; i++)
+	{
+		uint8_t batch[1][LIBTEREDO_NONCE_LEN];
+
+		teredo_get_nonces (stamp + 2000, ipv4 + i, port + i, batch, 1);
+		if (memcmp (batch[0], nonces[i], LIBTEREDO_NONCE_LEN))
+			return 1;
+	}
+	teredo_get_nonces (stamp, ipv4, port, nonces, 0);
 	return 0;
 }
 
 
 int main (void)
 {
+	static const char *const macs[] = { "hmac-md5", "siphash" };
+	uint8_t nonce[2][LIBTEREDO_NONCE_LEN];
+
 	assert (teredo_init_HMAC () == 0);
-	assert (test_ping () == 0);
-	assert (test_rs () == 0);
+	for (unsigned i = 0; i < sizeof (macs) / sizeof (macs[0]); i++)
+	{
+		assert (teredo_select_mac (macs[i]) == 0);
+		assert (test_ping () == 0);
+		assert (test_rs () == 0);
+		assert (test_nonces () == 0);
+		teredo_get_nonce (stamp, 0, 0, nonce[i]);
+	}
+	/* cached nonces must not survive a change of function */
+	assert (memcmp (nonce[0], nonce[1], LIBTEREDO_NONCE_LEN));
+	assert (teredo_select_mac ("crc32") == -1);
 
 	teredo_deinit_HMAC ();
 	return 0;
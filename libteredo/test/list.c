@@ -27,6 +27,9 @@
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h> // putenv()
+#include <string.h> // memset()
+#include <stdint.h>
+#include <errno.h>
 
 #include <inttypes.h> /* for Mac OS X */
 #include <sys/types.h>
@@ -36,6 +39,7 @@
 #include "teredo.h"
 #include "clock.h"
 #include "peerlist.h"
+#include "stats.h"
 
 
 static void wait (unsigned sec)
@@ -50,7 +54,7 @@ lookup (teredo_peerlist *l, struct in6_addr *addr, bool *create)
 {
 	teredo_peer *p = teredo_list_lookup (l, addr, create);
 	if (p != NULL)
-		teredo_list_release (l);
+		teredo_list_release (l, p);
 	return p;
 }
 
@@ -163,6 +167,573 @@ static int test_list (teredo_peerlist *l)
 }
 
 
+static void dequeue_cb (void *opaque, const void *data, size_t len)
+{
+	unsigned *next = opaque;
+
+	/* Packets must come out in FIFO order */
+	if ((len == 100) && (*(const uint8_t *)data == *next))
+		++*next;
+	else
+		*next = 1000;
+}
+
+
+static int test_queue (size_t size)
+{
+	struct in6_addr addr = { { } };
+	uint8_t buf[100] = { 0 };
+	bool create;
+
+	printf ("Packets queueing test (%zu bytes)...\n", size);
+	teredo_peerlist *l = teredo_list_create (1, 3);
+	if (l == NULL)
+		return -1;
+
+	teredo_list_set_queue_size (l, size);
+	if (teredo_list_reserve (l, 1000))
+		return -1;
+
+	teredo_peer *p = teredo_list_lookup (l, &addr, &create);
+	if (p == NULL)
+		return -1;
+
+	for (unsigned round = 0; round < 2; round++)
+	{
+		/* Only as many packets as fit in the queue size are kept */
+		for (unsigned i = 0; i < 50; i++)
+		{
+			buf[0] = i;
+			teredo_enqueue_in (l, p, buf, sizeof (buf), 1, 2);
+		}
+
+		/* Packets from another source are discarded when dequeued */
+		teredo_enqueue_in (l, p, buf, sizeof (buf), 3, 4);
+
+		unsigned next = 0;
+		teredo_queue_emit (l, teredo_peer_queue_yield (p), -1, 1, 2,
+		                   dequeue_cb, &next);
+		if (next != size / sizeof (buf))
+			return -1;
+	}
+
+	/* Queued packets are released with their peer */
+	teredo_enqueue_in (l, p, buf, sizeof (buf), 1, 2);
+	teredo_list_release (l, p);
+	teredo_list_destroy (l);
+	return 0;
+}
+
+
+static int test_probation (void)
+{
+	struct in6_addr addr = { { } };
+
+	puts ("Probation test...");
+	teredo_peerlist *l = teredo_list_create (32, 1000);
+	if (l == NULL)
+		return -1;
+
+	for (unsigned i = 0; i < 32; i++)
+	{
+		addr.s6_addr[12] = i;
+		if (!try_insert (l, &addr))
+			return -1;
+	}
+
+	/* Half of the peers are proven */
+	for (unsigned i = 0; i < 16; i++)
+	{
+		addr.s6_addr[12] = i;
+
+		teredo_peer *p = teredo_list_lookup (l, &addr, NULL);
+		if (p == NULL)
+			return -1;
+		teredo_list_trust (l, p);
+		teredo_list_release (l, p);
+	}
+
+	/* Peers on probation must get some time to prove themselves */
+	addr.s6_addr[0] = 1;
+	for (unsigned i = 0; i < 256; i++)
+	{
+		addr.s6_addr[12] = i;
+		if (try_insert (l, &addr))
+			return -1;
+	}
+
+	wait (4);
+
+	/* Then they make room for new peers, but trusted peers never do */
+	unsigned n = 0;
+	for (unsigned i = 0; i < 256; i++)
+	{
+		addr.s6_addr[12] = i;
+		if (try_insert (l, &addr))
+			n++;
+	}
+	if (n != 16)
+		return -1;
+
+	addr.s6_addr[0] = 0;
+	for (unsigned i = 0; i < 32; i++)
+	{
+		addr.s6_addr[12] = i;
+		if (try_lookup (l, &addr) != (i < 16))
+			return -1;
+	}
+
+	teredo_list_destroy (l);
+	return 0;
+}
+
+
+static int test_expiry (void)
+{
+	struct in6_addr addr = { { } };
+	const unsigned max = 20000;
+
+	puts ("Batched expiration test...");
+	teredo_peerlist *l = teredo_list_create (max, 1);
+	if (l == NULL)
+		return -1;
+
+	for (unsigned round = 0; round < 2; round++)
+	{
+		/* All the room must come back once peers expire */
+		for (unsigned i = 0; i < max; i++)
+		{
+			addr.s6_addr[11] = i >> 8;
+			addr.s6_addr[12] = i;
+			if (!try_insert (l, &addr))
+				return -1;
+		}
+		if (try_insert (l, &(struct in6_addr){ { { 0xff } } }))
+			return -1;
+		wait (3);
+	}
+
+	teredo_list_destroy (l);
+	return 0;
+}
+
+
+static int test_manual_gc (void)
+{
+	struct in6_addr addr = { { } };
+
+	puts ("Manual garbage collection test...");
+	teredo_peerlist *l = teredo_list_create_manual (1, 1000);
+	if ((l == NULL) || !try_insert (l, &addr))
+		return -1;
+
+	teredo_list_gc (l);
+	if (!try_lookup (l, &addr))
+		return -1; /* expired too early */
+	teredo_list_gc (l);
+	teredo_list_gc (l);
+	if (try_lookup (l, &addr) || !try_insert (l, &addr))
+		return -1;
+
+	/* Peers used in each generation stay visible through the filters */
+	for (unsigned i = 0; i < 10; i++)
+	{
+		teredo_list_gc (l);
+		if (!try_lookup (l, &addr))
+			return -1;
+	}
+	addr.s6_addr[12] = 1;
+	if (try_lookup (l, &addr))
+		return -1;
+
+	teredo_list_destroy (l);
+	return 0;
+}
+
+
+static int test_snapshot (void)
+{
+	struct in6_addr addr = { { } };
+
+	puts ("Snapshot test...");
+	FILE *file = tmpfile ();
+	if (file == NULL)
+		return -1;
+
+	int fd = fileno (file);
+	teredo_peerlist *l = teredo_list_create (64, 1000);
+	if ((l == NULL) || (teredo_list_load (l, fd, 1, 2) != 0))
+		return -1; /* an empty file is not an error */
+
+	for (unsigned i = 0; i < 64; i++)
+	{
+		bool create;
+
+		addr.s6_addr[12] = i;
+		teredo_peer *p = teredo_list_lookup (l, &addr, &create);
+		if (p == NULL)
+			return -1;
+		SetMapping (p, i, i + 1000);
+		TouchReceive (p, teredo_clock ());
+		if (i & 1)
+			teredo_list_trust (l, p);
+		else
+			p->trusted = 0;
+		teredo_list_release (l, p);
+	}
+	if (teredo_list_save (l, fd, 1, 2) != 64)
+		return -1;
+	teredo_list_destroy (l);
+
+	/* Trust is only restored for the same local address and port */
+	for (unsigned round = 0; round < 2; round++)
+	{
+		l = teredo_list_create (64, 1000);
+		if ((l == NULL) || (teredo_list_load (l, fd, 1, 2 + round) != 64))
+			return -1;
+
+		for (unsigned i = 0; i < 64; i++)
+		{
+			addr.s6_addr[12] = i;
+			teredo_peer *p = teredo_list_lookup (l, &addr, NULL);
+			if ((p == NULL) || (p->mapped_addr != i)
+			 || (p->mapped_port != i + 1000)
+			 || (p->trusted != ((round == 0) && (i & 1)))
+			 || !IsValid (p, teredo_clock ()))
+				return -1;
+			teredo_list_release (l, p);
+		}
+		teredo_list_destroy (l);
+	}
+
+	fclose (file);
+	return 0;
+}
+
+
+static int test_dump (void)
+{
+	struct in6_addr addr = { { } };
+	char line[256];
+
+	puts ("Dump test...");
+	FILE *file = tmpfile ();
+	if (file == NULL)
+		return -1;
+
+	teredo_peerlist *l = teredo_list_create (64, 1000);
+	if (l == NULL)
+		return -1;
+
+	for (unsigned i = 0; i < 10; i++)
+	{
+		bool create;
+
+		addr.s6_addr[15] = i;
+		teredo_peer *p = teredo_list_lookup (l, &addr, &create);
+		if (p == NULL)
+			return -1;
+		memset (p, 0, sizeof (*p));
+		SetMapping (p, htonl (0xc0000200 + i), htons (1000 + i));
+		TouchReceive (p, teredo_clock ());
+		TouchTransmit (p, teredo_clock ());
+		if (i < 3)
+			teredo_list_trust (l, p);
+		if (i == 9)
+			teredo_enqueue_out (l, p, line, 100);
+		teredo_list_release (l, p);
+	}
+
+	/* The previous content is replaced */
+	if ((fputs ("garbage\n", file) < 0) || fflush (file)
+	 || (teredo_list_dump (l, fileno (file)) != 10))
+		return -1;
+
+	unsigned count = 0, trusted = 0, queued = 0;
+	bool trailer = false;
+
+	rewind (file);
+	if ((fgets (line, sizeof (line), file) == NULL) || (line[0] != '#'))
+		return -1;
+	while (fgets (line, sizeof (line), file) != NULL)
+	{
+		char ip6[46], mapping[22], state[10], gen[8];
+		unsigned rx, tx, bubbles, pings, packets, bytes, shard;
+
+		if (strcmp (line, "# end: 10 peers, 16 shards\n") == 0)
+		{
+			trailer = true;
+			continue;
+		}
+		if (trailer
+		 || (sscanf (line, "%45s %21s %9s %7s %u %u %u %u %u %u %u",
+		             ip6, mapping, state, gen, &rx, &tx, &bubbles, &pings,
+		             &packets, &bytes, &shard) != 11)
+		 || (strncmp (ip6, "::", 2) || strncmp (mapping, "192.0.2.", 8))
+		 || strcmp (gen, "recent") || (rx > 1) || (tx > 1)
+		 || (shard >= 256))
+			return -1;
+
+		count++;
+		if (strcmp (state, "trusted") == 0)
+			trusted++;
+		else
+		if (strcmp (state, "probation"))
+			return -1;
+		if (packets > 0)
+		{
+			if ((packets != 1) || (bytes != 100)
+			 || strcmp (mapping, "192.0.2.9:1009"))
+				return -1;
+			queued++;
+		}
+	}
+
+	if (!trailer || (count != 10) || (trusted != 3) || (queued != 1))
+		return -1;
+
+	teredo_list_destroy (l);
+	fclose (file);
+	return 0;
+}
+
+
+static void batch_cb (void *opaque, unsigned i, teredo_peer *p)
+{
+	unsigned *found = opaque;
+
+	/* Peers 0 to 99 exist, their mapped port is their index */
+	found[i] = (p != NULL) ? p->mapped_port + 1 : 0;
+}
+
+
+static int test_batch (void)
+{
+	struct in6_addr addrs[150];
+	const struct in6_addr *ptrs[300];
+	unsigned found[300];
+
+	puts ("Batched lookup test...");
+	teredo_peerlist *l = teredo_list_create (1000, 1000);
+	if (l == NULL)
+		return -1;
+
+	memset (addrs, 0, sizeof (addrs));
+	for (unsigned i = 0; i < 150; i++)
+	{
+		addrs[i].s6_addr[11] = i;
+		addrs[i].s6_addr[12] = i * 7;
+
+		if (i < 100)
+		{
+			bool create;
+			teredo_peer *p = teredo_list_lookup (l, addrs + i, &create);
+			if (p == NULL)
+				return -1;
+			SetMapping (p, 0, i);
+			teredo_list_release (l, p);
+		}
+	}
+
+	/* Several chunks, with the same peers more than once */
+	for (unsigned i = 0; i < 300; i++)
+		ptrs[i] = addrs + ((i * 37) % 150);
+
+	memset (found, 0xff, sizeof (found));
+	teredo_list_lookup_batch (l, ptrs, 300, batch_cb, found);
+	for (unsigned i = 0; i < 300; i++)
+	{
+		unsigned idx = (i * 37) % 150;
+		if (found[i] != ((idx < 100) ? idx + 1 : 0))
+			return -1;
+	}
+
+	teredo_list_lookup_batch (l, ptrs, 0, batch_cb, found);
+	teredo_list_destroy (l);
+	return 0;
+}
+
+
+static int test_budget (void)
+{
+	struct in6_addr addr = { { } };
+
+	puts ("Memory budget test...");
+	teredo_peerlist *l = teredo_list_create (1 << 20, 1000);
+	if (l == NULL)
+		return -1;
+
+	errno = 0;
+	if ((teredo_list_set_budget (l, 4096) != -1) || (errno != EINVAL))
+		return -1;
+
+	int max = teredo_list_set_budget (l, 8 << 20);
+	if (max <= 0)
+		return -1;
+	printf (" %d peers in 8 MiB\n", max);
+
+	for (int i = 0; i < max; i++)
+	{
+		addr.s6_addr32[3] = i;
+		if (!try_insert (l, &addr))
+			return -1;
+	}
+	addr.s6_addr32[3] = max;
+	if (try_insert (l, &addr))
+		return -1;
+	addr.s6_addr32[3] = 0;
+	if (!try_lookup (l, &addr))
+		return -1;
+
+	/* Fixed tables are emptied, and the budget still applies */
+	teredo_list_reset (l, 1 << 20);
+	if (try_lookup (l, &addr))
+		return -1;
+	for (int i = 0; i < max; i++)
+	{
+		addr.s6_addr32[3] = ~i;
+		if (!try_insert (l, &addr))
+			return -1;
+	}
+	addr.s6_addr32[3] = ~max;
+	if (try_insert (l, &addr) || (teredo_list_reserve (l, 1000) != 0))
+		return -1;
+
+	teredo_list_reset (l, 1);
+	addr.s6_addr32[3] = 1;
+	if (!try_insert (l, &addr))
+		return -1;
+	addr.s6_addr32[3] = 2;
+	if (try_insert (l, &addr))
+		return -1;
+
+	teredo_list_destroy (l);
+	return 0;
+}
+
+
+static int test_recycle (void)
+{
+	struct in6_addr addr = { { } };
+	bool create;
+
+	puts ("Recycled peer test...");
+	teredo_peerlist *l = teredo_list_create_manual (1, 1000);
+	if (l == NULL)
+		return -1;
+
+	teredo_peer *p = teredo_list_lookup (l, &addr, &create);
+	if ((p == NULL) || !create)
+		return -1;
+	p->scheduled = 1; /* expires with its timer armed */
+	teredo_list_release (l, p);
+
+	for (unsigned i = 0; i < 3; i++)
+		teredo_list_gc (l);
+
+	/* Same address, same shard: the expired item gets recycled */
+	const teredo_peer *old = p;
+	p = teredo_list_lookup (l, &addr, &create);
+	if ((p != old) || !create || p->scheduled)
+		return -1;
+	teredo_list_release (l, p);
+
+	teredo_list_destroy (l);
+	return 0;
+}
+
+
+static int test_limit (void)
+{
+	struct in6_addr addr = { { } };
+
+	puts ("Live peers limit test...");
+	teredo_peerlist *l = teredo_list_create_manual (3, 1000);
+	if (l == NULL)
+		return -1;
+
+	for (unsigned i = 0; i < 3; i++)
+	{
+		addr.s6_addr[12] = i;
+		if (!try_insert (l, &addr))
+			return -1;
+	}
+
+	/* Lowered below use: peers are kept, but no new ones */
+	teredo_list_set_limit (l, 2);
+	addr.s6_addr[12] = 0;
+	if (!try_lookup (l, &addr))
+		return -1;
+	addr.s6_addr[12] = 3;
+	if (try_insert (l, &addr))
+		return -1;
+
+	/* Raised again */
+	teredo_list_set_limit (l, 5);
+	for (unsigned i = 3; i < 5; i++)
+	{
+		addr.s6_addr[12] = i;
+		if (!try_insert (l, &addr))
+			return -1;
+	}
+	addr.s6_addr[12] = 5;
+	if (try_insert (l, &addr))
+		return -1;
+
+	teredo_list_destroy (l);
+	return 0;
+}
+
+
+static uint64_t setup_count (void)
+{
+	uint64_t counts[TEREDO_HIST_BUCKETS], total = 0;
+
+	teredo_hist_read (TEREDO_HIST_PEER_SETUP, counts);
+	for (unsigned i = 0; i < TEREDO_HIST_BUCKETS; i++)
+		total += counts[i];
+	return total;
+}
+
+
+static int test_setup (void)
+{
+	struct in6_addr addr = { { } };
+	bool create;
+
+	puts ("Peer setup latency test...");
+	teredo_peerlist *l = teredo_list_create_manual (2, 1000);
+	if (l == NULL)
+		return -1;
+
+	/* Trusted straight away: not a setup */
+	uint64_t before = setup_count ();
+	teredo_peer *p = teredo_list_lookup (l, &addr, &create);
+	if (p == NULL)
+		return -1;
+	teredo_list_trust (l, p);
+	teredo_list_release (l, p);
+	if (setup_count () != before)
+		return -1;
+
+	/* Trusted after packets were queued */
+	addr.s6_addr[12] = 1;
+	p = teredo_list_lookup (l, &addr, &create);
+	if (p == NULL)
+		return -1;
+	teredo_enqueue_out (l, p, &addr, sizeof (addr));
+	teredo_enqueue_out (l, p, &addr, sizeof (addr));
+	teredo_list_trust (l, p);
+	teredo_list_trust (l, p);
+	teredo_list_release (l, p);
+	if (setup_count () != before + 1)
+		return -1;
+
+	teredo_list_destroy (l);
+	return 0;
+}
+
+
 int main (void)
 {
 	struct in6_addr addr = { { } };
@@ -196,9 +767,10 @@ int main (void)
 
 		teredo_list_reset (l, 1);
 		// should now be able to insert a single item
-		if (teredo_list_lookup (l, &addr, &create) == NULL)
+		teredo_peer *p = teredo_list_lookup (l, &addr, &create);
+		if (p == NULL)
 			return -1;
-		teredo_list_release (l);
+		teredo_list_release (l, p);
 
 		addr.s6_addr[12] = 10;
 		if (teredo_list_lookup (l, &addr, &create) != NULL)
@@ -209,6 +781,11 @@ int main (void)
 		teredo_list_destroy (l);
 	}
 
+	if (test_queue (MAXQUEUE) || test_queue (3000) || test_probation ()
+	 || test_snapshot () || test_dump () || test_expiry () || test_manual_gc ()
+	 || test_recycle () || test_setup () || test_limit () || test_batch () || test_budget ())
+		return 1;
+
 	puts ("List creation test...");
 	l = teredo_list_create (255, 2);
 	if (l == NULL)
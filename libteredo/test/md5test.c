@@ -42,6 +42,7 @@
   <ghost@aladdin.com>.  Other authors are noted in the change history
   that follows (in reverse chronological order):
 
+  2026-10-14 rdc Added multi-buffer hashing test.
   2002-04-13 lpd Splits off main program into a separate file, md5main.c.
  */
 
@@ -97,9 +98,66 @@ do_test(void)
     return status;
 }
 
+/* Compare multi-buffer hashing with the scalar functions. */
+static int
+do_multi_test(void)
+{
+    static const char prefix[] = "HMAC-like 64-byte block, or partial block";
+    md5_byte_t msgs[17][200];
+    const md5_byte_t *ptrs[17];
+    md5_byte_t digests[17][16];
+    int len, status = 0;
+    unsigned i, count, p;
+
+    for (i = 0; i < 17; ++i) {
+	unsigned j;
+
+	for (j = 0; j < sizeof (msgs[i]); ++j)
+	    msgs[i][j] = (md5_byte_t)(i * 31 + j * 7);
+	ptrs[i] = msgs[i];
+    }
+
+    /* Empty, 64-byte, partial and multi-block initial states */
+    for (p = 0; p < 4; ++p) {
+	static const int plen[4] = { 0, 64, 13, 150 };
+	md5_state_t init;
+
+	md5_init(&init);
+	for (len = 0; len < plen[p]; len += sizeof (prefix) - 1) {
+	    int n = plen[p] - len;
+
+	    if (n > (int)sizeof (prefix) - 1)
+		n = sizeof (prefix) - 1;
+	    md5_append(&init, (const md5_byte_t *)prefix, n);
+	}
+
+	for (len = 0; len <= 200; len += (len < 72) ? 1 : 64)
+	    for (count = 1; count <= 17; count += (count < 9) ? 1 : 8) {
+		md5_finish_multi(&init, ptrs, len, digests, count);
+
+		for (i = 0; i < count; ++i) {
+		    md5_state_t state = init;
+		    md5_byte_t digest[16];
+
+		    md5_append(&state, msgs[i], len);
+		    md5_finish(&state, digest);
+		    if (memcmp(digest, digests[i], 16)) {
+			printf("**** ERROR, multi-buffer message %u of %u, "
+			       "length %d after %d bytes\n", i, count, len,
+			       plen[p]);
+			status = 1;
+		    }
+		}
+	    }
+    }
+    if (status == 0)
+	puts("md5 multi-buffer test completed successfully.");
+    return status;
+}
+
 /* Main program */
 int
 main(void)
 {
-    return do_test();
+    return do_test() || do_multi_test();
 }
@@ -0,0 +1,137 @@
+/*
+ * peertable.c - Libteredo shared peer table tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "teredo.h"
+#include "tunnel.h"
+#include "peertable.h"
+
+static void make_address (struct in6_addr *addr, unsigned i)
+{
+	memset (addr, 0, sizeof (*addr));
+	addr->s6_addr32[0] = htonl (TEREDO_PREFIX);
+	addr->s6_addr32[3] = htonl (i);
+}
+
+
+int main (void)
+{
+	char name[32];
+	struct in6_addr addr;
+	teredo_peertable_entry e = { .local_ip = 1, .local_port = 2 };
+
+	snprintf (name, sizeof (name), "/libteredo-test-%u", (unsigned)getpid ());
+	shm_unlink (name);
+
+	errno = 0;
+	assert (teredo_peertable_open (name, 0) == NULL);
+	assert (errno == EINVAL);
+
+	teredo_peertable *t = teredo_peertable_open (name, 64);
+	if (t == NULL)
+	{
+		perror ("Shared memory");
+		return 77; /* skip */
+	}
+
+	make_address (&addr, 1);
+	assert (!teredo_peertable_lookup (t, &addr, &e));
+
+	/* A sibling process publishes, the other one sees it */
+	pid_t pid = fork ();
+	assert (pid != -1);
+	if (pid == 0)
+	{
+		teredo_peertable *t2 = teredo_peertable_open (name, 1000000);
+		if (t2 == NULL)
+			_exit (1);
+
+		for (unsigned i = 0; i < 64; i++)
+		{
+			make_address (&addr, i);
+			e.mapped_addr = i;
+			e.mapped_port = i + 1000;
+			e.seen = 100 + i;
+			teredo_peertable_publish (t2, &addr, &e);
+		}
+		teredo_peertable_close (t2);
+		_exit (0);
+	}
+
+	int status;
+	assert (waitpid (pid, &status, 0) == pid);
+	assert (WIFEXITED (status) && (WEXITSTATUS (status) == 0));
+
+	unsigned found = 0;
+	for (unsigned i = 0; i < 64; i++)
+	{
+		make_address (&addr, i);
+		if (teredo_peertable_lookup (t, &addr, &e))
+		{
+			assert ((e.mapped_addr == i) && (e.mapped_port == i + 1000));
+			assert ((e.local_ip == 1) && (e.local_port == 2));
+			assert (e.seen == 100 + i);
+			found++;
+		}
+	}
+	printf ("Found %u/64 peers\n", found);
+	assert (found >= 32); /* barring bad luck with collisions */
+
+	/* Updates replace existing entries */
+	make_address (&addr, 63);
+	e.mapped_addr = 42;
+	e.seen = 1000;
+	teredo_peertable_publish (t, &addr, &e);
+	assert (teredo_peertable_lookup (t, &addr, &e));
+	assert ((e.mapped_addr == 42) && (e.seen == 1000));
+
+	/* Many more peers than entries: recent ones replace old ones */
+	for (unsigned i = 0; i < 4096; i++)
+	{
+		make_address (&addr, 10000 + i);
+		e.seen = 2000 + i;
+		teredo_peertable_publish (t, &addr, &e);
+	}
+	make_address (&addr, 10000 + 4095);
+	assert (teredo_peertable_lookup (t, &addr, &e) && (e.seen == 6095));
+
+	teredo_peertable_close (t);
+	shm_unlink (name);
+	return 0;
+}
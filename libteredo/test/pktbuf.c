@@ -0,0 +1,164 @@
+/*
+ * pktbuf.c - Libteredo reference-counted packet buffers tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "tunnel.h"
+#include "pktbuf.h"
+#include "clock.h"
+#include "peerlist.h"
+
+#define COUNT 1000
+
+static unsigned refs (teredo_pktbuf *b)
+{
+	return atomic_load (&b->refs);
+}
+
+static void *release_thread (void *data)
+{
+	teredo_pktbuf **bufs = data;
+
+	/* Buffers freed by another thread go back to the shared pool */
+	for (unsigned i = 0; i < COUNT; i++)
+		teredo_pktbuf_release (bufs[i]);
+	return NULL;
+}
+
+static void dequeue_cb (void *opaque, const void *data, size_t len)
+{
+	teredo_pktbuf **held = opaque;
+
+	/* The queued packet was not copied, and can be retained again */
+	*held = teredo_pktbuf_hold (data, len);
+}
+
+int main (void)
+{
+	teredo_pktbuf *b = teredo_pktbuf_alloc ();
+	assert (b != NULL);
+	assert (refs (b) == 1);
+
+	uint8_t *data = b->packet.buf.fill + 8;
+
+	/* Only the current buffer of the thread can be retained */
+	assert (teredo_pktbuf_hold (data, 100) == NULL);
+	assert (teredo_pktbuf_swap_current (b) == NULL);
+	assert (teredo_pktbuf_hold (data, 100) == b);
+	assert (refs (b) == 2);
+	assert (teredo_pktbuf_hold (data, sizeof (b->packet.buf.fill)) == NULL);
+	assert (teredo_pktbuf_hold (&(uint8_t){ 0 }, 1) == NULL);
+
+	/* Retained buffers are swapped for new ones */
+	teredo_pktbuf *bufs[COUNT] = { b, NULL };
+	assert (teredo_pktbuf_recycle (bufs, 4) == 4);
+	assert (bufs[0] != b);
+	assert (refs (b) == 1);
+	for (unsigned i = 0; i < 4; i++)
+		assert (refs (bufs[i]) == 1);
+
+	/* Non-retained buffers are kept */
+	teredo_pktbuf *c = bufs[1];
+	assert (teredo_pktbuf_recycle (bufs, 4) == 4);
+	assert (bufs[1] == c);
+	for (unsigned i = 0; i < 4; i++)
+		teredo_pktbuf_release (bufs[i]);
+
+	/* Released buffers are reused */
+	teredo_pktbuf_swap_current (NULL);
+	teredo_pktbuf_release (b);
+	assert (teredo_pktbuf_alloc () == b);
+
+	for (unsigned i = 0; i < COUNT; i++)
+	{
+		bufs[i] = teredo_pktbuf_alloc ();
+		assert (bufs[i] != NULL);
+	}
+
+	pthread_t th;
+	assert (pthread_create (&th, NULL, release_thread, bufs) == 0);
+	assert (pthread_join (th, NULL) == 0);
+
+	for (unsigned i = 0; i < COUNT; i++)
+	{
+		bufs[i] = teredo_pktbuf_alloc ();
+		assert (bufs[i] != NULL);
+	}
+	for (unsigned i = 0; i < COUNT; i++)
+		teredo_pktbuf_release (bufs[i]);
+
+	/* Peer queues retain incoming packets instead of copying them */
+	struct in6_addr addr = { { } };
+	bool create;
+	teredo_peerlist *l = teredo_list_create (1, 3);
+	assert (l != NULL);
+
+	teredo_peer *p = teredo_list_lookup (l, &addr, &create);
+	assert (p != NULL);
+
+	/* Not if a whole buffer does not fit in the queue size limit */
+	memset (data, 0x42, 100);
+	teredo_pktbuf_swap_current (b);
+	teredo_enqueue_in (l, p, data, 100, 1, 2);
+	teredo_pktbuf_swap_current (NULL);
+	assert (refs (b) == 1);
+	teredo_list_release (l, p);
+	teredo_list_reset (l, 1);
+	teredo_list_set_queue_size (l, 2 * sizeof (teredo_pktbuf));
+
+	p = teredo_list_lookup (l, &addr, &create);
+	assert (p != NULL);
+	teredo_pktbuf_swap_current (b);
+	teredo_enqueue_in (l, p, data, 100, 1, 2);
+	teredo_pktbuf_swap_current (NULL);
+	assert (refs (b) == 2);
+
+	teredo_pktbuf *held = NULL;
+	teredo_queue_emit (l, teredo_peer_queue_yield (p), -1, 1, 2,
+	                   dequeue_cb, &held);
+	assert (held == b);
+	assert (refs (b) == 2);
+	teredo_pktbuf_release (held);
+
+	/* Queued buffers are released with their peer */
+	teredo_pktbuf_swap_current (b);
+	teredo_enqueue_in (l, p, data, 100, 1, 2);
+	teredo_pktbuf_swap_current (NULL);
+	assert (refs (b) == 2);
+	teredo_list_release (l, p);
+	teredo_list_destroy (l);
+	assert (refs (b) == 1);
+
+	teredo_pktbuf_release (b);
+	return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * siphash.c - SipHash-2-4 test vectors
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "siphash.h"
+
+/* From the SipHash reference implementation */
+static const uint8_t vec64[][8] =
+{
+	{ 0x31, 0x0e, 0x0e, 0xdd, 0x47, 0xdb, 0x6f, 0x72 },
+	{ 0xfd, 0x67, 0xdc, 0x93, 0xc5, 0x39, 0xf8, 0x74 },
+};
+
+static const uint8_t vec128[][16] =
+{
+	{ 0xa3, 0x81, 0x7f, 0x04, 0xba, 0x25, 0xa8, 0xe6,
+	  0x6d, 0xf6, 0x72, 0x14, 0xc7, 0x55, 0x02, 0x93 },
+};
+
+int main (void)
+{
+	uint8_t key[SIPHASH_KEY_LEN], msg[64], out[16];
+
+	for (unsigned i = 0; i < sizeof (key); i++)
+		key[i] = i;
+	for (unsigned i = 0; i < sizeof (msg); i++)
+		msg[i] = i;
+
+	for (unsigned i = 0; i < sizeof (vec64) / sizeof (vec64[0]); i++)
+	{
+		siphash (key, msg, i, out, 8);
+		assert (memcmp (out, vec64[i], 8) == 0);
+	}
+
+	for (unsigned i = 0; i < sizeof (vec128) / sizeof (vec128[0]); i++)
+	{
+		siphash (key, msg, i, out, 16);
+		assert (memcmp (out, vec128[i], 16) == 0);
+	}
+
+	/* Example from the SipHash paper (appendix A) */
+	static const uint8_t paper[8] =
+		{ 0xe5, 0x45, 0xbe, 0x49, 0x61, 0xca, 0x29, 0xa1 };
+	siphash (key, msg, 15, out, 8);
+	assert (memcmp (out, paper, 8) == 0);
+	return 0;
+}
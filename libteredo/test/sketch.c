@@ -0,0 +1,76 @@
+/*
+ * sketch.c - Per-source packet budgets tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "clock.h"
+#include "sketch.h"
+
+int main (void)
+{
+	const uint32_t ip = htonl (0xC0000201), ip2 = htonl (0xC0000202);
+	const uint16_t port = htons (40000);
+	teredo_sketch *s = malloc (sizeof (*s));
+	assert (s != NULL);
+
+	errno = 0;
+	assert ((teredo_sketch_init (s, 0) == -1) && (errno == EINVAL));
+	assert (teredo_sketch_init (s, TEREDO_SKETCH_MAX_BUDGET + 1) == -1);
+	assert (teredo_sketch_init (s, 10) == 0);
+
+	/* Budget is enforced per source */
+	for (unsigned i = 0; i < 10; i++)
+		assert (teredo_sketch_admit (s, ip, port, 1000));
+	assert (!teredo_sketch_admit (s, ip, port, 1000));
+	assert (!teredo_sketch_admit (s, ip, port, 1000));
+
+	/* Other sources are unaffected (barring collisions on all rows) */
+	assert (teredo_sketch_admit (s, ip2, port, 1000));
+	assert (teredo_sketch_admit (s, ip, htons (40001), 1000));
+
+	/* Many other sources do not starve a well-behaved one */
+	for (uint32_t i = 0; i < 20000; i++)
+		teredo_sketch_admit (s, htonl (0xC6120000 + i), port, 1000);
+	for (unsigned i = 0; i < 8; i++)
+		assert (teredo_sketch_admit (s, ip2, port, 1000));
+
+	/* Counts are reset every second */
+	assert (teredo_sketch_admit (s, ip, port, 1001));
+	for (unsigned i = 1; i < 10; i++)
+		assert (teredo_sketch_admit (s, ip, port, 1001));
+	assert (!teredo_sketch_admit (s, ip, port, 1001));
+
+	free (s);
+	return 0;
+}
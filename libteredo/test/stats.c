@@ -0,0 +1,154 @@
+/*
+ * stats.c - Libteredo performance counters tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "stats.h"
+
+#define THREADS 4
+#define COUNT 100000
+
+static void *worker (void *data)
+{
+	(void)data;
+
+	for (unsigned i = 0; i < COUNT; i++)
+		teredo_stat_inc (TEREDO_STAT_RELAY_RX);
+	teredo_stat_add (TEREDO_STAT_GC_USEC, 7);
+	return NULL;
+}
+
+
+int main (void)
+{
+	uint64_t values[TEREDO_STAT_MAX];
+	pthread_t th[THREADS];
+
+	teredo_stats_read (values);
+	for (unsigned i = 0; i < TEREDO_STAT_MAX; i++)
+	{
+		assert (values[i] == 0);
+		assert (teredo_stats_name (i) != NULL);
+	}
+
+	teredo_stat_inc (TEREDO_STAT_RELAY_RX);
+
+	for (unsigned i = 0; i < THREADS; i++)
+		assert (pthread_create (th + i, NULL, worker, NULL) == 0);
+	for (unsigned i = 0; i < THREADS; i++)
+		assert (pthread_join (th[i], NULL) == 0);
+
+	/* Counters of exited threads are retained */
+	teredo_stats_read (values);
+	assert (values[TEREDO_STAT_RELAY_RX] == THREADS * COUNT + 1);
+	assert (values[TEREDO_STAT_GC_USEC] == THREADS * 7);
+	assert (values[TEREDO_STAT_RELAY_TX] == 0);
+
+	/* Text export replaces the previous content */
+	FILE *f = tmpfile ();
+	assert (f != NULL);
+	assert (fputs ("garbage\n", f) >= 0);
+	assert (fflush (f) == 0);
+	assert (teredo_stats_dump (fileno (f)) == 0);
+
+	char name[64];
+	uint64_t val;
+	unsigned n = 0;
+
+	rewind (f);
+	while ((n < TEREDO_STAT_MAX)
+	    && (fscanf (f, "%63s %"SCNu64, name, &val) == 2))
+	{
+		assert (strcmp (name, teredo_stats_name (n)) == 0);
+		assert (val == values[n]);
+		n++;
+	}
+	assert (n == TEREDO_STAT_MAX);
+
+	/* Followed by the histograms summaries */
+	n = 0;
+	while ((n < TEREDO_HIST_MAX * 5)
+	    && (fscanf (f, "%63s %"SCNu64, name, &val) == 2))
+	{
+		assert (strncmp (name, teredo_hist_name (n / 5),
+		                 strlen (teredo_hist_name (n / 5))) == 0);
+		assert (val == 0);
+		n++;
+	}
+	assert (n == TEREDO_HIST_MAX * 5);
+	assert (fscanf (f, "%63s", name) == EOF);
+	fclose (f);
+
+	/* Histograms */
+	uint64_t counts[TEREDO_HIST_BUCKETS];
+
+	teredo_hist_read (TEREDO_HIST_PEER_SETUP, counts);
+	assert (teredo_hist_percentile (counts, 50.) == 0);
+
+	for (uint64_t v = 1; v <= 1000; v++)
+		teredo_hist_record (TEREDO_HIST_PEER_SETUP, v * 1000);
+	teredo_hist_record (TEREDO_HIST_PEER_SETUP, UINT64_MAX);
+	teredo_hist_record (TEREDO_HIST_QUALIFICATION, 7);
+
+	teredo_hist_read (TEREDO_HIST_PEER_SETUP, counts);
+
+	static const double pcs[] = { 0., 50., 90., 99. };
+
+	for (unsigned i = 0; i < sizeof (pcs) / sizeof (pcs[0]); i++)
+	{
+		uint64_t exact = 1000 + 10 * (uint64_t)pcs[i] * 1000;
+		uint64_t approx = teredo_hist_percentile (counts, pcs[i]);
+
+		assert (approx >= exact - exact / TEREDO_HIST_SUB);
+		assert (approx <= exact + exact / TEREDO_HIST_SUB);
+	}
+	assert (teredo_hist_percentile (counts, 100.)
+	        >= (UINT64_C(1) << (TEREDO_HIST_BITS - 1)));
+
+	teredo_hist_read (TEREDO_HIST_QUALIFICATION, counts);
+	assert (teredo_hist_percentile (counts, 100.) == 7);
+	teredo_hist_read (TEREDO_HIST_TUNNEL_UP, counts);
+	assert (teredo_hist_percentile (counts, 99.) == 0);
+
+	uint64_t t0 = teredo_hist_now ();
+	usleep (2000);
+	assert (teredo_hist_now () - t0 >= 2000);
+	return 0;
+}
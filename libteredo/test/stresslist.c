@@ -94,7 +94,7 @@ int main (void)
 		p = teredo_list_lookup (l, &addr, &create);
 		if ((!create) || (p == NULL))
 			return -1;
-		teredo_list_release (l);
+		teredo_list_release (l, p);
 	}
 	t = clock () - t;
 
@@ -113,7 +113,7 @@ int main (void)
 		p = teredo_list_lookup (l, &addr, NULL);
 		if (p == NULL)
 			return -1;
-		teredo_list_release (l);
+		teredo_list_release (l, p);
 	}
 	t = clock () - t;
 
@@ -0,0 +1,101 @@
+/*
+ * thread.c - Libteredo threads placement tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+
+#include "teredo-udp.h"
+#include "thread.h"
+
+static int first_cpu;
+
+static void *thread_run (void *data)
+{
+	(void)data;
+	teredo_thread_setup (TEREDO_THREAD_PACKETS, "test-rx%u", 7u);
+
+#ifdef HAVE_PTHREAD_SETNAME_NP
+	char name[16];
+	assert (pthread_getname_np (pthread_self (), name, sizeof (name)) == 0);
+	assert (strcmp (name, "test-rx7") == 0);
+#endif
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t set;
+	assert (pthread_getaffinity_np (pthread_self (), sizeof (set),
+	                                &set) == 0);
+	assert (CPU_COUNT (&set) == 1);
+	assert (CPU_ISSET (first_cpu, &set));
+#endif
+	return NULL;
+}
+
+int main (void)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t set;
+
+	assert (teredo_cpulist_parse ("0-3,8", &set) == 0);
+	assert (CPU_COUNT (&set) == 5);
+	assert (CPU_ISSET (3, &set) && CPU_ISSET (8, &set));
+	assert (!CPU_ISSET (4, &set));
+	assert (teredo_cpulist_parse ("5\n", &set) == 0);
+	assert (CPU_COUNT (&set) == 1 && CPU_ISSET (5, &set));
+	assert (teredo_cpulist_parse ("", &set) == -1);
+	assert (teredo_cpulist_parse ("3-1", &set) == -1);
+	assert (teredo_cpulist_parse ("1,x", &set) == -1);
+	assert (teredo_cpulist_parse ("99999", &set) == -1);
+
+	/* Only pin to a CPU the process may run on */
+	assert (sched_getaffinity (0, sizeof (set), &set) == 0);
+	while (!CPU_ISSET (first_cpu, &set))
+		first_cpu++;
+
+	char cpus[16];
+	snprintf (cpus, sizeof (cpus), "%d", first_cpu);
+	assert (teredo_set_thread_policy (TEREDO_THREAD_PACKETS, cpus, -1,
+	                                  0) == 0);
+	assert (teredo_set_thread_policy (TEREDO_THREAD_HOUSEKEEPING, "bogus",
+	                                  -1, 0) == -1);
+	assert (errno == EINVAL);
+	assert (teredo_set_thread_policy (TEREDO_THREAD_HOUSEKEEPING, NULL,
+	                                  1 << 20, 0) == -1);
+#endif
+	assert (teredo_set_thread_policy (TEREDO_THREAD_HOUSEKEEPING, NULL, -1,
+	                                  1000) == -1);
+	assert (errno == EINVAL);
+
+	pthread_t th;
+	assert (pthread_create (&th, NULL, thread_run, NULL) == 0);
+	assert (pthread_join (th, NULL) == 0);
+	return 0;
+}
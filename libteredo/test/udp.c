@@ -0,0 +1,221 @@
+/*
+ * udp.c - Libteredo UDP packets reception tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+
+static const uint8_t auth[13] = { 0, 1, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 0 };
+static const uint8_t orig[8] = { 0, 0, 0xcf, 0xc6, 0x3f, 0xff, 0xfd, 0x74 };
+static const uint8_t ip6[40] = { 0x60 };
+
+
+int main (void)
+{
+	const uint32_t lo = htonl (INADDR_LOOPBACK);
+	uint8_t buf[sizeof (auth) + sizeof (orig) + sizeof (ip6)];
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof (addr);
+
+	int fd = teredo_socket (lo, 0);
+	if (fd == -1)
+	{
+		perror ("Loopback socket");
+		return 77; /* skip */
+	}
+
+	int val = getsockname (fd, (struct sockaddr *)&addr, &addrlen);
+	assert (val == 0);
+
+	/* Plain, authentication, origin indication, and malformatted packets */
+	val = teredo_send (fd, ip6, sizeof (ip6), lo, addr.sin_port);
+	assert (val == sizeof (ip6));
+
+	memcpy (buf, auth, sizeof (auth));
+	memcpy (buf + sizeof (auth), ip6, sizeof (ip6));
+	val = teredo_send (fd, buf, sizeof (auth) + sizeof (ip6),
+	                   lo, addr.sin_port);
+	assert (val == sizeof (auth) + sizeof (ip6));
+
+	memcpy (buf, auth, sizeof (auth));
+	memcpy (buf + sizeof (auth), orig, sizeof (orig));
+	memcpy (buf + sizeof (auth) + sizeof (orig), ip6, sizeof (ip6));
+	val = teredo_send (fd, buf, sizeof (buf), lo, addr.sin_port);
+	assert (val == sizeof (buf));
+
+	val = teredo_send (fd, buf, 1, lo, addr.sin_port);
+	assert (val == 1);
+
+	teredo_packet_batch *b = calloc (1, sizeof (*b));
+	assert (b != NULL);
+
+	val = teredo_recv_batch (fd, b, TEREDO_BATCH_SIZE);
+	assert (val == 3);
+	assert (b->count == 3);
+
+	for (unsigned i = 0; i < b->count; i++)
+	{
+		const teredo_packet *p = b->packets[i];
+
+		assert (p->source_ipv4 == lo);
+		assert (p->source_port == addr.sin_port);
+#if defined (IP_PKTINFO) || defined (IP_RECVDSTADDR)
+		assert (p->dest_ipv4 == lo);
+#endif
+		assert (p->ip6_len == sizeof (ip6));
+		assert (memcmp (p->ip6, ip6, sizeof (ip6)) == 0);
+		assert (((uintptr_t)p->ip6 & 7) == 0);
+		assert (p->auth_present == (i > 0));
+	}
+
+	assert (memcmp (b->packets[1]->auth_nonce, auth + 4, 8) == 0);
+	assert (!b->packets[1]->auth_fail);
+	assert (b->packets[0]->orig_port == 0);
+	assert (b->packets[2]->orig_port == htons (12345));
+	assert (b->packets[2]->orig_ipv4 == htonl (0xc000028b));
+	/* 13 + 8 bytes of Teredo headers: next datagrams go at offset 3 */
+	assert (b->headroom == 3);
+
+	/* Batched transmission (possibly with UDP GSO) */
+	teredo_sendq *q = malloc (sizeof (*q));
+	assert (q != NULL);
+	teredo_sendq_init (q, fd);
+	teredo_sendq_start (q);
+
+	for (unsigned i = 0; i < 5; i++)
+	{
+		val = teredo_send (fd, ip6, sizeof (ip6) - (i == 4), lo,
+		                   addr.sin_port);
+		assert (val == (int)sizeof (ip6) - (i == 4));
+	}
+	val = teredo_send (fd, buf, sizeof (buf), lo, addr.sin_port);
+	assert (val == sizeof (buf));
+	teredo_sendq_stop (q);
+
+	/* GSO segments need not all be pending at once */
+	for (unsigned n = 0; n < 6;)
+	{
+		val = teredo_recv_batch (fd, b, TEREDO_BATCH_SIZE);
+		assert (val >= 1);
+
+		for (unsigned i = 0; i < b->count; i++, n++)
+		{
+			const teredo_packet *p = b->packets[i];
+
+			assert (n < 6);
+			assert (p->ip6_len == sizeof (ip6) - (n == 4));
+			assert (((uintptr_t)p->ip6 & 7) == 0);
+			assert (p->auth_present == (n == 5));
+		}
+	}
+
+	/* Datagrams bigger than the inline buffer */
+	static uint8_t big[3000];
+	memcpy (big, ip6, sizeof (ip6));
+	for (size_t i = sizeof (ip6); i < sizeof (big); i++)
+		big[i] = i;
+
+	for (unsigned n = 0; n < 3; n++)
+	{
+		val = teredo_send (fd, big, sizeof (big), lo, addr.sin_port);
+		assert (val == sizeof (big));
+	}
+	val = teredo_send (fd, ip6, sizeof (ip6), lo, addr.sin_port);
+	assert (val == sizeof (ip6));
+
+	for (unsigned n = 0; n < 3;)
+	{
+		val = teredo_recv_batch (fd, b, TEREDO_BATCH_SIZE);
+		assert (val >= 1);
+
+		for (unsigned i = 0; i < b->count; i++, n++)
+		{
+			const teredo_packet *p = b->packets[i];
+
+			assert (n < 4);
+			if (n == 3)
+				continue;
+			assert (p->ip6_len == sizeof (big));
+			assert (memcmp (p->ip6, big, sizeof (big)) == 0);
+		}
+	}
+
+	val = teredo_send (fd, big, sizeof (big), lo, addr.sin_port);
+	assert (val == sizeof (big));
+
+	teredo_packet *p = malloc (sizeof (*p));
+	assert (p != NULL);
+	for (;;)
+	{
+		val = teredo_wait_recv (fd, p);
+		assert (val == 0);
+		if (p->ip6_len != sizeof (ip6))
+			break;
+	}
+	assert (p->ip6_len == sizeof (big));
+	assert (memcmp (p->ip6, big, sizeof (big)) == 0);
+	free (p);
+
+	/* Path MTU discovery */
+	if (teredo_socket_pmtud (fd, true) == 0)
+		assert (teredo_socket_pmtud (fd, false) == 0);
+	assert (teredo_pmtu_get (htonl (0xc0000201)) == 0);
+	teredo_pmtu_update (htonl (0xc0000201), 1400);
+	assert (teredo_pmtu_get (htonl (0xc0000201)) == 1400);
+	assert (teredo_pmtu_get (htonl (0xc0000202)) == 0);
+
+	free (q);
+	teredo_packet_batch_destroy (b);
+	free (b);
+	teredo_close (fd);
+
+	/* Shared sockets */
+	fd = teredo_socket_shared (lo, 0);
+	if (fd != -1)
+	{
+		addrlen = sizeof (addr);
+		val = getsockname (fd, (struct sockaddr *)&addr, &addrlen);
+		assert (val == 0);
+
+		int fd2 = teredo_socket_shared (lo, addr.sin_port);
+		assert (fd2 != -1);
+		assert (teredo_socket (lo, addr.sin_port) == -1);
+		teredo_close (fd2);
+		teredo_close (fd);
+	}
+	return 0;
+}
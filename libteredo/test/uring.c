@@ -0,0 +1,138 @@
+/*
+ * uring.c - Libteredo io_uring reception engine tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "uring.h"
+
+static const uint8_t auth[13] = { 0, 1, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 0 };
+static const uint8_t ip6[40] = { 0x60 };
+
+#define COUNT 1000
+
+static teredo_uring *u;
+static unsigned received[2];
+
+static void cb (void *opaque, unsigned index, struct teredo_packet *p)
+{
+	const struct sockaddr_in *addr = opaque;
+
+	if (p == NULL)
+		return; /* end of batch */
+
+	assert (index < 2);
+	assert (p->source_ipv4 == htonl (INADDR_LOOPBACK));
+	assert (p->source_port == addr[!index].sin_port);
+	assert (p->ip6_len == sizeof (ip6));
+	assert (memcmp (p->ip6, ip6, sizeof (ip6)) == 0);
+	assert (((uintptr_t)p->ip6 & 7) == 0);
+	assert (p->auth_present == (index == 1));
+
+	if (++received[index] == COUNT && received[!index] == COUNT)
+		teredo_uring_stop (u);
+}
+
+
+static void *thread (void *data)
+{
+	int val = teredo_uring_run (u, NULL, cb, data);
+	assert (val == 0);
+	return NULL;
+}
+
+
+int main (void)
+{
+	const uint32_t lo = htonl (INADDR_LOOPBACK);
+	struct sockaddr_in addr[2];
+	int fds[2];
+
+	for (unsigned i = 0; i < 2; i++)
+	{
+		socklen_t addrlen = sizeof (addr[i]);
+
+		fds[i] = teredo_socket (lo, 0);
+		if (fds[i] == -1)
+		{
+			perror ("Loopback socket");
+			return 77; /* skip */
+		}
+		int val = getsockname (fds[i], (struct sockaddr *)(addr + i),
+		                       &addrlen);
+		assert (val == 0);
+	}
+
+	u = teredo_uring_create (fds, 2);
+	if (u == NULL)
+	{
+		perror ("io_uring");
+		return 77; /* skip */
+	}
+
+	pthread_t th;
+	int val = pthread_create (&th, NULL, thread, addr);
+	assert (val == 0);
+
+	/* More packets than provided buffers: reception gets re-armed */
+	uint8_t buf[sizeof (auth) + sizeof (ip6)];
+	memcpy (buf, auth, sizeof (auth));
+	memcpy (buf + sizeof (auth), ip6, sizeof (ip6));
+
+	for (unsigned i = 0; i < COUNT; i++)
+	{
+		val = teredo_send (fds[1], ip6, sizeof (ip6), lo, addr[0].sin_port);
+		assert (val == sizeof (ip6));
+		val = teredo_send (fds[0], buf, sizeof (buf), lo, addr[1].sin_port);
+		assert (val == sizeof (buf));
+		/* Do not overflow the socket receive buffers */
+		if ((i % 64) == 63)
+		{
+			struct timespec ts = { 0, 1000000 };
+			nanosleep (&ts, NULL);
+		}
+	}
+
+	pthread_join (th, NULL);
+	assert (received[0] == COUNT && received[1] == COUNT);
+	teredo_uring_destroy (u);
+
+	teredo_close (fds[0]);
+	teredo_close (fds[1]);
+	return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * wheel.c - Libteredo retransmission timer wheel tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "clock.h"
+#include "wheel.h"
+
+static struct in6_addr expired[64];
+static unsigned nexpired;
+static teredo_wheel wheel;
+
+static void make_addr (struct in6_addr *addr, unsigned i)
+{
+	memset (addr, 0, sizeof (*addr));
+	addr->s6_addr[15] = i;
+}
+
+static void expire_cb (void *opaque, const struct in6_addr *addrs,
+                       unsigned count, teredo_clock_t now)
+{
+	assert (opaque == &wheel);
+	assert (nexpired + count <= 64);
+	(void)now;
+	memcpy (expired + nexpired, addrs, count * sizeof (*addrs));
+	nexpired += count;
+}
+
+static void rearm_cb (void *opaque, const struct in6_addr *addrs,
+                      unsigned count, teredo_clock_t now)
+{
+	/* Timers scheduled from the callback go to a later slot */
+	for (unsigned i = 0; i < count; i++)
+		assert (teredo_wheel_add (opaque, addrs + i, now + 2) == 0);
+	expire_cb (opaque, addrs, count, now);
+}
+
+static unsigned expire (teredo_clock_t now, teredo_wheel_cb cb)
+{
+	nexpired = 0;
+	teredo_wheel_expire (&wheel, now, cb, &wheel);
+	return nexpired;
+}
+
+int main (void)
+{
+	struct in6_addr addr;
+	teredo_clock_t due;
+
+	teredo_wheel_init (&wheel, 100);
+
+	/* Nothing is due yet */
+	assert (expire (100, expire_cb) == 0);
+	assert (teredo_wheel_next (&wheel, &due) == -1);
+
+	make_addr (&addr, 1);
+	assert (teredo_wheel_add (&wheel, &addr, 103) == 0);
+	make_addr (&addr, 2);
+	assert (teredo_wheel_add (&wheel, &addr, 101) == 0);
+	make_addr (&addr, 3);
+	assert (teredo_wheel_add (&wheel, &addr, 50) == 0); /* past: next slot */
+	make_addr (&addr, 4);
+	assert (teredo_wheel_add (&wheel, &addr, 1000) == 0); /* too far */
+	assert ((teredo_wheel_next (&wheel, &due) == 0) && (due == 101));
+
+	assert (expire (101, expire_cb) == 2);
+	assert (expired[0].s6_addr[15] == 2);
+	assert (expired[1].s6_addr[15] == 3);
+	assert (expire (102, expire_cb) == 0);
+	assert (expire (103, expire_cb) == 1);
+	assert (expired[0].s6_addr[15] == 1);
+	assert ((teredo_wheel_next (&wheel, &due) == 0)
+	     && (due == 100 + TEREDO_WHEEL_SLOTS - 1));
+	assert (expire (100 + TEREDO_WHEEL_SLOTS - 2, expire_cb) == 0);
+	assert (expire (100 + TEREDO_WHEEL_SLOTS - 1, expire_cb) == 1);
+	assert (expired[0].s6_addr[15] == 4);
+	assert (teredo_wheel_next (&wheel, &due) == -1);
+
+	/* Many timers in the same slot */
+	for (unsigned i = 0; i < 40; i++)
+	{
+		make_addr (&addr, i);
+		assert (teredo_wheel_add (&wheel, &addr, 110) == 0);
+	}
+	assert (expire (110, rearm_cb) == 40);
+	for (unsigned i = 0; i < 40; i++)
+		assert (expired[i].s6_addr[15] == i);
+	assert (expire (111, expire_cb) == 0);
+	/* Clock jump: everything pending expires at once */
+	assert (expire (200, expire_cb) == 40);
+	assert (expire (200, expire_cb) == 0);
+
+	make_addr (&addr, 5);
+	assert (teredo_wheel_add (&wheel, &addr, 203) == 0);
+	teredo_wheel_destroy (&wheel); /* discards pending timers */
+	return 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * thread.c - Threads placement and naming
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <gettext.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <syslog.h>
+#include <netinet/in.h>
+
+#include "teredo-udp.h"
+#include "thread.h"
+
+struct teredo_thread_policy
+{
+	bool has_cpus;
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t cpus;
+#endif
+	int priority;
+};
+
+static pthread_mutex_t policy_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct teredo_thread_policy policies[TEREDO_THREAD_ROLES];
+
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+int teredo_cpulist_parse (const char *str, cpu_set_t *set)
+{
+	CPU_ZERO (set);
+
+	do
+	{
+		char *end;
+		unsigned long lo = strtoul (str, &end, 10), hi = lo;
+
+		if (end == str)
+			return -1;
+		if (*end == '-')
+		{
+			str = end + 1;
+			hi = strtoul (str, &end, 10);
+			if ((end == str) || (hi < lo))
+				return -1;
+		}
+		if (hi >= CPU_SETSIZE)
+			return -1;
+
+		while (lo <= hi)
+			CPU_SET (lo++, set);
+
+		str = end;
+		if (*str == '\n')
+			str++;
+	}
+	while ((*str == ',') && *++str);
+
+	return (*str == '\0') ? 0 : -1;
+}
+
+
+/**
+ * Reads the CPUs of a NUMA node.
+ */
+static int numa_node_cpus (int node, cpu_set_t *set)
+{
+	char path[64], buf[1024];
+
+	snprintf (path, sizeof (path),
+	          "/sys/devices/system/node/node%d/cpulist", node);
+
+	FILE *stream = fopen (path, "re");
+	if (stream == NULL)
+		return -1;
+
+	bool ok = fgets (buf, sizeof (buf), stream) != NULL;
+	fclose (stream);
+	if (!ok || teredo_cpulist_parse (buf, set))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+
+int teredo_set_thread_policy (enum teredo_thread_role role, const char *cpus,
+                              int numa_node, int priority)
+{
+	struct teredo_thread_policy p = { .priority = priority };
+
+	if ((unsigned)role >= TEREDO_THREAD_ROLES
+	 || (priority < 0) || (priority > sched_get_priority_max (SCHED_FIFO)))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((cpus != NULL) || (numa_node >= 0))
+	{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+		if (sched_getaffinity (0, sizeof (p.cpus), &p.cpus))
+			return -1;
+
+		if (cpus != NULL)
+		{
+			cpu_set_t set;
+
+			if (teredo_cpulist_parse (cpus, &set))
+			{
+				errno = EINVAL;
+				return -1;
+			}
+			CPU_AND (&p.cpus, &p.cpus, &set);
+		}
+
+		if (numa_node >= 0)
+		{
+			cpu_set_t set;
+
+			if (numa_node_cpus (numa_node, &set))
+				return -1;
+			CPU_AND (&p.cpus, &p.cpus, &set);
+		}
+
+		if (CPU_COUNT (&p.cpus) == 0)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		p.has_cpus = true;
+#else
+		errno = ENOSYS;
+		return -1;
+#endif
+	}
+
+	pthread_mutex_lock (&policy_lock);
+	policies[role] = p;
+	pthread_mutex_unlock (&policy_lock);
+	return 0;
+}
+
+
+void teredo_thread_setup (enum teredo_thread_role role, const char *fmt, ...)
+{
+	assert ((unsigned)role < TEREDO_THREAD_ROLES);
+
+#ifdef HAVE_PTHREAD_SETNAME_NP
+	/* Linux truncates thread names to 15 characters */
+	char name[16];
+	va_list ap;
+
+	va_start (ap, fmt);
+	vsnprintf (name, sizeof (name), fmt, ap);
+	va_end (ap);
+	pthread_setname_np (pthread_self (), name);
+#else
+	(void)fmt;
+#endif
+
+	pthread_mutex_lock (&policy_lock);
+	struct teredo_thread_policy p = policies[role];
+	pthread_mutex_unlock (&policy_lock);
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	if (p.has_cpus)
+	{
+		errno = pthread_setaffinity_np (pthread_self (), sizeof (p.cpus),
+		                                &p.cpus);
+		if (errno)
+			syslog (LOG_WARNING, _("Error (%s): %m"),
+			        "pthread_setaffinity_np");
+	}
+#endif
+
+	if (p.priority > 0)
+	{
+		struct sched_param param = { .sched_priority = p.priority };
+
+		errno = pthread_setschedparam (pthread_self (), SCHED_FIFO, &param);
+		if (errno)
+			syslog (LOG_WARNING, _("Error (%s): %m"),
+			        "pthread_setschedparam");
+	}
+}
@@ -0,0 +1,50 @@
+/**
+ * @file thread.h
+ * @brief Threads placement and naming
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_THREAD_H
+# define LIBTEREDO_THREAD_H
+
+/*
+ * teredo_set_thread_policy() and teredo_thread_setup() are declared in
+ * teredo-udp.h. Every libteredo thread calls teredo_thread_setup() first
+ * thing, so that it is named and placed according to its role.
+ */
+
+# ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#  include <sched.h>
+
+#  ifdef __cplusplus
+extern "C" {
+#  endif
+
+/**
+ * Parses a list of CPUs in the Linux format, e.g. "0-3,8".
+ * @return 0 on success, -1 if the list is invalid.
+ */
+int teredo_cpulist_parse (const char *str, cpu_set_t *set);
+
+#  ifdef __cplusplus
+}
+#  endif
+# endif
+
+#endif /* ifndef LIBTEREDO_THREAD_H */
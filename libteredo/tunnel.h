@@ -102,6 +102,25 @@ typedef struct teredo_tunnel teredo_tunnel;
  */
 teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port);
 
+/**
+ * Creates a teredo_tunnel instance with several receive workers, much like
+ * teredo_create(). Each worker gets its own UDP/IPv4 socket, all bound to
+ * the same address with SO_REUSEPORT, so that the kernel spreads incoming
+ * packets across them. Once teredo_run_async() is called, each worker runs
+ * in its own thread. All workers share the same Teredo peers list.
+ *
+ * Packets sent from a thread other than one of the workers, such as with
+ * teredo_transmit(), go through one socket assigned to the calling thread.
+ *
+ * Thread-safety: This function is thread-safe.
+ *
+ * @param workers number of workers (one is the same as teredo_create()).
+ *
+ * @return NULL in case of failure (e.g. the system lacks SO_REUSEPORT).
+ */
+teredo_tunnel *teredo_create_workers (uint32_t ipv4, uint16_t port,
+                                      unsigned workers);
+
 /**
  * Releases all resources (sockets, memory chunks...) and terminates all
  * threads associated with a teredo_tunnel instance.
@@ -123,8 +142,10 @@ void teredo_destroy (teredo_tunnel *t);
  * between busy waiting on this function for better response time of
  * the Teredo tunnel, and a long delay to not waste too much CPU
  * cycles. You should really consider using teredo_run_async() instead!
+ * Only the first worker socket is polled.
  * libteredo will spawn some threads even if you don't call
- * teredo_run_async() anyway...
+ * teredo_run_async() anyway, unless the tunnel was created with
+ * teredo_create_embedded()...
  *
  * Thread-safety: This function is thread-safe.
  *
@@ -135,6 +156,8 @@ void teredo_run (teredo_tunnel *t);
 /**
  * Spawns a new thread to perform Teredo packet reception in the background.
  * The thread will be automatically terminated when the tunnel is destroyed.
+ * If the tunnel has several workers (see teredo_create_workers()), one
+ * thread is spawned per worker.
  *
  * It is safe to call teredo_run_async multiple times for the same tunnel,
  * however all call will fail (safe) after the first succesful one.
@@ -150,6 +173,81 @@ void teredo_run (teredo_tunnel *t);
  */
 int teredo_run_async (teredo_tunnel *t);
 
+/**
+ * Creates a teredo_tunnel instance that runs without any library thread,
+ * much like teredo_create_workers() otherwise. Instead, the caller polls
+ * the worker sockets (see teredo_get_fds()) from its own event loop, calls
+ * teredo_process_batch() when they are readable, and teredo_tick() by the
+ * deadline from teredo_next_deadline(). The sockets are non-blocking.
+ *
+ * Such tunnels cannot be used with teredo_run_async(), and only support
+ * relay mode. They are otherwise used as any other tunnel.
+ *
+ * Thread-safety: This function is thread-safe.
+ *
+ * @return NULL in case of failure.
+ */
+teredo_tunnel *teredo_create_embedded (uint32_t ipv4, uint16_t port,
+                                       unsigned workers);
+
+/**
+ * Gets the UDP/IPv4 sockets of the workers of a tunnel, for polling.
+ *
+ * @param fds [out] table of (at most @p max) file descriptors,
+ * in the worker order
+ * @param max size of the table
+ *
+ * @return the number of workers (which may be more than @p max).
+ */
+unsigned teredo_get_fds (const teredo_tunnel *t, int *fds, unsigned max);
+
+/**
+ * Receives and processes one batch of pending packets from a worker
+ * socket of a tunnel created with teredo_create_embedded(). This never
+ * blocks; to drain the socket, call it until it fails with EAGAIN.
+ *
+ * Thread-safety: This function is thread-safe, but must not be called
+ * from several threads at a time for the same worker.
+ *
+ * @param worker worker index (see teredo_get_fds())
+ *
+ * @return the number of processed packets (possibly 0 if all pending
+ * datagrams were invalid), or -1 on error, with errno set to EAGAIN if
+ * no datagrams were pending.
+ */
+int teredo_process_batch (teredo_tunnel *t, unsigned worker);
+
+struct teredo_packet_batch;
+
+/**
+ * Processes a batch of already parsed datagrams as if the first worker of
+ * a tunnel created with teredo_create_embedded() had received them, so as
+ * to replay captured traffic. This is an internal interface, that is not
+ * exported from the shared library.
+ *
+ * @return the number of processed packets, or -1 on error.
+ */
+int teredo_replay_batch (teredo_tunnel *t,
+                         const struct teredo_packet_batch *batch);
+
+/**
+ * Tells when teredo_tick() is due next for a tunnel created with
+ * teredo_create_embedded(). The deadline can only move earlier as packets
+ * are processed or transmitted, so it should be queried again afterwards.
+ *
+ * @return milliseconds until the deadline (0 if due already), or -1 if
+ * the tunnel has its own timer thread.
+ */
+int teredo_next_deadline (teredo_tunnel *t);
+
+/**
+ * Runs the timers, retransmissions and garbage collection of a tunnel
+ * created with teredo_create_embedded(). Calling it early is harmless.
+ *
+ * Thread-safety: This function is thread-safe.
+ */
+void teredo_tick (teredo_tunnel *t);
+
 /**
  * Overrides the Teredo prefix of a Teredo relay.
  * Currently ignored for Teredo client (but might later restrict accepted
@@ -165,6 +263,133 @@ int teredo_run_async (teredo_tunnel *t);
  */
 int teredo_set_prefix (teredo_tunnel *t, uint32_t prefix);
 
+/**
+ * Sets the maximum number of Teredo peers in the tunnel peers list, and
+ * allocates memory for that many peers upfront. Existing peers are removed.
+ * Must be called before teredo_run_async().
+ *
+ * @param t Teredo tunnel instance
+ * @param max maximum number of peers (must not be 0)
+ *
+ * @return 0 on success, -1 on error.
+ */
+int teredo_set_max_peers (teredo_tunnel *t, unsigned max);
+
+/**
+ * Changes the maximum number of Teredo peers of a tunnel, keeping the
+ * existing peers, unlike teredo_set_max_peers(). This can be called at
+ * any time. If the tunnel has more peers than the new maximum already, no
+ * new peers are added until enough have expired. The maximum cannot exceed
+ * what fits in the teredo_set_peer_memory() budget, if any.
+ *
+ * @param t Teredo tunnel instance
+ * @param max maximum number of peers (must not be 0)
+ *
+ * @return 0 on success, -1 on error.
+ */
+int teredo_set_peer_limit (teredo_tunnel *t, unsigned max);
+
+/**
+ * Preallocates all memory for the Teredo peers list at once, preferably
+ * from huge pages, within a byte budget. The maximum number of peers is
+ * lowered to what fits in the budget, if needed. Existing peers are removed.
+ * Must be called before teredo_run_async(), and after
+ * teredo_set_max_peers() if at all.
+ *
+ * @param t Teredo tunnel instance
+ * @param bytes memory budget for the peers list (excluding packet queues)
+ *
+ * @return 0 on success, -1 on error (e.g. the budget is too small).
+ */
+int teredo_set_peer_memory (teredo_tunnel *t, size_t bytes);
+
+/**
+ * Sets how many bytes of packets are queued for each Teredo peer pending
+ * connectivity (1280 by default).
+ * Must be called before teredo_run_async().
+ *
+ * @param t Teredo tunnel instance
+ * @param bytes queue size (between 1280 and 65535)
+ *
+ * @return 0 on success, -1 on error.
+ */
+int teredo_set_queue_size (teredo_tunnel *t, size_t bytes);
+
+/**
+ * Enables or disables path MTU discovery toward the Teredo peers (disabled
+ * by default). Datagrams are then sent with the Don't Fragment flag, so
+ * that ICMPv4 errors report the path MTU toward each peer. Packets bigger
+ * than 1280 bytes and than that path MTU are dropped, with an ICMPv6 Packet
+ * Too Big error, so that their source adapts its packet sizes per
+ * destination. Reports expire after 10 minutes, and bigger packets are
+ * then tried again.
+ * This is only useful if the tunnel interface MTU exceeds 1280 bytes.
+ * Must be called before teredo_run_async().
+ *
+ * @param t Teredo tunnel instance
+ * @param on whether to enable path MTU discovery
+ *
+ * @return 0 on success, -1 on error (e.g. not supported).
+ */
+int teredo_set_pmtud (teredo_tunnel *t, bool on);
+
+/**
+ * Sets the minimum average interval between ICMPv6 errors sent by the
+ * tunnel (100 ms by default).
+ *
+ * Thread-safety: This function is thread-safe.
+ *
+ * @param t Teredo tunnel instance
+ * @param ms interval in milliseconds (at most 1000), 0 for no rate limit
+ *
+ * @return 0 on success, -1 on error.
+ */
+int teredo_set_icmp_rate_limit (teredo_tunnel *t, unsigned ms);
+
+/**
+ * Saves the recently used Teredo peers (mappings and trust) to a file, so
+ * that they can be restored with teredo_load_peers() after a restart.
+ *
+ * Thread-safety: This function is thread-safe.
+ *
+ * @param t Teredo tunnel instance
+ * @param fd file to write to (its previous content is discarded)
+ *
+ * @return the number of saved peers, or -1 on error.
+ */
+int teredo_save_peers (teredo_tunnel *t, int fd);
+
+/**
+ * Restores Teredo peers saved with teredo_save_peers(). Peers not heard
+ * from within the last 30 seconds, including the time elapsed since they
+ * were saved, are skipped. Peers are only trusted again if the tunnel UDP
+ * socket is bound to the same address and port as when they were saved.
+ * Must be called after teredo_set_max_peers(), if at all.
+ *
+ * Thread-safety: This function is thread-safe.
+ *
+ * @param t Teredo tunnel instance
+ * @param fd file to read from (an empty file holds no peers)
+ *
+ * @return the number of restored peers, or -1 on error.
+ */
+int teredo_load_peers (teredo_tunnel *t, int fd);
+
+/**
+ * Writes all Teredo peers as text to a file, one line per peer, with their
+ * mapping, trust state, ages and queued packets, for debugging. Packets
+ * forwarding goes on meanwhile: only a fraction of the peers is locked at
+ * any time, and only shortly.
+ *
+ * Thread-safety: This function is thread-safe.
+ *
+ * @param t Teredo tunnel instance
+ * @param fd file to write to (its previous content is discarded)
+ *
+ * @return the number of peers, or -1 on error.
+ */
+int teredo_dump_peers (teredo_tunnel *t, int fd);
+
 /**
  * Defines the cone flag of the Teredo tunnel.
  * This only works for Teredo relays.
@@ -191,13 +416,140 @@ int teredo_set_cone_flag (teredo_tunnel *t, bool flag);
  */
 int teredo_set_relay_mode (teredo_tunnel *t);
 
+/**
+ * Enables NAT binding lifetime discovery in client mode: the refresh
+ * interval starts at 30 seconds and is increased as long as the NAT keeps
+ * the client mapping, up to the specified limit. A mapping change reveals
+ * a too long interval. Must be called before teredo_set_client_mode().
+ *
+ * @param t Teredo tunnel instance
+ * @param sec longest refresh interval (seconds), 30 or less to always
+ * refresh every 30 seconds (the default)
+ *
+ * @return 0 on success, -1 on error.
+ */
+int teredo_set_max_refresh_interval (teredo_tunnel *t, unsigned sec);
+
+/**
+ * Enables the relays cache in client mode. When a ping reply shows which
+ * Teredo relay serves a non-Teredo destination, that relay is remembered
+ * for the whole destination prefix. Packets toward new destinations
+ * within the prefix then go through that relay straight away, while a
+ * ping discovers the relay that actually serves the destination.
+ * Must be called before teredo_set_client_mode().
+ *
+ * @param t Teredo tunnel instance
+ * @param prefix_len destination prefix length (at most 64),
+ * 0 to disable the cache (the default)
+ *
+ * @return 0 on success, -1 on error.
+ */
+int teredo_set_relay_cache (teredo_tunnel *t, unsigned prefix_len);
+
+/**
+ * Sets a file to cache the Teredo client qualification in. When the cached
+ * qualification is recent enough and was obtained from the same local UDP
+ * port, the tunnel comes up immediately with the cached address, which is
+ * then revalidated with the server in the background. Must be called
+ * before teredo_set_client_mode().
+ *
+ * @param t Teredo tunnel instance
+ * @param fd read/write file descriptor (remains owned by the caller and
+ * must remain valid until the tunnel is destroyed), or -1 for none
+ *
+ * @return 0 on success, -1 on error.
+ */
+int teredo_set_qualification_cache (teredo_tunnel *t, int fd);
+
+typedef struct teredo_datapath teredo_datapath;
+
+/**
+ * Loads and attaches the in-kernel eBPF datapath, which forwards packets
+ * to and from trusted peers without going through userspace: Teredo
+ * packets are decapsulated as they are received from the network
+ * interface, and IPv6 packets are encapsulated as they are sent to the
+ * tunnel interface. Requires the CAP_NET_ADMIN and CAP_BPF (or
+ * CAP_SYS_ADMIN) capabilities, and Linux 6.6 or later.
+ *
+ * @param tun_ifindex index of the tunnel interface
+ * @param net_ifindex index of the IPv4 network interface
+ * @param ipv4 IPv4 address the tunnel is bound to (INADDR_ANY: first
+ * address of the network interface)
+ * @param port UDP port the tunnel is bound to (must not be 0)
+ *
+ * @return NULL on error (including if the datapath is not supported).
+ */
+teredo_datapath *teredo_datapath_create (unsigned tun_ifindex,
+                                         unsigned net_ifindex,
+                                         uint32_t ipv4, uint16_t port);
+
+/**
+ * Detaches and releases the in-kernel datapath. The tunnel it was given to
+ * must have been destroyed first.
+ */
+void teredo_datapath_destroy (teredo_datapath *dp);
+
+/**
+ * Mirrors the trusted peers of a tunnel into an in-kernel datapath.
+ * Must be called before teredo_run_async().
+ *
+ * @param t Teredo tunnel instance
+ * @param dp datapath (remains owned by the caller), or NULL for none
+ *
+ * @return 0 on success, -1 on error.
+ */
+int teredo_set_datapath (teredo_tunnel *t, teredo_datapath *dp);
+
+typedef struct teredo_peertable teredo_peertable;
+
+/**
+ * Opens a named shared memory table of peer mappings, creating it if it
+ * does not exist yet. Sibling relay processes on the same host can share
+ * the trusted mappings they learn through it (see teredo_set_peer_table()).
+ * The segment persists until it is removed with shm_unlink(). This must
+ * be called before dropping privileges if the segment is protected.
+ *
+ * @param name shared memory object name (e.g. "/miredo-peers")
+ * @param capacity number of peers to make room for, if the table is
+ * created (an existing table keeps its size)
+ *
+ * @return NULL on error (including if shared memory is not supported).
+ */
+teredo_peertable *teredo_peertable_open (const char *name,
+                                         unsigned capacity);
+
+/**
+ * Unmaps a shared peer table. The tunnels it was given to must have been
+ * destroyed first.
+ */
+void teredo_peertable_close (teredo_peertable *table);
+
+/**
+ * Shares the trusted peers of a relay with its sibling processes. The relay
+ * then publishes the mappings of the peers it trusts to the table, and
+ * looks up unknown peers in it before trying to reach them. A mapping
+ * learnt by a sibling is only trusted if the sibling is bound to the same
+ * IPv4 address and UDP port, or if the peer is behind a cone NAT, since
+ * other NATs only let through packets from the hosts that were sent some.
+ * This only works for Teredo relays. Must be called before
+ * teredo_run_async().
+ *
+ * @param t Teredo tunnel instance
+ * @param table shared peer table (remains owned by the caller), or NULL
+ * for none
+ *
+ * @return 0 on success, -1 on error.
+ */
+int teredo_set_peer_table (teredo_tunnel *t, teredo_peertable *table);
+
 /**
  * Enables Teredo client mode for a teredo_tunnel and starts the Teredo
  * client maintenance procedure in a separate thread.
  *
  * NOTE: calling teredo_set_client_mode() multiple times on the same tunnel
  * is currently not supported, and will safely return an error. Future
- * versions might support this.
+ * versions might support this. Tunnels created with
+ * teredo_create_embedded() only support relay mode.
  *
  * Thread-safety: This function is thread-safe.
  *
@@ -251,6 +603,28 @@ typedef void (*teredo_recv_cb) (void *opaque, const void *data, size_t len);
  */
 void teredo_set_recv_callback (teredo_tunnel *restrict t, teredo_recv_cb cb);
 
+typedef struct teredo_pktbuf teredo_pktbuf;
+
+/**
+ * Retains the buffer holding a packet passed to the receive callback, so
+ * that the packet remains valid after the callback returns. This must be
+ * called from within the callback.
+ *
+ * @param data packet, as passed to the receive callback
+ * @param len packet byte length
+ *
+ * @return a buffer handle to release with teredo_pktbuf_release(), or
+ * NULL if the packet is not in a reference-counted buffer (it must then
+ * be copied).
+ */
+teredo_pktbuf *teredo_pktbuf_hold (const void *data, size_t len);
+
+/**
+ * Releases a buffer handle from teredo_pktbuf_hold(). This can be called
+ * from any thread.
+ */
+void teredo_pktbuf_release (teredo_pktbuf *b);
+
 /**
  * Transmits a packet coming from the IPv6 Internet, toward a Teredo node
  * (as specified per paragraph 5.4.1). That's what the specification calls
@@ -272,6 +646,22 @@ void teredo_set_recv_callback (teredo_tunnel *restrict t, teredo_recv_cb cb);
 int teredo_transmit (teredo_tunnel *restrict t,
                      const struct ip6_hdr *restrict buf, size_t n);
 
+struct iovec;
+
+/**
+ * Transmits several IPv6 packets, much like teredo_transmit(). Resulting
+ * UDP datagrams are sent with as few system calls as possible.
+ *
+ * Thread-safety: This function is thread-safe.
+ *
+ * @param pkts packets (each one contiguous and suitably aligned)
+ * @param count number of packets
+ *
+ * @return 0 on success, -1 if any packet could not be transmitted.
+ */
+int teredo_transmit_batch (teredo_tunnel *restrict t,
+                           const struct iovec *restrict pkts, unsigned count);
+
 /**
  * Prototype for callback to process ICMPv6 messages generated by the Teredo
  * tunnel.
@@ -294,6 +684,41 @@ typedef void (*teredo_icmpv6_cb) (void *opaque, const void *data, size_t len,
 void teredo_set_icmpv6_callback (teredo_tunnel *restrict t,
                                  teredo_icmpv6_cb cb);
 
+/**
+ * ICMPv6 error message generated by the Teredo tunnel. The payload refers
+ * in place to the IPv6 packet that caused the error, hence the message is
+ * only valid for the duration of the callback.
+ */
+typedef struct teredo_icmpv6_msg
+{
+	const struct in6_addr *dst; /**< destination of the ICMPv6 error */
+	const struct iovec *iov; /**< ICMPv6 header, then quoted packet */
+	unsigned iovcnt; /**< number of elements in iov */
+} teredo_icmpv6_msg;
+
+/**
+ * Prototype for callback to process several ICMPv6 messages generated by the
+ * Teredo tunnel at once, typically while teredo_transmit_batch() runs.
+ *
+ * @param opaque private data pointer, set by teredo_set_privdata()
+ * @param msgs ICMPv6 messages
+ * @param count number of ICMPv6 messages (at least one)
+ */
+typedef void (*teredo_icmpv6_batch_cb) (void *opaque,
+                                        const teredo_icmpv6_msg *msgs,
+                                        unsigned count);
+
+/**
+ * Registers a callback to emit ICMPv6 messages in batches, without copying
+ * the packets they quote. That callback supersedes the one registered by
+ * teredo_set_icmpv6_callback(), if any.
+ *
+ * @param t Teredo tunnel instance
+ * @param cb callback (or NULL to fall back to teredo_set_icmpv6_callback())
+ */
+void teredo_set_icmpv6_batch_callback (teredo_tunnel *restrict t,
+                                       teredo_icmpv6_batch_cb cb);
+
 /**
  * Prototype for Teredo tunnel readiness event notification.
  * @param opaque private data pointer, set by teredo_set_privdata()
@@ -0,0 +1,475 @@
+/*
+ * uring.c - io_uring packets reception engine
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "uring.h"
+#include "debug.h"
+
+/* Provided buffers: count (power of two) and size */
+#define URING_BUFS 256
+#define URING_BUF_SIZE 2048
+/* Completion user data for the stop event */
+#define URING_STOP_DATA UINT64_MAX
+
+/* Layout of multishot recvmsg buffers: header, address, control, payload */
+#define URING_NAME_LEN sizeof (struct sockaddr_in)
+#define URING_CMSG_LEN CMSG_SPACE (sizeof (struct in_pktinfo))
+#define URING_PAYLOAD_OFFSET \
+	(sizeof (struct io_uring_recvmsg_out) + URING_NAME_LEN + URING_CMSG_LEN)
+
+static_assert (URING_PAYLOAD_OFFSET + TEREDO_SMALL_PACKET_SIZE
+               <= URING_BUF_SIZE, "Provided buffers too small");
+
+struct teredo_uring
+{
+	int fd;
+	int stopfd;
+	uint64_t stopval;
+
+	/* Submission queue */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_head, *sq_tail, sq_mask, sq_entries;
+	unsigned sqe_tail;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	/* Completion queue */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned *cq_head, *cq_tail, cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Provided buffers */
+	struct io_uring_buf_ring *br;
+	uint8_t *bufs;
+
+	struct msghdr msg; /* multishot recvmsg template */
+	unsigned nfds;
+	int fds[];
+};
+
+
+static int sys_io_uring_setup (unsigned entries, struct io_uring_params *p)
+{
+	return syscall (__NR_io_uring_setup, entries, p);
+}
+
+
+static int sys_io_uring_enter (int fd, unsigned submit, unsigned wait,
+                               unsigned flags)
+{
+	return syscall (__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+
+static int sys_io_uring_register (int fd, unsigned op, void *arg,
+                                  unsigned n)
+{
+	return syscall (__NR_io_uring_register, fd, op, arg, n);
+}
+
+
+static struct io_uring_sqe *uring_get_sqe (teredo_uring *u)
+{
+	unsigned head = atomic_load_explicit ((_Atomic unsigned *)u->sq_head,
+	                                      memory_order_acquire);
+
+	if (u->sqe_tail - head >= u->sq_entries)
+		return NULL;
+
+	struct io_uring_sqe *sqe = u->sqes + (u->sqe_tail++ & u->sq_mask);
+	memset (sqe, 0, sizeof (*sqe));
+	return sqe;
+}
+
+
+/**
+ * Submits queued operations, and optionally waits for one completion.
+ */
+static int uring_submit (teredo_uring *u, bool wait)
+{
+	unsigned tail = *u->sq_tail;
+	unsigned n = u->sqe_tail - tail;
+
+	atomic_store_explicit ((_Atomic unsigned *)u->sq_tail, u->sqe_tail,
+	                       memory_order_release);
+
+	for (;;)
+	{
+		int val = sys_io_uring_enter (u->fd, n, wait,
+		                              wait ? IORING_ENTER_GETEVENTS : 0);
+		if (val >= 0)
+			return 0;
+		if (errno != EINTR)
+			return -1;
+	}
+}
+
+
+static int uring_arm_recv (teredo_uring *u, unsigned i)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe (u);
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = u->fds[i];
+	sqe->addr = (uintptr_t)&u->msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = i;
+	return 0;
+}
+
+
+static int uring_arm_stop (teredo_uring *u)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe (u);
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = u->stopfd;
+	sqe->addr = (uintptr_t)&u->stopval;
+	sqe->len = sizeof (u->stopval);
+	sqe->user_data = URING_STOP_DATA;
+	return 0;
+}
+
+
+/**
+ * Gives a buffer back to the kernel.
+ */
+static void uring_recycle (teredo_uring *u, unsigned bid)
+{
+	unsigned tail = u->br->tail;
+	struct io_uring_buf *b = u->br->bufs + (tail & (URING_BUFS - 1));
+
+	b->addr = (uintptr_t)(u->bufs + bid * URING_BUF_SIZE);
+	b->len = URING_BUF_SIZE;
+	b->bid = bid;
+	atomic_store_explicit ((_Atomic uint16_t *)&u->br->tail, tail + 1,
+	                       memory_order_release);
+}
+
+
+static void uring_unmap (teredo_uring *u)
+{
+	if (u->cq_ring != NULL && u->cq_ring != u->sq_ring)
+		munmap (u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring != NULL)
+		munmap (u->sq_ring, u->sq_ring_size);
+	if (u->sqes != NULL)
+		munmap (u->sqes, u->sqes_size);
+}
+
+
+static int uring_map (teredo_uring *u, const struct io_uring_params *p)
+{
+	u->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof (unsigned);
+	u->cq_ring_size = p->cq_off.cqes
+	                  + p->cq_entries * sizeof (struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+
+	u->sq_ring = mmap (NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+	                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+	{
+		u->sq_ring = NULL;
+		return -1;
+	}
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ring = u->sq_ring;
+	else
+	{
+		u->cq_ring = mmap (NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+		                   MAP_SHARED | MAP_POPULATE, u->fd,
+		                   IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+		{
+			u->cq_ring = NULL;
+			return -1;
+		}
+	}
+
+	u->sqes_size = p->sq_entries * sizeof (struct io_uring_sqe);
+	u->sqes = mmap (NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+	                MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+	{
+		u->sqes = NULL;
+		return -1;
+	}
+
+	uint8_t *sq = u->sq_ring, *cq = u->cq_ring;
+
+	u->sq_head = (unsigned *)(sq + p->sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+	u->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+	u->sq_entries = p->sq_entries;
+	u->sqe_tail = *u->sq_tail;
+
+	/* Submission entries are always used in order */
+	unsigned *array = (unsigned *)(sq + p->sq_off.array);
+	for (unsigned i = 0; i < p->sq_entries; i++)
+		array[i] = i;
+
+	u->cq_head = (unsigned *)(cq + p->cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+	u->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+	return 0;
+}
+
+
+static int uring_setup_bufs (teredo_uring *u)
+{
+	size_t ringlen = URING_BUFS * sizeof (struct io_uring_buf);
+
+	u->br = mmap (NULL, ringlen, PROT_READ | PROT_WRITE,
+	              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED)
+	{
+		u->br = NULL;
+		return -1;
+	}
+
+	u->bufs = mmap (NULL, URING_BUFS * URING_BUF_SIZE,
+	                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+	                -1, 0);
+	if (u->bufs == MAP_FAILED)
+	{
+		u->bufs = NULL;
+		return -1;
+	}
+
+	struct io_uring_buf_reg reg =
+	{
+		.ring_addr = (uintptr_t)u->br,
+		.ring_entries = URING_BUFS,
+		.bgid = 0,
+	};
+
+	if (sys_io_uring_register (u->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+		return -1;
+
+	u->br->tail = 0;
+	for (unsigned i = 0; i < URING_BUFS; i++)
+		uring_recycle (u, i);
+	return 0;
+}
+
+
+void teredo_uring_destroy (teredo_uring *u)
+{
+	if (u->fd != -1)
+		close (u->fd);
+	uring_unmap (u);
+	if (u->bufs != NULL)
+		munmap (u->bufs, URING_BUFS * URING_BUF_SIZE);
+	if (u->br != NULL)
+		munmap (u->br, URING_BUFS * sizeof (struct io_uring_buf));
+	if (u->stopfd != -1)
+		close (u->stopfd);
+	free (u);
+}
+
+
+teredo_uring *teredo_uring_create (const int *fds, unsigned n)
+{
+	teredo_uring *u = malloc (sizeof (*u) + n * sizeof (u->fds[0]));
+	if (u == NULL)
+		return NULL;
+
+	memset (u, 0, sizeof (*u));
+	memcpy (u->fds, fds, n * sizeof (u->fds[0]));
+	u->nfds = n;
+	u->msg.msg_namelen = URING_NAME_LEN;
+	u->msg.msg_controllen = URING_CMSG_LEN;
+	u->fd = -1;
+	u->stopfd = eventfd (0, EFD_CLOEXEC);
+	if (u->stopfd == -1)
+		goto error;
+
+	struct io_uring_params p;
+	memset (&p, 0, sizeof (p));
+	p.flags = IORING_SETUP_COOP_TASKRUN;
+	u->fd = sys_io_uring_setup (2 * n + 2, &p);
+	if ((u->fd == -1) && (errno == EINVAL))
+	{   /* Kernel older than 5.19 */
+		memset (&p, 0, sizeof (p));
+		u->fd = sys_io_uring_setup (2 * n + 2, &p);
+	}
+	if (u->fd == -1)
+		goto error;
+
+	if (!(p.features & IORING_FEAT_NODROP) || uring_map (u, &p)
+	 || uring_setup_bufs (u))
+		goto error;
+
+	for (unsigned i = 0; i < n; i++)
+		if (uring_arm_recv (u, i))
+			goto error;
+	if (uring_arm_stop (u) || uring_submit (u, false))
+		goto error;
+
+	/* Multishot recvmsg (Linux 6.0) gets rejected immediately if missing */
+	unsigned head = *u->cq_head;
+	unsigned tail = atomic_load_explicit ((_Atomic unsigned *)u->cq_tail,
+	                                      memory_order_acquire);
+	for (; head != tail; head++)
+	{
+		const struct io_uring_cqe *cqe = u->cqes + (head & u->cq_mask);
+
+		if ((cqe->res == -EINVAL) && !(cqe->flags & IORING_CQE_F_MORE))
+		{
+			debug ("io_uring multishot reception not supported");
+			goto error;
+		}
+	}
+
+	return u;
+
+error:
+	teredo_uring_destroy (u);
+	return NULL;
+}
+
+
+/**
+ * Processes a reception completion.
+ * @return 0 on success, -1 if the socket must be re-armed.
+ */
+static int uring_recv_complete (teredo_uring *u, const struct io_uring_cqe *cqe,
+                                teredo_uring_cb cb, void *opaque)
+{
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+	{
+		unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		uint8_t *buf = u->bufs + bid * URING_BUF_SIZE;
+
+		if (cqe->res >= (int)URING_PAYLOAD_OFFSET)
+		{
+			const struct io_uring_recvmsg_out *out = (void *)buf;
+			struct msghdr msg =
+			{
+				.msg_name = buf + sizeof (*out),
+				.msg_namelen = out->namelen,
+				.msg_control = buf + sizeof (*out) + URING_NAME_LEN,
+				.msg_controllen = out->controllen,
+				.msg_flags = out->flags,
+			};
+			teredo_packet p;
+
+			if (teredo_parse_msg (&p, &msg, buf, URING_PAYLOAD_OFFSET,
+			                      cqe->res - URING_PAYLOAD_OFFSET) == 0)
+				cb (opaque, cqe->user_data, &p);
+		}
+		uring_recycle (u, bid);
+	}
+
+	return (cqe->flags & IORING_CQE_F_MORE) ? 0 : -1;
+}
+
+
+int teredo_uring_run (teredo_uring *u, teredo_sendq *q,
+                      teredo_uring_cb cb, void *opaque)
+{
+	bool stop = false;
+
+	while (!stop)
+	{
+		if (uring_submit (u, true))
+			return -1;
+
+		unsigned head = *u->cq_head;
+		unsigned tail = atomic_load_explicit ((_Atomic unsigned *)u->cq_tail,
+		                                      memory_order_acquire);
+
+		if (q != NULL)
+			teredo_sendq_start (q);
+
+		for (; head != tail; head++)
+		{
+			const struct io_uring_cqe *cqe = u->cqes + (head & u->cq_mask);
+
+			if (cqe->user_data == URING_STOP_DATA)
+				stop = true;
+			else if (uring_recv_complete (u, cqe, cb, opaque))
+			{
+				/* Multishot reception ended (e.g. out of buffers) */
+				if ((cqe->res < 0) && (cqe->res != -ENOBUFS))
+					debug ("io_uring reception error: %s",
+					       strerror (-cqe->res));
+				uring_arm_recv (u, cqe->user_data);
+			}
+		}
+
+		atomic_store_explicit ((_Atomic unsigned *)u->cq_head, head,
+		                       memory_order_release);
+
+		cb (opaque, 0, NULL);
+		if (q != NULL)
+			teredo_sendq_stop (q);
+	}
+	return 0;
+}
+
+
+void teredo_uring_stop (teredo_uring *u)
+{
+	uint64_t one = 1;
+
+	(void)write (u->stopfd, &one, sizeof (one));
+}
@@ -0,0 +1,89 @@
+/**
+ * @file uring.h
+ * @brief io_uring packets reception engine
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_URING_H
+# define LIBTEREDO_URING_H
+
+/*
+ * The engine receives datagrams from one or more UDP sockets with multishot
+ * recvmsg operations into a ring of kernel-provided buffers. Packets are
+ * parsed in place, so that in steady state, reception involves neither
+ * copies nor submission system calls. The engine thread is stopped through
+ * an eventfd rather than cancelled.
+ */
+
+typedef struct teredo_uring teredo_uring;
+struct teredo_packet;
+struct teredo_sendq;
+
+/**
+ * Callback to process one received packet. It is also called with a NULL
+ * packet at the end of each batch of completions, so that any pending
+ * output can be flushed.
+ * @param index index of the receiving socket in the array given to
+ * teredo_uring_create()
+ */
+typedef void (*teredo_uring_cb) (void *opaque, unsigned index,
+                                 struct teredo_packet *p);
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Creates a reception engine for a set of UDP sockets, and ensures that the
+ * kernel supports all required io_uring features.
+ *
+ * @param fds sockets to receive from
+ * @param n number of sockets
+ *
+ * @return NULL on error (including if io_uring is not available).
+ */
+teredo_uring *teredo_uring_create (const int *fds, unsigned n);
+
+/**
+ * Releases an engine. The engine must not be running.
+ */
+void teredo_uring_destroy (teredo_uring *u);
+
+/**
+ * Runs an engine until teredo_uring_stop() is called. Packets from each
+ * batch of completions are processed with the send queue (if not NULL)
+ * current, so that replies get sent together.
+ * Not thread-safe (only one thread can run an engine), no cancellation
+ * points.
+ *
+ * @return 0 once stopped, -1 on error.
+ */
+int teredo_uring_run (teredo_uring *u, struct teredo_sendq *q,
+                      teredo_uring_cb cb, void *opaque);
+
+/**
+ * Asks an engine to stop running.
+ * Thread-safe.
+ */
+void teredo_uring_stop (teredo_uring *u);
+
+# ifdef __cplusplus
+}
+# endif
+#endif /* ifndef LIBTEREDO_URING_H */
@@ -0,0 +1,132 @@
+/*
+ * wheel.c - Retransmission timer wheel
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h> // struct in6_addr
+
+#include "clock.h"
+#include "wheel.h"
+
+void teredo_wheel_init (teredo_wheel *w, teredo_clock_t now)
+{
+	pthread_mutex_init (&w->lock, NULL);
+	w->last = now;
+	memset (w->slots, 0, sizeof (w->slots));
+}
+
+
+void teredo_wheel_destroy (teredo_wheel *w)
+{
+	for (unsigned i = 0; i < TEREDO_WHEEL_SLOTS; i++)
+		free (w->slots[i].addrs);
+	pthread_mutex_destroy (&w->lock);
+}
+
+
+int teredo_wheel_add (teredo_wheel *w, const struct in6_addr *addr,
+                      teredo_clock_t due)
+{
+	int retval = 0;
+
+	pthread_mutex_lock (&w->lock);
+	/* A slot is expired as a whole: the earliest usable one is the next */
+	if ((long)(due - w->last) < 1)
+		due = w->last + 1;
+	else if (due - w->last >= TEREDO_WHEEL_SLOTS)
+		due = w->last + TEREDO_WHEEL_SLOTS - 1;
+
+	teredo_wheel_slot *s = w->slots + (due & (TEREDO_WHEEL_SLOTS - 1));
+
+	if (s->count == s->size)
+	{
+		unsigned size = s->size ? (2 * s->size) : 16;
+		struct in6_addr *addrs = realloc (s->addrs, size * sizeof (*addrs));
+
+		if (addrs == NULL)
+		{
+			retval = -1;
+			goto out;
+		}
+		s->addrs = addrs;
+		s->size = size;
+	}
+	s->addrs[s->count++] = *addr;
+out:
+	pthread_mutex_unlock (&w->lock);
+	return retval;
+}
+
+
+void teredo_wheel_expire (teredo_wheel *w, teredo_clock_t now,
+                          teredo_wheel_cb cb, void *opaque)
+{
+	for (;;)
+	{
+		teredo_wheel_slot s;
+
+		pthread_mutex_lock (&w->lock);
+		if ((long)(now - w->last) <= 0)
+		{
+			pthread_mutex_unlock (&w->lock);
+			break;
+		}
+
+		/* After a long sleep, all timers expire at once */
+		if (now - w->last > TEREDO_WHEEL_SLOTS)
+			w->last = now - TEREDO_WHEEL_SLOTS;
+
+		w->last++;
+		/* Detaches the slot, so the callback can schedule new timers */
+		teredo_wheel_slot *cur = w->slots + (w->last & (TEREDO_WHEEL_SLOTS - 1));
+		s = *cur;
+		cur->addrs = NULL;
+		cur->count = cur->size = 0;
+		pthread_mutex_unlock (&w->lock);
+
+		if (s.count > 0)
+			cb (opaque, s.addrs, s.count, now);
+		free (s.addrs);
+	}
+}
+
+
+int teredo_wheel_next (teredo_wheel *w, teredo_clock_t *due)
+{
+	int retval = -1;
+
+	pthread_mutex_lock (&w->lock);
+	for (unsigned i = 1; i < TEREDO_WHEEL_SLOTS; i++)
+		if (w->slots[(w->last + i) & (TEREDO_WHEEL_SLOTS - 1)].count > 0)
+		{
+			*due = w->last + i;
+			retval = 0;
+			break;
+		}
+	pthread_mutex_unlock (&w->lock);
+	return retval;
+}
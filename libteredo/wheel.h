@@ -0,0 +1,108 @@
+/**
+ * @file wheel.h
+ * @brief Retransmission timer wheel
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+
+#ifndef LIBTEREDO_WHEEL_H
+# define LIBTEREDO_WHEEL_H
+
+/*
+ * Peers awaiting a retransmission (bubble or ping) are kept in a ring of
+ * one second slots, by due time. Entries only hold the peer address: the
+ * peer is looked up again when its entry expires, so that peers removed
+ * from the list in the mean time need not be unscheduled. Timers can be
+ * at most TEREDO_WHEEL_SLOTS - 1 seconds ahead. The wheel is thread-safe.
+ */
+# include <pthread.h>
+
+# define TEREDO_WHEEL_SLOTS 8 // seconds, must be a power of two
+
+struct in6_addr;
+
+typedef struct teredo_wheel_slot
+{
+	struct in6_addr *addrs;
+	unsigned count, size;
+} teredo_wheel_slot;
+
+typedef struct teredo_wheel
+{
+	pthread_mutex_t lock;
+	teredo_clock_t last; /* last expired second */
+	teredo_wheel_slot slots[TEREDO_WHEEL_SLOTS];
+} teredo_wheel;
+
+/**
+ * Callback for expired timers.
+ * @param addrs addresses whose timer expired
+ * @param count number of addresses at @p addrs
+ * @param now current clock value
+ */
+typedef void (*teredo_wheel_cb) (void *opaque, const struct in6_addr *addrs,
+                                 unsigned count, teredo_clock_t now);
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Initializes an empty timer wheel.
+ * @param now current clock value
+ */
+void teredo_wheel_init (teredo_wheel *w, teredo_clock_t now);
+
+/**
+ * Releases all the memory of a timer wheel. Pending timers are discarded.
+ */
+void teredo_wheel_destroy (teredo_wheel *w);
+
+/**
+ * Schedules a timer. Timers due in the past expire on the next call to
+ * teredo_wheel_expire(); timers too far in the future expire early.
+ *
+ * @param addr peer address
+ * @param due clock value at which the timer expires
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+int teredo_wheel_add (teredo_wheel *w, const struct in6_addr *addr,
+                      teredo_clock_t due);
+
+/**
+ * Expires all timers due no later than @p now, one slot at a time. The
+ * callback is called without the wheel lock, and can schedule timers.
+ */
+void teredo_wheel_expire (teredo_wheel *w, teredo_clock_t now,
+                          teredo_wheel_cb cb, void *opaque);
+
+/**
+ * Finds when the earliest pending timer is due.
+ *
+ * @param due [out] clock value of the earliest pending timer
+ *
+ * @return 0 on success, -1 if no timers are pending.
+ */
+int teredo_wheel_next (teredo_wheel *w, teredo_clock_t *due);
+
+# ifdef __cplusplus
+}
+# endif
+#endif /* ifndef LIBTEREDO_WHEEL_H */
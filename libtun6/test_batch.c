@@ -0,0 +1,214 @@
+/*
+ * test_batch.c - Libtun6 batched reception test
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h> // alarm()
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <net/if.h>
+#include "tun6.h"
+
+static const struct in6_addr local =
+	{ { { 0xfd, 0x6e, 0x6c, 0x8f, 0xb3, 0xd1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 } } };
+static const struct in6_addr remote =
+	{ { { 0xfd, 0x6e, 0x6c, 0x8f, 0xb3, 0xd1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2 } } };
+
+static uint32_t get32 (const uint8_t *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put32 (uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/* TCP checksum of an IPv6 packet, without extension headers */
+static uint16_t tcp_sum (const uint8_t *pkt, size_t len)
+{
+	uint32_t sum = (len - 40) + IPPROTO_TCP;
+
+	for (size_t i = 8; i < 40; i += 2)
+		sum += (pkt[i] << 8) | pkt[i + 1];
+	for (size_t i = 40; i < len; i += 2)
+		sum += (pkt[i] << 8) | ((i + 1 < len) ? pkt[i + 1] : 0);
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+static uint8_t buf[4 * 65536] __attribute__ ((aligned (8)));
+
+/**
+ * Waits for the next TCP packet from the kernel, checking it.
+ */
+static unsigned recv_tcp (tun6 *t, struct iovec *pkts, unsigned max)
+{
+	for (;;)
+	{
+		int val = tun6_recv_batch (t, buf, sizeof (buf), pkts, max);
+		assert (val >= 1);
+
+		unsigned n = 0;
+		for (int i = 0; i < val; i++)
+		{
+			const uint8_t *p = pkts[i].iov_base;
+			size_t len = pkts[i].iov_len;
+
+			assert (((uintptr_t)p & 7) == 0);
+			assert (len <= 1280);
+			if ((len < 60) || (p[6] != IPPROTO_TCP))
+				continue; /* MLD, router solicitation... */
+
+			assert ((size_t)((p[4] << 8) | p[5]) == len - 40);
+			assert (tcp_sum (p, len) == 0);
+			pkts[n++] = pkts[i];
+		}
+		if (n > 0)
+			return n;
+	}
+}
+
+
+int main (void)
+{
+	openlog ("libtun6-batch", LOG_PERROR, LOG_USER);
+
+	tun6 *t = tun6_create (NULL);
+	if (t == NULL)
+		return 77; /* not privileged */
+
+	if (tun6_setOffload (t, true))
+		perror ("Offloading not supported");
+	if (tun6_setMTU (t, 1280) || tun6_bringUp (t)
+	 || tun6_addAddress (t, &local, 64))
+	{
+		tun6_destroy (t);
+		return 77;
+	}
+
+	alarm (10);
+
+	int fd = socket (AF_INET6, SOCK_STREAM, 0);
+	assert (fd != -1);
+	fcntl (fd, F_SETFL, O_NONBLOCK);
+
+	struct sockaddr_in6 addr =
+	{
+		.sin6_family = AF_INET6,
+		.sin6_addr = remote,
+		.sin6_port = htons (9),
+	};
+	int val = connect (fd, (struct sockaddr *)&addr, sizeof (addr));
+	assert ((val == -1) && (errno == EINPROGRESS));
+
+	/* Completes the 3-way handshake on behalf of the remote peer */
+	struct iovec pkts[64];
+	const uint8_t *syn;
+	do
+	{
+		recv_tcp (t, pkts, 1);
+		syn = pkts[0].iov_base;
+	}
+	while (!(syn[40 + 13] & 0x02));
+
+	uint8_t synack[64] = { 0x60 };
+	const uint32_t iss = 0x12345678;
+
+	synack[5] = 24;
+	synack[6] = IPPROTO_TCP;
+	synack[7] = 64;
+	memcpy (synack + 8, syn + 24, 16);
+	memcpy (synack + 24, syn + 8, 16);
+	memcpy (synack + 40, syn + 42, 2);
+	memcpy (synack + 42, syn + 40, 2);
+	put32 (synack + 44, iss);
+	put32 (synack + 48, get32 (syn + 44) + 1);
+	synack[52] = 6 << 4; /* header length: 24 bytes */
+	synack[53] = 0x12; /* SYN, ACK */
+	synack[54] = synack[55] = 0xff; /* window */
+	synack[60] = 2; /* MSS option */
+	synack[61] = 4;
+	synack[62] = 1220 >> 8;
+	synack[63] = 1220 & 0xff;
+	uint16_t sum = tcp_sum (synack, sizeof (synack));
+	synack[56] = sum >> 8;
+	synack[57] = sum;
+
+	const uint32_t isn = get32 (syn + 44) + 1;
+	val = tun6_send (t, synack, sizeof (synack));
+	assert (val == sizeof (synack));
+
+	/* Sends a burst of data, likely to be handed as a super-packet */
+	static uint8_t data[12000];
+	for (size_t i = 0; i < sizeof (data); i++)
+		data[i] = i * 7;
+
+	fcntl (fd, F_SETFL, 0);
+	val = send (fd, data, sizeof (data), 0);
+	assert (val == (int)sizeof (data));
+
+	size_t got = 0;
+	while (got < sizeof (data))
+	{
+		unsigned n = recv_tcp (t, pkts, 64);
+
+		for (unsigned i = 0; i < n; i++)
+		{
+			const uint8_t *p = pkts[i].iov_base;
+			size_t hlen = 40 + 4 * (p[52] >> 4);
+			size_t plen = pkts[i].iov_len - hlen;
+
+			if (plen == 0)
+				continue; /* pure ACK */
+			if (get32 (p + 44) - isn != got)
+				continue; /* retransmission */
+
+			assert (got + plen <= sizeof (data));
+			assert (memcmp (p + hlen, data + got, plen) == 0);
+			got += plen;
+		}
+	}
+
+	close (fd);
+	tun6_destroy (t);
+	return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * test_config.c - Libtun6 interface configuration test
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include "tun6.h"
+
+static const struct in6_addr local =
+	{ { { 0xfd, 0x6e, 0x6c, 0x8f, 0xb3, 0xd2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 } } };
+static const struct in6_addr prefix =
+	{ { { 0xfd, 0x6e, 0x6c, 0x8f, 0xb3, 0xd3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } } };
+
+static bool has_address (const char *ifname)
+{
+	struct ifaddrs *ifap;
+	bool found = false;
+
+	assert (getifaddrs (&ifap) == 0);
+	for (struct ifaddrs *ifa = ifap; ifa != NULL; ifa = ifa->ifa_next)
+		if ((ifa->ifa_addr != NULL) && (ifa->ifa_addr->sa_family == AF_INET6)
+		 && !strcmp (ifa->ifa_name, ifname)
+		 && !memcmp (&((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr,
+		             &local, sizeof (local)))
+			found = true;
+	freeifaddrs (ifap);
+	return found;
+}
+
+
+int main (void)
+{
+	openlog ("libtun6-config", LOG_PERROR, LOG_USER);
+
+	tun6 *t = tun6_create (NULL);
+	if (t == NULL)
+		return 77; /* not privileged */
+
+	const struct tun6_address addrs[] = {
+		{ &local, 64 },
+	};
+	const struct tun6_route routes[] = {
+		{ &prefix, 48, 0 },
+		{ &prefix, 64, -1 },
+	};
+	struct tun6_config cfg = { 1279, addrs, 1, routes, 2 };
+
+	/* Invalid parameters */
+	assert (tun6_configure (t, &cfg) == -1);
+	cfg.mtu = 1400;
+	cfg.naddrs = 0;
+	cfg.addrs = NULL;
+	cfg.nroutes = 0;
+	assert (tun6_configure (t, &cfg) == 0);
+	cfg.addrs = addrs;
+	cfg.naddrs = 1;
+	cfg.nroutes = 2;
+
+	if (tun6_configure (t, &cfg))
+	{
+		tun6_destroy (t);
+		return 77;
+	}
+	/* Applying the same configuration again must not fail */
+	assert (tun6_configure (t, &cfg) == 0);
+
+	int fd = socket (AF_INET6, SOCK_DGRAM, 0);
+	assert (fd != -1);
+
+	struct ifreq req;
+	memset (&req, 0, sizeof (req));
+	assert (if_indextoname (tun6_getId (t), req.ifr_name) != NULL);
+	assert (ioctl (fd, SIOCGIFMTU, &req) == 0);
+	assert (req.ifr_mtu == 1400);
+	assert (ioctl (fd, SIOCGIFFLAGS, &req) == 0);
+	assert (req.ifr_flags & IFF_UP);
+	assert (req.ifr_flags & IFF_NOARP);
+	assert (!(req.ifr_flags & IFF_MULTICAST));
+	assert (has_address (req.ifr_name));
+
+	/* The route goes through the tunnel */
+	struct sockaddr_in6 addr =
+	{
+		.sin6_family = AF_INET6,
+		.sin6_addr = prefix,
+		.sin6_port = htons (9),
+	};
+	addr.sin6_addr.s6_addr[15] = 1;
+	assert (connect (fd, (struct sockaddr *)&addr, sizeof (addr)) == 0);
+	close (fd);
+
+	/* Removes the configuration, twice */
+	int id = tun6_getId (t);
+	assert (tun6_configureIndex (id, false, &cfg) == 0);
+	assert (!has_address (req.ifr_name));
+	assert (tun6_configureIndex (id, false, &cfg) == 0);
+	assert (tun6_configureIndex (id, true, &cfg) == 0);
+	assert (has_address (req.ifr_name));
+
+	tun6_destroy (t);
+	return 0;
+}
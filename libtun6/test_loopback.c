@@ -0,0 +1,130 @@
+/*
+ * test_loopback.c - Libtun6 loopback tunnel test
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "tun6.h"
+
+static uint8_t buf[4 * 65536] __attribute__ ((aligned (8)));
+
+static bool readable (int fd)
+{
+	struct pollfd ufd = { .fd = fd, .events = POLLIN };
+	return poll (&ufd, 1, 0) == 1;
+}
+
+int main (void)
+{
+	uint8_t pkt[1280], out[2048];
+	struct iovec pkts[16];
+	fd_set set;
+
+	assert (tun6_create_loopback (1024) == NULL);
+
+	tun6 *t = tun6_create_loopback (3 * 65536);
+	assert (t != NULL);
+
+	/* Configuration is a no-op */
+	static const struct in6_addr addr = { { { 0xfd, [15] = 1 } } };
+	assert (tun6_getId (t) != 0);
+	assert (tun6_setMTU (t, 1280) == 0);
+	assert (tun6_setMTU (t, 1279) == -1);
+	assert (tun6_bringUp (t) == 0);
+	assert (tun6_addAddress (t, &addr, 64) == 0);
+	assert (tun6_addRoute (t, &addr, 64, 0) == 0);
+	assert (tun6_openQueue (t) == NULL);
+
+	/* Nothing pending */
+	FD_ZERO (&set);
+	int fd = tun6_registerReadSet (t, &set);
+	assert (fd >= 0);
+	assert (!readable (fd));
+	assert ((tun6_recv (t, &set, buf, sizeof (buf)) == -1)
+	     && (errno == EAGAIN));
+	assert ((tun6_loopback_drain (t, out, sizeof (out)) == -1)
+	     && (errno == EAGAIN));
+
+	/* Host to tunnel */
+	for (unsigned i = 0; i < sizeof (pkt); i++)
+		pkt[i] = i;
+	assert (tun6_loopback_inject (t, pkt, 100) == 0);
+	assert (tun6_loopback_inject (t, pkt, 1280) == 0);
+	assert (tun6_loopback_inject (t, pkt, 1) == 0);
+	assert (readable (fd));
+	assert (tun6_wait_recv (t, buf, sizeof (buf)) == 100);
+	assert (memcmp (buf, pkt, 100) == 0);
+	assert (tun6_recv_batch (t, buf, sizeof (buf), pkts, 16) == 2);
+	assert ((pkts[0].iov_len == 1280) && (pkts[1].iov_len == 1));
+	assert (memcmp (pkts[0].iov_base, pkt, 1280) == 0);
+	assert (((uintptr_t)pkts[1].iov_base & 7) == 0);
+	assert (!readable (fd));
+
+	/* Tunnel to host */
+	assert (tun6_loopback_fd (t) != -1);
+	assert (!readable (tun6_loopback_fd (t)));
+	assert (tun6_send (t, pkt, 200) == 200);
+	pkts[0].iov_base = pkt;
+	pkts[0].iov_len = 1280;
+	pkts[1].iov_base = pkt + 1;
+	pkts[1].iov_len = 40;
+	assert (tun6_send_batch (t, pkts, 2) == 2);
+	assert (readable (tun6_loopback_fd (t)));
+	assert (tun6_loopback_drain (t, out, sizeof (out)) == 200);
+	assert (tun6_loopback_drain (t, out, 1000) == 1000); /* truncated */
+	assert (memcmp (out, pkt, 1000) == 0);
+	assert (tun6_loopback_drain (t, out, sizeof (out)) == 40);
+	assert (memcmp (out, pkt + 1, 40) == 0);
+	assert (!readable (tun6_loopback_fd (t)));
+
+	/* Full queue, then wrap-around */
+	unsigned n = 0;
+	while (tun6_loopback_inject (t, pkt, sizeof (pkt)) == 0)
+		n++;
+	assert (errno == ENOBUFS);
+	assert ((n > 100) && (n <= 3 * 65536 / sizeof (pkt)));
+	unsigned rounds = 4 * n;
+	for (unsigned i = 0; i < rounds; i++)
+	{
+		pkt[0] = i;
+		assert (tun6_wait_recv (t, buf, sizeof (buf)) == sizeof (pkt));
+		assert (tun6_loopback_inject (t, pkt, sizeof (pkt)) == 0);
+	}
+	while (n-- > 0)
+		assert (tun6_wait_recv (t, buf, sizeof (buf)) == sizeof (pkt));
+	assert (buf[0] == (uint8_t)(rounds - 1));
+	assert (!readable (fd));
+
+	tun6_destroy (t);
+	return 0;
+}
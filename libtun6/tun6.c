@@ -38,6 +38,8 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <sys/uio.h> // readv() & writev()
+#include <poll.h>
+#include <pthread.h>
 #include <syslog.h>
 #include <errno.h>
 #include <netinet/in.h> // htons(), struct in6_addr
@@ -54,6 +56,7 @@ const char os_driver[] = "Linux";
 # define USE_LINUX 1
 
 # include <linux/if_tun.h> // TUNSETIFF - Linux tunnel driver
+# include <linux/virtio_net.h> // struct virtio_net_hdr
 /*
  * <linux/ipv6.h> conflicts with <netinet/in.h> and <arpa/inet.h>,
  * so we've got to declare this structure by hand.
@@ -66,6 +69,8 @@ struct in6_ifreq {
 
 # include <net/route.h> // struct in6_rtmsg
 # include <netinet/if_ether.h> // ETH_P_IPV6
+# include <linux/netlink.h>
+# include <linux/rtnetlink.h>
 
 typedef struct
 {
@@ -155,12 +160,51 @@ const char os_driver[] = "Generic";
 #define safe_strcpy( tgt, src ) \
 	((strlcpy (tgt, src, sizeof (tgt)) >= sizeof (tgt)) ? -1 : 0)
 
+#if defined (USE_LINUX) && defined (IFF_VNET_HDR)
+# define USE_VNET_HDR 1
+
+/* TCP super-packet being segmented by tun6_recv_batch() */
+struct tun6_gso
+{
+	size_t len; /* super-packet length */
+	size_t hlen; /* IPv6 and TCP headers length */
+	size_t off; /* offset of the next segment payload */
+	size_t thoff; /* TCP header offset */
+	size_t mss; /* segment payload size */
+	uint8_t data[40 + 65535]; /* IPv6 header and largest payload */
+};
+#endif
+
+/*
+ * In-memory packets queue of a loopback tunnel. Each packet is stored
+ * as a 32-bits length followed by the packet, padded to 32-bits.
+ */
+struct tun6_ring
+{
+	pthread_mutex_t lock;
+	int fd[2]; /* pipe, readable whenever the ring is not empty */
+	size_t head, tail; /* write and read offsets (bytes) */
+	size_t size; /* buffer size (bytes) */
+	uint8_t *buf;
+};
+
+struct tun6_loop
+{
+	struct tun6_ring rx; /* toward tun6_recv() */
+	struct tun6_ring tx; /* from tun6_send() */
+};
+
 struct tun6
 {
 	int  id, fd, reqfd;
 #if defined (USE_BSD)
 	char orig_name[IFNAMSIZ];
 #endif
+#ifdef USE_VNET_HDR
+	bool vnet; /* packets carry a virtio-net header */
+	struct tun6_gso *gso;
+#endif
+	struct tun6_loop *loop; /* loopback tunnel, or NULL */
 };
 
 /**
@@ -197,6 +241,12 @@ tun6 *tun6_create (const char *req_name)
 	struct ifreq req =
 	{
 		.ifr_flags = IFF_TUN
+# ifdef IFF_MULTI_QUEUE
+		             | IFF_MULTI_QUEUE /* see tun6_openQueue() */
+# endif
+# ifdef USE_VNET_HDR
+		             | IFF_VNET_HDR /* see tun6_setOffload() */
+# endif
 	};
 
 	if ((req_name != NULL) && safe_strcpy (req.ifr_name, req_name))
@@ -215,7 +265,22 @@ tun6 *tun6_create (const char *req_name)
 	}
 
 	// Allocates the tunneling virtual network interface
-	if (ioctl (fd, TUNSETIFF, (void *)&req))
+	int val = ioctl (fd, TUNSETIFF, (void *)&req);
+# ifdef USE_VNET_HDR
+	if (val && (errno == EINVAL))
+	{   /* Kernel without virtio-net headers support */
+		req.ifr_flags &= ~IFF_VNET_HDR;
+		val = ioctl (fd, TUNSETIFF, (void *)&req);
+	}
+# endif
+# ifdef IFF_MULTI_QUEUE
+	if (val && (errno == EINVAL))
+	{   /* Old kernel, or pre-existing single queue interface */
+		req.ifr_flags &= ~IFF_MULTI_QUEUE;
+		val = ioctl (fd, TUNSETIFF, (void *)&req);
+	}
+# endif
+	if (val)
 	{
 		syslog (LOG_ERR, _("Tunneling driver error (%s): %m"), "TUNSETIFF");
 		if (errno == EBUSY)
@@ -228,6 +293,11 @@ tun6 *tun6_create (const char *req_name)
 	int id = if_nametoindex (req.ifr_name);
 	if (id == 0)
 		goto error;
+# ifdef USE_VNET_HDR
+	t->vnet = (req.ifr_flags & IFF_VNET_HDR) != 0;
+# endif
+	/* see tun6_recv_batch() */
+	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
 #elif defined (USE_BSD)
 # ifdef HAVE_KLDLOAD
 	kldload ("if_tun");
@@ -418,6 +488,318 @@ error:
 }
 
 
+/**
+ * Opens an extra packets queue to a tunnel interface. Packets sent by the
+ * kernel through the interface are then spread across all queues, and each
+ * queue can be read from and written to independently. This is only
+ * supported by the Linux multi-queue tunneling driver.
+ *
+ * The returned handle shall only be used with tun6_recv(), tun6_wait_recv(),
+ * tun6_send(), tun6_registerReadSet() and tun6_destroy(). It must be
+ * destroyed before the tunnel itself, and must be opened while the process
+ * still has the privileges required to create the tunnel.
+ *
+ * @return NULL on error.
+ */
+tun6 *tun6_openQueue (const tun6 *t)
+{
+	assert (t != NULL);
+
+	if (t->loop != NULL)
+	{
+		errno = ENOSYS;
+		return NULL;
+	}
+	assert (t->reqfd != -1);
+
+#if defined (USE_LINUX) && defined (IFF_MULTI_QUEUE)
+	struct ifreq req =
+	{
+		.ifr_flags = IFF_TUN | IFF_MULTI_QUEUE
+	};
+# ifdef USE_VNET_HDR
+	if (t->vnet)
+		req.ifr_flags |= IFF_VNET_HDR;
+# endif
+
+	if (if_indextoname (t->id, req.ifr_name) == NULL)
+		return NULL;
+
+	tun6 *q = (tun6 *)malloc (sizeof (*q));
+	if (q == NULL)
+		return NULL;
+	memset (q, 0, sizeof (*q));
+
+	int fd = open ("/dev/net/tun", O_RDWR);
+	if (fd == -1)
+	{
+		free (q);
+		return NULL;
+	}
+
+	if (ioctl (fd, TUNSETIFF, (void *)&req))
+	{
+		syslog (LOG_ERR, _("Tunneling driver error (%s): %m"), "TUNSETIFF");
+		(void)close (fd);
+		free (q);
+		return NULL;
+	}
+
+	fcntl (fd, F_SETFD, FD_CLOEXEC);
+	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+	q->id = t->id;
+	q->fd = fd;
+	q->reqfd = -1;
+# ifdef USE_VNET_HDR
+	q->vnet = t->vnet;
+# endif
+	return q;
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+
+/*** In-memory loopback tunnel ***/
+static int tun6_ring_init (struct tun6_ring *r, size_t size)
+{
+	r->buf = malloc (size);
+	if (r->buf == NULL)
+		return -1;
+	if (pipe (r->fd))
+	{
+		free (r->buf);
+		return -1;
+	}
+
+	for (unsigned i = 0; i < 2; i++)
+	{
+		fcntl (r->fd[i], F_SETFD, FD_CLOEXEC);
+		fcntl (r->fd[i], F_SETFL, fcntl (r->fd[i], F_GETFL) | O_NONBLOCK);
+	}
+	pthread_mutex_init (&r->lock, NULL);
+	r->head = r->tail = 0;
+	r->size = size;
+	return 0;
+}
+
+
+static void tun6_ring_destroy (struct tun6_ring *r)
+{
+	pthread_mutex_destroy (&r->lock);
+	(void)close (r->fd[0]);
+	(void)close (r->fd[1]);
+	free (r->buf);
+}
+
+
+#define TUN6_RING_WRAP UINT32_MAX
+#define TUN6_RING_ALIGN( len ) (((len) + 3) & ~(size_t)3)
+
+/**
+ * Appends a packet to a ring.
+ * @return 0 on success, -1 if the ring is full.
+ */
+static int tun6_ring_push (struct tun6_ring *r, const struct iovec *iov,
+                           unsigned count)
+{
+	size_t len = 0;
+
+	for (unsigned i = 0; i < count; i++)
+		len += iov[i].iov_len;
+
+	size_t need = 4 + TUN6_RING_ALIGN (len);
+	int val = -1;
+
+	pthread_mutex_lock (&r->lock);
+
+	size_t used = r->head - r->tail, off = r->head % r->size;
+	size_t pad = (r->size - off < need) ? (r->size - off) : 0;
+
+	if (need + pad <= r->size - used)
+	{
+		if (pad > 0)
+		{   /* Not enough room at the end: wraps around */
+			memcpy (r->buf + off, &(uint32_t){ TUN6_RING_WRAP }, 4);
+			off = 0;
+		}
+
+		uint32_t hdr = len;
+		uint8_t *p = r->buf + off + 4;
+
+		memcpy (r->buf + off, &hdr, 4);
+		for (unsigned i = 0; i < count; i++)
+		{
+			memcpy (p, iov[i].iov_base, iov[i].iov_len);
+			p += iov[i].iov_len;
+		}
+
+		if (used == 0) /* wakes the reader up */
+			(void)write (r->fd[1], "", 1);
+		r->head += pad + need;
+		val = 0;
+	}
+	else
+		errno = ENOBUFS;
+
+	pthread_mutex_unlock (&r->lock);
+	return val;
+}
+
+
+/**
+ * Removes the oldest packet from a ring. The packet is truncated if the
+ * buffer is too small, like with a tunnel device.
+ * @return the number of bytes copied, or -1 if the ring is empty.
+ */
+static int tun6_ring_pop (struct tun6_ring *r, void *buf, size_t maxlen)
+{
+	int val = -1;
+
+	pthread_mutex_lock (&r->lock);
+	if (r->head != r->tail)
+	{
+		size_t off = r->tail % r->size;
+		uint32_t hdr;
+
+		memcpy (&hdr, r->buf + off, 4);
+		if (hdr == TUN6_RING_WRAP)
+		{
+			r->tail += r->size - off;
+			off = 0;
+			memcpy (&hdr, r->buf, 4);
+		}
+
+		val = (hdr < maxlen) ? hdr : maxlen;
+		memcpy (buf, r->buf + off + 4, val);
+		r->tail += 4 + TUN6_RING_ALIGN (hdr);
+
+		if (r->head == r->tail)
+		{
+			char dummy;
+			(void)read (r->fd[0], &dummy, 1);
+		}
+	}
+	else
+		errno = EAGAIN;
+	pthread_mutex_unlock (&r->lock);
+	return val;
+}
+
+
+/**
+ * Creates a tunnel that is not backed by any kernel device: packets
+ * injected with tun6_loopback_inject() are received with tun6_recv() and
+ * friends, while packets sent with tun6_send() and friends are retrieved
+ * with tun6_loopback_drain(). This requires no privileges, and is meant
+ * for testing and benchmarking.
+ *
+ * Configuration functions succeed without any effect on the system.
+ * The file descriptor of the tunnel is readable whenever a packet is
+ * pending. tun6_openQueue() and tun6_setOffload() are not supported.
+ *
+ * @param size capacity of each direction (bytes)
+ *
+ * @return NULL on error.
+ */
+tun6 *tun6_create_loopback (size_t size)
+{
+	if ((size < 65536 + 8) || (size > UINT32_MAX))
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	size &= ~(size_t)3;
+
+	tun6 *t = malloc (sizeof (*t));
+	if (t == NULL)
+		return NULL;
+	memset (t, 0, sizeof (*t));
+
+	struct tun6_loop *l = t->loop = malloc (sizeof (*l));
+	if (l == NULL)
+		goto error;
+	if (tun6_ring_init (&l->rx, size))
+		goto error;
+	if (tun6_ring_init (&l->tx, size))
+	{
+		tun6_ring_destroy (&l->rx);
+		goto error;
+	}
+
+	t->id = -1; /* no kernel interface */
+	t->fd = l->rx.fd[0];
+	t->reqfd = -1;
+	return t;
+
+error:
+	free (t->loop);
+	free (t);
+	return NULL;
+}
+
+
+/**
+ * Queues a packet toward the reader of a loopback tunnel, as if the
+ * system had routed it through the tunnel.
+ * Never blocks.
+ *
+ * @return 0 on success, -1 if the queue is full (ENOBUFS) or if the tunnel
+ * is not a loopback tunnel (EINVAL).
+ */
+int tun6_loopback_inject (tun6 *t, const void *packet, size_t len)
+{
+	assert (t != NULL);
+
+	if ((t->loop == NULL) || (len > 65535))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	const struct iovec iov = { (void *)packet, len };
+	return tun6_ring_push (&t->loop->rx, &iov, 1);
+}
+
+
+/**
+ * Dequeues a packet sent through a loopback tunnel.
+ * Never blocks.
+ *
+ * @param buf buffer to store the packet into (should be 65535 bytes)
+ * @param len buffer length in bytes
+ *
+ * @return the packet length (possibly truncated) on success, -1 if no
+ * packets are pending (EAGAIN) or if the tunnel is not a loopback tunnel
+ * (EINVAL).
+ */
+int tun6_loopback_drain (tun6 *t, void *buf, size_t len)
+{
+	assert (t != NULL);
+
+	if (t->loop == NULL)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	return tun6_ring_pop (&t->loop->tx, buf, len);
+}
+
+
+/**
+ * @return a file descriptor that is readable whenever packets sent
+ * through a loopback tunnel are pending, or -1 if the tunnel is not a
+ * loopback one.
+ */
+int tun6_loopback_fd (const tun6 *t)
+{
+	assert (t != NULL);
+
+	return (t->loop != NULL) ? t->loop->tx.fd[0] : -1;
+}
+
+
 /**
  * Removes a tunnel from the kernel.
  * BEWARE: if you fork, child processes must call tun6_destroy() too.
@@ -429,9 +811,28 @@ void tun6_destroy (tun6* t)
 {
 	assert (t != NULL);
 	assert (t->fd != -1);
-	assert (t->reqfd != -1);
 	assert (t->id != 0);
 
+	if (t->loop != NULL)
+	{
+		tun6_ring_destroy (&t->loop->rx);
+		tun6_ring_destroy (&t->loop->tx);
+		free (t->loop);
+		free (t);
+		return;
+	}
+
+#ifdef USE_VNET_HDR
+	free (t->gso);
+#endif
+
+	if (t->reqfd == -1)
+	{   /* Extra queue from tun6_openQueue() */
+		(void)close (t->fd);
+		free (t);
+		return;
+	}
+
 	(void)tun6_setState (t, false);
 
 #ifdef USE_BSD
@@ -470,7 +871,7 @@ void tun6_destroy (tun6* t)
  */
 
 /**
- * @return the scope id of the tunnel device
+ * @return the scope id of the tunnel device (-1 for a loopback tunnel)
  */
 int tun6_getId (const tun6 *t)
 {
@@ -501,21 +902,16 @@ proc_write_zero (const char *path)
 #endif
 
 
-/**
- * Brings a tunnel interface up or down.
- *
- * @return 0 on success, -1 on error (see errno).
- */
-int
-tun6_setState (tun6 *t, bool up)
+static int
+_iface_state (int reqfd, int id, bool up)
 {
-	assert (t != NULL);
-	assert (t-> id != 0);
+	assert (reqfd != -1);
+	assert (id != 0);
 
 	struct ifreq req;
 	memset (&req, 0, sizeof (req));	
-	if ((if_indextoname (t->id, req.ifr_name) == NULL)
-	 || ioctl (t->reqfd, SIOCGIFFLAGS, &req))
+	if ((if_indextoname (id, req.ifr_name) == NULL)
+	 || ioctl (reqfd, SIOCGIFFLAGS, &req))
 		return -1;
 
 	/* settings we want/don't want: */
@@ -527,14 +923,32 @@ tun6_setState (tun6 *t, bool up)
 		req.ifr_flags &= ~(IFF_UP | IFF_RUNNING);
 
 	/* Sets up the interface */
-	if ((if_indextoname (t->id, req.ifr_name) == NULL)
-	 || ioctl (t->reqfd, SIOCSIFFLAGS, &req))
+	if ((if_indextoname (id, req.ifr_name) == NULL)
+	 || ioctl (reqfd, SIOCSIFFLAGS, &req))
 		return -1;
 
 	return 0;
 }
 
 
+/**
+ * Brings a tunnel interface up or down.
+ *
+ * @return 0 on success, -1 on error (see errno).
+ */
+int
+tun6_setState (tun6 *t, bool up)
+{
+	assert (t != NULL);
+	assert (t-> id != 0);
+
+	if (t->loop != NULL)
+		return 0;
+
+	return _iface_state (t->reqfd, t->id, up);
+}
+
+
 #if defined (USE_BSD) || defined(USE_DARWIN)
 /**
  * Converts a prefix length to a netmask (used for the BSD routing)
@@ -791,6 +1205,9 @@ tun6_addAddress (tun6 *t, const struct in6_addr *addr, unsigned prefixlen)
 {
 	assert (t != NULL);
 
+	if (t->loop != NULL)
+		return 0;
+
 	int res = _iface_addr (t->reqfd, t->id, true, addr, prefixlen);
 
 #if defined (USE_LINUX)
@@ -832,6 +1249,9 @@ tun6_delAddress (tun6 *t, const struct in6_addr *addr, unsigned prefixlen)
 {
 	assert (t != NULL);
 
+	if (t->loop != NULL)
+		return 0;
+
 	return _iface_addr (t->reqfd, t->id, false, addr, prefixlen);
 }
 
@@ -852,6 +1272,8 @@ tun6_addRoute (tun6 *t, const struct in6_addr *addr, unsigned prefix_len,
 {
 	assert (t != NULL);
 
+	if (t->loop != NULL)
+		return 0;
 	return _iface_route (t->reqfd, t->id, true, addr, prefix_len, rel_metric);
 }
 
@@ -868,21 +1290,16 @@ tun6_delRoute (tun6 *t, const struct in6_addr *addr, unsigned prefix_len,
 {
 	assert (t != NULL);
 
+	if (t->loop != NULL)
+		return 0;
 	return _iface_route (t->reqfd, t->id, false, addr, prefix_len,
 	                     rel_metric);
 }
 
 
-/**
- * Defines the tunnel interface Max Transmission Unit (bytes).
- *
- * @return 0 on success, -1 in case of error.
- */
-int
-tun6_setMTU (tun6 *t, unsigned mtu)
+static int
+_iface_mtu (int reqfd, int id, unsigned mtu)
 {
-	assert (t != NULL);
-
 	if ((mtu < 1280) || (mtu > 65535))
 		return -1;
 
@@ -890,64 +1307,600 @@ tun6_setMTU (tun6 *t, unsigned mtu)
 	{
 		.ifr_mtu = mtu
 	};
-	if (if_indextoname (t->id, req.ifr_name) == NULL)
+	if (if_indextoname (id, req.ifr_name) == NULL)
 		return -1;
 
-	return ioctl (t->reqfd, SIOCSIFMTU, &req) ? -1 : 0;
+	return ioctl (reqfd, SIOCSIFMTU, &req) ? -1 : 0;
 }
 
 
 /**
- * Registers file descriptors in an fd_set for use with select().
- * If any of the file descriptors is out of range (>= FD_SETSIZE), it
- * will not be registered.
- *
- * @param readset a fd_set (with FD_SETSIZE no smaller than the default
- * libc value libtun6 was compiled with).
+ * Defines the tunnel interface Max Transmission Unit (bytes).
  *
- * @return the "biggest" file descriptor registered (useful as the
- * first parameter to select()). -1 if any of the file descriptors was
- * bigger than FD_SETSIZE - 1.
+ * @return 0 on success, -1 in case of error.
  */
 int
-tun6_registerReadSet (const tun6 *t, fd_set *readset)
+tun6_setMTU (tun6 *t, unsigned mtu)
 {
 	assert (t != NULL);
 
-	if (t->fd >= (int)FD_SETSIZE)
-		return -1;
-
-	FD_SET (t->fd, readset);
-	return t->fd;
+	if (t->loop != NULL)
+		return ((mtu < 1280) || (mtu > 65535)) ? -1 : 0;
+	return _iface_mtu (t->reqfd, t->id, mtu);
 }
 
 
-/**
- * Receives a packet from a tunnel device.
- * @param buffer address to store packet
- * @param maxlen buffer length in bytes (should be 65535)
+#if defined (USE_LINUX)
+/*
+ * Linux rtnetlink interface
+ */
+struct tun6_nlbuf
+{
+	size_t len;
+	unsigned count;
+	uint32_t seq;
+	union
+	{
+		struct nlmsghdr hdr;
+		uint8_t bytes[4096];
+	} u;
+};
+
+
+static struct nlmsghdr *
+nl_msg (struct tun6_nlbuf *b, uint16_t type, uint16_t flags,
+        const void *payload, size_t plen)
+{
+	struct nlmsghdr *h = (struct nlmsghdr *)(b->u.bytes + b->len);
+
+	if (b->len + NLMSG_SPACE (plen) > sizeof (b->u))
+		return NULL;
+
+	memset (h, 0, NLMSG_SPACE (plen));
+	h->nlmsg_len = NLMSG_LENGTH (plen);
+	h->nlmsg_type = type;
+	h->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	h->nlmsg_seq = b->seq + b->count++;
+	memcpy (NLMSG_DATA (h), payload, plen);
+	b->len += NLMSG_ALIGN (h->nlmsg_len);
+	return h;
+}
+
+
+static int
+nl_attr (struct tun6_nlbuf *b, struct nlmsghdr *h, uint16_t type,
+         const void *data, size_t len)
+{
+	struct rtattr *rta = (struct rtattr *)(((uint8_t *)h)
+	                                       + NLMSG_ALIGN (h->nlmsg_len));
+
+	if (b->len + RTA_SPACE (len) > sizeof (b->u))
+		return -1;
+
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH (len);
+	memcpy (RTA_DATA (rta), data, len);
+	h->nlmsg_len = NLMSG_ALIGN (h->nlmsg_len) + RTA_ALIGN (rta->rta_len);
+	b->len = ((uint8_t *)h - b->u.bytes) + NLMSG_ALIGN (h->nlmsg_len);
+	return 0;
+}
+
+
+/**
+ * Sends all queued requests at once, and collects the acknowledgements.
  *
- * This function will block if there is no input.
+ * @param tolerant whether to ignore missing addresses and routes errors
  *
- * @return the packet length on success, -1 if no packet were to be received.
+ * @return 0 if all requests succeeded, -1 otherwise (see errno).
  */
-static inline int
-tun6_recv_inner (int fd, void *buffer, size_t maxlen)
+static int
+nl_commit (struct tun6_nlbuf *b, bool tolerant)
 {
-	struct iovec vect[2];
+	int fd = socket (AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd == -1)
+		return -1;
+
+	struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+	int retval = -1, error = 0;
+
+	if (sendto (fd, b->u.bytes, b->len, 0, (struct sockaddr *)&kernel,
+	            sizeof (kernel)) != (ssize_t)b->len)
+		goto out;
+
+	for (unsigned acked = 0; acked < b->count;)
+	{
+		union
+		{
+			struct nlmsghdr hdr;
+			uint8_t bytes[8192];
+		} reply;
+
+		ssize_t len = recv (fd, &reply, sizeof (reply), 0);
+		if (len == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			goto out;
+		}
+
+		for (struct nlmsghdr *h = &reply.hdr; NLMSG_OK (h, (size_t)len);
+		     h = NLMSG_NEXT (h, len))
+		{
+			if ((h->nlmsg_type != NLMSG_ERROR)
+			 || (h->nlmsg_seq - b->seq >= b->count))
+				continue;
+
+			const struct nlmsgerr *err = NLMSG_DATA (h);
+			int val = -err->error;
+
+			if (tolerant && ((val == ESRCH) || (val == ENOENT)
+			              || (val == EADDRNOTAVAIL)))
+				val = 0;
+			if ((val != 0) && (error == 0))
+				error = val;
+			acked++;
+		}
+	}
+
+	if (error == 0)
+		retval = 0;
+	else
+		errno = error;
+out:
+	error = errno;
+	(void)close (fd);
+	errno = error;
+	return retval;
+}
+
+
+static int
+nl_link (struct tun6_nlbuf *b, int id, bool up, unsigned mtu)
+{
+	struct ifinfomsg ifi =
+	{
+		.ifi_family = AF_UNSPEC,
+		.ifi_index = id,
+		.ifi_flags = IFF_NOARP | (up ? (IFF_UP | IFF_RUNNING) : 0),
+		.ifi_change = IFF_NOARP | IFF_UP | IFF_RUNNING | IFF_MULTICAST
+		            | IFF_BROADCAST,
+	};
+	uint32_t val = mtu;
+
+	struct nlmsghdr *h = nl_msg (b, RTM_NEWLINK, 0, &ifi, sizeof (ifi));
+	if (h == NULL)
+		return -1;
+	return up ? nl_attr (b, h, IFLA_MTU, &val, sizeof (val)) : 0;
+}
+
+
+static int
+nl_addr (struct tun6_nlbuf *b, int id, bool add,
+         const struct tun6_address *a)
+{
+	struct ifaddrmsg ifa =
+	{
+		.ifa_family = AF_INET6,
+		.ifa_prefixlen = a->prefix_len,
+		.ifa_scope = RT_SCOPE_UNIVERSE,
+		.ifa_index = id,
+	};
+
+	struct nlmsghdr *h = nl_msg (b, add ? RTM_NEWADDR : RTM_DELADDR,
+	                             add ? (NLM_F_CREATE | NLM_F_REPLACE) : 0,
+	                             &ifa, sizeof (ifa));
+	if ((h == NULL) || nl_attr (b, h, IFA_LOCAL, a->addr, sizeof (*a->addr))
+	 || nl_attr (b, h, IFA_ADDRESS, a->addr, sizeof (*a->addr)))
+		return -1;
+	return 0;
+}
+
+
+static int
+nl_route (struct tun6_nlbuf *b, int id, bool add,
+          const struct tun6_route *r)
+{
+	struct rtmsg rtm =
+	{
+		.rtm_family = AF_INET6,
+		.rtm_dst_len = r->prefix_len,
+		.rtm_table = RT_TABLE_MAIN,
+		.rtm_protocol = RTPROT_BOOT,
+		.rtm_scope = RT_SCOPE_UNIVERSE,
+		.rtm_type = RTN_UNICAST,
+	};
+	/* Same default metric as the ioctl interface */
+	uint32_t metric = 1024 + r->relative_metric;
+	uint32_t oif = id;
+
+	struct nlmsghdr *h = nl_msg (b, add ? RTM_NEWROUTE : RTM_DELROUTE,
+	                             add ? (NLM_F_CREATE | NLM_F_REPLACE) : 0,
+	                             &rtm, sizeof (rtm));
+	if ((h == NULL)
+	 || nl_attr (b, h, RTA_DST, r->prefix, sizeof (*r->prefix))
+	 || nl_attr (b, h, RTA_OIF, &oif, sizeof (oif))
+	 || nl_attr (b, h, RTA_PRIORITY, &metric, sizeof (metric)))
+		return -1;
+	return 0;
+}
+
+
+static int
+nl_configure (int id, bool up, const struct tun6_config *cfg)
+{
+	/* The socket is private to this call: sequence numbers cannot clash */
+	struct tun6_nlbuf b = { .len = 0, .count = 0, .seq = 1 };
+
+	if (up && nl_link (&b, id, true, cfg->mtu))
+		goto toobig;
+	for (unsigned i = 0; i < cfg->naddrs; i++)
+		if (nl_addr (&b, id, up, cfg->addrs + i))
+			goto toobig;
+	for (unsigned i = 0; i < cfg->nroutes; i++)
+		if (nl_route (&b, id, up, cfg->routes + i))
+			goto toobig;
+	if (!up && nl_link (&b, id, false, 0))
+		goto toobig;
+
+	return nl_commit (&b, !up);
+
+toobig:
+	errno = ENOBUFS;
+	return -1;
+}
+#endif
+
+
+static int
+_iface_configure (int reqfd, int id, bool up, const struct tun6_config *cfg)
+{
+	assert (id != 0);
+	assert (cfg != NULL);
+	assert ((cfg->addrs != NULL) || (cfg->naddrs == 0));
+	assert ((cfg->routes != NULL) || (cfg->nroutes == 0));
+
+	if (up && ((cfg->mtu < 1280) || (cfg->mtu > 65535)))
+		return -1;
+	for (unsigned i = 0; i < cfg->naddrs; i++)
+		if ((cfg->addrs[i].addr == NULL) || (cfg->addrs[i].prefix_len > 128))
+			return -1;
+	for (unsigned i = 0; i < cfg->nroutes; i++)
+		if ((cfg->routes[i].prefix == NULL)
+		 || (cfg->routes[i].prefix_len > 128))
+			return -1;
+
+#if defined (USE_LINUX)
+	int res = nl_configure (id, up, cfg);
+	if ((res == 0) || (errno != EAFNOSUPPORT))
+	{
+		char ifname[IFNAMSIZ];
+
+		if ((res == 0) && up && (if_indextoname (id, ifname) != NULL))
+		{
+			/* Disable ICMPv6 Redirects. */
+			char proc_path[24 + IFNAMSIZ + 16 + 1];
+
+			snprintf (proc_path, sizeof (proc_path),
+			          "/proc/sys/net/ipv6/conf/%s/accept_redirects", ifname);
+			proc_write_zero (proc_path);
+		}
+		return res;
+	}
+	/* No rtnetlink (?!): falls back to ioctl() */
+#endif
+
+	int fd = reqfd;
+	if (fd == -1)
+	{
+		fd = socket (AF_INET6, SOCK_DGRAM, 0);
+		if (fd == -1)
+			return -1;
+	}
+
+	int retval = -1;
+
+	if (up)
+	{
+		if (_iface_mtu (fd, id, cfg->mtu) || _iface_state (fd, id, true))
+			goto out;
+		for (unsigned i = 0; i < cfg->naddrs; i++)
+			if (_iface_addr (fd, id, true, cfg->addrs[i].addr,
+			                 cfg->addrs[i].prefix_len))
+				goto out;
+		for (unsigned i = 0; i < cfg->nroutes; i++)
+			if (_iface_route (fd, id, true, cfg->routes[i].prefix,
+			                  cfg->routes[i].prefix_len,
+			                  cfg->routes[i].relative_metric))
+				goto out;
+	}
+	else
+	{
+		/* Best effort: some of these may be gone already */
+		for (unsigned i = 0; i < cfg->nroutes; i++)
+			_iface_route (fd, id, false, cfg->routes[i].prefix,
+			              cfg->routes[i].prefix_len,
+			              cfg->routes[i].relative_metric);
+		for (unsigned i = 0; i < cfg->naddrs; i++)
+			_iface_addr (fd, id, false, cfg->addrs[i].addr,
+			             cfg->addrs[i].prefix_len);
+		if (_iface_state (fd, id, false))
+			goto out;
+	}
+	retval = 0;
+out:
+	if (fd != reqfd)
+		(void)close (fd);
+	return retval;
+}
+
+
+/**
+ * Applies a whole tunnel interface configuration: sets the MTU, brings the
+ * interface up, adds addresses and inserts routes through the tunnel.
+ * On Linux, this is sent to the kernel as a single batch of rtnetlink
+ * requests, rather than one ioctl per setting.
+ * Requires CAP_NET_ADMIN or root privileges.
+ *
+ * @return 0 on success, -1 in case of error (see errno).
+ */
+int
+tun6_configure (tun6 *restrict t, const struct tun6_config *restrict cfg)
+{
+	assert (t != NULL);
+
+	if (t->loop != NULL)
+		return 0;
+	return _iface_configure (t->reqfd, t->id, true, cfg);
+}
+
+
+/**
+ * Applies or removes a whole interface configuration, like
+ * tun6_configure(), on an interface identified by its index. This is
+ * meant for processes that do not own the tunnel device, such as a
+ * privileged helper.
+ * Requires CAP_NET_ADMIN or root privileges.
+ *
+ * @param up true to apply the configuration, false to remove its
+ * addresses and routes (those that are already gone are ignored) and bring
+ * the interface down
+ *
+ * @return 0 on success, -1 in case of error (see errno).
+ */
+int
+tun6_configureIndex (int id, bool up, const struct tun6_config *cfg)
+{
+	return _iface_configure (-1, id, up, cfg);
+}
+
+
+/**
+ * Registers file descriptors in an fd_set for use with select().
+ * If any of the file descriptors is out of range (>= FD_SETSIZE), it
+ * will not be registered.
+ *
+ * @param readset a fd_set (with FD_SETSIZE no smaller than the default
+ * libc value libtun6 was compiled with).
+ *
+ * @return the "biggest" file descriptor registered (useful as the
+ * first parameter to select()). -1 if any of the file descriptors was
+ * bigger than FD_SETSIZE - 1.
+ */
+int
+tun6_registerReadSet (const tun6 *t, fd_set *readset)
+{
+	assert (t != NULL);
+
+	if (t->fd >= (int)FD_SETSIZE)
+		return -1;
+
+	FD_SET (t->fd, readset);
+	return t->fd;
+}
+
+
+#ifdef USE_VNET_HDR
+/**
+ * Computes the 16-bits one's complement sum of a buffer, in host byte
+ * order (not complemented, not folded).
+ */
+static uint32_t tun6_sum (const uint8_t *p, size_t len, uint32_t sum)
+{
+	for (; len >= 2; p += 2, len -= 2)
+		sum += (p[0] << 8) | p[1];
+	if (len > 0)
+		sum += p[0] << 8;
+	return sum;
+}
+
+
+static uint16_t tun6_cksum (uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+
+static inline void tun6_store16 (uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+
+/**
+ * Completes the transport checksum of a packet, which the kernel left
+ * partial, with only the pseudo-header sum in place.
+ * @return 0 on success, -1 if the packet is malformatted.
+ */
+static int tun6_complete_cksum (uint8_t *pkt, size_t len,
+                                const struct virtio_net_hdr *vh)
+{
+	size_t start = vh->csum_start, off = start + vh->csum_offset;
+
+	if ((start > len) || (off + 2 > len))
+		return -1;
+
+	uint16_t sum = tun6_cksum (tun6_sum (pkt + start, len - start, 0));
+	tun6_store16 (pkt + off, sum ? sum : 0xffff);
+	return 0;
+}
+
+
+/**
+ * Prepares a TCP super-packet for segmentation.
+ * @return 0 on success, -1 if the packet cannot be segmented.
+ */
+static int tun6_gso_start (struct tun6_gso *g, const uint8_t *pkt,
+                           size_t len, const struct virtio_net_hdr *vh)
+{
+	size_t thoff = vh->csum_start;
+
+	if (((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) != VIRTIO_NET_HDR_GSO_TCPV6)
+	 || (vh->gso_size == 0) || (thoff < 40) || (thoff + 20 > len)
+	 || (len > sizeof (g->data)))
+		return -1;
+
+	size_t hlen = thoff + 4 * (pkt[thoff + 12] >> 4);
+	if ((hlen < thoff + 20) || (hlen >= len))
+		return -1;
+
+	memcpy (g->data, pkt, len);
+	g->len = len;
+	g->thoff = thoff;
+	g->hlen = hlen;
+	g->off = hlen;
+	g->mss = vh->gso_size;
+	return 0;
+}
+
+
+/**
+ * Builds the next segment of a TCP super-packet.
+ * @param out buffer for the segment (at least hlen + mss bytes)
+ * @return segment length (bytes).
+ */
+static size_t tun6_gso_next (struct tun6_gso *g, uint8_t *out)
+{
+	size_t plen = g->len - g->off;
+	if (plen > g->mss)
+		plen = g->mss;
+
+	bool first = g->off == g->hlen, last = g->off + plen == g->len;
+	size_t len = g->hlen + plen;
+
+	memcpy (out, g->data, g->hlen);
+	memcpy (out + g->hlen, g->data + g->off, plen);
+	tun6_store16 (out + 4, len - 40); /* IPv6 payload length */
+
+	uint8_t *th = out + g->thoff;
+	uint32_t seq = (th[4] << 24) | (th[5] << 16) | (th[6] << 8) | th[7];
+
+	seq += g->off - g->hlen;
+	tun6_store16 (th + 4, seq >> 16);
+	tun6_store16 (th + 6, seq);
+	if (!last)
+		th[13] &= ~0x09; /* FIN, PSH */
+	if (!first)
+		th[13] &= ~0x80; /* CWR */
+
+	/* Pseudo-header, then TCP header and payload */
+	uint32_t sum = tun6_sum (out + 8, 32, (len - g->thoff) + IPPROTO_TCP);
+	th[16] = th[17] = 0;
+	tun6_store16 (th + 16, tun6_cksum (tun6_sum (th, len - g->thoff, sum)));
+
+	g->off += plen;
+	return len;
+}
+#endif
+
+
+/**
+ * Reads a packet from a tunnel device file descriptor, with its
+ * virtio-net header (if any).
+ *
+ * @return the packet length on success, -1 on error (including with
+ * errno zero if a non-IPv6 packet was discarded).
+ */
+static int
+tun6_read (const tun6 *t, void *buffer, size_t maxlen, void *vhdr)
+{
+	struct iovec vect[3];
 	tun_head_t head;
+	unsigned n = 0;
+	size_t hlen = sizeof (head);
+
+	vect[n].iov_base = (char *)&head;
+	vect[n++].iov_len = sizeof (head);
+#ifdef USE_VNET_HDR
+	if (t->vnet)
+	{
+		vect[n].iov_base = vhdr;
+		vect[n++].iov_len = sizeof (struct virtio_net_hdr);
+		hlen += sizeof (struct virtio_net_hdr);
+	}
+	else
+		memset (vhdr, 0, sizeof (struct virtio_net_hdr));
+#else
+	(void)vhdr;
+#endif
+	vect[n].iov_base = (char *)buffer;
+	vect[n++].iov_len = maxlen;
 
-	vect[0].iov_base = (char *)&head;
-	vect[0].iov_len = sizeof (head);
-	vect[1].iov_base = (char *)buffer;
-	vect[1].iov_len = maxlen;
+	int len;
 
-	int len = readv (fd, vect, 2);
-	if ((len < (int)sizeof (head))
-	 || !tun_head_is_ipv6 (head))
+	if (t->loop != NULL)
+		len = tun6_ring_pop (&t->loop->rx, buffer, maxlen);
+	else
+		len = readv (t->fd, vect, n);
+	if (len == -1)
+		return -1;
+	if (t->loop != NULL)
+		return len;
+	if ((len < (int)hlen) || !tun_head_is_ipv6 (head))
+	{
+		errno = 0;
 		return -1; /* only accept IPv6 packets */
+	}
+
+	return len - hlen;
+}
+
+
+/**
+ * Receives a packet from a tunnel device.
+ * @param buffer address to store packet
+ * @param maxlen buffer length in bytes (should be 65535)
+ *
+ * This function will block if there is no input.
+ *
+ * @return the packet length on success, -1 if no packet were to be received.
+ */
+static int
+tun6_recv_inner (tun6 *t, void *buffer, size_t maxlen)
+{
+#ifdef USE_VNET_HDR
+	struct virtio_net_hdr vh;
+#else
+	char vh;
+#endif
 
-	return len - sizeof (head);
+	int len = tun6_read (t, buffer, maxlen, &vh);
+#ifdef USE_VNET_HDR
+	if (len >= 0)
+	{
+		if (vh.gso_type != VIRTIO_NET_HDR_GSO_NONE)
+		{   /* see tun6_recv_batch() */
+			errno = EMSGSIZE;
+			return -1;
+		}
+		if ((vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+		 && tun6_complete_cksum (buffer, len, &vh))
+			return -1;
+	}
+#endif
+	return len;
 }
 
 
@@ -972,7 +1925,7 @@ tun6_recv (tun6 *t, const fd_set *readset, void *buffer, size_t maxlen)
 		errno = EAGAIN;
 		return -1;
 	}
-	return tun6_recv_inner (fd, buffer, maxlen);
+	return tun6_recv_inner (t, buffer, maxlen);
 }
 
 
@@ -988,7 +1941,113 @@ tun6_recv (tun6 *t, const fd_set *readset, void *buffer, size_t maxlen)
 int
 tun6_wait_recv (tun6 *t, void *buffer, size_t maxlen)
 {
-	return tun6_recv_inner (t->fd, buffer, maxlen);
+	for (;;)
+	{
+		int val = tun6_recv_inner (t, buffer, maxlen);
+		if ((val != -1) || (errno != EAGAIN))
+			return val;
+
+		/* The file descriptor is non-blocking on some systems */
+		poll (&(struct pollfd){ .fd = t->fd, .events = POLLIN }, 1, -1);
+	}
+}
+
+
+/**
+ * Waits for at least one packet, and receives as many packets as are
+ * readily available, up to a limit. On Linux, once tun6_setOffload() was
+ * called, TCP super-packets from the kernel are split into segments that
+ * fit the tunnel MTU.
+ *
+ * @param buf buffer to store packets into (should be at least 65535 bytes;
+ * a few times as much lets more packets be received at once)
+ * @param len buffer length in bytes
+ * @param pkts [OUT] received packets (pointing into the buffer)
+ * @param count maximum number of packets to receive
+ *
+ * This function will block until a packet arrives or an error occurs.
+ *
+ * @return the number of received packets, -1 on error.
+ */
+/* Packets are stored 8-bytes aligned (if the buffer is) */
+#define TUN6_ALIGN( len ) (((len) + 7) & ~(size_t)7)
+
+int
+tun6_recv_batch (tun6 *restrict t, void *restrict buf, size_t len,
+                 struct iovec *restrict pkts, unsigned count)
+{
+	assert (t != NULL);
+
+	uint8_t *ptr = buf;
+	unsigned n = 0;
+
+	while (n < count)
+	{
+		size_t room = len - (ptr - (uint8_t *)buf);
+#ifdef USE_VNET_HDR
+		struct tun6_gso *g = t->gso;
+
+		if ((g != NULL) && (g->off < g->len))
+		{   /* Splits pending super-packet */
+			if (room < g->hlen + g->mss)
+				break;
+
+			size_t plen = tun6_gso_next (g, ptr);
+			pkts[n].iov_base = ptr;
+			pkts[n++].iov_len = plen;
+			ptr += TUN6_ALIGN (plen);
+			continue;
+		}
+
+		struct virtio_net_hdr vh;
+#else
+		char vh;
+#endif
+
+		if (n > 0)
+		{
+#ifndef USE_LINUX
+			break; /* blocking file descriptor: do not wait again */
+#endif
+			if (room < 65535 + 8)
+				break;
+		}
+
+		int val = tun6_read (t, ptr, room, &vh);
+		if (val == -1)
+		{
+			if (errno == 0)
+				continue; /* non-IPv6 packet */
+			if (n > 0)
+				break;
+			if (errno == EAGAIN)
+			{
+				poll (&(struct pollfd){ .fd = t->fd, .events = POLLIN }, 1,
+				      -1);
+				continue;
+			}
+			return -1;
+		}
+
+#ifdef USE_VNET_HDR
+		if (vh.gso_type != VIRTIO_NET_HDR_GSO_NONE)
+		{
+			if (g == NULL)
+				g = t->gso = malloc (sizeof (*g));
+			if ((g != NULL) && tun6_gso_start (g, ptr, val, &vh))
+				g->len = 0; /* not segmentable: dropped */
+			continue;
+		}
+
+		if ((vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+		 && tun6_complete_cksum (ptr, val, &vh))
+			continue;
+#endif
+		pkts[n].iov_base = ptr;
+		pkts[n++].iov_len = val;
+		ptr += TUN6_ALIGN (val);
+	}
+	return n;
 }
 
 
@@ -1009,20 +2068,82 @@ tun6_send (tun6 *t, const void *packet, size_t len)
 		return -1;
 
 	tun_head_t head = TUN_HEAD_IPV6_INITIALIZER;
-	struct iovec vect[2];
-	vect[0].iov_base = (char *)&head;
-	vect[0].iov_len = sizeof (head);
-	vect[1].iov_base = (char *)packet; /* necessary cast to non-const */
-	vect[1].iov_len = len;
+	struct iovec vect[3];
+	unsigned n = 0;
+	size_t hlen = sizeof (head);
+
+	vect[n].iov_base = (char *)&head;
+	vect[n++].iov_len = sizeof (head);
+#ifdef USE_VNET_HDR
+	struct virtio_net_hdr vh = { .gso_type = VIRTIO_NET_HDR_GSO_NONE };
+	if (t->vnet)
+	{
+		vect[n].iov_base = (char *)&vh;
+		vect[n++].iov_len = sizeof (vh);
+		hlen += sizeof (vh);
+	}
+#endif
+	vect[n].iov_base = (char *)packet; /* necessary cast to non-const */
+	vect[n++].iov_len = len;
+
+	if (t->loop != NULL)
+		return tun6_ring_push (&t->loop->tx, vect + n - 1, 1) ? -1 : (int)len;
 
-	int val = writev (t->fd, vect, 2);
+	int val = writev (t->fd, vect, n);
 	if (val == -1)
 		return -1;
 
-	val -= sizeof (head);
+	val -= hlen;
 	if (val < 0)
 		return -1;
 
 	return val;
 }
 
+
+/**
+ * Sends several IPv6 packets.
+ * @param pkts packets (one contiguous buffer each)
+ * @param count number of packets
+ *
+ * @return the number of packets succesfully transmitted, -1 if none was.
+ */
+int
+tun6_send_batch (tun6 *restrict t, const struct iovec *restrict pkts,
+                 unsigned count)
+{
+	unsigned n = 0;
+
+	while ((n < count)
+	    && (tun6_send (t, pkts[n].iov_base, pkts[n].iov_len) >= 0))
+		n++;
+
+	return ((n > 0) || (count == 0)) ? (int)n : -1;
+}
+
+
+/**
+ * Lets the kernel hand TCP super-packets, and packets with incomplete
+ * checksums, to tun6_recv_batch() rather than segment and checksum them
+ * itself. This applies to the whole tunnel, including all its queues.
+ * Once enabled, tun6_recv() and tun6_wait_recv() drop super-packets.
+ *
+ * @return 0 on success, -1 on error (e.g. not supported by the system).
+ */
+int
+tun6_setOffload (tun6 *t, bool on)
+{
+	assert (t != NULL);
+
+#ifdef USE_VNET_HDR
+	if (t->vnet)
+	{
+		unsigned flags = on ? (TUN_F_CSUM | TUN_F_TSO6 | TUN_F_TSO_ECN) : 0;
+		return ioctl (t->fd, TUNSETOFFLOAD, flags) ? -1 : 0;
+	}
+#endif
+	if (!on)
+		return 0;
+	errno = ENOSYS;
+	return -1;
+}
@@ -74,6 +74,13 @@ int tun6_driver_diagnose (char *errbuf) LIBTUN6_NONNULL;
 
 tun6 *tun6_create (const char *req_name) LIBTUN6_WARN_UNUSED;
 void tun6_destroy (tun6 *t) LIBTUN6_NONNULL;
+tun6 *tun6_openQueue (const tun6 *t) LIBTUN6_NONNULL LIBTUN6_WARN_UNUSED;
+
+tun6 *tun6_create_loopback (size_t size) LIBTUN6_WARN_UNUSED;
+int tun6_loopback_inject (tun6 *t, const void *packet, size_t len)
+	LIBTUN6_NONNULL;
+int tun6_loopback_drain (tun6 *t, void *buf, size_t len) LIBTUN6_NONNULL;
+int tun6_loopback_fd (const tun6 *t) LIBTUN6_NONNULL LIBTUN6_PURE;
 
 int tun6_getId (const tun6 *t) LIBTUN6_NONNULL;
 
@@ -100,6 +107,33 @@ int tun6_addRoute (tun6 *restrict t, const struct in6_addr *restrict addr,
 int tun6_delRoute (tun6 *restrict t, const struct in6_addr *restrict addr,
                    unsigned prefix_len, int relative_metric) LIBTUN6_NONNULL;
 
+struct tun6_address
+{
+	const struct in6_addr *addr;
+	unsigned prefix_len;
+};
+
+struct tun6_route
+{
+	const struct in6_addr *prefix;
+	unsigned prefix_len;
+	int relative_metric;
+};
+
+struct tun6_config
+{
+	unsigned mtu;
+	const struct tun6_address *addrs;
+	unsigned naddrs;
+	const struct tun6_route *routes;
+	unsigned nroutes;
+};
+
+int tun6_configure (tun6 *restrict t, const struct tun6_config *restrict cfg)
+	LIBTUN6_NONNULL;
+int tun6_configureIndex (int id, bool up, const struct tun6_config *cfg)
+	LIBTUN6_NONNULL;
+
 int tun6_registerReadSet (const tun6 *restrict t, fd_set *restrict readset)
 	LIBTUN6_NONNULL LIBTUN6_PURE;
 
@@ -109,6 +143,14 @@ int tun6_wait_recv (tun6 *restrict t, void *buf, size_t len) LIBTUN6_NONNULL;
 int tun6_send (tun6 *restrict t, const void *packet, size_t len)
 	LIBTUN6_NONNULL;
 
+struct iovec;
+int tun6_setOffload (tun6 *t, bool on) LIBTUN6_NONNULL;
+int tun6_recv_batch (tun6 *restrict t, void *restrict buf, size_t len,
+                     struct iovec *restrict pkts, unsigned count)
+	LIBTUN6_NONNULL;
+int tun6_send_batch (tun6 *restrict t, const struct iovec *restrict pkts,
+                     unsigned count) LIBTUN6_NONNULL;
+
 # ifdef __cplusplus
 }
 # endif /* C++ */
@@ -103,6 +103,39 @@ static int miredo_checkconf (miredo_conf *conf)
 			fprintf (stderr, "%s\n", _("Server address not specified"));
 			res = -1;
 		}
+
+		val = miredo_conf_get (conf, "HookMode", &line);
+		if (val != NULL)
+		{
+			if (strcasecmp (val, "script") && strcasecmp (val, "builtin")
+			 && strcasecmp (val, "async"))
+			{
+				fprintf (stderr, _("Invalid hook mode \"%s\" at line %u"),
+				         val, line);
+				fputc ('\n', stderr);
+				res = -1;
+			}
+			free (val);
+		}
+
+		if (!miredo_conf_get_int16 (conf, "MaxRefreshInterval", &u16, NULL))
+			res = -1;
+
+		line = 0;
+		u16 = 0;
+		if (!miredo_conf_get_int16 (conf, "RelayCachePrefix", &u16, &line))
+			res = -1;
+		else if (u16 > 64)
+		{
+			fprintf (stderr, _("Invalid prefix length %u at line %u "
+			         "(must be at most 64)"), (unsigned)u16, line);
+			fputc ('\n', stderr);
+			res = -1;
+		}
+
+		val = miredo_conf_get (conf, "QualificationFile", NULL);
+		if (val != NULL)
+			free (val);
 #else
 		fprintf (stderr, "%s\n", _("Unsupported Teredo client mode"));
 		res = -1;
@@ -114,13 +147,156 @@ static int miredo_checkconf (miredo_conf *conf)
 		if (!miredo_conf_parse_teredo_prefix (conf, "Prefix", &pref)
 		 || !miredo_conf_get_int16 (conf, "InterfaceMTU", &u16, NULL))
 			res = -1;
+
+		val = miredo_conf_get (conf, "SharedPeers", NULL);
+		if (val != NULL)
+		{
+			if (val[0] != '/')
+			{
+				fprintf (stderr, _("Invalid shared memory name \"%s\""),
+				         val);
+				fputc ('\n', stderr);
+				res = -1;
+			}
+			free (val);
+		}
+
+		unsigned n = 0;
+		while ((val = miredo_conf_get (conf, "RelayInstance", &line)) != NULL)
+		{
+			if (strchr (val, ',') == NULL)
+			{
+				fprintf (stderr, _("Invalid relay instance at line %u"),
+				         line);
+				fputc ('\n', stderr);
+				res = -1;
+			}
+			free (val);
+			n++;
+		}
+		if (n >= 16)
+		{
+			fprintf (stderr, _("Too many relay instances %u "
+			         "(must be at most %u)\n"), n, 15);
+			res = -1;
+		}
 	}
 
+	u16 = 0;
 	if (!miredo_conf_parse_IPv4 (conf, "BindAddress", &u32)
 	 || !miredo_conf_get_int16 (conf, "BindPort", &u16, NULL))
 		res = -1;
 
-	char *str = miredo_conf_get (conf, "InterfaceName", NULL);
+	char *str = miredo_conf_get (conf, "DatapathInterface", NULL);
+	if (str != NULL)
+	{
+		if (u16 == 0)
+		{
+			fprintf (stderr, _("%s requires %s\n"), "DatapathInterface",
+			         "BindPort");
+			res = -1;
+		}
+		free (str);
+	}
+
+	u16 = 1;
+	if (!miredo_conf_get_int16 (conf, "Workers", &u16, NULL))
+		res = -1;
+	else
+	if ((u16 < 1) || (u16 > 64))
+	{
+		fprintf (stderr, _("Invalid workers count %u "
+		         "(must be between 1 and %u)\n"), (unsigned)u16, 64);
+		res = -1;
+	}
+
+	static const char *const roles[] = { "Packet", "Housekeeping" };
+	for (unsigned i = 0; i < sizeof (roles) / sizeof (roles[0]); i++)
+	{
+		char name[32];
+
+		snprintf (name, sizeof (name), "%sNUMANode", roles[i]);
+		if (!miredo_conf_get_int16 (conf, name, &u16, NULL))
+			res = -1;
+		u16 = 0;
+		snprintf (name, sizeof (name), "%sPriority", roles[i]);
+		if (!miredo_conf_get_int16 (conf, name, &u16, NULL))
+			res = -1;
+		else if (u16 > 99)
+		{
+			fprintf (stderr, _("Invalid %s threads priority %u "
+			         "(must be at most %u)\n"), roles[i], (unsigned)u16, 99);
+			res = -1;
+		}
+		snprintf (name, sizeof (name), "%sCPUs", roles[i]);
+		char *cpus = miredo_conf_get (conf, name, NULL);
+		if (cpus != NULL)
+			free (cpus);
+	}
+
+	u32 = 1;
+	if (!miredo_conf_get_int32 (conf, "MaxPeers", &u32, NULL))
+		res = -1;
+	else if (u32 == 0)
+	{
+		fputs (_("Invalid peers count 0 (must be at least 1)\n"), stderr);
+		res = -1;
+	}
+
+	u16 = 4;
+	if (!miredo_conf_get_int16 (conf, "MaxPeersMiB", &u16, NULL))
+		res = -1;
+	else if (u16 < 4)
+	{
+		fprintf (stderr, _("Invalid peers memory %u MiB (must be at least "
+		         "%u)\n"), (unsigned)u16, 4);
+		res = -1;
+	}
+
+	u16 = 1280;
+	if (!miredo_conf_get_int16 (conf, "MaxQueueBytes", &u16, NULL))
+		res = -1;
+	else if (u16 < 1280)
+	{
+		fprintf (stderr, _("Invalid queue size %u "
+		         "(must be at least %u)\n"), (unsigned)u16, 1280);
+		res = -1;
+	}
+
+	u16 = 0;
+	if (!miredo_conf_get_int16 (conf, "TunnelRingSize", &u16, NULL))
+		res = -1;
+	else if ((u16 != 0) && (u16 < 128))
+	{
+		fprintf (stderr, _("Invalid ring size %u KiB "
+		         "(must be at least %u)\n"), (unsigned)u16, 128);
+		res = -1;
+	}
+
+	u16 = 0;
+	if (!miredo_conf_get_int16 (conf, "IcmpRateLimitMs", &u16, NULL))
+		res = -1;
+	else if (u16 > 1000)
+	{
+		fprintf (stderr, _("Invalid ICMPv6 rate limit %u "
+		         "(must be at most %u)\n"), (unsigned)u16, 1000);
+		res = -1;
+	}
+
+	bool pmtud;
+	if (!miredo_conf_get_bool (conf, "PathMTUDiscovery", &pmtud, NULL))
+		res = -1;
+
+	str = miredo_conf_get (conf, "InterfaceName", NULL);
+	if (str != NULL)
+		free (str);
+	str = miredo_conf_get (conf, "StatsFile", NULL);
+	if (str != NULL)
+		free (str);
+	str = miredo_conf_get (conf, "PeersDumpFile", NULL);
+	if (str != NULL)
+		free (str);
+	str = miredo_conf_get (conf, "PeersFile", NULL);
 	if (str != NULL)
 		free (str);
 
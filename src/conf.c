@@ -301,6 +301,29 @@ bool miredo_conf_read_file (miredo_conf *conf, const char *path)
 }
 
 
+/* Parses a configuration file already loaded in memory.
+ *
+ * @return false on error, true on success.
+ */
+bool miredo_conf_read_buffer (miredo_conf *conf, const void *buf, size_t len)
+{
+	if (len == 0)
+		return true;
+
+	FILE *stream = fmemopen ((void *)buf, len, "r");
+	if (stream != NULL)
+	{
+		bool ret = miredo_conf_read_FILE (conf, stream);
+		fclose (stream);
+		return ret;
+	}
+
+	LogError (conf, _("Error reading configuration file: %s"),
+	          strerror (errno));
+	return false;
+}
+
+
 /**
  * Looks up an unsigned 16-bits integer. Returns false if the
  * setting was found but incorrectly formatted.
@@ -334,11 +357,44 @@ bool miredo_conf_get_int16 (miredo_conf *conf, const char *name,
 }
 
 
-#if 0
-/* This is supposedly bad for DSO (but we are not a DSO atm) */
-static const char *true_strings[] = { "yes", "true", "on", "enabled", NULL };
-static const char *false_strings[] =
-	{ "no", "false", "off", "disabled", NULL };
+/**
+ * Looks up an unsigned 32-bits integer. Returns false if the
+ * setting was found but incorrectly formatted.
+ *
+ * If the setting was not found value, returns true and leave
+ * *value unchanged.
+ */
+bool miredo_conf_get_int32 (miredo_conf *conf, const char *name,
+                            uint32_t *value, unsigned *line)
+{
+	char *val = miredo_conf_get (conf, name, line);
+
+	if (val == NULL)
+		return true;
+
+	char *end;
+	unsigned long long l;
+
+	errno = 0;
+	l = strtoull (val, &end, 0);
+
+	if ((*end) || (*val == '-') || (l > UINT32_MAX))
+	{
+		LogError (conf, _("Invalid integer value \"%s\" for %s: %s"),
+		          val, name, strerror (errno ? errno : EINVAL));
+		free (val);
+		return false;
+	}
+	*value = (uint32_t)l;
+	free (val);
+	return true;
+}
+
+
+/* Arrays of characters rather than of pointers: no relocations needed */
+static const char true_strings[][9] = { "yes", "true", "on", "enabled", "" };
+static const char false_strings[][9] =
+	{ "no", "false", "off", "disabled", "" };
 
 bool miredo_conf_get_bool (miredo_conf *conf, const char *name,
                            bool *value, unsigned *line)
@@ -363,7 +419,7 @@ bool miredo_conf_get_bool (miredo_conf *conf, const char *name,
 		}
 	}
 
-	for (const char **ptr = true_strings; *ptr != NULL; ptr++)
+	for (const char (*ptr)[9] = true_strings; **ptr; ptr++)
 		if (!strcasecmp (val, *ptr))
 		{
 			*value = true;
@@ -371,7 +427,7 @@ bool miredo_conf_get_bool (miredo_conf *conf, const char *name,
 			return true;
 		}
 
-	for (const char **ptr = false_strings; *ptr != NULL; ptr++)
+	for (const char (*ptr)[9] = false_strings; **ptr; ptr++)
 		if (!strcasecmp (val, *ptr))
 		{
 			*value = false;
@@ -383,7 +439,6 @@ bool miredo_conf_get_bool (miredo_conf *conf, const char *name,
 	free (val);
 	return false;
 }
-#endif
 
 /* Utilities function */
 
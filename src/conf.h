@@ -22,6 +22,7 @@
 #ifndef MIREDO_CONF_H
 
 # include <stdarg.h>
+# include <stddef.h>
 
 typedef void (*miredo_conf_logger) (void *, bool, const char *, va_list);
 struct in6_addr;
@@ -34,12 +35,15 @@ miredo_conf *miredo_conf_create (miredo_conf_logger logger, void *opaque);
 void miredo_conf_destroy (miredo_conf *conf);
 
 bool miredo_conf_read_file (miredo_conf *conf, const char *path);
+bool miredo_conf_read_buffer (miredo_conf *conf, const void *buf, size_t len);
 
 void miredo_conf_clear (miredo_conf *conf, int show);
 char *miredo_conf_get (miredo_conf *conf, const char *name, unsigned *line);
 
 bool miredo_conf_get_int16 (miredo_conf *conf, const char *name,
                             uint16_t *value, unsigned *line);
+bool miredo_conf_get_int32 (miredo_conf *conf, const char *name,
+                            uint32_t *value, unsigned *line);
 bool miredo_conf_get_bool (miredo_conf *conf, const char *name,
                            bool *value, unsigned *line);
 
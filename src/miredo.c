@@ -28,6 +28,7 @@
 
 #include <gettext.h>
 
+#include <stdio.h>
 #include <string.h> // memset(), strsignal()
 #include <stdlib.h> // exit()
 #include <inttypes.h>
@@ -42,6 +43,8 @@
 #include <syslog.h>
 #include <unistd.h> // uid_t
 #include <sys/wait.h> // waitpid()
+#include <fcntl.h> // open()
+#include <time.h>
 #ifdef HAVE_SYS_CAPABILITY_H
 # include <sys/capability.h>
 #endif
@@ -155,6 +158,72 @@ static void logger (void *dummy, bool error, const char *fmt, va_list ap)
 }
 
 
+/*
+ * Hitless reload: on SIGHUP, the parent process sends the configuration file
+ * contents through a pipe to the (unprivileged, possibly chrooted) child
+ * process, then signals it. A 32-bits length in host byte order precedes the
+ * contents. The child applies what it can on the fly (see miredo_reload),
+ * and exits with MIREDO_RESTART to be restarted otherwise.
+ */
+#define MIREDO_RELOAD_MAX 32768
+
+static int reload_fd = -1;
+
+/**
+ * Sends the configuration file to the child process.
+ * @return 0 on success, -1 on error.
+ */
+static int miredo_reload_send (int fd, const char *path)
+{
+	char buf[sizeof (uint32_t) + MIREDO_RELOAD_MAX + 1];
+	FILE *stream = fopen (path, "r");
+	if (stream == NULL)
+	{
+		syslog (LOG_WARNING, _("Error (%s): %m"), path);
+		return -1;
+	}
+
+	size_t len = fread (buf + sizeof (uint32_t), 1, MIREDO_RELOAD_MAX + 1,
+	                    stream);
+	bool error = ferror (stream);
+	fclose (stream);
+	if (error || (len > MIREDO_RELOAD_MAX))
+		return -1;
+
+	uint32_t len32 = len;
+	memcpy (buf, &len32, sizeof (len32));
+	len += sizeof (len32);
+	/* Fits in the pipe buffer, so the child need not be reading */
+	return (write (fd, buf, len) == (ssize_t)len) ? 0 : -1;
+}
+
+
+/**
+ * Reads the configuration sent by the parent process on SIGHUP.
+ * @return a configuration (to be destroyed by the caller), or NULL if none.
+ */
+miredo_conf *miredo_reload_conf (void)
+{
+	static char buf[MIREDO_RELOAD_MAX];
+	uint32_t len;
+
+	/* The parent writes everything before signaling */
+	if ((reload_fd == -1)
+	 || (read (reload_fd, &len, sizeof (len)) != sizeof (len))
+	 || (len > sizeof (buf))
+	 || (read (reload_fd, buf, len) != (ssize_t)len))
+		return NULL;
+
+	miredo_conf *conf = miredo_conf_create (logger, NULL);
+	if ((conf != NULL) && !miredo_conf_read_buffer (conf, buf, len))
+	{
+		miredo_conf_destroy (conf);
+		conf = NULL;
+	}
+	return conf;
+}
+
+
 extern int
 miredo (const char *confpath, const char *server_name, int pidfd)
 {
@@ -177,6 +246,9 @@ miredo (const char *confpath, const char *server_name, int pidfd)
 	sigaddset (&set, SIGHUP);
 	reload_set = set;
 
+	/* Peers dump signal (forwarded to the child) */
+	sigaddset (&set, SIGUSR1);
+
 	/* No-op signal */
 	sigaddset (&set, SIGCHLD);
 
@@ -200,6 +272,10 @@ miredo (const char *confpath, const char *server_name, int pidfd)
 		openlog (miredo_name, LOG_PID | LOG_PERROR, facility);
 		syslog (LOG_INFO, _("Starting..."));
 
+		int pipefd[2] = { -1, -1 };
+		if (miredo_reload && pipe (pipefd))
+			pipefd[0] = pipefd[1] = -1;
+
 		// Starts the main miredo process
 		pid_t pid = fork ();
 
@@ -207,10 +283,22 @@ miredo (const char *confpath, const char *server_name, int pidfd)
 		{
 			case -1:
 				syslog (LOG_ALERT, _("Error (%s): %m"), "fork");
+				if (pipefd[0] != -1)
+				{
+					close (pipefd[0]);
+					close (pipefd[1]);
+				}
 				continue;
 
 			case 0:
 				close (pidfd);
+				if (pipefd[0] != -1)
+				{
+					close (pipefd[1]);
+					reload_fd = pipefd[0];
+					fcntl (reload_fd, F_SETFD, FD_CLOEXEC);
+					fcntl (reload_fd, F_SETFL, O_NONBLOCK);
+				}
 				retval = miredo_run (cnf, server_name);
 				miredo_conf_destroy (cnf);
 				closelog ();
@@ -219,6 +307,8 @@ miredo (const char *confpath, const char *server_name, int pidfd)
 
 			default:
 				miredo_conf_clear (cnf, 0);
+				if (pipefd[0] != -1)
+					close (pipefd[0]);
 		}
 
 		int status, signum;
@@ -231,6 +321,12 @@ miredo (const char *confpath, const char *server_name, int pidfd)
 			 && waitpid (pid, &status, WNOHANG) == pid)
 				break; /* child died */
 
+			if (signum == SIGUSR1)
+			{
+				kill (pid, SIGUSR1);
+				continue;
+			}
+
 			if (sigismember (&exit_set, signum))
 			{
 				syslog (LOG_NOTICE, _("Exiting on signal %d (%s)"),
@@ -243,6 +339,11 @@ miredo (const char *confpath, const char *server_name, int pidfd)
 				syslog (LOG_NOTICE,
 				        _("Reloading configuration on signal %d (%s)"),
 				        signum, strsignal (signum));
+				/* Lets the child apply the configuration if it can */
+				if ((pipefd[1] != -1)
+				 && (miredo_reload_send (pipefd[1], confpath) == 0)
+				 && (kill (pid, SIGHUP) == 0))
+					continue;
 				retval = 2;
 			}
 			else
@@ -256,11 +357,17 @@ miredo (const char *confpath, const char *server_name, int pidfd)
 		}
 
 		// At this point, the child process is gone.
+		if (pipefd[1] != -1)
+			close (pipefd[1]);
+
 		if (WIFEXITED (status))
 		{
 			status = WEXITSTATUS (status);
 			syslog (LOG_NOTICE, _("Child %d exited (code: %d)"),
 			        (int)pid, status);
+			if (status == -MIREDO_RESTART)
+				retval = 2;
+			else
 			if (status)
 				retval = 1;
 		}
@@ -287,8 +394,75 @@ miredo (const char *confpath, const char *server_name, int pidfd)
 }
 
 
+/**
+ * Opens the statistics file, if one is configured ("StatsFile"). This must
+ * be called before privileges are dropped.
+ * @return a file descriptor, or -1 if none.
+ */
+int miredo_stats_open (miredo_conf *conf)
+{
+	char *path = miredo_conf_get (conf, "StatsFile", NULL);
+	if (path == NULL)
+		return -1;
+
+	int fd = open (path, O_WRONLY | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0644);
+	if (fd == -1)
+		syslog (LOG_WARNING, _("Error (%s): %m"), path);
+	free (path);
+	return fd;
+}
+
+
+#define MIREDO_STATS_INTERVAL 10 // seconds
+
+/**
+ * Waits for any of the currently blocked signals. In the mean time, if
+ * stats_fd is not -1, statistics are written to it with dump() every
+ * MIREDO_STATS_INTERVAL seconds, and once more before returning.
+ * @return the caught signal number.
+ */
+int miredo_wait (int stats_fd, int (*dump) (int))
+{
+	sigset_t dummyset, set;
+	int signum;
+
+	/* changes nothing, only gets the current mask */
+	sigemptyset (&dummyset);
+	pthread_sigmask (SIG_BLOCK, &dummyset, &set);
+
+	if (stats_fd == -1)
+	{
+		while (sigwait (&set, &signum));
+		return signum;
+	}
+
+	bool failed = false;
+	for (;;)
+	{
+		if (dump (stats_fd) && !failed)
+		{
+			syslog (LOG_WARNING, _("Error (%s): %m"), "StatsFile");
+			failed = true;
+		}
+#ifdef HAVE_SIGTIMEDWAIT
+		struct timespec ts = { .tv_sec = MIREDO_STATS_INTERVAL };
+
+		signum = sigtimedwait (&set, NULL, &ts);
+		if (signum != -1)
+			break;
+#else
+		while (sigwait (&set, &signum));
+		break;
+#endif
+	}
+	dump (stats_fd);
+	return signum;
+}
+
+
 int (*miredo_diagnose) (void);
 int (*miredo_run) (miredo_conf *conf, const char *server);
+bool miredo_reload = false;
 
 const char *miredo_name;
 
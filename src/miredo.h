@@ -33,6 +33,9 @@
 #  define LIBTEREDO_NORETURN
 # endif
 
+/* Upper bound for the "Workers" configuration option */
+# define MIREDO_MAX_WORKERS 64
+
 typedef struct miredo_conf miredo_conf;
 
 # ifdef __cplusplus
@@ -47,6 +50,10 @@ int drop_privileges (void);
 bool miredo_nosigpipe (int fd);
 bool miredo_send (int fd, const void *buffer, int length);
 bool miredo_recv (int fd, void *buffer, int length);
+int miredo_stats_open (miredo_conf *conf);
+int miredo_threads_setup (miredo_conf *conf);
+int miredo_wait (int stats_fd, int (*dump) (int));
+miredo_conf *miredo_reload_conf (void);
 
 # ifdef __cplusplus
 }
@@ -54,6 +61,10 @@ bool miredo_recv (int fd, void *buffer, int length);
 
 extern int (*miredo_diagnose) (void);
 extern int (*miredo_run) (miredo_conf *conf, const char *server);
+extern bool miredo_reload;
+
+/* miredo_run() return value requesting a restart, e.g. on reload */
+# define MIREDO_RESTART (-3)
 
 # include <sys/types.h> // uid_t
 
@@ -0,0 +1,438 @@
+/*
+ * peers.c - Dumps the Teredo peers of a running Miredo relay
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <gettext.h>
+#include <locale.h>
+#include "binreloc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include "miredo.h"
+#include "conf.h"
+
+#ifdef HAVE_GETOPT_H
+# include <getopt.h>
+#endif
+
+static const char conffile[] = SYSCONFDIR"/miredo/miredo.conf";
+static const char pidfile[] = LOCALSTATEDIR"/run/miredo.pid";
+
+#define PEERS_TRAILER "# end:"
+
+static void logger (void *opaque, bool error, const char *fmt, va_list ap)
+{
+	(void)opaque;
+	(void)error;
+
+	vfprintf (stderr, fmt, ap);
+	fputc ('\n', stderr);
+}
+
+
+/**
+ * Gets the peers dump file path from the Miredo configuration.
+ * @return a heap-allocated path, or NULL if none.
+ */
+static char *dump_path (const char *filename)
+{
+	miredo_conf *conf = miredo_conf_create (logger, NULL);
+	if (conf == NULL)
+		return NULL;
+
+	char *path = NULL;
+	if (miredo_conf_read_file (conf, filename))
+		path = miredo_conf_get (conf, "PeersDumpFile", NULL);
+	miredo_conf_destroy (conf);
+
+	if (path == NULL)
+		fprintf (stderr, _("%s: no PeersDumpFile directive\n"), filename);
+	return path;
+}
+
+
+/**
+ * Checks whether a dump file is complete, i.e. ends with the trailer.
+ */
+static bool dump_complete (int fd)
+{
+	char buf[64];
+	struct stat st;
+
+	if (fstat (fd, &st) || (st.st_size < (off_t)sizeof (PEERS_TRAILER)))
+		return false;
+
+	off_t off = st.st_size - (off_t)(sizeof (buf) - 1);
+	if (off < 0)
+		off = 0;
+
+	ssize_t len = pread (fd, buf, sizeof (buf) - 1, off);
+	if (len <= 0)
+		return false;
+	buf[len] = '\0';
+
+	char *last = strstr (buf, PEERS_TRAILER);
+	return (last != NULL) && (strchr (last, '\n') != NULL);
+}
+
+
+/**
+ * Asks the daemon for a new dump, and waits until it is written.
+ * @return 0 on success, -1 on error.
+ */
+static int dump_request (int fd, const char *pidpath, unsigned timeout)
+{
+	FILE *stream = fopen (pidpath, "re");
+	int pid;
+
+	if (stream == NULL)
+	{
+		perror (pidpath);
+		return -1;
+	}
+	if (fscanf (stream, "%d", &pid) != 1)
+		pid = 0;
+	fclose (stream);
+	if (pid <= 0)
+	{
+		fprintf (stderr, _("%s: invalid PID file\n"), pidpath);
+		return -1;
+	}
+
+	struct stat before;
+	if (fstat (fd, &before))
+		return -1;
+
+	if (kill (pid, SIGUSR1))
+	{
+		perror ("kill");
+		return -1;
+	}
+
+	/* The dump is complete once modified and terminated by the trailer */
+	for (unsigned ms = 0; ms < timeout * 1000; ms += 50)
+	{
+		struct stat st;
+		struct timespec delay = { 0, 50000000 };
+
+		nanosleep (&delay, NULL);
+		if (fstat (fd, &st))
+			return -1;
+		if (((st.st_mtim.tv_sec != before.st_mtim.tv_sec)
+		  || (st.st_mtim.tv_nsec != before.st_mtim.tv_nsec)
+		  || (st.st_size != before.st_size))
+		 && dump_complete (fd))
+			return 0;
+	}
+
+	fprintf (stderr, _("Timed out waiting for the peers dump\n"));
+	return -1;
+}
+
+
+#define SHARDS_MAX 256
+
+struct peers_summary
+{
+	unsigned total, trusted, probation, untrusted, stuck;
+	unsigned gens[3]; /* recent, old, expired */
+	unsigned fresh, idle, stale; /* by reception age */
+	unsigned queued_peers;
+	uint64_t queued, queued_bytes;
+	unsigned nshards; /* from the dump trailer */
+	unsigned shards[SHARDS_MAX];
+};
+
+
+struct peer_line
+{
+	char addr[46], mapping[22], state[10], gen[8];
+	uint32_t rx_age, tx_age;
+	unsigned bubbles, pings, queued, shard;
+	uint32_t queued_bytes;
+};
+
+/**
+ * Peers that are not trusted yet but have packets or probes in flight are
+ * waiting for a bubble or ping round trip that might never come.
+ */
+static bool peer_stuck (const struct peer_line *p)
+{
+	return strcmp (p->state, "trusted")
+	    && ((p->queued > 0) || (p->bubbles > 0) || (p->pings > 0));
+}
+
+
+static void summary_add (struct peers_summary *s, const struct peer_line *p)
+{
+	static const char *const gens[3] = { "recent", "old", "expired" };
+
+	s->total++;
+	if (strcmp (p->state, "trusted") == 0)
+		s->trusted++;
+	else
+	if (strcmp (p->state, "probation") == 0)
+		s->probation++;
+	else
+		s->untrusted++;
+	if (peer_stuck (p))
+		s->stuck++;
+
+	for (unsigned i = 0; i < 3; i++)
+		if (strcmp (p->gen, gens[i]) == 0)
+			s->gens[i]++;
+
+	if (p->rx_age < 5)
+		s->fresh++;
+	else
+	if (p->rx_age <= 30)
+		s->idle++;
+	else
+		s->stale++;
+
+	if (p->queued > 0)
+	{
+		s->queued_peers++;
+		s->queued += p->queued;
+		s->queued_bytes += p->queued_bytes;
+	}
+	if (p->shard < SHARDS_MAX)
+		s->shards[p->shard]++;
+}
+
+
+static void summary_print (const struct peers_summary *s)
+{
+	printf (_("Peers:            %u\n"), s->total);
+	printf (_(" trusted:         %u\n"), s->trusted);
+	printf (_(" on probation:    %u\n"), s->probation);
+	printf (_(" untrusted:       %u\n"), s->untrusted);
+	printf (_(" stuck:           %u\n"), s->stuck);
+	printf (_("Generations:      %u recent, %u old, %u expired\n"),
+	        s->gens[0], s->gens[1], s->gens[2]);
+	printf (_("Last received:    %u < 5s, %u <= 30s, %u older\n"),
+	        s->fresh, s->idle, s->stale);
+	printf (_("Queues:           %u peers, %"PRIu64" packets, "
+	          "%"PRIu64" bytes\n"), s->queued_peers, s->queued,
+	        s->queued_bytes);
+
+	unsigned lo = UINT32_MAX, hi = 0;
+	for (unsigned i = 0; i < s->nshards; i++)
+	{
+		if (s->shards[i] < lo)
+			lo = s->shards[i];
+		if (s->shards[i] > hi)
+			hi = s->shards[i];
+	}
+	if (s->nshards > 0)
+		printf (_("Shards:           %u, with %u to %u peers\n"),
+		        s->nshards, lo, hi);
+}
+
+
+static int print_dump (FILE *stream, bool summary, bool stuck)
+{
+	struct peers_summary s;
+	char line[256];
+	bool complete = false;
+
+	memset (&s, 0, sizeof (s));
+	if (!summary)
+		printf ("%-39s %-21s %-9s %-7s %6s %6s %2s %2s %4s %6s\n",
+		        _("Address"), _("Mapping"), _("State"), _("Gen."),
+		        _("RX"), _("TX"), _("B"), _("P"), _("Q"), _("Bytes"));
+
+	while (fgets (line, sizeof (line), stream) != NULL)
+	{
+		struct peer_line p;
+
+		if (line[0] == '#')
+		{
+			unsigned peers;
+
+			if (sscanf (line, PEERS_TRAILER" %u peers, %u shards", &peers,
+			            &s.nshards) == 2)
+			{
+				if (s.nshards > SHARDS_MAX)
+					s.nshards = SHARDS_MAX;
+				complete = true;
+			}
+			continue;
+		}
+
+		if (sscanf (line, "%45s %21s %9s %7s %"SCNu32" %"SCNu32" %u %u %u %"
+		            SCNu32" %u", p.addr, p.mapping, p.state, p.gen,
+		            &p.rx_age, &p.tx_age, &p.bubbles, &p.pings, &p.queued,
+		            &p.queued_bytes, &p.shard) != 11)
+		{
+			fprintf (stderr, _("Invalid peers dump line: %s"), line);
+			return -1;
+		}
+
+		summary_add (&s, &p);
+		if (summary || (stuck && !peer_stuck (&p)))
+			continue;
+
+		printf ("%-39s %-21s %-9s %-7s %6"PRIu32" %6"PRIu32" %2u %2u %4u %6"
+		        PRIu32"\n", p.addr, p.mapping, p.state, p.gen, p.rx_age,
+		        p.tx_age, p.bubbles, p.pings, p.queued, p.queued_bytes);
+	}
+
+	if (!complete)
+	{
+		fprintf (stderr, _("Incomplete peers dump\n"));
+		return -1;
+	}
+
+	if (summary)
+		summary_print (&s);
+	return 0;
+}
+
+
+static int usage (const char *path)
+{
+	printf (_(
+"Usage: %s [OPTIONS] [DUMP_FILE]\n"
+"Dumps the Teredo peers of a running Miredo relay.\n"
+"\n"
+"  -c, --config     Miredo configuration file (for PeersDumpFile)\n"
+"  -h, --help       display this help and exit\n"
+"  -n, --no-signal  read the current dump rather than requesting a new one\n"
+"  -p, --pidfile    PID file of the Miredo daemon\n"
+"  -s, --summary    only display the peers table composition\n"
+"  -S, --stuck      only list untrusted peers with packets or probes pending\n"
+"  -t, --timeout    seconds to wait for the dump (default: 10)\n"
+"  -V, --version    display program version and exit\n"), path);
+	return 0;
+}
+
+
+int main (int argc, char *argv[])
+{
+	(void)br_init (NULL);
+	(void)setlocale (LC_ALL, "");
+	char *path = br_find_locale_dir (LOCALEDIR);
+	(void)bindtextdomain (PACKAGE_NAME, path);
+	free (path);
+
+	static const struct option opts[] =
+	{
+		{ "conf",       required_argument, NULL, 'c' },
+		{ "config",     required_argument, NULL, 'c' },
+		{ "help",       no_argument,       NULL, 'h' },
+		{ "no-signal",  no_argument,       NULL, 'n' },
+		{ "pidfile",    required_argument, NULL, 'p' },
+		{ "summary",    no_argument,       NULL, 's' },
+		{ "stuck",      no_argument,       NULL, 'S' },
+		{ "timeout",    required_argument, NULL, 't' },
+		{ "version",    no_argument,       NULL, 'V' },
+		{ NULL,         no_argument,       NULL, '\0'}
+	};
+
+	const char *filename = conffile, *pidpath = pidfile;
+	bool request = true, summary = false, stuck = false;
+	unsigned timeout = 10;
+
+	int c;
+	while ((c = getopt_long (argc, argv, "c:hnp:sSt:V", opts, NULL)) != -1)
+		switch (c)
+		{
+			case 'c':
+				filename = optarg;
+				break;
+
+			case 'h':
+				return usage (argv[0]);
+
+			case 'n':
+				request = false;
+				break;
+
+			case 'p':
+				pidpath = optarg;
+				break;
+
+			case 's':
+				summary = true;
+				break;
+
+			case 'S':
+				stuck = true;
+				break;
+
+			case 't':
+				timeout = strtoul (optarg, NULL, 10);
+				break;
+
+			case 'V':
+				return miredo_version ();
+
+			default:
+				usage (argv[0]);
+				return 1;
+		}
+
+	path = (optind < argc) ? strdup (argv[optind]) : dump_path (filename);
+	if (path == NULL)
+		return 1;
+
+	int fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		perror (path);
+		free (path);
+		return 1;
+	}
+	free (path);
+
+	if (request && dump_request (fd, pidpath, timeout))
+	{
+		close (fd);
+		return 1;
+	}
+
+	FILE *stream = fdopen (fd, "r");
+	if (stream == NULL)
+	{
+		close (fd);
+		return 1;
+	}
+
+	int val = print_dump (stream, summary, stuck);
+	fclose (stream);
+	return val ? 1 : 0;
+}
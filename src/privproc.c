@@ -49,6 +49,7 @@
 # define LOG_PERROR 0
 #endif
 
+#include <libtun6/tun6.h>
 #include <libteredo/teredo.h>
 
 #include "miredo.h"
@@ -57,10 +58,10 @@
 static const char script_path[] = SYSCONFDIR"/miredo/client-hook";
 
 /**
- * Runs the hook script.
- * @return the script exit status, or -1 in case of error.
+ * Starts the hook script.
+ * @return the script process ID, or -1 in case of error.
  */
-static int run_script (void)
+static pid_t spawn_script (void)
 {
 	pid_t pid = fork ();
 
@@ -84,7 +85,21 @@ static int run_script (void)
 		}
 	}
 
+	return pid;
+}
+
+
+/**
+ * Waits for the hook script to complete.
+ * @return the script exit status, or -1 in case of error.
+ */
+static int wait_script (pid_t pid)
+{
 	int res;
+
+	if (pid == -1)
+		return -1;
+
 	while (waitpid (pid, &res, 0) == -1);
 
 	if (WIFEXITED (res))
@@ -94,13 +109,103 @@ static int run_script (void)
 }
 
 
+/**
+ * Runs the hook script.
+ * @return the script exit status, or -1 in case of error.
+ */
+static int run_script (void)
+{
+	return wait_script (spawn_script ());
+}
+
+
+/* Interface configuration applied in-process (see HookMode) */
+struct builtin_config
+{
+	struct in6_addr addr, lladdr;
+	struct tun6_address addrs[2];
+	struct tun6_route route;
+	struct tun6_config cfg;
+	bool up;
+};
+
+
+/**
+ * Configures the tunnel interface without the hook script, the same way
+ * as the default Linux client hook does (minus source routing).
+ * @return 0 on success, -1 on error.
+ */
+static int
+builtin_configure (unsigned ifindex, struct builtin_config *c,
+                   const struct miredo_tunnel_settings *s)
+{
+	bool up = memcmp (&s->addr, &in6addr_any, sizeof (in6addr_any)) != 0;
+
+	/* Requalification with unchanged settings: nothing to do */
+	if (up && c->up && !memcmp (&c->addr, &s->addr, sizeof (c->addr))
+	 && (c->cfg.mtu == s->mtu))
+		return 0;
+
+	if (c->up)
+	{
+		(void)tun6_configureIndex (ifindex, false, &c->cfg);
+		c->up = false;
+	}
+
+	if (!up)
+		return 0;
+
+	c->addr = s->addr;
+	c->lladdr = IN6_IS_TEREDO_ADDR_CONE (&s->addr)
+		? teredo_cone : teredo_restrict;
+	c->addrs[0].addr = &c->lladdr;
+	c->addrs[0].prefix_len = 64;
+	c->addrs[1].addr = &c->addr;
+	c->addrs[1].prefix_len = 32;
+	/* Teredo is used as a last resort (metric 1029 on Linux) */
+	c->route.prefix = &in6addr_any;
+	c->route.prefix_len = 0;
+	c->route.relative_metric = 5;
+	c->cfg.mtu = s->mtu;
+	c->cfg.addrs = c->addrs;
+	c->cfg.naddrs = 2;
+	c->cfg.routes = &c->route;
+	c->cfg.nroutes = 1;
+
+	if (tun6_configureIndex (ifindex, true, &c->cfg))
+	{
+		syslog (LOG_ERR, "Could not configure tunnel interface: %m");
+		return -1;
+	}
+	c->up = true;
+	return 0;
+}
+
+
 int main (int argc, char *argv[])
 {
 	openlog ("miredo-privproc", LOG_PID | LOG_PERROR, LOG_DAEMON);
 
-	if (argc != 2)
+	if ((argc != 2) && (argc != 3))
 		exit (1);
 
+	/* How to apply tunnel settings, see HookMode in miredo.conf(5) */
+	enum { HOOK_SCRIPT, HOOK_BUILTIN, HOOK_ASYNC } mode = HOOK_SCRIPT;
+	if (argc == 3)
+	{
+		if (!strcmp (argv[2], "builtin"))
+			mode = HOOK_BUILTIN;
+		else
+		if (!strcmp (argv[2], "async"))
+			mode = HOOK_ASYNC;
+		else
+		if (strcmp (argv[2], "script"))
+			exit (1);
+	}
+
+	struct builtin_config builtin = { .up = false };
+	pid_t async_pid = -1;
+
 	unsigned ifindex = strtoul (argv[1], NULL, 0x10);
 	if (ifindex == 0)
 		exit (1);
@@ -181,7 +286,19 @@ int main (int argc, char *argv[])
 
 		/* Run hook script */
 
-		res = run_script ();
+		if (mode == HOOK_SCRIPT)
+			res = run_script ();
+		else
+		{
+			res = builtin_configure (ifindex, &builtin, &cfg);
+			if (mode == HOOK_ASYNC)
+			{
+				/* Keeps invocations in order, without delaying the reply
+				 * unless the previous one is still running. */
+				wait_script (async_pid);
+				async_pid = spawn_script ();
+			}
+		}
 
 		/* Notify main process of completion */
 	error:
@@ -206,8 +323,13 @@ int main (int argc, char *argv[])
 	}
 
 	/* Run scripts for the last time */
+	wait_script (async_pid);
+
+	if (builtin.up)
+		(void)tun6_configureIndex (ifindex, false, &builtin.cfg);
+
 	char iface[IFNAMESIZE];
-	if (if_indextoname (ifindex, iface) != NULL)
+	if ((mode != HOOK_BUILTIN) && (if_indextoname (ifindex, iface) != NULL))
 	{
 		setenv ("STATE", "down", 1);
 		unsetenv ("ADDRESS");
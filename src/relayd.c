@@ -27,6 +27,7 @@
 #include <gettext.h>
 
 #include <inttypes.h>
+#include <stddef.h> // offsetof()
 #include <stdlib.h> // free()
 #include <stdio.h> // fputs()
 #include <sys/types.h>
@@ -34,17 +35,21 @@
 #include <errno.h>
 #include <unistd.h> // close()
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/wait.h> // wait()
 #include <signal.h> // sigemptyset()
 #include <syslog.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h> // struct iovec
 #include <netinet/in.h>
 #include <netinet/ip6.h>
 #include <netinet/icmp6.h>
 #include <arpa/inet.h> // inet_ntop()
 #include <netdb.h> // NI_MAXHOST
+#include <net/if.h> // if_nametoindex()
 #ifdef HAVE_SYS_CAPABILITY_H
 # include <sys/capability.h>
 #endif
@@ -61,11 +66,13 @@
 #include <libtun6/tun6.h>
 
 #include <libteredo/teredo.h>
+#include <libteredo/teredo-udp.h> // teredo_stats_dump()
 #include <libteredo/tunnel.h>
 
 #include "privproc.h"
 #include "miredo.h"
 #include "conf.h"
+#include "ring.h"
 
 static void miredo_setup_fd (int fd);
 static void miredo_setup_nonblock_fd (int fd);
@@ -83,11 +90,35 @@ static int relay_diagnose (void)
 }
 
 
+/* Upper bound for the relay instances of one process (see RelayInstance) */
+#define MIREDO_MAX_INSTANCES 16
+
+struct miredo_tunnel;
+
+/* Worker tunnel queue, its encapsulation thread and optional writer */
+typedef struct miredo_queue
+{
+	tun6 *tunnel;
+	const struct miredo_tunnel *parent;
+	pthread_t thread;
+	unsigned index;
+	miredo_ring *ring;
+	pthread_t writer;
+	pthread_t receiver; // with several relay instances only
+} miredo_queue;
+
 typedef struct miredo_tunnel
 {
 	tun6 *tunnel;
 	int priv_fd;
 	teredo_tunnel *relay;
+	unsigned workers;
+	atomic_uint producers; // receive threads bound to a ring
+	miredo_queue queues[MIREDO_MAX_WORKERS];
+	/* Relay instances sharing the tunnel and the worker threads */
+	unsigned ninstances;
+	teredo_tunnel *instances[MIREDO_MAX_INSTANCES]; // [0] is relay
+	uint32_t prefixes[MIREDO_MAX_INSTANCES];
 } miredo_tunnel;
 
 static int icmp6_fd = -1;
@@ -123,40 +154,174 @@ static void miredo_deinit (bool client)
 }
 
 
+/**
+ * Opens one tunnel queue per worker. If the tunneling driver does not
+ * support multiple queues, all workers share the tunnel.
+ */
+static void
+open_tunnel_queues (tun6 *tunnel, miredo_queue *queues, unsigned n)
+{
+	/* Encapsulation threads segment TCP super-packets themselves */
+	(void)tun6_setOffload (tunnel, true);
+	queues[0].tunnel = tunnel;
+
+	for (unsigned i = 1; i < n; i++)
+	{
+		tun6 *q = tun6_openQueue (tunnel);
+		if (q == NULL)
+		{
+			if (i == 1)
+				syslog (LOG_INFO, _("Tunnel queues not supported: "
+				        "workers will share the tunnel."));
+			q = tunnel;
+		}
+		queues[i].tunnel = q;
+	}
+}
+
+
+static void
+close_tunnel_queues (tun6 *tunnel, miredo_queue *queues, unsigned n)
+{
+	for (unsigned i = 1; i < n; i++)
+		if (queues[i].tunnel != tunnel)
+			tun6_destroy (queues[i].tunnel);
+}
+
+
+static void miredo_pktbuf_release (void *buf)
+{
+	teredo_pktbuf_release (buf);
+}
+
+
+/**
+ * Allocates one ring per worker queue, so that a dedicated thread writes
+ * decapsulated packets to the tunnel. If that fails, the receive threads
+ * write to the tunnel themselves.
+ */
+static void
+open_tunnel_rings (miredo_queue *queues, unsigned n, size_t size)
+{
+	for (unsigned i = 0; i < n; i++)
+	{
+		queues[i].ring = miredo_ring_create (size);
+		if (queues[i].ring == NULL)
+		{
+			syslog (LOG_WARNING, _("Error (%s): %m"), "TunnelRingSize");
+			while (i > 0)
+			{
+				miredo_ring_destroy (queues[--i].ring, NULL);
+				queues[i].ring = NULL;
+			}
+			return;
+		}
+	}
+}
+
+
+static void close_tunnel_rings (miredo_queue *queues, unsigned n)
+{
+	for (unsigned i = 0; i < n; i++)
+		if (queues[i].ring != NULL)
+			miredo_ring_destroy (queues[i].ring, miredo_pktbuf_release);
+}
+
+
 /**
  * Callback to transmit decapsulated Teredo IPv6 packets to the kernel.
+ * Each libteredo receive thread gets its own tunnel queue, or its own ring
+ * toward the writer thread of that queue.
  */
 static void
 miredo_recv_callback (void *data, const void *packet, size_t length)
 {
-	assert (data != NULL);
+	miredo_tunnel *t = data;
+	assert (t != NULL);
+
+	if (t->queues[0].ring != NULL)
+	{
+		static _Thread_local miredo_ring *ring = NULL;
 
-	(void)tun6_send (((miredo_tunnel *)data)->tunnel, packet, length);
+		if (ring == NULL)
+		{
+			unsigned i = atomic_fetch_add_explicit (&t->producers, 1,
+			                                        memory_order_relaxed);
+			if (i < t->workers)
+				ring = t->queues[i].ring;
+		}
+
+		if (ring != NULL)
+		{   /* Drops the packet rather than wait for the writer */
+			teredo_pktbuf *buf = teredo_pktbuf_hold (packet, length);
+
+			if (miredo_ring_push (ring, packet, length, buf) && (buf != NULL))
+				teredo_pktbuf_release (buf);
+			return;
+		}
+	}
+
+	static atomic_uint next = 0;
+	static _Thread_local unsigned slot = 0;
+
+	if (slot == 0)
+		slot = atomic_fetch_add_explicit (&next, 1, memory_order_relaxed) + 1;
+
+	(void)tun6_send (t->queues[(slot - 1) % t->workers].tunnel,
+	                 packet, length);
 }
 
 
 /**
- * Callback to emit an ICMPv6 error message through a raw ICMPv6 socket.
+ * Callback to emit ICMPv6 error messages through a raw ICMPv6 socket.
+ * The kernel computes the checksums, as it picks the source address.
  */
 static void
-miredo_icmp6_callback (void *data, const void *packet, size_t length,
-                        const struct in6_addr *dst)
+miredo_icmp6_callback (void *data, const teredo_icmpv6_msg *msgs,
+                       unsigned count)
 {
 	(void)data;
 	assert (icmp6_fd != -1);
 
-	struct sockaddr_in6 addr =
+	struct sockaddr_in6 addr[count];
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr vec[count];
+#endif
+
+	for (unsigned i = 0; i < count; i++)
 	{
-		.sin6_family = AF_INET6,
+		memset (addr + i, 0, sizeof (addr[i]));
+		addr[i].sin6_family = AF_INET6;
 #ifdef HAVE_SA_LEN
-		.sin6_len = sizeof (struct sockaddr_in6),
+		addr[i].sin6_len = sizeof (struct sockaddr_in6);
 #endif
-		.sin6_addr = *dst
-	};
+		addr[i].sin6_addr = *msgs[i].dst;
 
-	/* TODO: use sendmsg and don't memcpy in BuildICMPv6Error */
-	(void)sendto (icmp6_fd, packet, length, 0,
-	              (struct sockaddr *)&addr, sizeof (addr));
+		struct msghdr hdr =
+		{
+			.msg_name = addr + i,
+			.msg_namelen = sizeof (addr[i]),
+			.msg_iov = (struct iovec *)msgs[i].iov,
+			.msg_iovlen = msgs[i].iovcnt
+		};
+#ifdef HAVE_SENDMMSG
+		vec[i].msg_hdr = hdr;
+		vec[i].msg_len = 0;
+#else
+		(void)sendmsg (icmp6_fd, &hdr, 0);
+#endif
+	}
+
+#ifdef HAVE_SENDMMSG
+	/* Errors are best effort: stop at the first failure */
+	for (unsigned done = 0; done < count;)
+	{
+		int val = sendmmsg (icmp6_fd, vec + done, count - done, 0);
+		if (val <= 0)
+			break;
+		done += val;
+	}
+#endif
 }
 
 
@@ -200,8 +365,33 @@ ParseRelayType (miredo_conf *conf, const char *name, int *type)
 
 
 #ifdef MIREDO_TEREDO_CLIENT
+static bool
+ParseHookMode (miredo_conf *conf, const char *name, const char **mode)
+{
+	static const char modes[][8] = { "script", "builtin", "async" };
+	unsigned line;
+	char *val = miredo_conf_get (conf, name, &line);
+
+	*mode = modes[0];
+	if (val == NULL)
+		return true;
+
+	for (size_t i = 0; i < sizeof (modes) / sizeof (modes[0]); i++)
+		if (strcasecmp (val, modes[i]) == 0)
+		{
+			*mode = modes[i];
+			free (val);
+			return true;
+		}
+
+	syslog (LOG_ERR, _("Invalid hook mode \"%s\" at line %u"), val, line);
+	free (val);
+	return false;
+}
+
+
 static tun6 *
-create_dynamic_tunnel (const char *ifname, int *pfd)
+create_dynamic_tunnel (const char *ifname, const char *hook, int *pfd)
 {
 	tun6 *tunnel = tun6_create (ifname);
 	if (tunnel == NULL)
@@ -227,7 +417,7 @@ create_dynamic_tunnel (const char *ifname, int *pfd)
 
 		case 0:
 			if (dup2 (fd[0], 0) == 0 && dup2 (fd[0], 1) == 1)
-				execl (path, path, ifindex, (char *)NULL);
+				execl (path, path, ifindex, hook, (char *)NULL);
 
 			syslog (LOG_ERR, _("Could not execute %s: %m"), path);
 			exit (1);
@@ -311,22 +501,31 @@ miredo_down_callback (void *data)
 
 
 static int
-setup_client (teredo_tunnel *client, const char *server, const char *server2)
+setup_client (teredo_tunnel *client, const char *server, const char *server2,
+              unsigned refresh_max, unsigned relay_cache, int cache_fd)
 {
 	teredo_set_state_cb (client, miredo_up_callback, miredo_down_callback);
+	if (teredo_set_max_refresh_interval (client, refresh_max)
+	 || teredo_set_relay_cache (client, relay_cache)
+	 || teredo_set_qualification_cache (client, cache_fd))
+		return -1;
 	return teredo_set_client_mode (client, server, server2);
 }
 #else
-# define create_dynamic_tunnel( a, b )   NULL
+# define create_dynamic_tunnel( a, b, c )   NULL
 # define destroy_dynamic_tunnel( a, b )   (void)0
-# define setup_client( a, b, c )         (-1)
+# define setup_client( a, b, c, d, e, f ) (-1)
 #endif
 
 
+/**
+ * Creates the tunnel of a relay, routing the Teredo prefixes of all of its
+ * instances.
+ */
 static tun6 *
 create_static_tunnel (const char *restrict ifname,
-                      const struct in6_addr *restrict prefix,
-                      uint16_t mtu)
+                      const union teredo_addr *restrict prefixes,
+                      unsigned n, uint16_t mtu)
 {
 	tun6 *tunnel = tun6_create (ifname);
 
@@ -335,9 +534,19 @@ create_static_tunnel (const char *restrict ifname,
 	if (tunnel == NULL)
 		return NULL;
 
-	if (tun6_setMTU (tunnel, mtu) || tun6_bringUp (tunnel)
-	 || tun6_addAddress (tunnel, &teredo_restrict, 64)
-	 || tun6_addRoute (tunnel, prefix, 32, 0))
+	const struct tun6_address addr = { &teredo_restrict, 64 };
+	struct tun6_route routes[n];
+
+	for (unsigned i = 0; i < n; i++)
+	{
+		routes[i].prefix = &prefixes[i].ip6;
+		routes[i].prefix_len = 32;
+		routes[i].relative_metric = 0;
+	}
+
+	const struct tun6_config cfg = { mtu, &addr, 1, routes, n };
+
+	if (tun6_configure (tunnel, &cfg))
 	{
 		tun6_destroy (tunnel);
 		return NULL;
@@ -378,89 +587,318 @@ setup_relay (teredo_tunnel *relay, uint32_t prefix, bool cone)
 }
 
 
+/* Packets received from the tunnel at once */
+#define MIREDO_ENCAP_BATCH 64
+
+/**
+ * Encapsulates IPv6 packets through the relay instance of their destination
+ * Teredo prefix. Packets toward other destinations go to the first
+ * instance, which rejects them.
+ */
+static void
+miredo_transmit_batch (const miredo_tunnel *t, struct iovec *pkts,
+                       unsigned n)
+{
+	for (unsigned i = 1; (i < t->ninstances) && (n > 0); i++)
+	{
+		struct iovec sub[MIREDO_ENCAP_BATCH];
+		unsigned left = 0, count = 0;
+
+		for (unsigned j = 0; j < n; j++)
+		{
+			uint32_t prefix;
+
+			memcpy (&prefix, (const uint8_t *)pkts[j].iov_base
+			                 + offsetof (struct ip6_hdr, ip6_dst), 4);
+			if (prefix == t->prefixes[i])
+				sub[count++] = pkts[j];
+			else
+				pkts[left++] = pkts[j];
+		}
+
+		if (count > 0)
+			teredo_transmit_batch (t->instances[i], sub, count);
+		n = left;
+	}
+
+	if (n > 0)
+		teredo_transmit_batch (t->relay, pkts, n);
+}
+
+
 /**
  * Thread to encapsulate IPv6 packets into UDP.
  * Cancellation safe.
  */
-static LIBTEREDO_NORETURN void *miredo_encap_thread (void *d)
+static void *miredo_encap_thread (void *d)
 {
-	teredo_tunnel *relay = ((miredo_tunnel *)d)->relay;
-	tun6 *tunnel = ((miredo_tunnel *)d)->tunnel;
+	const miredo_tunnel *parent = ((miredo_queue *)d)->parent;
+	tun6 *tunnel = ((miredo_queue *)d)->tunnel;
 
-	for (;;)
+	teredo_thread_setup (TEREDO_THREAD_PACKETS, "miredo-tx%u",
+	                     ((miredo_queue *)d)->index);
+
+	/* Handle incoming data (on the heap to keep the thread stack small) */
+	struct
 	{
-		/* Handle incoming data */
-		struct
-		{
-			struct ip6_hdr ip6;
-			uint8_t fill[65467];
-		} pbuf;
+		struct iovec pkts[MIREDO_ENCAP_BATCH];
+		uint64_t buf[4 * 65536 / 8];
+	} *pbuf = malloc (sizeof (*pbuf));
 
-		/* Forwards IPv6 packet to Teredo
+	if (pbuf == NULL)
+	{
+		syslog (LOG_ERR, _("Error (%s): %m"), "malloc");
+		return NULL;
+	}
+
+	pthread_cleanup_push (free, pbuf);
+	for (;;)
+	{
+		/* Forwards IPv6 packets to Teredo
 		 * (Packet transmission) */
-		int val = tun6_wait_recv (tunnel, &pbuf.ip6, sizeof (pbuf));
-		if (val >= 40)
+		int val = tun6_recv_batch (tunnel, pbuf->buf, sizeof (pbuf->buf),
+		                           pbuf->pkts, MIREDO_ENCAP_BATCH);
+		unsigned n = 0;
+
+		for (int i = 0; i < val; i++)
+			if (pbuf->pkts[i].iov_len >= 40)
+				pbuf->pkts[n++] = pbuf->pkts[i];
+
+		if (n > 0)
 		{
 			pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
-			teredo_transmit (relay, &pbuf.ip6, val);
+			miredo_transmit_batch (parent, pbuf->pkts, n);
 			pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
 		}
 		else
 			pthread_testcancel ();
 	}
+	pthread_cleanup_pop (1);
+	return NULL;
 }
 
 
 /**
- * Miredo main daemon function, with UDP datagrams and IPv6 packets
- * receive loop.
+ * Thread to write decapsulated IPv6 packets from a ring to the tunnel.
+ * Cancellation safe.
  */
-static int
-run_tunnel (miredo_tunnel *tunnel)
+static void *miredo_writer_thread (void *d)
 {
-	pthread_t encap_th;
-	if (teredo_run_async (tunnel->relay)
-	 || pthread_create (&encap_th, NULL, miredo_encap_thread, tunnel))
-		return -1;
+	miredo_queue *q = d;
+	struct iovec pkts[MIREDO_ENCAP_BATCH];
 
-	sigset_t dummyset, set;
-	sigemptyset (&dummyset);
-	pthread_sigmask (SIG_BLOCK, &dummyset, &set);
-	while (sigwait (&set, &(int){ 0 }));
+	teredo_thread_setup (TEREDO_THREAD_PACKETS, "miredo-wr%u", q->index);
 
-	pthread_cancel (encap_th);
-	pthread_join (encap_th, NULL);
-	return 0;
+	for (;;)
+	{
+		unsigned n = miredo_ring_peek (q->ring, pkts, MIREDO_ENCAP_BATCH);
+
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+		(void)tun6_send_batch (q->tunnel, pkts, n);
+		miredo_ring_pop (q->ring, miredo_pktbuf_release);
+		pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+	}
+	return NULL;
 }
 
 
-static int
-relay_run (miredo_conf *conf, const char *server_name)
+/* Batches processed per socket before polling again, for fairness */
+#define MIREDO_RECV_BURST 8
+
+/*
+ * Longest sleep between timer checks. Encapsulation threads arm timers
+ * without waking the poll, so this bounds how late they run, like the
+ * one second tick of the library timer thread.
+ */
+#define MIREDO_TICK_MS 1000
+
+/**
+ * Thread to receive Teredo packets on behalf of one worker of all relay
+ * instances, when there are several: the instances run without threads of
+ * their own (see teredo_create_embedded()). The first worker also runs
+ * their timers. Cancellation safe.
+ */
+static void *miredo_recv_thread (void *d)
 {
-	/*
-	 * CONFIGURATION
-	 */
-	union teredo_addr prefix;
-	memset (&prefix, 0, sizeof (prefix));
-	prefix.teredo.prefix = htonl (TEREDO_PREFIX);
+	const miredo_queue *q = d;
+	const miredo_tunnel *t = q->parent;
+	struct pollfd ufd[MIREDO_MAX_INSTANCES];
 
-	int mode = TEREDO_CLIENT;
-	if (!ParseRelayType (conf, "RelayType", &mode))
+	teredo_thread_setup (TEREDO_THREAD_PACKETS, "miredo-rx%u", q->index);
+
+	for (unsigned i = 0; i < t->ninstances; i++)
 	{
-		syslog (LOG_ALERT, _("Fatal configuration error"));
-		return -2;
+		int fds[MIREDO_MAX_WORKERS];
+
+		teredo_get_fds (t->instances[i], fds, MIREDO_MAX_WORKERS);
+		ufd[i].fd = fds[q->index];
+		ufd[i].events = POLLIN;
+	}
+
+	for (;;)
+	{
+		int timeout = -1;
+
+		if (q->index == 0)
+		{
+			timeout = MIREDO_TICK_MS;
+			for (unsigned i = 0; i < t->ninstances; i++)
+			{
+				int ms = teredo_next_deadline (t->instances[i]);
+
+				if ((ms >= 0) && (ms < timeout))
+					timeout = ms;
+			}
+		}
+
+		int val = poll (ufd, t->ninstances, timeout);
+
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+		for (unsigned i = 0; (val > 0) && (i < t->ninstances); i++)
+			if (ufd[i].revents)
+				for (unsigned j = 0; j < MIREDO_RECV_BURST; j++)
+					if (teredo_process_batch (t->instances[i], q->index) < 0)
+						break; /* drained */
+
+		if (q->index == 0)
+			for (unsigned i = 0; i < t->ninstances; i++)
+				if (teredo_next_deadline (t->instances[i]) == 0)
+					teredo_tick (t->instances[i]);
+		pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
 	}
+	return NULL;
+}
 
+
+/* Settings from the configuration */
+struct relay_settings
+{
+	int mode;
+	union teredo_addr prefix;
+	uint16_t mtu;
+	bool cone;
+	uint32_t bind_ip;
+	uint16_t bind_port;
+	uint16_t workers;
+	uint32_t max_peers;
+	uint16_t peers_mib; // peers list memory budget
+	uint16_t queue_bytes;
+	uint16_t icmp_ms;
+	bool icmp_set;
+	bool pmtud;
+	uint16_t ring_kib;
+	char *ifname;
+	char *dp_ifname; // in-kernel datapath network interface
+	char *peers_shm; // shared peer table name (relays only)
+	unsigned ninstances; // extra relay instances
+	struct relay_instance
+	{
+		uint32_t prefix;
+		uint32_t bind_ip;
+		uint16_t bind_port;
+	} instances[MIREDO_MAX_INSTANCES - 1];
 #ifdef MIREDO_TEREDO_CLIENT
-	const char *server_name2 = NULL;
+	const char *server_name, *server_name2;
 	char namebuf[NI_MAXHOST], namebuf2[NI_MAXHOST];
+	const char *hook_mode;
+	uint16_t refresh_max;
+	uint16_t relay_cache;
 #endif
-	uint16_t mtu = 1280;
-	bool cone = false;
+};
+
+
+/**
+ * Parses the extra relay instances: "RelayInstance prefix,address[,port]".
+ * Each has its own Teredo prefix, so that packets from the tunnel can be
+ * dispatched by destination.
+ */
+static bool
+ParseRelayInstances (miredo_conf *conf, struct relay_settings *s)
+{
+	unsigned line;
+	char *val;
 
-	if (mode & TEREDO_CLIENT)
+	while ((val = miredo_conf_get (conf, "RelayInstance", &line)) != NULL)
+	{
+		union teredo_addr addr;
+		struct relay_instance inst;
+		unsigned long port = 0;
+		char *host = strchr (val, ','), *end = NULL;
+
+		memset (&inst, 0, sizeof (inst)); /* compared on reload */
+		if (host != NULL)
+		{
+			*host++ = '\0';
+			end = strchr (host, ',');
+			if (end != NULL)
+			{
+				*end++ = '\0';
+				port = strtoul (end, &end, 10);
+			}
+		}
+
+		bool ok = (host != NULL) && ((end == NULL) || (*end == '\0'))
+		       && (port <= 65535)
+		       && (inet_pton (AF_INET6, val, &addr) == 1)
+		       && is_valid_teredo_prefix (addr.teredo.prefix)
+		       && (GetIPv4ByName (host, &inst.bind_ip) == 0);
+		free (val);
+		if (!ok)
+		{
+			syslog (LOG_ERR, _("Invalid relay instance at line %u"), line);
+			return false;
+		}
+
+		inst.prefix = addr.teredo.prefix;
+		inst.bind_port = htons (port);
+
+		bool dup = inst.prefix == s->prefix.teredo.prefix;
+		for (unsigned i = 0; i < s->ninstances; i++)
+			if (s->instances[i].prefix == inst.prefix)
+				dup = true;
+		if (dup)
+		{
+			syslog (LOG_ERR, _("Duplicate Teredo prefix at line %u"), line);
+			return false;
+		}
+
+		if (s->ninstances >= MIREDO_MAX_INSTANCES - 1)
+		{
+			syslog (LOG_ERR, _("Too many relay instances at line %u "
+			        "(at most %u)"), line, MIREDO_MAX_INSTANCES);
+			return false;
+		}
+		s->instances[s->ninstances++] = inst;
+	}
+	return true;
+}
+
+
+/**
+ * Parses the relay settings.
+ * @return 0 on success, -2 on configuration error.
+ */
+static int
+relay_parse (miredo_conf *conf, const char *server_name,
+             struct relay_settings *s)
+{
+	memset (s, 0, sizeof (*s));
+	s->prefix.teredo.prefix = htonl (TEREDO_PREFIX);
+
+	s->mode = TEREDO_CLIENT;
+	if (!ParseRelayType (conf, "RelayType", &s->mode))
+	{
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+
+	s->mtu = 1280;
+	s->cone = false;
+
+	if (s->mode & TEREDO_CLIENT)
 	{
 #ifdef MIREDO_TEREDO_CLIENT
+		s->server_name = server_name;
 		if (server_name == NULL)
 		{
 			char *name = miredo_conf_get (conf, "ServerAddress", NULL);
@@ -470,19 +908,44 @@ relay_run (miredo_conf *conf, const char *server_name)
 				syslog (LOG_ALERT, _("Fatal configuration error"));
 				return -2;
 			}
-			strlcpy (namebuf, name, sizeof (namebuf));
+			strlcpy (s->namebuf, name, sizeof (s->namebuf));
 			free (name);
-			server_name = namebuf;
+			s->server_name = s->namebuf;
 
 			name = miredo_conf_get (conf, "ServerAddress2", NULL);
 			if (name != NULL)
 			{
-				strlcpy (namebuf2, name, sizeof (namebuf2));
+				strlcpy (s->namebuf2, name, sizeof (s->namebuf2));
 				free (name);
-				server_name2 = namebuf2;
+				s->server_name2 = s->namebuf2;
 			}
 		}
+
+		if (!ParseHookMode (conf, "HookMode", &s->hook_mode)
+		 || !miredo_conf_get_int16 (conf, "MaxRefreshInterval",
+		                            &s->refresh_max, NULL))
+		{
+			syslog (LOG_ALERT, _("Fatal configuration error"));
+			return -2;
+		}
+
+		unsigned line = 0;
+		if (!miredo_conf_get_int16 (conf, "RelayCachePrefix",
+		                            &s->relay_cache, &line))
+		{
+			syslog (LOG_ALERT, _("Fatal configuration error"));
+			return -2;
+		}
+		if (s->relay_cache > 64)
+		{
+			syslog (LOG_ALERT, _("Invalid prefix length %u at line %u "
+			        "(must be at most 64)"), (unsigned)s->relay_cache,
+			        line);
+			syslog (LOG_ALERT, _("Fatal configuration error"));
+			return -2;
+		}
 #else
+		(void)server_name;
 		syslog (LOG_ALERT, _("Unsupported Teredo client mode"));
 		syslog (LOG_ALERT, _("Fatal configuration error"));
 		return -2;
@@ -490,21 +953,19 @@ relay_run (miredo_conf *conf, const char *server_name)
 	}
 	else
 	{
-		server_name = NULL;
-		mtu = 1280;
-		cone = (mode == TEREDO_CONE);
+		s->cone = (s->mode == TEREDO_CONE);
 
 		if (!miredo_conf_parse_teredo_prefix (conf, "Prefix",
-		                                      &prefix.teredo.prefix)
-		 || !miredo_conf_get_int16 (conf, "InterfaceMTU", &mtu, NULL))
+		                                      &s->prefix.teredo.prefix)
+		 || !miredo_conf_get_int16 (conf, "InterfaceMTU", &s->mtu, NULL))
 		{
 			syslog (LOG_ALERT, _("Fatal configuration error"));
 			return -2;
 		}
 	}
 
-	uint32_t bind_ip = INADDR_ANY;
-	uint16_t bind_port = 
+	s->bind_ip = INADDR_ANY;
+	s->bind_port =
 #if 0
 		/*
 		 * We use 3545 as a Teredo service port.
@@ -519,16 +980,445 @@ relay_run (miredo_conf *conf, const char *server_name)
 		0;
 #endif
 
-	if (!miredo_conf_parse_IPv4 (conf, "BindAddress", &bind_ip)
-	 || !miredo_conf_get_int16 (conf, "BindPort", &bind_port, NULL))
+	if (!miredo_conf_parse_IPv4 (conf, "BindAddress", &s->bind_ip)
+	 || !miredo_conf_get_int16 (conf, "BindPort", &s->bind_port, NULL))
+	{
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+
+	s->bind_port = htons (s->bind_port);
+
+	s->workers = 1;
+	unsigned line = 0;
+	if (!miredo_conf_get_int16 (conf, "Workers", &s->workers, &line))
+	{
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+	if ((s->workers < 1) || (s->workers > MIREDO_MAX_WORKERS))
+	{
+		syslog (LOG_ALERT, _("Invalid workers count %u at line %u "
+		        "(must be between 1 and %u)"), (unsigned)s->workers, line,
+		        MIREDO_MAX_WORKERS);
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+
+	unsigned icmp_line = 0;
+	line = 0;
+	if (!miredo_conf_get_int32 (conf, "MaxPeers", &s->max_peers, &line))
 	{
 		syslog (LOG_ALERT, _("Fatal configuration error"));
 		return -2;
 	}
+	if ((line != 0) && (s->max_peers == 0))
+	{
+		syslog (LOG_ALERT, _("Invalid peers count 0 at line %u "
+		        "(must be at least 1)"), line);
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+	line = 0;
+	if (!miredo_conf_get_int16 (conf, "MaxPeersMiB", &s->peers_mib, &line))
+	{
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+	if ((line != 0) && (s->peers_mib < 4))
+	{
+		syslog (LOG_ALERT, _("Invalid peers memory %u MiB at line %u "
+		        "(must be at least %u)"), (unsigned)s->peers_mib, line, 4);
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+	if (!miredo_conf_get_int16 (conf, "MaxQueueBytes", &s->queue_bytes,
+	                            &line)
+	 || !miredo_conf_get_int16 (conf, "IcmpRateLimitMs", &s->icmp_ms,
+	                            &icmp_line))
+	{
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+	if ((s->queue_bytes != 0) && (s->queue_bytes < 1280))
+	{
+		syslog (LOG_ALERT, _("Invalid queue size %u at line %u "
+		        "(must be at least %u)"), (unsigned)s->queue_bytes, line,
+		        1280);
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+	if (s->icmp_ms > 1000)
+	{
+		syslog (LOG_ALERT, _("Invalid ICMPv6 rate limit %u at line %u "
+		        "(must be at most %u)"), (unsigned)s->icmp_ms, icmp_line,
+		        1000);
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+	s->icmp_set = icmp_line != 0;
 
-	bind_port = htons (bind_port);
+	if (!miredo_conf_get_bool (conf, "PathMTUDiscovery", &s->pmtud, NULL))
+	{
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+
+	line = 0;
+	if (!miredo_conf_get_int16 (conf, "TunnelRingSize", &s->ring_kib, &line))
+	{
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+	if ((s->ring_kib != 0) && (s->ring_kib < 128))
+	{
+		syslog (LOG_ALERT, _("Invalid ring size %u KiB at line %u "
+		        "(must be at least %u)"), (unsigned)s->ring_kib, line, 128);
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+
+	s->dp_ifname = miredo_conf_get (conf, "DatapathInterface", NULL);
+	if ((s->dp_ifname != NULL) && (s->bind_port == 0))
+	{
+		syslog (LOG_ALERT, _("%s requires %s"), "DatapathInterface",
+		        "BindPort");
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		free (s->dp_ifname);
+		return -2;
+	}
+
+	if (!(s->mode & TEREDO_CLIENT))
+	{
+		s->peers_shm = miredo_conf_get (conf, "SharedPeers", NULL);
+
+		if (!ParseRelayInstances (conf, s))
+		{
+			syslog (LOG_ALERT, _("Fatal configuration error"));
+			free (s->dp_ifname);
+			free (s->peers_shm);
+			return -2;
+		}
+
+		/* Extra instances run without library threads of their own */
+		const char *other = (s->dp_ifname != NULL) ? "DatapathInterface"
+			: (s->peers_shm != NULL) ? "SharedPeers" : NULL;
+		if ((s->ninstances > 0) && (other != NULL))
+		{
+			syslog (LOG_ALERT, _("%s cannot be used with %s"),
+			        "RelayInstance", other);
+			syslog (LOG_ALERT, _("Fatal configuration error"));
+			free (s->dp_ifname);
+			free (s->peers_shm);
+			return -2;
+		}
+	}
+	s->ifname = miredo_conf_get (conf, "InterfaceName", NULL);
+	return 0;
+}
+
+
+static bool name_equal (const char *a, const char *b)
+{
+	if ((a == NULL) || (b == NULL))
+		return a == b;
+	return strcmp (a, b) == 0;
+}
+
+
+/**
+ * Applies new settings to a running relay. Only the cone flag, the
+ * ICMPv6 rate limit and the maximum number of peers can be changed on the
+ * fly: the other settings require recreating the sockets, the tunnel or
+ * the peers list, or privileges that were dropped (e.g. to change the
+ * route to the prefix).
+ *
+ * @param cur current settings, updated on success
+ * @return 0 on success, -1 if the relay needs to be restarted.
+ */
+static int
+relay_reload (miredo_tunnel *tunnel, struct relay_settings *cur,
+              const struct relay_settings *s)
+{
+	if ((s->mode & TEREDO_CLIENT) != (cur->mode & TEREDO_CLIENT)
+	 || (s->prefix.teredo.prefix != cur->prefix.teredo.prefix)
+	 || (s->mtu != cur->mtu)
+	 || (s->bind_ip != cur->bind_ip) || (s->bind_port != cur->bind_port)
+	 || (s->workers != cur->workers)
+	 || ((s->max_peers == 0) != (cur->max_peers == 0)) // library default
+	 || (s->peers_mib != cur->peers_mib)
+	 || (s->queue_bytes != cur->queue_bytes) || (s->pmtud != cur->pmtud)
+	 || (s->ring_kib != cur->ring_kib)
+	 || !name_equal (s->ifname, cur->ifname)
+	 || !name_equal (s->dp_ifname, cur->dp_ifname)
+	 || !name_equal (s->peers_shm, cur->peers_shm)
+	 || (s->ninstances != cur->ninstances)
+	 || memcmp (s->instances, cur->instances,
+	            s->ninstances * sizeof (s->instances[0])))
+		return -1;
+#ifdef MIREDO_TEREDO_CLIENT
+	if (!name_equal (s->server_name, cur->server_name)
+	 || !name_equal (s->server_name2, cur->server_name2)
+	 || (s->hook_mode != cur->hook_mode)
+	 || (s->refresh_max != cur->refresh_max)
+	 || (s->relay_cache != cur->relay_cache))
+		return -1;
+#endif
+
+	for (unsigned i = 0; i < tunnel->ninstances; i++)
+	{
+		teredo_tunnel *relay = tunnel->instances[i];
+
+		if (!(s->mode & TEREDO_CLIENT)
+		 && teredo_set_cone_flag (relay, s->cone))
+			return -1;
+		if (teredo_set_icmp_rate_limit (relay,
+		                                s->icmp_set ? s->icmp_ms : 100))
+			return -1;
+		if ((s->max_peers != cur->max_peers)
+		 && teredo_set_peer_limit (relay, s->max_peers))
+			return -1;
+	}
+
+	cur->cone = s->cone;
+	cur->icmp_set = s->icmp_set;
+	cur->icmp_ms = s->icmp_ms;
+	cur->max_peers = s->max_peers;
+	return 0;
+}
 
-	char *ifname = miredo_conf_get (conf, "InterfaceName", NULL);
+
+/**
+ * Applies the settings common to all instances of a relay.
+ * @return 0 on success, -1 on error.
+ */
+static int
+setup_instance (teredo_tunnel *relay, miredo_tunnel *data,
+                const struct relay_settings *s)
+{
+	teredo_set_privdata (relay, data);
+	teredo_set_recv_callback (relay, miredo_recv_callback);
+	teredo_set_icmpv6_batch_callback (relay, miredo_icmp6_callback);
+
+	if (((s->max_peers != 0) && teredo_set_max_peers (relay, s->max_peers))
+	 || ((s->peers_mib != 0)
+	  && teredo_set_peer_memory (relay, (size_t)s->peers_mib << 20))
+	 || ((s->queue_bytes != 0)
+	  && teredo_set_queue_size (relay, s->queue_bytes))
+	 || (s->icmp_set && teredo_set_icmp_rate_limit (relay, s->icmp_ms))
+	 || (s->pmtud && teredo_set_pmtud (relay, true)))
+		return -1;
+	return 0;
+}
+
+
+/**
+ * Creates the extra instances of a relay (see RelayInstance). They run
+ * without library threads, so that they share those of the daemon.
+ * @return 0 on success, -1 on error.
+ */
+static int
+open_instances (miredo_tunnel *data, const struct relay_settings *s)
+{
+	for (unsigned i = 0; i < s->ninstances; i++)
+	{
+		const struct relay_instance *inst = s->instances + i;
+		teredo_tunnel *relay = teredo_create_embedded (inst->bind_ip,
+		                                               inst->bind_port,
+		                                               s->workers);
+		if (relay == NULL)
+		{
+			syslog (LOG_ALERT, _("Error (%s): %m"), "RelayInstance");
+			return -1;
+		}
+
+		data->instances[data->ninstances] = relay;
+		data->prefixes[data->ninstances++] = inst->prefix;
+
+		if (setup_instance (relay, data, s)
+		 || setup_relay (relay, inst->prefix, s->cone))
+			return -1;
+	}
+	return 0;
+}
+
+
+static void close_instances (miredo_tunnel *data)
+{
+	while (data->ninstances > 1)
+		teredo_destroy (data->instances[--data->ninstances]);
+}
+
+
+/**
+ * Opens a state file, if one is configured (e.g. "PeersFile"). This
+ * must be called before privileges are dropped.
+ * @return a file descriptor, or -1 if none.
+ */
+static int state_open (miredo_conf *conf, const char *directive)
+{
+	char *path = miredo_conf_get (conf, directive, NULL);
+	if (path == NULL)
+		return -1;
+
+	int fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+	if (fd == -1)
+		syslog (LOG_WARNING, _("Error (%s): %m"), path);
+	free (path);
+	return fd;
+}
+
+
+/**
+ * Miredo main daemon function, with UDP datagrams and IPv6 packets
+ * receive loop.
+ */
+static int
+run_tunnel (miredo_tunnel *tunnel, int stats_fd, int dump_fd,
+            const char *server_name, struct relay_settings *settings)
+{
+	unsigned w = 0;
+	if (tunnel->queues[0].ring != NULL)
+		for (; w < tunnel->workers; w++)
+			if (pthread_create (&tunnel->queues[w].writer, NULL,
+			                    miredo_writer_thread, tunnel->queues + w))
+				break;
+
+	if ((tunnel->queues[0].ring != NULL) && (w < tunnel->workers))
+	{
+		while (w > 0)
+		{
+			pthread_cancel (tunnel->queues[--w].writer);
+			pthread_join (tunnel->queues[w].writer, NULL);
+		}
+		return -1;
+	}
+
+	for (unsigned i = 0; i < tunnel->workers; i++)
+	{
+		tunnel->queues[i].parent = tunnel;
+		tunnel->queues[i].index = i;
+	}
+
+	/* Several relay instances share the receive threads */
+	unsigned r = 0;
+	if (tunnel->ninstances > 1)
+		for (; r < tunnel->workers; r++)
+			if (pthread_create (&tunnel->queues[r].receiver, NULL,
+			                    miredo_recv_thread, tunnel->queues + r))
+				break;
+
+	if ((tunnel->ninstances > 1) ? (r < tunnel->workers)
+	                             : teredo_run_async (tunnel->relay))
+	{
+		for (unsigned i = 0; i < r; i++)
+			pthread_cancel (tunnel->queues[i].receiver);
+		for (unsigned i = 0; i < r; i++)
+			pthread_join (tunnel->queues[i].receiver, NULL);
+		for (unsigned i = 0; i < w; i++)
+			pthread_cancel (tunnel->queues[i].writer);
+		for (unsigned i = 0; i < w; i++)
+			pthread_join (tunnel->queues[i].writer, NULL);
+		return -1;
+	}
+
+	unsigned n;
+	for (n = 0; n < tunnel->workers; n++)
+	{
+		miredo_queue *q = tunnel->queues + n;
+
+		if (pthread_create (&q->thread, NULL, miredo_encap_thread, q))
+			break;
+	}
+
+	int retval = -1;
+	if (n == tunnel->workers)
+	{
+		retval = 0;
+
+		/* Reloads the configuration on SIGHUP, keeping the peers */
+		int signum;
+		while (((signum = miredo_wait (stats_fd, teredo_stats_dump))
+		         == SIGHUP) || (signum == SIGUSR1))
+		{
+			if (signum == SIGUSR1)
+			{   /* Dumps the peers on SIGUSR1 (see miredo-peers) */
+				if ((dump_fd == -1)
+				 || (teredo_dump_peers (tunnel->relay, dump_fd) < 0))
+					syslog (LOG_WARNING, _("Error (%s): %m"),
+					        "PeersDumpFile");
+				continue;
+			}
+
+			miredo_conf *conf = miredo_reload_conf ();
+			struct relay_settings s;
+
+			if ((conf == NULL)
+			 || relay_parse (conf, server_name, &s))
+			{
+				syslog (LOG_WARNING, _("Configuration not reloaded"));
+				if (conf != NULL)
+					miredo_conf_destroy (conf);
+				continue;
+			}
+			/* Startup-only settings (e.g. StatsFile) are left unread */
+			miredo_conf_destroy (conf);
+
+			int val = relay_reload (tunnel, settings, &s);
+			free (s.ifname);
+			free (s.dp_ifname);
+			free (s.peers_shm);
+			if (val)
+			{   /* Some settings cannot be changed on the fly */
+				retval = MIREDO_RESTART;
+				break;
+			}
+			syslog (LOG_NOTICE, _("Configuration reloaded"));
+		}
+	}
+
+	for (unsigned i = 0; i < n; i++)
+		pthread_cancel (tunnel->queues[i].thread);
+	for (unsigned i = 0; i < r; i++)
+		pthread_cancel (tunnel->queues[i].receiver);
+	for (unsigned i = 0; i < w; i++)
+		pthread_cancel (tunnel->queues[i].writer);
+	for (unsigned i = 0; i < n; i++)
+		pthread_join (tunnel->queues[i].thread, NULL);
+	for (unsigned i = 0; i < r; i++)
+		pthread_join (tunnel->queues[i].receiver, NULL);
+	for (unsigned i = 0; i < w; i++)
+		pthread_join (tunnel->queues[i].writer, NULL);
+	return retval;
+}
+
+
+static int
+relay_run (miredo_conf *conf, const char *server_name)
+{
+	/*
+	 * CONFIGURATION
+	 */
+	struct relay_settings s;
+
+	int retval = relay_parse (conf, server_name, &s);
+	if (retval)
+		return retval;
+
+	if (miredo_threads_setup (conf))
+	{
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		free (s.ifname);
+		free (s.dp_ifname);
+		free (s.peers_shm);
+		return -2;
+	}
+
+	int stats_fd = miredo_stats_open (conf);
+	int peers_fd = state_open (conf, "PeersFile");
+	int dump_fd = state_open (conf, "PeersDumpFile");
+	int qual_fd = (s.mode & TEREDO_CLIENT)
+		? state_open (conf, "QualificationFile") : -1;
 
 	miredo_conf_clear (conf, 5);
 
@@ -537,62 +1427,154 @@ relay_run (miredo_conf *conf, const char *server_name)
 	 */
 
 	// Tunneling interface initialization
-	int privfd = -1;
-	tun6 *tunnel = (mode & TEREDO_CLIENT)
-		? create_dynamic_tunnel (ifname, &privfd)
-		: create_static_tunnel (ifname, &prefix.ip6, mtu);
+	union teredo_addr prefixes[MIREDO_MAX_INSTANCES];
 
-	if (ifname != NULL)
-		free (ifname);
+	memset (prefixes, 0, sizeof (prefixes));
+	prefixes[0] = s.prefix;
+	for (unsigned i = 0; i < s.ninstances; i++)
+		prefixes[i + 1].teredo.prefix = s.instances[i].prefix;
 
-	int retval = -1;
+	int privfd = -1;
+	tun6 *tunnel = (s.mode & TEREDO_CLIENT)
+		? create_dynamic_tunnel (s.ifname, s.hook_mode, &privfd)
+		: create_static_tunnel (s.ifname, prefixes, s.ninstances + 1, s.mtu);
+
+	retval = -1;
 
 	if (tunnel == NULL)
 	{
 		syslog (LOG_ALERT, _("Miredo setup failure: %s"),
 		        _("Cannot create IPv6 tunnel"));
+		if (stats_fd != -1)
+			close (stats_fd);
+		if (peers_fd != -1)
+			close (peers_fd);
+		if (dump_fd != -1)
+			close (dump_fd);
+		if (qual_fd != -1)
+			close (qual_fd);
+		free (s.ifname);
+		free (s.dp_ifname);
+		free (s.peers_shm);
 		return -1;
 	}
 
-	if (miredo_init ((mode & TEREDO_CLIENT) != 0))
+	/* The in-kernel datapath must be loaded before privileges are dropped */
+	teredo_datapath *dp = NULL;
+	if (s.dp_ifname != NULL)
+	{
+		unsigned ifindex = if_nametoindex (s.dp_ifname);
+
+		if (ifindex != 0)
+			dp = teredo_datapath_create (tun6_getId (tunnel), ifindex,
+			                             s.bind_ip, s.bind_port);
+		if (dp == NULL)
+			syslog (LOG_WARNING, _("Error (%s): %m"), "DatapathInterface");
+	}
+
+	/* So must the shared peer table, as the segment is owner-only */
+	teredo_peertable *peers_shm = NULL;
+	if (s.peers_shm != NULL)
+	{
+		peers_shm = teredo_peertable_open (s.peers_shm,
+		                                   s.max_peers ? s.max_peers
+		                                               : 1048576);
+		if (peers_shm == NULL)
+			syslog (LOG_WARNING, _("Error (%s): %m"), "SharedPeers");
+	}
+
+	/* Extra queues must be opened before privileges are dropped */
+	miredo_tunnel data = { tunnel, privfd, NULL, s.workers, 0, { { NULL } },
+	                       0, { NULL }, { 0 } };
+	open_tunnel_queues (tunnel, data.queues, s.workers);
+	if (s.ring_kib != 0)
+		open_tunnel_rings (data.queues, s.workers, s.ring_kib * 1024);
+
+	if (miredo_init ((s.mode & TEREDO_CLIENT) != 0))
 		syslog (LOG_ALERT, _("Miredo setup failure: %s"),
 		        _("libteredo cannot be initialized"));
 	else
 	{
 		if (drop_privileges () == 0)
 		{
-			teredo_tunnel *relay = teredo_create (bind_ip, bind_port);
+			teredo_tunnel *relay = (s.ninstances > 0)
+				? teredo_create_embedded (s.bind_ip, s.bind_port, s.workers)
+				: teredo_create_workers (s.bind_ip, s.bind_port, s.workers);
 			if (relay != NULL)
 			{
-				miredo_tunnel data = { tunnel, privfd, relay };
-				teredo_set_privdata (relay, &data);
-				teredo_set_recv_callback (relay, miredo_recv_callback);
-				teredo_set_icmpv6_callback (relay, miredo_icmp6_callback);
-
-				retval = (mode & TEREDO_CLIENT)
-					? setup_client (relay, server_name, server_name2)
-					: setup_relay (relay, prefix.teredo.prefix, cone);
+				data.relay = relay;
+				data.instances[0] = relay;
+				data.prefixes[0] = s.prefix.teredo.prefix;
+				data.ninstances = 1;
+
+				if (setup_instance (relay, &data, &s)
+				 || ((dp != NULL) && teredo_set_datapath (relay, dp))
+				 || ((peers_shm != NULL)
+				  && teredo_set_peer_table (relay, peers_shm))
+				 || open_instances (&data, &s))
+					retval = -1;
+				else
+				{
+					if (peers_fd != -1)
+					{   /* Restores peers from the previous run */
+						int n = teredo_load_peers (relay, peers_fd);
+						if (n >= 0)
+							syslog (LOG_INFO, _("Restored %d peers"), n);
+						else
+							syslog (LOG_WARNING, _("Error (%s): %m"),
+							        "PeersFile");
+					}
+					retval = (s.mode & TEREDO_CLIENT)
+						? setup_client (relay, s.server_name, s.server_name2,
+					                s.refresh_max, s.relay_cache, qual_fd)
+						: setup_relay (relay, s.prefix.teredo.prefix, s.cone);
+				}
 	
 				/*
 				 * RUN
 				 */
 				if (retval == 0)
-					retval = run_tunnel (&data);
+				{
+					retval = run_tunnel (&data, stats_fd, dump_fd, server_name,
+					                     &s);
+					if ((peers_fd != -1)
+					 && (teredo_save_peers (relay, peers_fd) < 0))
+						syslog (LOG_WARNING, _("Error (%s): %m"), "PeersFile");
+				}
+				close_instances (&data);
 				teredo_destroy (relay);
 			}
 
-			if (retval)
+			if (retval && (retval != MIREDO_RESTART))
 				syslog (LOG_ALERT, _("Miredo setup failure: %s"),
 				        _("libteredo cannot be initialized"));
 		}
-		miredo_deinit ((mode & TEREDO_CLIENT) != 0);
+		miredo_deinit ((s.mode & TEREDO_CLIENT) != 0);
 	}
 
-	if (mode & TEREDO_CLIENT)
+	close_tunnel_queues (tunnel, data.queues, s.workers);
+	close_tunnel_rings (data.queues, s.workers);
+	if (dp != NULL)
+		teredo_datapath_destroy (dp);
+	if (peers_shm != NULL)
+		teredo_peertable_close (peers_shm);
+	if (stats_fd != -1)
+		close (stats_fd);
+	if (peers_fd != -1)
+		close (peers_fd);
+	if (dump_fd != -1)
+		close (dump_fd);
+	if (qual_fd != -1)
+		close (qual_fd);
+
+	if (s.mode & TEREDO_CLIENT)
 		destroy_dynamic_tunnel (tunnel, privfd);
 	else
-		destroy_static_tunnel (tunnel, &prefix.ip6);
+		destroy_static_tunnel (tunnel, &s.prefix.ip6);
 
+	free (s.ifname);
+	free (s.dp_ifname);
+	free (s.peers_shm);
 	return retval;
 }
 
@@ -630,6 +1612,7 @@ int main (int argc, char *argv[])
 	miredo_name = "miredo";
 	miredo_diagnose = relay_diagnose;
 	miredo_run = relay_run;
+	miredo_reload = true;
 
 	return miredo_main (argc, argv);
 }
@@ -0,0 +1,280 @@
+/*
+ * ring.c - single-producer/single-consumer packets ring
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h> // struct iovec
+
+#include "ring.h"
+
+/*
+ * Head and tail are free-running byte counters. Each packet is stored
+ * after a 32-bits length header, and padded to a multiple of 8 bytes.
+ * A retained packet is stored as a reference and a pointer instead, after
+ * a header with the REF_FLAG bit set. A record that would straddle the
+ * end of the buffer starts over at the beginning, after a header with
+ * the PAD_LENGTH length.
+ */
+#define PAD_LENGTH UINT32_MAX
+#define REF_FLAG   UINT32_C(0x80000000)
+#define RECORD_SIZE(len) (((len) + 4 + 7) & ~(size_t)7)
+#define REF_RECORD_SIZE (8 + 2 * sizeof (void *))
+
+struct ring_ref
+{
+	void *ref;
+	const void *data;
+};
+
+struct miredo_ring
+{
+	/* Producer side */
+	atomic_size_t head;
+	size_t tail_cache;
+	char pad1[64];
+
+	/* Consumer side */
+	atomic_size_t tail;
+	size_t next_tail;
+	atomic_bool sleeping;
+	char pad2[64];
+
+	pthread_mutex_t lock;
+	pthread_cond_t wait;
+	size_t mask;
+	uint8_t *buf;
+};
+
+
+miredo_ring *miredo_ring_create (size_t size)
+{
+	size_t s = 8;
+
+	while (s < size)
+	{
+		s <<= 1;
+		if (s == 0)
+			return NULL;
+	}
+
+	miredo_ring *r = malloc (sizeof (*r));
+	if (r == NULL)
+		return NULL;
+
+	r->buf = malloc (s);
+	if (r->buf == NULL)
+	{
+		free (r);
+		return NULL;
+	}
+
+	atomic_init (&r->head, 0);
+	r->tail_cache = 0;
+	atomic_init (&r->tail, 0);
+	r->next_tail = 0;
+	atomic_init (&r->sleeping, false);
+	pthread_mutex_init (&r->lock, NULL);
+	pthread_cond_init (&r->wait, NULL);
+	r->mask = s - 1;
+	return r;
+}
+
+
+void miredo_ring_destroy (miredo_ring *r, void (*release) (void *))
+{
+	/* Releases the references of the packets left over */
+	r->next_tail = atomic_load_explicit (&r->head, memory_order_acquire);
+	miredo_ring_pop (r, release);
+
+	pthread_cond_destroy (&r->wait);
+	pthread_mutex_destroy (&r->lock);
+	free (r->buf);
+	free (r);
+}
+
+
+int miredo_ring_push (miredo_ring *restrict r, const void *restrict data,
+                      size_t len, void *ref)
+{
+	size_t head = atomic_load_explicit (&r->head, memory_order_relaxed);
+	size_t size = r->mask + 1;
+	size_t need = (ref != NULL) ? REF_RECORD_SIZE : RECORD_SIZE (len);
+	size_t offset = head & r->mask, skip = 0;
+
+	if (need > size - offset)
+		skip = size - offset; /* wrap around */
+
+	if (need + skip > size - (head - r->tail_cache))
+	{
+		r->tail_cache = atomic_load_explicit (&r->tail,
+		                                      memory_order_acquire);
+		if (need + skip > size - (head - r->tail_cache))
+			return -1;
+	}
+
+	if (skip > 0)
+	{
+		uint32_t pad = PAD_LENGTH;
+
+		memcpy (r->buf + offset, &pad, 4);
+		offset = 0;
+	}
+
+	uint32_t len32 = len;
+	if (ref != NULL)
+	{
+		struct ring_ref rr = { ref, data };
+
+		len32 |= REF_FLAG;
+		memcpy (r->buf + offset + 8, &rr, sizeof (rr));
+	}
+	else
+		memcpy (r->buf + offset + 4, data, len);
+	memcpy (r->buf + offset, &len32, 4);
+	atomic_store_explicit (&r->head, head + skip + need,
+	                       memory_order_release);
+
+	/* Pairs with the consumer store to sleeping then load of head */
+	atomic_thread_fence (memory_order_seq_cst);
+	if (atomic_load_explicit (&r->sleeping, memory_order_relaxed))
+	{
+		pthread_mutex_lock (&r->lock);
+		pthread_cond_signal (&r->wait);
+		pthread_mutex_unlock (&r->lock);
+	}
+	return 0;
+}
+
+
+static void cleanup_unlock (void *data)
+{
+	miredo_ring *r = data;
+
+	atomic_store_explicit (&r->sleeping, false, memory_order_relaxed);
+	pthread_mutex_unlock (&r->lock);
+}
+
+
+/**
+ * Sleeps until the producer moves the ring head past the given tail.
+ * This is a cancellation point.
+ * @return the new head.
+ */
+static size_t ring_wait (miredo_ring *r, size_t tail)
+{
+	size_t head;
+
+	pthread_mutex_lock (&r->lock);
+	pthread_cleanup_push (cleanup_unlock, r);
+	atomic_store_explicit (&r->sleeping, true, memory_order_seq_cst);
+	while ((head = atomic_load_explicit (&r->head,
+	                                     memory_order_seq_cst)) == tail)
+		pthread_cond_wait (&r->wait, &r->lock);
+	pthread_cleanup_pop (1);
+	return head;
+}
+
+
+unsigned miredo_ring_peek (miredo_ring *restrict r,
+                           struct iovec *restrict pkts, unsigned max)
+{
+	size_t tail = atomic_load_explicit (&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit (&r->head, memory_order_acquire);
+
+	assert (max > 0);
+
+	if (head == tail)
+		head = ring_wait (r, tail);
+
+	unsigned n = 0;
+
+	while ((tail != head) && (n < max))
+	{
+		size_t offset = tail & r->mask;
+		uint32_t len;
+
+		memcpy (&len, r->buf + offset, 4);
+		if (len == PAD_LENGTH)
+		{
+			tail += r->mask + 1 - offset;
+			continue;
+		}
+
+		if (len & REF_FLAG)
+		{
+			struct ring_ref rr;
+
+			memcpy (&rr, r->buf + offset + 8, sizeof (rr));
+			pkts[n].iov_base = (void *)rr.data;
+			pkts[n].iov_len = len & ~REF_FLAG;
+			tail += REF_RECORD_SIZE;
+		}
+		else
+		{
+			pkts[n].iov_base = r->buf + offset + 4;
+			pkts[n].iov_len = len;
+			tail += RECORD_SIZE (len);
+		}
+		n++;
+	}
+
+	r->next_tail = tail;
+	return n;
+}
+
+
+void miredo_ring_pop (miredo_ring *r, void (*release) (void *))
+{
+	size_t tail = atomic_load_explicit (&r->tail, memory_order_relaxed);
+
+	while (tail != r->next_tail)
+	{
+		size_t offset = tail & r->mask;
+		uint32_t len;
+
+		memcpy (&len, r->buf + offset, 4);
+		if (len == PAD_LENGTH)
+			tail += r->mask + 1 - offset;
+		else
+		if (len & REF_FLAG)
+		{
+			struct ring_ref rr;
+
+			memcpy (&rr, r->buf + offset + 8, sizeof (rr));
+			release (rr.ref);
+			tail += REF_RECORD_SIZE;
+		}
+		else
+			tail += RECORD_SIZE (len);
+	}
+
+	atomic_store_explicit (&r->tail, tail, memory_order_release);
+}
@@ -0,0 +1,72 @@
+/*
+ * ring.h - single-producer/single-consumer packets ring
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef MIREDO_RING_H
+# define MIREDO_RING_H
+
+/*
+ * The ring copies variable-length packets into a circular buffer, or
+ * keeps references to packets that remain valid until they are popped.
+ * Exactly one thread may push packets, and exactly one other thread may
+ * pop them: neither side takes a lock, except to wake up a sleeping
+ * consumer.
+ */
+typedef struct miredo_ring miredo_ring;
+struct iovec;
+
+/**
+ * Creates a ring.
+ * @param size buffer size in bytes (rounded up to a power of two)
+ * @return NULL on error.
+ */
+miredo_ring *miredo_ring_create (size_t size);
+
+/**
+ * Destroys a ring.
+ * @param release callback for the reference of each packet left over
+ */
+void miredo_ring_destroy (miredo_ring *r, void (*release) (void *));
+
+/**
+ * Queues a packet into the ring (producer side). Never blocks.
+ * @param ref reference that keeps the packet valid until it is popped,
+ *            or NULL to copy the packet into the ring
+ * @return 0 on success, -1 if the ring is full.
+ */
+int miredo_ring_push (miredo_ring *restrict r, const void *restrict data,
+                      size_t len, void *ref);
+
+/**
+ * Waits for packets and returns the oldest ones (consumer side), in place.
+ * The packets remain in the ring until miredo_ring_pop() is called.
+ * This is a thread cancellation point.
+ * @return the number of packets (at least 1).
+ */
+unsigned miredo_ring_peek (miredo_ring *restrict r,
+                           struct iovec *restrict pkts, unsigned max);
+
+/**
+ * Releases the packets returned by the last miredo_ring_peek() call.
+ * @param release callback for the reference of each referenced packet
+ */
+void miredo_ring_pop (miredo_ring *r, void (*release) (void *));
+
+#endif
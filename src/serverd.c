@@ -42,8 +42,10 @@
 #endif
 #include <signal.h> // sigwait()
 
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <libteredo/teredo.h>
+#include <libteredo/teredo-udp.h> // teredo_stats_dump()
 
 #include "miredo.h"
 #include "conf.h"
@@ -121,43 +123,75 @@ server_run (miredo_conf *conf, const char *server_name)
 		return -2;
 	}
 
+	uint16_t workers = 1, rate_limit = 0;
+	unsigned line = 0;
+	bool affinity = false;
+	if (!miredo_conf_get_int16 (conf, "Workers", &workers, &line)
+	 || !miredo_conf_get_bool (conf, "CPUAffinity", &affinity, NULL)
+	 || !miredo_conf_get_int16 (conf, "ClientRateLimit", &rate_limit, NULL))
+	{
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+	if ((workers < 1) || (workers > MIREDO_MAX_WORKERS))
+	{
+		syslog (LOG_ALERT, _("Invalid workers count %u at line %u "
+		        "(must be between 1 and %u)"), (unsigned)workers, line,
+		        MIREDO_MAX_WORKERS);
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+
+	if (miredo_threads_setup (conf))
+	{
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
+
+	int stats_fd = miredo_stats_open (conf);
+
 	miredo_conf_clear (conf, 5);
 
 	// Sets up server (needs privileges to create raw socket)
-	server = teredo_server_create (server_ip, server_ip2);
+	server = teredo_server_create_workers (server_ip, server_ip2, workers);
 
 	if (drop_privileges ())
+	{
+		if (stats_fd != -1)
+			close (stats_fd);
 		return -1;
+	}
+
+	int retval = -1;
 
 	if (server != NULL)
 	{
 		if ((teredo_server_set_prefix (server, prefix.teredo.prefix) == 0)
 		 && (teredo_server_set_MTU (server, mtu) == 0)
+		 && (teredo_server_set_cpu_affinity (server, affinity) == 0)
+		 && (teredo_server_set_rate_limit (server, rate_limit) == 0)
 		 && (teredo_server_start (server) == 0))
 		{
-			sigset_t dummyset, set;
-			int dummy;
-
-			/* changes nothing, only gets the current mask */
-			sigemptyset (&dummyset);
-			pthread_sigmask (SIG_BLOCK, &dummyset, &set);
-
-			/* wait for fatal signal */
-			while (sigwait (&set, &dummy) != 0);
+			/* wait for fatal signal (peers dumps are for relays only) */
+			while (miredo_wait (stats_fd, teredo_stats_dump) == SIGUSR1);
 
 			teredo_server_stop (server);
-			teredo_server_destroy (server);
-
 			// parent's been signaled or died
-			return 0;
+			retval = 0;
 		}
 		teredo_server_destroy (server);
 	}
 
-	syslog (LOG_ALERT, _("Teredo server fatal error"));
-	syslog (LOG_NOTICE, _("Make sure another instance "
-	        "of the program is not already running."));
-	return -1;
+	if (stats_fd != -1)
+		close (stats_fd);
+
+	if (retval)
+	{
+		syslog (LOG_ALERT, _("Teredo server fatal error"));
+		syslog (LOG_NOTICE, _("Make sure another instance "
+		        "of the program is not already running."));
+	}
+	return retval;
 }
 
 
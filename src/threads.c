@@ -0,0 +1,101 @@
+/*
+ * threads.c - Threads placement settings
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont.                              *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <gettext.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h> // free()
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h> // setrlimit()
+#include <netinet/in.h>
+
+#include <libteredo/teredo-udp.h> // teredo_set_thread_policy()
+
+#include "miredo.h"
+#include "conf.h"
+
+/* Configuration directives prefix for each thread role */
+static const char *const roles[TEREDO_THREAD_ROLES] =
+{
+	[TEREDO_THREAD_PACKETS] = "Packet",
+	[TEREDO_THREAD_HOUSEKEEPING] = "Housekeeping",
+};
+
+
+int miredo_threads_setup (miredo_conf *conf)
+{
+	unsigned maxprio = 0;
+
+	for (unsigned i = 0; i < TEREDO_THREAD_ROLES; i++)
+	{
+		char name[32];
+		uint16_t node = 0, prio = 0;
+		unsigned node_line = 0;
+
+		snprintf (name, sizeof (name), "%sNUMANode", roles[i]);
+		if (!miredo_conf_get_int16 (conf, name, &node, &node_line))
+			return -1;
+		snprintf (name, sizeof (name), "%sPriority", roles[i]);
+		if (!miredo_conf_get_int16 (conf, name, &prio, NULL))
+			return -1;
+		snprintf (name, sizeof (name), "%sCPUs", roles[i]);
+		char *cpus = miredo_conf_get (conf, name, NULL);
+
+		if ((cpus != NULL) || (node_line != 0) || (prio != 0))
+		{
+			int val = teredo_set_thread_policy (i, cpus,
+			                                    node_line ? node : -1, prio);
+			free (cpus);
+			if (val)
+			{
+				syslog (LOG_ALERT, _("Invalid %s threads placement: %m"),
+				        roles[i]);
+				return -1;
+			}
+		}
+
+		if (prio > maxprio)
+			maxprio = prio;
+	}
+
+	/*
+	 * Threads set their own priority as they start, which is after
+	 * privileges are dropped: raise the real-time priority limit now.
+	 */
+	struct rlimit lim;
+	if ((maxprio > 0) && (getrlimit (RLIMIT_RTPRIO, &lim) == 0)
+	 && (lim.rlim_cur < maxprio))
+	{
+		lim.rlim_cur = maxprio;
+		if (lim.rlim_max < maxprio)
+			lim.rlim_max = maxprio;
+		if (setrlimit (RLIMIT_RTPRIO, &lim))
+			syslog (LOG_WARNING, _("Error (%s): %m"), "RLIMIT_RTPRIO");
+	}
+	return 0;
+}